@@ -0,0 +1,257 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Read request throughput of a completer driven by warppipe_server_loop,
+ * for every event loop backend.
+ *
+ * The completer runs in its own thread, listening on the loopback interface.
+ * The requester thread keeps `depth` MRd requests outstanding on each of
+ * `connections` sockets and counts completions.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <warppipe/capture.h>
+#include <warppipe/client.h>
+#include <warppipe/server.h>
+
+#define BENCH_BAR_ADDR	0x1000
+#define BENCH_BAR_SIZE	4096
+#define BENCH_MAX_DEPTH	32
+
+static uint8_t bar_memory[BENCH_BAR_SIZE];
+static atomic_bool completer_stop;
+static int read_size = 64;
+
+struct requester {
+	struct warppipe_client client;
+	unsigned long completed;
+	bool running;
+};
+
+static void completer_accept(struct warppipe_client *client, void *private_data)
+{
+	warppipe_register_bar_memory(client, BENCH_BAR_ADDR, BENCH_BAR_SIZE, 0, bar_memory, WARPPIPE_MEMORY_READONLY);
+}
+
+static void *completer_thread(void *arg)
+{
+	struct warppipe_server *server = arg;
+
+	while (!atomic_load(&completer_stop))
+		warppipe_server_loop(server);
+
+	return NULL;
+}
+
+static void read_completed(const struct warppipe_completion_status completion_status, const void *data, int length, void *private_data)
+{
+	struct requester *req = private_data;
+
+	req->completed++;
+	if (req->running)
+		warppipe_read(&req->client, 0, (req->completed * read_size) % BENCH_BAR_SIZE, read_size, read_completed);
+}
+
+static int requester_connect(int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int enable = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd == -1)
+		return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run(enum warppipe_server_backend backend, int connections, int depth, double duration)
+{
+	struct warppipe_server server = {
+		.listen = true,
+		.host = "127.0.0.1",
+		.port = "0",
+		.backend = backend,
+	};
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct requester *reqs;
+	struct pollfd *pfds;
+	pthread_t thread;
+	unsigned long total = 0;
+	int ret = -1;
+
+	if (warppipe_server_create(&server) == -1)
+		return -1;
+
+	/* report the backend actually in use, the requested one might not be available */
+	const char *name = server.uring ? "io_uring" : server.epoll_fd != -1 ? "epoll" : "select";
+
+	warppipe_server_register_accept_cb(&server, completer_accept);
+	getsockname(server.fd, (struct sockaddr *)&addr, &addrlen);
+
+	reqs = calloc(connections, sizeof(*reqs));
+	pfds = calloc(connections, sizeof(*pfds));
+
+	atomic_store(&completer_stop, false);
+	pthread_create(&thread, NULL, completer_thread, &server);
+
+	for (int i = 0; i < connections; i++) {
+		int fd = requester_connect(ntohs(addr.sin_port));
+
+		if (fd == -1) {
+			perror("connect");
+			goto out;
+		}
+		warppipe_client_create(&reqs[i].client, fd);
+		warppipe_register_bar(&reqs[i].client, BENCH_BAR_ADDR, BENCH_BAR_SIZE, 0, NULL, NULL);
+		reqs[i].client.private_data = &reqs[i];
+		reqs[i].running = true;
+		pfds[i].fd = fd;
+		pfds[i].events = POLLIN;
+	}
+
+	for (int i = 0; i < connections; i++)
+		for (int j = 0; j < depth; j++)
+			warppipe_read(&reqs[i].client, 0, j * read_size % BENCH_BAR_SIZE, read_size, read_completed);
+
+	double start = now();
+	double end = start + duration;
+
+	while (now() < end) {
+		if (poll(pfds, connections, 100) <= 0)
+			continue;
+		for (int i = 0; i < connections; i++)
+			if (pfds[i].revents & POLLIN)
+				warppipe_client_read(&reqs[i].client);
+	}
+	double elapsed = now() - start;
+
+	for (int i = 0; i < connections; i++) {
+		reqs[i].running = false;
+		total += reqs[i].completed;
+	}
+
+	printf("%-9s %5d %5d %12.0f %10.2f\n", name, connections, depth, total / elapsed,
+	       elapsed * 1e6 * connections / (total ? total : 1));
+	ret = 0;
+
+out:
+	for (int i = 0; i < connections; i++)
+		if (pfds[i].fd > 0)
+			close(pfds[i].fd);
+
+	atomic_store(&completer_stop, true);
+	pthread_join(thread, NULL);
+	warppipe_server_destroy(&server);
+	free(pfds);
+	free(reqs);
+
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-c connections] [-q depth] [-t seconds] [-s read_size] [-w capture_file]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int connections = 4;
+	int depth = 8;
+	double duration = 2.0;
+	const char *capture_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:q:t:s:w:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			connections = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 's':
+			read_size = atoi(optarg);
+			break;
+		case 'w':
+			capture_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (connections < 1 || depth < 1 || depth > BENCH_MAX_DEPTH || read_size < 1 || read_size > BENCH_BAR_SIZE) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* the completer may still be answering when the requester sockets get closed */
+	signal(SIGPIPE, SIG_IGN);
+	/* per-packet debug messages would dominate the measurement */
+	setlogmask(LOG_UPTO(LOG_NOTICE));
+	/* the cost of capturing every packet of the run */
+	if (capture_path && warppipe_capture_start(capture_path, 0, 0, 0))
+		return 1;
+
+	printf("%-9s %5s %5s %12s %10s\n", "backend", "conns", "depth", "reads/s", "us/read");
+	run(WARPPIPE_SERVER_BACKEND_SELECT, connections, depth, duration);
+	run(WARPPIPE_SERVER_BACKEND_EPOLL, connections, depth, duration);
+	run(WARPPIPE_SERVER_BACKEND_IO_URING, connections, depth, duration);
+	warppipe_capture_stop();
+	if (capture_path)
+		printf("capture: %llu packets dropped\n", (unsigned long long)warppipe_capture_dropped());
+
+	return 0;
+}
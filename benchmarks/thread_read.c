@@ -0,0 +1,239 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Read request throughput of a requester shared by many threads through
+ * warppipe_thread, against a completer driven by warppipe_server_loop.
+ *
+ * Every worker thread issues blocking reads of `read_size` bytes in a loop,
+ * so the number of outstanding requests equals the number of workers.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <warppipe/client.h>
+#include <warppipe/server.h>
+#include <warppipe/thread.h>
+
+#define BENCH_BAR_ADDR	0x1000
+#define BENCH_BAR_SIZE	4096
+#define BENCH_MAX_WORKERS	256
+
+static uint8_t bar_memory[BENCH_BAR_SIZE];
+static atomic_bool completer_stop;
+static atomic_bool workers_stop;
+static int read_size = 64;
+
+struct worker {
+	pthread_t thread;
+	struct warppipe_thread *io;
+	int idx;
+	unsigned long completed;
+	unsigned long failed;
+};
+
+static void completer_accept(struct warppipe_client *client, void *private_data)
+{
+	warppipe_register_bar_memory(client, BENCH_BAR_ADDR, BENCH_BAR_SIZE, 0, bar_memory, WARPPIPE_MEMORY_READONLY);
+}
+
+static void *completer_thread(void *arg)
+{
+	struct warppipe_server *server = arg;
+
+	while (!atomic_load(&completer_stop))
+		warppipe_server_loop(server);
+
+	return NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	uint8_t buf[BENCH_BAR_SIZE];
+
+	while (!atomic_load_explicit(&workers_stop, memory_order_relaxed)) {
+		uint64_t addr = (w->idx + w->completed) * read_size % BENCH_BAR_SIZE;
+
+		if (warppipe_thread_read(w->io, 0, addr, buf, read_size) == read_size)
+			w->completed++;
+		else
+			w->failed++;
+	}
+	return NULL;
+}
+
+static int requester_connect(int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int enable = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd == -1)
+		return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run(int workers, double duration)
+{
+	struct warppipe_server server = {
+		.listen = true,
+		.host = "127.0.0.1",
+		.port = "0",
+		.backend = WARPPIPE_SERVER_BACKEND_EPOLL,
+	};
+	struct warppipe_client client;
+	struct warppipe_thread *io;
+	struct worker *ws;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	pthread_t thread;
+	unsigned long total = 0, failed = 0;
+	int fd;
+
+	if (warppipe_server_create(&server) == -1)
+		return -1;
+
+	warppipe_server_register_accept_cb(&server, completer_accept);
+	getsockname(server.fd, (struct sockaddr *)&addr, &addrlen);
+
+	atomic_store(&completer_stop, false);
+	pthread_create(&thread, NULL, completer_thread, &server);
+
+	fd = requester_connect(ntohs(addr.sin_port));
+	if (fd == -1) {
+		perror("connect");
+		goto out;
+	}
+	warppipe_client_create(&client, fd);
+	warppipe_register_bar(&client, BENCH_BAR_ADDR, BENCH_BAR_SIZE, 0, NULL, NULL);
+
+	io = warppipe_thread_create(&client);
+	if (!io) {
+		close(fd);
+		goto out;
+	}
+
+	ws = calloc(workers, sizeof(*ws));
+	atomic_store(&workers_stop, false);
+
+	double start = now();
+
+	for (int i = 0; i < workers; i++) {
+		ws[i].io = io;
+		ws[i].idx = i;
+		pthread_create(&ws[i].thread, NULL, worker_thread, &ws[i]);
+	}
+
+	usleep(duration * 1e6);
+	atomic_store(&workers_stop, true);
+	for (int i = 0; i < workers; i++) {
+		pthread_join(ws[i].thread, NULL);
+		total += ws[i].completed;
+		failed += ws[i].failed;
+	}
+	double elapsed = now() - start;
+
+	printf("%7d %12.0f %10.2f %8lu\n", workers, total / elapsed,
+	       elapsed * 1e6 * workers / (total ? total : 1), failed);
+
+	warppipe_thread_destroy(io);
+	close(fd);
+	free(ws);
+
+out:
+	atomic_store(&completer_stop, true);
+	pthread_join(thread, NULL);
+	warppipe_server_destroy(&server);
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-w max_workers] [-t seconds] [-s read_size]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int max_workers = 16;
+	double duration = 2.0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:t:s:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			max_workers = atoi(optarg);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 's':
+			read_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (max_workers < 1 || max_workers > BENCH_MAX_WORKERS || read_size < 1 || read_size > BENCH_BAR_SIZE) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	/* per-packet debug messages would dominate the measurement */
+	setlogmask(LOG_UPTO(LOG_NOTICE));
+
+	printf("%7s %12s %10s %8s\n", "workers", "reads/s", "us/read", "failed");
+	for (int workers = 1; workers <= max_workers; workers *= 2)
+		run(workers, duration);
+
+	return 0;
+}
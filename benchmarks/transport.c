@@ -0,0 +1,224 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Round-trip latency of a single outstanding MRd, for every transport,
+ * and of the same read from a BAR mapped by the requester.
+ *
+ * The completer runs in its own thread and the requester is a pool in connect
+ * mode, both driven by warppipe_server_loop, so the numbers include the event
+ * loop wakeups a real deployment pays for.
+ */
+
+/* memfd_create */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <warppipe/client.h>
+#include <warppipe/server.h>
+
+#define BENCH_BAR_ADDR	0x1000
+#define BENCH_BAR_SIZE	4096
+
+static uint8_t bar_memory[BENCH_BAR_SIZE];
+static int bar_memfd = -1;
+static atomic_bool completer_stop;
+static unsigned long completed;
+static int read_size = 64;
+
+static void completer_accept(struct warppipe_client *client, void *private_data)
+{
+	struct warppipe_server *server = private_data;
+
+	if (server->share_bars)
+		warppipe_register_bar_memfd(client, BENCH_BAR_ADDR, BENCH_BAR_SIZE, 0, bar_memfd, WARPPIPE_MEMORY_READONLY);
+	else
+		warppipe_register_bar_memory(client, BENCH_BAR_ADDR, BENCH_BAR_SIZE, 0, bar_memory, WARPPIPE_MEMORY_READONLY);
+}
+
+static void *completer_thread(void *arg)
+{
+	struct warppipe_server *server = arg;
+
+	while (!atomic_load(&completer_stop))
+		warppipe_server_loop(server);
+
+	return NULL;
+}
+
+static void read_completed(const struct warppipe_completion_status completion_status, const void *data, int length, void *private_data)
+{
+	completed++;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run(const char *name, int addr_family, enum warppipe_transport transport, bool share_bars, double duration)
+{
+	char path[64], port[8];
+	struct warppipe_server completer = {
+		.listen = true,
+		.addr_family = addr_family,
+		.transport = transport,
+		.share_bars = share_bars,
+		.backend = WARPPIPE_SERVER_BACKEND_EPOLL,
+	};
+	struct warppipe_server requester = {
+		.listen = false,
+		.addr_family = addr_family,
+		.transport = transport,
+		.share_bars = share_bars,
+		.backend = WARPPIPE_SERVER_BACKEND_EPOLL,
+	};
+	struct warppipe_client *client;
+	pthread_t thread;
+	int ret = -1;
+
+	if (addr_family == AF_INET) {
+		completer.host = "127.0.0.1";
+		completer.port = "0";
+	} else {
+		snprintf(path, sizeof(path), "@warppipe-bench-%d", getpid());
+		completer.host = path;
+	}
+
+	if (warppipe_server_create(&completer) == -1) {
+		printf("%-9s %s\n", name, "unavailable");
+		return -1;
+	}
+	warppipe_server_register_accept_cb(&completer, completer_accept);
+	completer.private_data = &completer;
+
+	atomic_store(&completer_stop, false);
+	pthread_create(&thread, NULL, completer_thread, &completer);
+
+	requester.host = completer.host;
+	if (addr_family == AF_INET) {
+		struct sockaddr_in addr;
+		socklen_t addrlen = sizeof(addr);
+
+		getsockname(completer.fd, (struct sockaddr *)&addr, &addrlen);
+		snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+		requester.port = port;
+	}
+	if (warppipe_server_create(&requester) == -1) {
+		perror("connect");
+		goto out;
+	}
+
+	client = TAILQ_FIRST(&requester.clients)->client;
+	warppipe_register_bar(client, BENCH_BAR_ADDR, BENCH_BAR_SIZE, 0, NULL, NULL);
+	/* the BAR comes right after the link capabilities */
+	for (int i = 0; i < 100 && share_bars && !client->peer_bars[0].memory && client->active; i++)
+		warppipe_server_loop(&requester);
+
+	completed = 0;
+	double start = now();
+	double end = start + duration;
+
+	while (now() < end) {
+		unsigned long expected = completed + 1;
+
+		warppipe_read(client, 0, (completed * read_size) % BENCH_BAR_SIZE, read_size, read_completed);
+		while (completed != expected && client->active)
+			warppipe_server_loop(&requester);
+		if (!client->active)
+			goto out_requester;
+	}
+	double elapsed = now() - start;
+
+	printf("%-9s %12.0f %10.2f\n", name, completed / elapsed, elapsed * 1e6 / (completed ? completed : 1));
+	ret = 0;
+
+out_requester:
+	warppipe_server_destroy(&requester);
+out:
+	atomic_store(&completer_stop, true);
+	pthread_join(thread, NULL);
+	warppipe_server_destroy(&completer);
+
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t seconds] [-s read_size]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	double duration = 2.0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:h")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 's':
+			read_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (read_size < 1 || read_size > BENCH_BAR_SIZE) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* the completer may still be answering when the requester goes away */
+	signal(SIGPIPE, SIG_IGN);
+	/* per-packet debug messages would dominate the measurement */
+	setlogmask(LOG_UPTO(LOG_NOTICE));
+
+	bar_memfd = memfd_create("warppipe-bench", MFD_CLOEXEC);
+	if (bar_memfd == -1 || ftruncate(bar_memfd, BENCH_BAR_SIZE) == -1) {
+		perror("memfd");
+		return 1;
+	}
+
+	printf("%-9s %12s %10s\n", "transport", "reads/s", "us/read");
+	run("tcp", AF_INET, WARPPIPE_TRANSPORT_SOCKET, false, duration);
+	run("unix", AF_UNIX, WARPPIPE_TRANSPORT_SOCKET, false, duration);
+	run("shm", AF_UNIX, WARPPIPE_TRANSPORT_SHM, false, duration);
+	run("unix-map", AF_UNIX, WARPPIPE_TRANSPORT_SOCKET, true, duration);
+
+	return 0;
+}
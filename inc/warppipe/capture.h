@@ -0,0 +1,55 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WARP_PIPE_CAPTURE_H
+#define WARP_PIPE_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Start capturing the transport packets every connection of the process sends and receives.
+ * Packets are queued without locking and written to pcapng files by a background thread,
+ * each one as a TCP segment on port CAPTURE_TCP_PORT so that the pcie-pipe.lua dissector decodes it.
+ * param:
+ *	path:          file to write; with max_file_size set, files path.0, path.1, ... are written instead
+ *	snaplen:       bytes kept of each packet, synthesized IP and TCP headers included; 0 keeps whole packets
+ *	max_file_size: bytes after which the next file is started, 0 for a single file
+ *	max_files:     only the last max_files files are kept, 0 keeps all of them
+ * returns: 0 on success, -1 on error or if a capture is running already
+ */
+int warppipe_capture_start(const char *path, uint32_t snaplen, uint64_t max_file_size, unsigned int max_files);
+/* stop capturing, write out whatever is queued and close the file */
+void warppipe_capture_stop(void);
+/* pause or resume a running capture, the file stays open; capturing starts enabled */
+void warppipe_capture_enable(bool enable);
+bool warppipe_capture_enabled(void);
+/* pause or resume a running capture whenever the process gets signo (e.g. SIGUSR1)
+ * returns: 0 on success, -1 on error
+ */
+int warppipe_capture_toggle_on_signal(int signo);
+/* packets lost since the capture started because the writer fell behind */
+uint64_t warppipe_capture_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WARP_PIPE_CAPTURE_H */
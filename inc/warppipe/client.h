@@ -23,6 +23,7 @@
 #include <stdint.h>
 
 #include <warppipe/config.h>
+#include <warppipe/crc.h>
 #include <warppipe/proto.h>
 
 #ifdef __cplusplus
@@ -37,23 +38,278 @@ typedef int (*warppipe_read_cb_t)(uint64_t addr, void *data, int length, void *p
 typedef void (*warppipe_write_cb_t)(uint64_t addr, const void *data, int length, void *private_data);
 
 typedef void (*warppipe_completion_cb_t)(const struct warppipe_completion_status completion_status, const void *data, int length, void *private_data);
+/* called once the library no longer needs the buffer passed to warppipe_write_zerocopy */
+typedef void (*warppipe_write_release_cb_t)(const void *data, void *private_data);
+
+/* MSG_ZEROCOPY write waiting for the kernel to release the pages */
+struct warppipe_zc_write {
+	const void *data;
+	warppipe_write_release_cb_t release_cb;
+	/* number of the last sendmsg call carrying it */
+	uint32_t id;
+	/* sequence number of its TLP, replays send data again until it is acknowledged */
+	uint16_t seqno;
+	/* header and trailer are sent without copying too, so they have to stay put */
+	uint8_t hdr[sizeof(struct warppipe_pcie_transport)];
+	uint8_t trailer[8];
+};
+
+/* reassembly buffer of a read delivered in several completions */
+struct warppipe_read;
+
+/* outstanding read request */
+struct warppipe_read_tag {
+	warppipe_completion_cb_t completion_cb;
+	/* NULL as long as the request is expected to complete in one go */
+	struct warppipe_read *split;
+	/* requested bytes are split->data[offset..offset + length) */
+	uint32_t offset;
+	uint32_t length;
+	/* passed to completion_cb */
+	void *private_data;
+	/* the read fails if not completed by then */
+	uint64_t deadline_us;
+};
+
+/* flags of warppipe_register_bar_memory */
+enum warppipe_memory_flags {
+	/* writes are dropped, write callbacks of regions in the BAR still get them */
+	WARPPIPE_MEMORY_READONLY = 1 << 0,
+};
+
+/* address range served by its own callbacks, see warppipe_register_region */
+struct warppipe_region {
+	/* BAR the range is relative to, -1 if offset is an absolute address */
+	int bar_idx;
+	uint64_t offset;
+	uint64_t size;
+	warppipe_read_cb_t read_cb;
+	warppipe_write_cb_t write_cb;
+	/* passed to the callbacks, NULL for the private_data of the client */
+	void *private_data;
+	/* size bytes backing the range, see warppipe_register_bar_memory */
+	void *memory;
+	uint32_t memory_flags;
+};
+
+/* BAR memory mapped by the library, see warppipe_register_bar_memfd */
+struct warppipe_bar_mapping {
+	/* NULL if not mapped */
+	uint8_t *memory;
+	uint64_t size;
+	uint32_t flags;
+};
+
+/* addresses start..last served by regions[region], whose first address is base */
+struct warppipe_region_span {
+	uint64_t start;
+	uint64_t last;
+	uint64_t base;
+	/* memory backing base onwards, memory_size bytes of it; NULL if not memory-backed */
+	uint8_t *memory;
+	uint64_t memory_size;
+	uint32_t memory_flags;
+	uint16_t region;
+};
+
+/* address space of a client, sorted spans that do not overlap; where regions do, the smaller one wins */
+struct warppipe_region_map {
+	uint16_t count;
+	struct warppipe_region_span spans[2 * CLIENT_MAX_REGIONS];
+};
+
+/* credits of one type the peer has room for, counters are modulo 2^8 (headers) and 2^12 (data) */
+struct warppipe_fc_tx {
+	/* set by the first InitFC of the peer, sending is not limited before */
+	bool initialized;
+	/* false if the peer advertised infinite credits */
+	bool hdr_limited;
+	bool data_limited;
+	/* CREDIT_LIMIT and CREDITS_CONSUMED of the PCIe spec, data credits are 16 bytes each */
+	uint8_t hdr_limit;
+	uint8_t hdr_consumed;
+	uint16_t data_limit;
+	uint16_t data_consumed;
+};
+
+/* credits of one type we advertised */
+struct warppipe_fc_rx {
+	/* CREDITS_ALLOCATED, returned to the peer with UpdateFC */
+	uint8_t hdr_allocated;
+	uint16_t data_allocated;
+	/* freed since the last UpdateFC */
+	uint16_t hdr_freed;
+	uint16_t data_freed;
+};
+
+/* TLP waiting for flow control credits */
+struct warppipe_fc_pending;
+
+/* operations of warppipe_submit */
+enum warppipe_op_type {
+	WARPPIPE_OP_READ,
+	WARPPIPE_OP_WRITE,
+	WARPPIPE_OP_CONFIG0_READ,
+	WARPPIPE_OP_CONFIG0_WRITE,
+	/* warppipe_thread_submit only: data points at the struct warppipe_region to register */
+	WARPPIPE_OP_REGISTER_REGION,
+	/* warppipe_thread_submit only: move BAR bar_idx to addr */
+	WARPPIPE_OP_REMAP_BAR,
+};
+
+struct warppipe_op {
+	enum warppipe_op_type type;
+	/* ignored by configuration space operations */
+	int bar_idx;
+	uint64_t addr;
+	/* data to write, or where to store length bytes read */
+	void *data;
+	int length;
+	/* returned with the completion event */
+	void *user_data;
+};
+
+/* completion of an operation submitted with warppipe_submit */
+struct warppipe_event {
+	void *user_data;
+	/* 0 on success */
+	int error_code;
+	/* bytes read or written */
+	int length;
+};
+
+/* submission state of warppipe_submit, allocated on first use */
+struct warppipe_async;
+
+/* I/O engine state of a connection driven by something else than plain socket calls */
+struct warppipe_client_io;
 
 /* client struct */
 struct warppipe_client {
 	int fd;
 	int seqno;
 	bool active;
+	/* link capabilities (enum warppipe_link_cap) advertised to the peer */
+	uint8_t link_caps;
+	/* link capabilities supported by both ends */
+	uint8_t link_caps_agreed;
+	/* NULL when the socket is accessed directly with recv/send */
+	struct warppipe_client_io *io;
 	void *private_data;
 	warppipe_read_cb_t bar_read_cb[6];
 	warppipe_write_cb_t bar_write_cb[6];
-	uint32_t bar[6];
-	uint32_t bar_size[6];
+	uint64_t bar[6];
+	uint64_t bar_size[6];
+	/* bit i set if BAR i is a 64-bit one, BAR i + 1 holds its upper half then */
+	uint8_t bar64;
+	/* registered regions, BARs included, in registration order */
+	struct warppipe_region regions[CLIENT_MAX_REGIONS];
+	uint16_t nregions;
+	/* requests are dispatched with region_maps[region_gen & 1], the other one is where the next map is built;
+	 * region_gen counts the rebuilds, a request spanning several regions checks it after each callback
+	 */
+	struct warppipe_region_map region_maps[2];
+	uint32_t region_gen;
+	/* span found by the last lookup, tried first if the current map has it */
+	uint16_t region_hint;
 	warppipe_read_cb_t cfg0_read_cb;
 	warppipe_write_cb_t cfg0_write_cb;
-	// 0x1F is maximum allowed tag
-	warppipe_completion_cb_t completion_cb[32];
-	uint8_t read_tag : 5;
-	char buf[CLIENT_BUFFER_SIZE];
+	/* Completer: memfds of BARs registered with warppipe_register_bar_memfd (-1 if none) and their mappings */
+	int bar_memfd[6];
+	struct warppipe_bar_mapping bar_mapping[6];
+	/* Requester: BARs of the peer mapped here, warppipe_read and warppipe_write access them directly */
+	struct warppipe_bar_mapping peer_bars[6];
+	/* file descriptors received ahead of the DLLPs they belong to */
+	int rx_fds[6];
+	uint8_t rx_nfds;
+	/* outstanding reads by tag, tag_bitmap has the bits of the tags in use set */
+	struct warppipe_read_tag tags[CLIENT_MAX_TAGS];
+	uint64_t tag_bitmap[CLIENT_MAX_TAGS / 64];
+	/* tags handed out: 32, 256 (Extended Tag) or 1024 (10-Bit Tag, the Completer has to echo T9/T8) */
+	uint16_t max_tags;
+	uint16_t tags_used;
+	/* Max Payload Size and Max Read Request Size, powers of 2 from 128 to 4096 */
+	uint16_t mps;
+	uint16_t mrrs;
+	/* received data, packets are handled in place; rx_buf[rx_head..rx_tail) is not handled yet */
+	uint8_t rx_buf[CLIENT_RX_BUFFER_SIZE];
+	size_t rx_head;
+	size_t rx_tail;
+	/* LCRC of the packet at rx_head, over its first rx_crc_len bytes (0 if not started) */
+	struct pcie_lcrc32_ctx rx_crc;
+	size_t rx_crc_len;
+	/* queue outgoing packets in tx_buf until warppipe_client_flush instead of sending each one */
+	bool tx_batch;
+	uint8_t tx_buf[CLIENT_TX_BUFFER_SIZE];
+	size_t tx_len;
+	/* a single ACK covers up to ack_factor good TLPs, sent at the latest ack_latency_us after the first one */
+	uint16_t ack_factor;
+	uint32_t ack_latency_us;
+	/* received TLPs not acknowledged yet, the last of them is ack_seqno */
+	uint16_t ack_pending;
+	uint16_t ack_seqno;
+	uint64_t ack_deadline_us;
+	/* last sequence number acknowledged by the peer */
+	uint16_t acked_seqno;
+	/* a NAK was sent, no other one goes out until the expected TLP arrives */
+	bool nak_sent;
+	/* TLPs sent and not acknowledged yet, as sent (zero-copy writes without their payload),
+	 * allocated with the first TLP and sized for the credits of the peer (NULL before);
+	 * replay_index has their offsets in replay_buf by sequence number,
+	 * replay_buf[replay_head..replay_tail) of replay_size bytes is in use (it wraps around)
+	 */
+	uint32_t *replay_index;
+	uint8_t *replay_buf;
+	size_t replay_size;
+	size_t replay_head;
+	size_t replay_tail;
+	/* unacknowledged TLPs are replayed at replay_deadline_us (0 if none), replay_timeout_us after the last progress */
+	uint32_t replay_timeout_us;
+	uint64_t replay_deadline_us;
+	/* reads fail cpl_timeout_us after they were sent (never if 0), the earliest of them at cpl_deadline_us (0 if none) */
+	uint32_t cpl_timeout_us;
+	uint64_t cpl_deadline_us;
+	/* number of replays so far */
+	uint32_t replays;
+	/* posted writes of at least write_sg_threshold bytes are sent from the caller buffer, 0 disables */
+	uint32_t write_sg_threshold;
+	/* set by warppipe_client_enable_zerocopy */
+	bool zerocopy;
+	/* zero-copy writes not released yet are zc[zc_head..zc_tail) modulo CLIENT_ZEROCOPY_MAX,
+	 * the kernel is done with those before zc_done and the peer acknowledged those before zc_acked
+	 */
+	struct warppipe_zc_write zc[CLIENT_ZEROCOPY_MAX];
+	uint32_t zc_head;
+	uint32_t zc_done;
+	uint32_t zc_acked;
+	uint32_t zc_tail;
+	/* MSG_ZEROCOPY sendmsg calls so far, the kernel numbers its notifications the same way */
+	uint32_t zc_calls;
+	/* NULL until warppipe_submit is called */
+	struct warppipe_async *async;
+	/* advertise fc_hdr_credits and fc_data_credits of each type at link-up and return them with UpdateFC,
+	 * 0 stands for infinite; credits advertised by the peer are honored either way
+	 */
+	bool flow_control;
+	uint8_t fc_hdr_credits;
+	uint16_t fc_data_credits;
+	bool fc_init_sent;
+	/* credits by enum pcie_fc_kind */
+	struct warppipe_fc_tx fc_tx[3];
+	struct warppipe_fc_rx fc_rx[3];
+	/* an UpdateFC is due, it is sent with the next ACK */
+	bool fc_update_pending;
+	/* TLPs waiting for credits or replay buffer room in the order they were sent,
+	 * fc_tail points at the last next link
+	 */
+	struct warppipe_fc_pending *fc_head;
+	struct warppipe_fc_pending **fc_tail;
+	/* queued TLPs by enum pcie_fc_kind and their total size */
+	uint16_t fc_queued[3];
+	size_t fc_queued_bytes;
+	/* packet capture: number of the connection (0 until its first packet) and bytes so far by direction */
+	uint32_t capture_id;
+	uint32_t capture_seq[2];
 };
 
 /* BSD TAILQ (sys/queue) node struct */
@@ -67,14 +323,65 @@ TAILQ_HEAD(warppipe_client_q, warppipe_client_node);
 
 void warppipe_client_create(struct warppipe_client *client, int client_fd);
 void warppipe_client_read(struct warppipe_client *client);
+/* release what the client holds once the connection is gone, pending reads complete with an error */
+void warppipe_client_destroy(struct warppipe_client *client);
+/* send the packets queued while client->tx_batch was set, returns 0 or -1 on network error */
+int warppipe_client_flush(struct warppipe_client *client);
+/* advertise client->link_caps (and receive credits if client->flow_control is set) to the peer,
+ * should be called once after connecting
+ */
+int warppipe_client_link_up(struct warppipe_client *client);
 int warppipe_ack(struct warppipe_client *client, enum pcie_dllp_type type, uint16_t seqno);
+/* send the pending ACK if its latency timer expired, replay unacknowledged TLPs if the replay timer did
+ * and fail the reads whose completion timer did,
+ * returns the time left until the next timer expires in ms or -1 if none is running
+ */
+int warppipe_client_ack_timeout(struct warppipe_client *client);
 
 /* called on Completer to get config0 data */
 void warppipe_register_config0_read_cb(struct warppipe_client *client, warppipe_read_cb_t warppipe_read_cb);
 /* called on Completer to write config0 data */
 void warppipe_register_config0_write_cb(struct warppipe_client *client, warppipe_write_cb_t warppipe_write_cb);
-/* called on Completer to register new BAR with associated read/write callbacks */
-int warppipe_register_bar(struct warppipe_client *client, uint64_t bar, uint32_t bar_size, int bar_idx, warppipe_read_cb_t read_cb, warppipe_write_cb_t write_cb);
+/* called on Completer to register new BAR with associated read/write callbacks,
+ * a BAR above 4 GiB is a 64-bit one and takes bar_idx + 1 too
+ */
+int warppipe_register_bar(struct warppipe_client *client, uint64_t bar, uint64_t bar_size, int bar_idx, warppipe_read_cb_t read_cb, warppipe_write_cb_t write_cb);
+/* called on Completer to register new BAR served straight from memory
+ * param:
+ *	base:  bar_size bytes of memory, reads are answered with its contents and writes land in it
+ *	flags: enum warppipe_memory_flags
+ * Regions registered in the BAR act as hooks: their read callbacks serve reads instead of the memory,
+ * their write callbacks get writes after they land in it.
+ * returns: 0 on success, -1 on error
+ */
+int warppipe_register_bar_memory(struct warppipe_client *client, uint64_t bar, uint64_t bar_size, int bar_idx, void *base, uint32_t flags);
+/* called on Completer to register new BAR served straight from a memory file (memfd_create, shm_open)
+ * The memory is mapped like for warppipe_register_bar_memory. Once WARPPIPE_LINK_CAP_SHARED_BARS is agreed
+ * on the link, the file is passed to the peer, whose reads and writes to the BAR become plain memory accesses.
+ * Such a BAR cannot have regions, as nothing would see the accesses of the peer.
+ * param:
+ *	memfd: at least bar_size bytes, duplicated, the caller may close it
+ *	flags: enum warppipe_memory_flags, READONLY maps it read-only on the peer too
+ * returns: 0 on success, -1 on error
+ */
+int warppipe_register_bar_memfd(struct warppipe_client *client, uint64_t bar, uint64_t bar_size, int bar_idx, int memfd, uint32_t flags);
+/* called on Completer to serve part of the address space with its own callbacks
+ * param:
+ *	bar_idx: BAR the range is in, it moves along with it; -1 for an absolute address range
+ *	offset:  start of the range in the BAR, or its address
+ *	private_data: passed to the callbacks, NULL for the private_data of the client
+ * Callbacks get the offset in the range. Where ranges overlap, requests go to the smallest one
+ * (the last one registered if equal), so a region registered in a BAR takes over that part of it.
+ * Called on the thread handling the connection, callbacks included; warppipe_thread_register_region with an I/O thread.
+ * returns: 0 on success, -1 on error
+ */
+int warppipe_register_region(struct warppipe_client *client, int bar_idx, uint64_t offset, uint64_t size,
+			     warppipe_read_cb_t read_cb, warppipe_write_cb_t write_cb, void *private_data);
+/* called on Completer when a BAR gets reprogrammed, its regions move along
+ * Called on the thread handling the connection; warppipe_thread_remap_bar with an I/O thread.
+ * returns: 0 on success, -1 on error
+ */
+int warppipe_remap_bar(struct warppipe_client *client, int bar_idx, uint64_t bar);
 /* called on Requester to send CR0 to Completer
  * param:
  *	client: Completer client
@@ -83,8 +390,11 @@ int warppipe_register_bar(struct warppipe_client *client, uint64_t bar, uint32_t
  * returns: error code
  *	0 - success
  *	-1 - network error
+ *	-EAGAIN - no free tag, or too many TLPs wait for flow control credits
  */
 int warppipe_config0_read(struct warppipe_client *client, uint64_t addr, int length, warppipe_completion_cb_t completion_cb);
+/* like warppipe_config0_read, completion_cb gets private_data instead of the one of the client */
+int warppipe_config0_read_ctx(struct warppipe_client *client, uint64_t addr, int length, warppipe_completion_cb_t completion_cb, void *private_data);
 /* called on Requester to send CW0 to Completer
  * param:
  *	client: Completer client
@@ -94,21 +404,32 @@ int warppipe_config0_read(struct warppipe_client *client, uint64_t addr, int len
  * returns: error code
  *	0 - success
  *	-1 - network error
+ *	-EAGAIN - too many TLPs wait for flow control credits
  */
 int warppipe_config0_write(struct warppipe_client *client, uint64_t addr, const void *data, int length);
 /* called on Requester to send MRd to Completer
  * Requester needs to register completion callback and match
  * request with completion tag
+ * Reads crossing a client->mrrs boundary are sent as several requests,
+ * the completion callback is called once with all of the data.
  * param:
  *	client: Completer client
  *	addr:   address from which Completer should read
  *	length: length of read (in bytes)
+ *	completion_cb: called with client->private_data as it was when the read was issued
  * returns: error code
  *	0 - success
  *	-1 - network error
+ *	-EAGAIN - not enough free tags, or too many TLPs wait for flow control credits,
+ *		handle some incoming packets and retry
  */
 int warppipe_read(struct warppipe_client *client, int bar_idx, uint64_t addr, int length, warppipe_completion_cb_t completion_cb);
+/* like warppipe_read, completion_cb gets private_data instead of the one of the client,
+ * so that any number of reads can be in flight, each with its own context
+ */
+int warppipe_read_ctx(struct warppipe_client *client, int bar_idx, uint64_t addr, int length, warppipe_completion_cb_t completion_cb, void *private_data);
 /* called on Requester to send MWr to Completer
+ * Writes crossing a client->mps boundary are sent as several TLPs.
  * param:
  *	client: Completer client
  *	addr:   address where Completer should write
@@ -117,8 +438,41 @@ int warppipe_read(struct warppipe_client *client, int bar_idx, uint64_t addr, in
  * returns: error code
  *	0 - success
  *	-1 - network error
+ *	-EAGAIN - too many TLPs wait for flow control credits
  */
 int warppipe_write(struct warppipe_client *client, int bar_idx, uint64_t addr, const void *data, int length);
+/* turn on MSG_ZEROCOPY for warppipe_write_zerocopy, returns -1 if the connection does not support it */
+int warppipe_client_enable_zerocopy(struct warppipe_client *client);
+/* called on Requester to send MWr to Completer without copying data
+ * The kernel sends straight from data, which must stay unchanged until release_cb is called:
+ * once the kernel is done with it and the peer acknowledged the TLPs, replays are sent from data too.
+ * Without zero-copy support the data is copied and release_cb is called before returning.
+ * param: like warppipe_write
+ *	release_cb: called with data and private_data of the client once data can be reused
+ * returns: error code
+ *	0 - success
+ *	-1 - network error
+ *	-EAGAIN - too many TLPs wait for flow control credits
+ */
+int warppipe_write_zerocopy(struct warppipe_client *client, int bar_idx, uint64_t addr, const void *data, int length, warppipe_write_release_cb_t release_cb);
+/* call release_cb of the zero-copy writes the kernel is done with and the peer acknowledged,
+ * returns the number not released yet
+ */
+int warppipe_client_zerocopy_reap(struct warppipe_client *client);
+
+/* called on Requester to issue n operations at once, sent together unless client->tx_batch is set
+ * Writes complete as soon as they are sent, reads once all of their data arrived.
+ * Each operation gets exactly one event from warppipe_poll_completions.
+ * returns: number of operations submitted, less than n if the client ran out of tags or credits
+ *	or CLIENT_ASYNC_DEPTH operations are waiting to be reaped; -1 if none was submitted because of an error
+ */
+int warppipe_submit(struct warppipe_client *client, const struct warppipe_op *ops, int n);
+/* called on Requester to reap up to max completion events of submitted operations
+ * Waits up to timeout ms (-1 forever, 0 not at all) for at least one, handling incoming packets.
+ * Connections driven by an I/O engine (client->io) are only handled by warppipe_server_loop.
+ * returns: number of events stored in events, -1 if the connection is gone
+ */
+int warppipe_poll_completions(struct warppipe_client *client, struct warppipe_event *events, int max, int timeout);
 
 #ifdef __cplusplus
 }
@@ -23,9 +23,73 @@
 
 #define SERVER_PORT_NUM			"2115"
 #define SERVER_LISTEN_QUEUE_SIZE	64
+#define SERVER_EPOLL_MAX_EVENTS		64
+#define SERVER_URING_ENTRIES		256
+
+/* receive buffers posted per connection by the io_uring backend, must be a power of 2 */
+#define CLIENT_URING_BUFS		8
+#define CLIENT_URING_BUF_SIZE		4096
+
+/* bytes in each direction of a shared memory connection, must be a power of 2 */
+#define CLIENT_SHM_RING_SIZE		(1 << 20)
+/* longest a shared memory connection polls an empty ring before it sleeps */
+#define CLIENT_SHM_SPIN_US		50
+/* how long connecting waits for the peer to hand over the shared memory */
+#define CLIENT_SHM_SETUP_TIMEOUT_MS	1000
+
+/* packets queued for the capture writer, must be a power of 2; more are dropped */
+#define CAPTURE_RING_SLOTS		4096
+/* how long the capture writer sleeps once it has written everything queued */
+#define CAPTURE_WRITER_IDLE_US		1000
+/* port of the TCP segments captured packets are written as, the one the Wireshark dissector is registered on */
+#define CAPTURE_TCP_PORT		2115
 
 #define CLIENT_MAX_PACKET_DATA_SIZE	4096
-#define CLIENT_MAX_PACKET_HEADER_SIZE	21 /* 1 PROTO + 16 TLP + 4 LCRC32 */
+#define CLIENT_MAX_PACKET_HEADER_SIZE	23 /* 1 PROTO + 2 SEQNO + 16 TLP + 4 LCRC32 */
 #define CLIENT_BUFFER_SIZE		(CLIENT_MAX_PACKET_DATA_SIZE + CLIENT_MAX_PACKET_HEADER_SIZE)
+/* receive buffer, filled with as much as the socket holds in one call */
+#define CLIENT_RX_BUFFER_SIZE		(4 * CLIENT_BUFFER_SIZE)
+/* transmit queue, flushed with a single send call */
+#define CLIENT_TX_BUFFER_SIZE		(2 * CLIENT_BUFFER_SIZE)
+
+/* default Max Payload Size and Max Read Request Size, larger transfers are split */
+#define CLIENT_MAX_PAYLOAD_SIZE		CLIENT_MAX_PACKET_DATA_SIZE
+#define CLIENT_MAX_READ_REQUEST_SIZE	CLIENT_MAX_PACKET_DATA_SIZE
+
+/* read tags per connection (10-Bit Tag), a multiple of 64, and the number used by default (Extended Tag) */
+#define CLIENT_MAX_TAGS			1024
+#define CLIENT_DEFAULT_TAGS		256
+
+/* address ranges with their own callbacks per connection, BARs included */
+#define CLIENT_MAX_REGIONS		64
+
+/* operations submitted with warppipe_submit and not reaped yet, per connection */
+#define CLIENT_ASYNC_DEPTH		256
+
+/* posted writes of at least this many bytes are sent straight from the caller buffer */
+#define CLIENT_WRITE_SG_THRESHOLD	512
+/* MSG_ZEROCOPY writes in flight per connection */
+#define CLIENT_ZEROCOPY_MAX		16
+
+/* received TLPs are acknowledged with one ACK per CLIENT_ACK_FACTOR TLPs, or after CLIENT_ACK_LATENCY_US */
+#define CLIENT_ACK_FACTOR		16
+#define CLIENT_ACK_LATENCY_US		1000
+
+/* sent TLPs are kept for replay until acknowledged, in a buffer of at most CLIENT_REPLAY_BUFFER_SIZE bytes
+ * per connection (less if the peer advertised fewer credits); they are replayed if no ACK comes within CLIENT_REPLAY_TIMEOUT_US
+ */
+#define CLIENT_REPLAY_BUFFER_SIZE	(32 * CLIENT_BUFFER_SIZE)
+#define CLIENT_REPLAY_TIMEOUT_US	(50 * CLIENT_ACK_LATENCY_US)
+
+/* a read not completed within CLIENT_COMPLETION_TIMEOUT_US fails and its tags are freed */
+#define CLIENT_COMPLETION_TIMEOUT_US	(20 * CLIENT_REPLAY_TIMEOUT_US)
+
+/* receive credits advertised for each credit type when flow control is on,
+ * headers (at most 127) and data in 16-byte units (at most 2047)
+ */
+#define CLIENT_FC_HDR_CREDITS		64
+#define CLIENT_FC_DATA_CREDITS		1024
+/* bytes of TLPs waiting for credits (or replay buffer room) above which new requests fail with -EAGAIN */
+#define CLIENT_FC_QUEUE_SIZE		(64 * 1024)
 
 #endif /* WARP_PIPE_CONFIG_H */
@@ -19,6 +19,7 @@
 #define WARP_PIPE_CRC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* The polynomials below are taken from the PCIe 5.0 spec, but with reversed bit
@@ -34,12 +35,35 @@ extern "C" {
 struct pcie_dllp;
 struct pcie_dltlp;
 
+/* running LCRC32 of a TLP that is received or built piece by piece */
+struct pcie_lcrc32_ctx {
+	uint32_t crc;
+};
+
+/* LCRC32 implementation, selected at runtime based on CPU features */
+struct lcrc32_kernel {
+	const char *name;
+	bool (*supported)(void);
+	uint32_t (*update)(const void *data, size_t len, uint32_t crc);
+};
+
 void pcie_crc16(struct pcie_dllp *pkt);
 bool pcie_crc16_valid(struct pcie_dllp *pkt);
 void pcie_lcrc32(struct pcie_dltlp *pkt);
 bool pcie_lcrc32_valid(struct pcie_dltlp *pkt);
+/* streaming LCRC32 over consecutive parts of a DLTLP (sequence number,
+ * TLP header and payload), final returns the value to be sent (or checked)
+ * as the 4 LCRC bytes in little endian order
+ */
+void pcie_lcrc32_init(struct pcie_lcrc32_ctx *ctx);
+void pcie_lcrc32_update(struct pcie_lcrc32_ctx *ctx, const void *data, size_t len);
+uint32_t pcie_lcrc32_final(const struct pcie_lcrc32_ctx *ctx);
 uint32_t crc32p(const void *start, const void *end, uint32_t init,
 		uint32_t poly);
+/* returns LCRC32 kernel at idx (ordered from the most preferred) or NULL */
+const struct lcrc32_kernel *lcrc32_kernel_get(int idx);
+/* returns the most preferred LCRC32 kernel supported by this CPU */
+const struct lcrc32_kernel *lcrc32_kernel_selected(void);
 
 #ifdef __cplusplus
 }
@@ -20,6 +20,7 @@
 
 #include <endian.h>
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -34,9 +35,39 @@ enum pcie_proto {
 enum pcie_dllp_type {
 	PCIE_DLLP_ACK = 0x00,
 	PCIE_DLLP_NAK = 0x10,
+	PCIE_DLLP_VENDOR = 0x30,
 	PCIE_DLLP_NOP = 0x31,
 };
 
+/* flow control DLLP (dl_fc.fc_type) */
+enum pcie_fc_type {
+	PCIE_FC_INIT1 = 1,
+	PCIE_FC_UPDATE = 2,
+	PCIE_FC_INIT2 = 3,
+};
+
+/* flow control credit type (dl_fc.fc_kind) */
+enum pcie_fc_kind {
+	PCIE_FC_P = 0,		/* Posted Requests */
+	PCIE_FC_NP = 1,		/* Non-Posted Requests */
+	PCIE_FC_CPL = 2,	/* Completions */
+};
+
+/* warp-pipe specific messages carried in vendor-specific DLLPs (dl_vendor_id) */
+enum warppipe_vendor_dllp {
+	WARPPIPE_VENDOR_DLLP_LINK_CAPS = 0x01,
+	/* dl_vendor_data: BAR index and enum warppipe_memory_flags, the memfd of the BAR rides along (SCM_RIGHTS) */
+	WARPPIPE_VENDOR_DLLP_BAR_MEMORY = 0x02,
+};
+
+/* link capabilities advertised with WARPPIPE_VENDOR_DLLP_LINK_CAPS */
+enum warppipe_link_cap {
+	/* the transport guarantees integrity, skip LCRC/CRC16 generation and checking */
+	WARPPIPE_LINK_CAP_TRUSTED = 1 << 0,
+	/* both ends share a host and a Unix socket, BARs registered with warppipe_register_bar_memfd are mapped by the peer */
+	WARPPIPE_LINK_CAP_SHARED_BARS = 1 << 1,
+};
+
 enum pcie_tlp_fmt {
 	PCIE_TLP_FMT_3DW = 0,
 	PCIE_TLP_FMT_4DW = 1,
@@ -67,6 +98,12 @@ enum pcie_tlp_type {
 	PCIE_TLP_CW1 = PCIE_TLP_FMT_3DW_DATA << 5 | 0x05,
 };
 
+enum pcie_cpl_status {
+	PCIE_CPL_STATUS_SC = 0,	/* Successful Completion */
+	PCIE_CPL_STATUS_UR = 1,	/* Unsupported Request */
+	PCIE_CPL_STATUS_CA = 4,	/* Completer Abort */
+};
+
 union pcie_id {
 	uint8_t id[2];
 	struct {
@@ -198,6 +235,11 @@ struct pcie_dllp {
 			uint8_t dl_seqno_lo:8;
 		} dl_acknak;
 		struct {
+			uint8_t dl_vendor_type;
+			uint8_t dl_vendor_id;
+			uint8_t dl_vendor_data[2];
+		} dl_vendor;
+		struct {
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 			uint8_t fc_vcid:3;
 			uint8_t fc_rsvd1:1;
@@ -316,6 +358,8 @@ static_assert(sizeof(struct pcie_configuration_space_header_type0) == 64);
 int tlp_data_length(const struct pcie_tlp *pkt);
 int tlp_data_length_bytes(const struct pcie_tlp *pkt);
 int tlp_total_length(const struct pcie_tlp *pkt);
+/* Length of the transport packet starting at data, 0 if more than len bytes are needed to tell, -1 if malformed. */
+int warppipe_transport_length(const void *data, size_t len);
 void tlp_req_set_addr(struct pcie_tlp *pkt, uint64_t addr, int length);
 uint64_t tlp_req_get_addr(const struct pcie_tlp *pkt);
 
@@ -29,6 +29,26 @@
 extern "C" {
 #endif
 
+enum warppipe_server_backend {
+	/* best backend available on the platform */
+	WARPPIPE_SERVER_BACKEND_AUTO = 0,
+	/* select(2), available everywhere (including Zephyr native_sim) */
+	WARPPIPE_SERVER_BACKEND_SELECT,
+	/* epoll(7), Linux only */
+	WARPPIPE_SERVER_BACKEND_EPOLL,
+	/* io_uring(7), Linux 6.0+, falls back to epoll */
+	WARPPIPE_SERVER_BACKEND_IO_URING,
+};
+
+enum warppipe_transport {
+	/* stream socket to host and port */
+	WARPPIPE_TRANSPORT_SOCKET = 0,
+	/* rings in shared memory, handed over a Unix socket at host (Linux only) */
+	WARPPIPE_TRANSPORT_SHM,
+};
+
+struct warppipe_uring;
+
 typedef void (*warppipe_server_accept_cb_t)(struct warppipe_client *client, void *private_data);
 typedef bool (*warppipe_server_disconnect_cond_t) (struct warppipe_client *client);
 
@@ -42,21 +62,46 @@ struct warppipe_server {
 	/* quit request */
 	bool quit;
 
-	/* server address family */
+	/* server address family, AF_UNIX for a Unix socket at host */
 	int addr_family;
 
-	/* server host address */
+	/* server host address, or the Unix socket path ('@' prefix for the abstract namespace) */
 	const char *host;
 
 	/* server port */
 	const char *port;
 
+	/* how connections carry packets, host is the path of the Unix socket for WARPPIPE_TRANSPORT_SHM */
+	enum warppipe_transport transport;
+
+	/* skip LCRC/CRC16 on connections where the peer requests it too,
+	 * use only when the transport already guarantees integrity
+	 */
+	bool trusted_link;
+
+	/* advertise receive credits to new clients and return them as TLPs are handled */
+	bool flow_control;
+
+	/* pass BARs registered with warppipe_register_bar_memfd to peers that request it too and map theirs,
+	 * Unix sockets (AF_UNIX) only
+	 */
+	bool share_bars;
+
+	/* event loop backend; io_uring falls back to epoll (always for shared memory connections), epoll to select */
+	enum warppipe_server_backend backend;
+
 	/* track max fd number for select */
 	int max_fd;
 
 	/* file descriptor set that will be checked with select */
 	fd_set read_fds;
 
+	/* epoll instance watching the server and client sockets (epoll backend) */
+	int epoll_fd;
+
+	/* submission and completion rings (io_uring backend) */
+	struct warppipe_uring *uring;
+
 	/* client linked-list */
 	struct warppipe_client_q clients;
 
@@ -69,10 +114,43 @@ struct warppipe_server {
 
 int warppipe_server_create(struct warppipe_server *server);
 void warppipe_server_loop(struct warppipe_server *server);
+/* Disconnect every client and release the server socket and event loop resources. */
+void warppipe_server_destroy(struct warppipe_server *server);
 void warppipe_server_disconnect_clients(struct warppipe_server *server, bool
 		(*condition)(struct warppipe_client *client));
 void warppipe_server_register_accept_cb(struct warppipe_server *server, warppipe_server_accept_cb_t server_accept_cb);
 
+/* server and event loop thread of a shard, private to the library */
+struct warppipe_server_shard;
+
+/* servers listening on the same address (SO_REUSEPORT), each driven by its own thread */
+struct warppipe_server_shards {
+	/* number of shards */
+	int count;
+
+	/* pin shard i to the i-th CPU the process may run on */
+	bool pin;
+
+	struct warppipe_server_shard *shards;
+
+	/* port the shards listen on, resolved from the first one when any port was asked for */
+	char port[32];
+};
+
+/* Create count listening servers configured like config and run an event loop for each of them
+ * in a thread of its own (Linux only). The kernel balances incoming connections across them
+ * and a shard owns the clients it accepted, so its accept_cb and the BAR callbacks of its
+ * clients run on its thread only; accept_cb may run on several shards at the same time.
+ * returns: error code
+ *	0 - success
+ *	-1 - failure, no shard is running
+ */
+int warppipe_server_shards_create(struct warppipe_server_shards *shards, const struct warppipe_server *config, int count);
+/* the server of shard idx, only to be used from its own thread once running */
+struct warppipe_server *warppipe_server_shards_get(struct warppipe_server_shards *shards, int idx);
+/* stop the event loops and destroy every shard */
+void warppipe_server_shards_destroy(struct warppipe_server_shards *shards);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WARP_PIPE_THREAD_H
+#define WARP_PIPE_THREAD_H
+
+#include <stdint.h>
+
+#include <warppipe/client.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* I/O thread owning a client, see warppipe_thread_create */
+struct warppipe_thread;
+
+/* operation queued with warppipe_thread_submit, owned by the caller until done is called */
+struct warppipe_thread_req {
+	struct warppipe_op op;
+	/* called on the I/O thread once the operation completed, must not block */
+	void (*done)(struct warppipe_thread_req *req);
+	/* bytes read or written, or a negative error code */
+	int result;
+	/* private to the library */
+	struct warppipe_thread_req *next;
+};
+
+/* Start an I/O thread serving client, which must not be used directly from then on.
+ * The thread handles incoming packets (BAR callbacks run on it) and issues the requests
+ * queued by any number of other threads.
+ * returns: the thread, NULL on error
+ */
+struct warppipe_thread *warppipe_thread_create(struct warppipe_client *client);
+/* stop the I/O thread, requests not completed yet complete with an error */
+void warppipe_thread_destroy(struct warppipe_thread *thread);
+/* called from any thread to queue an operation, lock-free
+ * returns: error code
+ *	0 - success, req->done will be called
+ *	-1 - the I/O thread has stopped
+ */
+int warppipe_thread_submit(struct warppipe_thread *thread, struct warppipe_thread_req *req);
+/* called from any thread other than the I/O thread, wait for a read to complete
+ * returns: number of bytes read or a negative error code
+ */
+int warppipe_thread_read(struct warppipe_thread *thread, int bar_idx, uint64_t addr, void *data, int length);
+/* called from any thread other than the I/O thread, wait for a write to be sent
+ * returns: number of bytes written or a negative error code
+ */
+int warppipe_thread_write(struct warppipe_thread *thread, int bar_idx, uint64_t addr, const void *data, int length);
+/* called from any thread other than the I/O thread, warppipe_register_region done on it
+ * returns: 0 on success, -1 on error
+ */
+int warppipe_thread_register_region(struct warppipe_thread *thread, int bar_idx, uint64_t offset, uint64_t size,
+				    warppipe_read_cb_t read_cb, warppipe_write_cb_t write_cb, void *private_data);
+/* called from any thread other than the I/O thread, warppipe_remap_bar done on it
+ * returns: 0 on success, -1 on error
+ */
+int warppipe_thread_remap_bar(struct warppipe_thread *thread, int bar_idx, uint64_t bar);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WARP_PIPE_THREAD_H */
@@ -15,6 +15,9 @@
  * limitations under the License.
  */
 
+/* memfd_create */
+#define _GNU_SOURCE
+
 #include <endian.h>
 #include <libgen.h>
 #include <signal.h>
@@ -26,7 +29,10 @@
 #include <netinet/in.h>
 #include <getopt.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <warppipe/capture.h>
 #include <warppipe/server.h>
 #include <warppipe/client.h>
 #include <warppipe/config.h>
@@ -59,36 +65,13 @@
 struct bar_config {
 	uint8_t config;
 	uint32_t size;
-	warppipe_read_cb_t read_cb;
-	warppipe_write_cb_t write_cb;
+	/* enum warppipe_memory_flags */
+	uint32_t flags;
 	void *data;
+	/* memory file holding data when the BARs are shared with the peer */
+	int memfd;
 };
 
-
-#define DECLARE_BAR_READ_CB(idx) \
-	static int __read_bar_cb_##idx(uint64_t addr, void *data, int length, void *private_data)
-#define DECLARE_BAR_WRITE_CB(idx) \
-	static void __write_bar_cb_##idx(uint64_t addr, const void *data, int length, void *private_data)
-
-#define DEFINE_BAR_READ_CB(idx) \
-	int __read_bar_cb_##idx(uint64_t addr, void *data, int length, void *private_data)\
-	{ \
-		return read_bar(bars_config[(idx)], addr, data, length, private_data); \
-	}
-
-#define DEFINE_BAR_WRITE_CB(idx) \
-	void __write_bar_cb_##idx(uint64_t addr, const void *data, int length, void *private_data)\
-	{ \
-		write_bar(bars_config[(idx)], addr, data, length, private_data); \
-	}
-
-#define REF_BAR_CB(type, idx) __##type##_bar_cb_##idx
-
-/* We need to define the functions to use them in the definition below. */
-DECLARE_BAR_READ_CB(0);
-DECLARE_BAR_READ_CB(1);
-DECLARE_BAR_WRITE_CB(1);
-
 static int8_t bar0_memory[128] = {
 	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
 	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
@@ -112,15 +95,12 @@ static struct bar_config bars_config[6] = {
 	[0] = {
 		.config = BAR_TYPE_32B | BAR_MEMORY_SPACE,
 		.size = sizeof(bar0_memory),
-		.read_cb = REF_BAR_CB(read, 0),
-		.write_cb = NULL,
+		.flags = WARPPIPE_MEMORY_READONLY,
 		.data = bar0_memory,
 	},
 	[1] = {
 		.config = BAR_TYPE_32B | BAR_MEMORY_SPACE,
 		.size = sizeof(bar1_memory),
-		.read_cb = REF_BAR_CB(read, 1),
-		.write_cb = REF_BAR_CB(write, 1),
 		.data = bar1_memory,
 	},
 	[2] = { .config = BAR_INACTIVE, },
@@ -137,46 +117,8 @@ static struct warppipe_server server = {
 	.quit = false,
 };
 
-static int read_bar(struct bar_config bar, uint64_t addr, void *data, int length, void *private_data)
-{
-	if (addr > bar.size) {
-		syslog(LOG_ERR, "Trying to read outside of the BAR memory (addr: 0x%lx, BAR size: 0x%x)", addr, bar.size);
-		return 1;
-	}
-
-	int max_len = bar.size - addr;
-
-	if (length > max_len) {
-		length = max_len;
-		syslog(LOG_ERR, "Trying to read part of memory outside of BAR. Read truncated to %d bytes.", length);
-	}
-
-	memcpy(data, (uint8_t *)bar.data + addr, length);
-	return 0;
-}
-
-static void write_bar(struct bar_config bar, uint64_t addr, const void *data, int length, void *private_data)
-{
-	if (addr > bar.size) {
-		syslog(LOG_ERR, "Trying to write outside of the BAR memory (addr: 0x%lx, BAR size: 0x%x)", addr, bar.size);
-		return;
-	}
-
-	int max_len = bar.size - addr;
-
-	if (length > max_len) {
-		length = max_len;
-		syslog(LOG_ERR, "Trying to write part of memory outside of BAR. Write truncated to %d bytes.", length);
-	}
-
-	memcpy((uint8_t *)bar.data + addr, data, length);
-}
-/* Definitions of the BARs callbacks. */
-DEFINE_BAR_READ_CB(0)
-DEFINE_BAR_READ_CB(1)
-DEFINE_BAR_WRITE_CB(1)
-
 static struct warppipe_client *mock_dev_client;
+static const char *capture_path;
 
 #define BAR_ADDR(addr) \
 	(((addr) >= offsetof(struct pcie_configuration_space_header_type0, bar)) && \
@@ -193,9 +135,18 @@ static void handle_config_bar_write(int bar_idx, uint32_t value, int length)
 	configuration_space.bar[bar_idx] = bar_addr | bar.config;
 
 	/* Register bar in warppipe when first write with actual address is made. */
-	if (value != 0xffffffff && mock_dev_client->bar[bar_idx] == 0) {
+	if (value == 0xffffffff)
+		return;
+	if (mock_dev_client->bar_size[bar_idx] == 0) {
 		syslog(LOG_NOTICE, "Registering bar %d at address %x\n", bar_idx, bar_addr);
-		warppipe_register_bar(mock_dev_client, bar_addr, bar.size, bar_idx, bar.read_cb, bar.write_cb);
+		if (server.share_bars)
+			warppipe_register_bar_memfd(mock_dev_client, bar_addr, bar.size, bar_idx, bar.memfd, bar.flags);
+		else
+			warppipe_register_bar_memory(mock_dev_client, bar_addr, bar.size, bar_idx, bar.data, bar.flags);
+	} else if (mock_dev_client->bar[bar_idx] != bar_addr) {
+		/* the host moved the BAR, e.g. during resource reassignment */
+		syslog(LOG_NOTICE, "Moving bar %d to address %x\n", bar_idx, bar_addr);
+		warppipe_remap_bar(mock_dev_client, bar_idx, bar_addr);
 	}
 }
 
@@ -244,13 +195,19 @@ static void server_client_accept(struct warppipe_client *client, void *private_d
 static void usage(char *progname)
 {
 	fprintf(stderr,
-	"Usage: %s [-4|-6] [-c] [-a <addr>] [-p <port>]\n"
+	"Usage: %s [-4|-6] [-c] [-t] [-C] [-a <addr>] [-p <port>] [-u <path> [-S]|-s <path>] [-w <file>]\n"
 	"\n"
 	"Options:\n"
 	" -4|-6      force IPv4/IPv6 (default: system preference)\n"
 	" -c         client mode (default: server mode),\n"
+	" -t         skip LCRC/CRC16 if the peer agrees (trusted link),\n"
+	" -C         credit-based flow control, advertise receive credits to the peer,\n"
 	" -a <addr>  server address (default: wildcard address for server, loopback address for client),\n"
 	" -p <port>  server port (default: " SERVER_PORT_NUM "),\n"
+	" -u <path>  Unix socket at path instead of TCP, '@' prefix for the abstract namespace,\n"
+	" -S         let a peer on the same host map the BARs instead of sending TLPs (with -u),\n"
+	" -s <path>  shared memory transport, rendezvous on the Unix socket at path (Linux only),\n"
+	" -w <file>  write the packets to a pcapng file, SIGUSR1 pauses and resumes,\n"
 	" -f path    path to yaml file with configuration space config (default: none)\n"
 	"\n", basename(progname));
 }
@@ -261,21 +218,41 @@ static int parse_args(int argc, char **argv)
 	int ret;
 	char *yaml_path = NULL;
 
-	while ((c = getopt(argc, argv, "ca:p:46f:h")) != -1) {
+	while ((c = getopt(argc, argv, "ctCa:p:u:Ss:46w:f:h")) != -1) {
 		switch (c) {
 		case 'c':
 			server.listen = false;
 			break;
+		case 't':
+			server.trusted_link = true;
+			break;
+		case 'C':
+			server.flow_control = true;
+			break;
 		case 'a':
 			server.host = optarg;
 			break;
 		case 'p':
 			server.port = optarg;
 			break;
+		case 'u':
+			server.addr_family = AF_UNIX;
+			server.host = optarg;
+			break;
+		case 'S':
+			server.share_bars = true;
+			break;
+		case 's':
+			server.transport = WARPPIPE_TRANSPORT_SHM;
+			server.host = optarg;
+			break;
 		case '4':
 		case '6':
 			server.addr_family = (c == '4' ? AF_INET : AF_INET6);
 			break;
+		case 'w':
+			capture_path = optarg;
+			break;
 		case 'f':
 			yaml_path = optarg;
 			break;
@@ -326,6 +303,25 @@ static int verify_args(void)
 	return 0;
 }
 
+/* move the BAR contents to memory files that can be passed to the peer */
+static int share_bars(void)
+{
+	for (int i = 0; i < BAR_N; i++) {
+		struct bar_config *const bar = &bars_config[i];
+
+		if (bar->config == BAR_INACTIVE)
+			continue;
+		bar->memfd = memfd_create("memory-mock-bar", MFD_CLOEXEC);
+		if (bar->memfd == -1 || ftruncate(bar->memfd, bar->size) == -1 ||
+		    pwrite(bar->memfd, bar->data, bar->size, 0) != bar->size) {
+			syslog(LOG_ERR, "Failed to set up shared memory for BAR%d.", i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 static int memory_mock_setup(int argc, char **argv)
 {
 	/* syslog initialization */
@@ -335,7 +331,8 @@ static int memory_mock_setup(int argc, char **argv)
 	/* server initialization */
 	syslog(LOG_NOTICE, "Starting " PRJ_NAME_LONG "...");
 
-	if (parse_args(argc, argv) || verify_args()) {
+	if (parse_args(argc, argv) || verify_args() || (server.share_bars && share_bars()) ||
+	    (capture_path && (warppipe_capture_start(capture_path, 0, 0, 0) || warppipe_capture_toggle_on_signal(SIGUSR1)))) {
 		closelog();
 		return 1;
 	}
@@ -350,14 +347,17 @@ static int memory_mark_start(void)
 	warppipe_server_register_accept_cb(&server, server_client_accept);
 
 	ret = warppipe_server_create(&server);
-	if (!ret)
+	if (!ret) {
 		while (!server.quit)
 			warppipe_server_loop(&server);
-	else
+		warppipe_server_destroy(&server);
+	} else {
 		syslog(LOG_NOTICE, "Failed to set up server for " PRJ_NAME_LONG ".");
+	}
 
 
 	syslog(LOG_NOTICE, "Shutting down " PRJ_NAME_LONG ".");
+	warppipe_capture_stop();
 	closelog();
 
 	return 0;
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+# Copyright 2023 Antmicro <www.antmicro.com>
+# Copyright 2023 Meta
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Generate src/crc_tables.h with the lookup tables used by src/crc.c.
+
+Usage: ./scripts/gen_crc_tables.py > src/crc_tables.h
+"""
+
+# Keep in sync with inc/warppipe/crc.h
+DLLP_CRC16_POLY = 0xd008
+TLP_LCRC32_POLY = 0xedb88320
+
+LCRC32_SLICES = 8
+PER_LINE = 6
+
+HEADER = """\
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This file is generated by scripts/gen_crc_tables.py. Do not edit. */
+
+#ifndef WARP_PIPE_CRC_TABLES_H
+#define WARP_PIPE_CRC_TABLES_H
+
+#include <stdint.h>
+"""
+
+FOOTER = """
+#endif /* WARP_PIPE_CRC_TABLES_H */"""
+
+
+def byte_table(poly):
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ poly if crc & 1 else crc >> 1
+        table.append(crc)
+    return table
+
+
+def slice_tables(poly, slices):
+    tables = [byte_table(poly)]
+    for _ in range(1, slices):
+        prev = tables[-1]
+        tables.append([(c >> 8) ^ tables[0][c & 0xff] for c in prev])
+    return tables
+
+
+def format_table(table, indent):
+    lines = []
+    for i in range(0, len(table), PER_LINE):
+        chunk = table[i:i + PER_LINE]
+        lines.append(indent + ", ".join(f"0x{v:08x}" for v in chunk) + ",")
+    return "\n".join(lines)
+
+
+def main():
+    out = [HEADER]
+
+    out.append("/* Byte-at-a-time table for DLLP_CRC16_POLY. */")
+    out.append("static const uint32_t crc16_table[256] = {")
+    out.append(format_table(byte_table(DLLP_CRC16_POLY), "\t"))
+    out.append("};\n")
+
+    out.append("/* Slicing-by-8 tables for TLP_LCRC32_POLY, lcrc32_table[0] is the byte-at-a-time one. */")
+    out.append(f"static const uint32_t lcrc32_table[{LCRC32_SLICES}][256] = {{")
+    for table in slice_tables(TLP_LCRC32_POLY, LCRC32_SLICES):
+        out.append("\t{")
+        out.append(format_table(table, "\t\t"))
+        out.append("\t},")
+    out.append("};")
+
+    out.append(FOOTER)
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()
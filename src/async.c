@@ -0,0 +1,212 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Batched requester API on top of warppipe_read_ctx/warppipe_write. */
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+
+#include <warppipe/client.h>
+#include <warppipe/config.h>
+
+#include "client_io.h"
+
+/* read waiting for its completion */
+struct warppipe_async_read {
+	struct warppipe_async *async;
+	void *data;
+	int length;
+	void *user_data;
+};
+
+struct warppipe_async {
+	/* operations submitted and not reaped yet, at most CLIENT_ASYNC_DEPTH */
+	int inflight;
+	/* completion events, events[head..tail) modulo CLIENT_ASYNC_DEPTH */
+	struct warppipe_event events[CLIENT_ASYNC_DEPTH];
+	uint32_t head;
+	uint32_t tail;
+	/* reads[free_reads[0..nfree)] are unused */
+	struct warppipe_async_read reads[CLIENT_ASYNC_DEPTH];
+	uint16_t free_reads[CLIENT_ASYNC_DEPTH];
+	int nfree;
+};
+
+static struct warppipe_async *async_get(struct warppipe_client *client)
+{
+	struct warppipe_async *async = client->async;
+
+	if (async)
+		return async;
+
+	async = malloc(sizeof(*async));
+	if (!async) {
+		syslog(LOG_ERR, "Failed to allocate the submission queue.");
+		return NULL;
+	}
+	async->inflight = 0;
+	async->head = 0;
+	async->tail = 0;
+	for (int i = 0; i < CLIENT_ASYNC_DEPTH; i++)
+		async->free_reads[i] = CLIENT_ASYNC_DEPTH - 1 - i;
+	async->nfree = CLIENT_ASYNC_DEPTH;
+	client->async = async;
+	return async;
+}
+
+/* there is always room, as no more than CLIENT_ASYNC_DEPTH operations are in flight */
+static void async_complete(struct warppipe_async *async, void *user_data, int error_code, int length)
+{
+	struct warppipe_event *event = &async->events[async->tail++ % CLIENT_ASYNC_DEPTH];
+
+	event->user_data = user_data;
+	event->error_code = error_code;
+	event->length = length;
+}
+
+static void async_read_done(const struct warppipe_completion_status completion_status, const void *data, int length, void *private_data)
+{
+	struct warppipe_async_read *read = private_data;
+	struct warppipe_async *async = read->async;
+
+	if (length > read->length)
+		length = read->length;
+	if (!completion_status.error_code)
+		memcpy(read->data, data, length);
+
+	async_complete(async, read->user_data, completion_status.error_code, completion_status.error_code ? 0 : length);
+	async->free_reads[async->nfree++] = read - async->reads;
+}
+
+/* issue a single operation, returns 0, -EAGAIN or -1 */
+static int async_submit(struct warppipe_client *client, struct warppipe_async *async, const struct warppipe_op *op)
+{
+	struct warppipe_async_read *read;
+	int rc;
+
+	switch (op->type) {
+	case WARPPIPE_OP_WRITE:
+	case WARPPIPE_OP_CONFIG0_WRITE:
+		if (op->type == WARPPIPE_OP_WRITE)
+			rc = warppipe_write(client, op->bar_idx, op->addr, op->data, op->length);
+		else
+			rc = warppipe_config0_write(client, op->addr, op->data, op->length);
+		/* posted, done once sent */
+		if (rc == 0)
+			async_complete(async, op->user_data, 0, op->length);
+		return rc;
+	case WARPPIPE_OP_READ:
+	case WARPPIPE_OP_CONFIG0_READ:
+		read = &async->reads[async->free_reads[--async->nfree]];
+		read->async = async;
+		read->data = op->data;
+		read->length = op->length;
+		read->user_data = op->user_data;
+		if (op->type == WARPPIPE_OP_READ)
+			rc = warppipe_read_ctx(client, op->bar_idx, op->addr, op->length, async_read_done, read);
+		else
+			rc = warppipe_config0_read_ctx(client, op->addr, op->length, async_read_done, read);
+		if (rc)
+			async->nfree++;
+		return rc;
+	default:
+		syslog(LOG_ERR, "Unknown operation type %d.", op->type);
+		return -1;
+	}
+}
+
+int warppipe_submit(struct warppipe_client *client, const struct warppipe_op *ops, int n)
+{
+	struct warppipe_async *async = async_get(client);
+	bool tx_batch = client->tx_batch;
+	int i, rc = 0;
+
+	if (!async)
+		return -1;
+
+	/* all requests leave in a single send */
+	client->tx_batch = true;
+	for (i = 0; i < n && async->inflight < CLIENT_ASYNC_DEPTH; i++) {
+		rc = async_submit(client, async, &ops[i]);
+		if (rc)
+			break;
+		async->inflight++;
+	}
+	client->tx_batch = tx_batch;
+
+	if (!tx_batch && warppipe_client_flush(client) == -1)
+		return -1;
+	if (rc == -1 && i == 0)
+		return -1;
+	return i;
+}
+
+static uint64_t async_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+int warppipe_poll_completions(struct warppipe_client *client, struct warppipe_event *events, int max, int timeout)
+{
+	struct warppipe_async *async = client->async;
+	uint64_t deadline = async_now_ms() + (timeout > 0 ? timeout : 0);
+	int n = 0;
+
+	if (!async)
+		return 0;
+
+	while (async->head == async->tail && client->active && (!client->io || client->io->pollable)) {
+		int wait = timeout < 0 ? -1 : (int)(deadline - async_now_ms());
+		int ack_wait = warppipe_client_ack_timeout(client);
+		struct pollfd pfd = {
+			.fd = client->fd,
+			.events = POLLIN,
+		};
+
+		if (wait < 0 && timeout >= 0)
+			wait = 0;
+		/* wake up for a coalesced ACK that is due */
+		if (ack_wait >= 0 && (wait < 0 || ack_wait < wait))
+			wait = ack_wait;
+
+		int rc = poll(&pfd, 1, wait);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "poll: %s", strerror(errno));
+			return -1;
+		}
+		if (rc > 0)
+			warppipe_client_read(client);
+		if (timeout >= 0 && async_now_ms() >= deadline)
+			break;
+	}
+
+	while (n < max && async->head != async->tail)
+		events[n++] = async->events[async->head++ % CLIENT_ASYNC_DEPTH];
+	async->inflight -= n;
+
+	return n == 0 && !client->active ? -1 : n;
+}
@@ -0,0 +1,538 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* pcapng capture of the transport packets.
+ * Connections copy their packets into a bounded ring shared by all of them. Every slot carries
+ * the position it is free for (or that plus one once filled), so producers only race on claiming
+ * a position and never wait for each other; when the ring is full, packets are dropped.
+ * A writer thread empties the ring into pcapng files, each packet as a TCP segment
+ * between 127.0.0.1:CAPTURE_TCP_PORT and a port of its own per connection on 127.0.0.2.
+ */
+
+#ifndef __ZEPHYR__
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <syslog.h>
+
+#include <warppipe/config.h>
+
+#include "capture.h"
+
+#ifdef WARPPIPE_HAVE_CAPTURE
+
+_Static_assert((CAPTURE_RING_SLOTS & (CAPTURE_RING_SLOTS - 1)) == 0, "CAPTURE_RING_SLOTS must be a power of 2");
+
+/* IPv4 and TCP headers in front of each packet */
+#define CAPTURE_HDR_LEN		40
+
+#define PCAPNG_SHB		0x0a0d0d0a
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC	0x1a2b3c4d
+#define PCAPNG_LINKTYPE_RAW	101
+#define PCAPNG_OPT_EPB_FLAGS	2
+#define PCAPNG_EPB_INBOUND	1
+#define PCAPNG_EPB_OUTBOUND	2
+
+struct capture_slot {
+	/* position the slot is free for, plus one once the packet is in */
+	uint64_t seq;
+	uint64_t ts_us;
+	uint32_t conn;
+	uint32_t tcp_seq;
+	uint32_t tcp_ack;
+	/* length of the packet and bytes of it kept */
+	uint32_t length;
+	uint32_t caplen;
+	uint8_t dir;
+	uint8_t data[];
+};
+
+struct capture {
+	/* next position producers claim */
+	uint64_t head __attribute__((aligned(64)));
+	/* next position the writer takes, only it touches it */
+	uint64_t tail __attribute__((aligned(64)));
+	uint8_t *slots;
+	size_t stride;
+	uint32_t snaplen;
+	/* bytes of each packet kept, snaplen without the headers */
+	uint32_t keep;
+	bool stop;
+	pthread_t writer;
+	FILE *file;
+	char *path;
+	uint64_t max_file_size;
+	unsigned int max_files;
+	unsigned int file_idx;
+	uint64_t file_size;
+	uint64_t file_packets;
+	bool write_failed;
+};
+
+bool warppipe_capture_on;
+static struct capture *capture_state;
+/* producers inside warppipe_capture_packet, the capture is not freed under them */
+static unsigned int capture_users;
+static uint32_t capture_next_conn;
+static uint64_t capture_dropped;
+
+static inline struct capture_slot *capture_slot(struct capture *c, uint64_t pos)
+{
+	return (struct capture_slot *)(c->slots + (pos & (CAPTURE_RING_SLOTS - 1)) * c->stride);
+}
+
+void warppipe_capture_packet(struct warppipe_client *client, enum warppipe_capture_dir dir, const struct iovec *iov, int iovcnt)
+{
+	struct capture_slot *slot;
+	struct capture *c;
+	struct timespec ts;
+	uint64_t pos;
+	uint32_t length = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		length += iov[i].iov_len;
+
+	/* sequence numbers count every byte, dropped packets show up as gaps */
+	uint32_t tcp_seq = client->capture_seq[dir];
+	uint32_t tcp_ack = client->capture_seq[!dir];
+
+	client->capture_seq[dir] += length;
+	if (!client->capture_id)
+		client->capture_id = __atomic_add_fetch(&capture_next_conn, 1, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&capture_users, 1, __ATOMIC_SEQ_CST);
+	c = __atomic_load_n(&capture_state, __ATOMIC_SEQ_CST);
+	if (!c)
+		goto out;
+
+	pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = capture_slot(c, pos);
+
+		int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+		if (diff == 0) {
+			/* on failure pos is updated to where the others got */
+			if (__atomic_compare_exchange_n(&c->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* the writer has not taken the packet from a round ago yet */
+			__atomic_add_fetch(&capture_dropped, 1, __ATOMIC_RELAXED);
+			goto out;
+		} else {
+			pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	slot->ts_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+	slot->conn = client->capture_id;
+	slot->tcp_seq = tcp_seq;
+	slot->tcp_ack = tcp_ack;
+	slot->length = length;
+	slot->caplen = length < c->keep ? length : c->keep;
+	slot->dir = dir;
+	for (uint32_t i = 0, copied = 0; copied < slot->caplen; i++) {
+		uint32_t n = slot->caplen - copied < iov[i].iov_len ? slot->caplen - copied : iov[i].iov_len;
+
+		memcpy(slot->data + copied, iov[i].iov_base, n);
+		copied += n;
+	}
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+out:
+	__atomic_sub_fetch(&capture_users, 1, __ATOMIC_RELEASE);
+}
+
+static void capture_write(struct capture *c, const void *buf, size_t len)
+{
+	if (c->file && fwrite(buf, 1, len, c->file) != len && !c->write_failed) {
+		syslog(LOG_ERR, "Failed to write the capture: %s", strerror(errno));
+		c->write_failed = true;
+	}
+	c->file_size += len;
+}
+
+/* open the next file and write the section and interface headers */
+static int capture_open(struct capture *c)
+{
+	char name[PATH_MAX];
+
+	if (c->max_file_size) {
+		if (c->max_files && c->file_idx >= c->max_files) {
+			snprintf(name, sizeof(name), "%s.%u", c->path, c->file_idx - c->max_files);
+			unlink(name);
+		}
+		snprintf(name, sizeof(name), "%s.%u", c->path, c->file_idx);
+	} else {
+		snprintf(name, sizeof(name), "%s", c->path);
+	}
+
+	/* packets are lost until the next rotation if the file cannot be opened */
+	c->file_size = 0;
+	c->file_packets = 0;
+	c->write_failed = false;
+	c->file = fopen(name, "wb");
+	if (!c->file) {
+		syslog(LOG_ERR, "Failed to open %s for the capture: %s", name, strerror(errno));
+		return -1;
+	}
+
+	struct __attribute__((packed)) {
+		uint32_t type;
+		uint32_t length;
+		uint32_t magic;
+		uint16_t major;
+		uint16_t minor;
+		int64_t section_length;
+		uint32_t length2;
+	} shb = {
+		.type = PCAPNG_SHB,
+		.length = sizeof(shb),
+		.magic = PCAPNG_BYTE_ORDER_MAGIC,
+		.major = 1,
+		.minor = 0,
+		/* not known up front */
+		.section_length = -1,
+		.length2 = sizeof(shb),
+	};
+	struct __attribute__((packed)) {
+		uint32_t type;
+		uint32_t length;
+		uint16_t linktype;
+		uint16_t reserved;
+		uint32_t snaplen;
+		uint32_t length2;
+	} idb = {
+		.type = PCAPNG_IDB,
+		.length = sizeof(idb),
+		.linktype = PCAPNG_LINKTYPE_RAW,
+		.snaplen = c->snaplen,
+		.length2 = sizeof(idb),
+	};
+
+	capture_write(c, &shb, sizeof(shb));
+	capture_write(c, &idb, sizeof(idb));
+	return 0;
+}
+
+static uint16_t capture_ip_checksum(const uint8_t *hdr, int len)
+{
+	uint32_t sum = 0;
+
+	for (int i = 0; i < len; i += 2)
+		sum += hdr[i] << 8 | hdr[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/* IPv4 and TCP headers making a segment of the connection out of the packet */
+static void capture_headers(uint8_t *hdr, const struct capture_slot *slot)
+{
+	bool tx = slot->dir == WARPPIPE_CAPTURE_TX;
+	uint32_t local = htonl(INADDR_LOOPBACK), peer = htonl(INADDR_LOOPBACK + 1);
+	uint16_t local_port = htons(CAPTURE_TCP_PORT), peer_port = htons(1024 + slot->conn % 64512);
+	uint32_t total = CAPTURE_HDR_LEN + slot->length;
+	uint16_t ip_length = htons(total > 0xffff ? 0xffff : total);
+	uint32_t seq = htonl(slot->tcp_seq), ack = htonl(slot->tcp_ack);
+	uint16_t csum;
+
+	memset(hdr, 0, CAPTURE_HDR_LEN);
+	hdr[0] = 0x45;			/* IPv4, 5 words of header */
+	memcpy(hdr + 2, &ip_length, 2);
+	hdr[6] = 0x40;			/* Don't Fragment */
+	hdr[8] = 64;			/* TTL */
+	hdr[9] = 6;			/* TCP */
+	memcpy(hdr + 12, tx ? &local : &peer, 4);
+	memcpy(hdr + 16, tx ? &peer : &local, 4);
+	csum = htons(capture_ip_checksum(hdr, 20));
+	memcpy(hdr + 10, &csum, 2);
+
+	uint8_t *tcp = hdr + 20;
+
+	memcpy(tcp, tx ? &local_port : &peer_port, 2);
+	memcpy(tcp + 2, tx ? &peer_port : &local_port, 2);
+	memcpy(tcp + 4, &seq, 4);
+	memcpy(tcp + 8, &ack, 4);
+	tcp[12] = 0x50;			/* 5 words of header */
+	tcp[13] = 0x18;			/* PSH, ACK */
+	tcp[14] = 0xff;			/* window */
+	tcp[15] = 0xff;
+}
+
+static void capture_write_packet(struct capture *c, const struct capture_slot *slot)
+{
+	uint8_t hdr[CAPTURE_HDR_LEN];
+	uint32_t caplen = CAPTURE_HDR_LEN + slot->caplen;
+	uint32_t pad = -caplen & 3;
+	static const uint8_t zero[4];
+
+	/* every file gets a packet at least */
+	if (c->max_file_size && c->file_packets && c->file_size >= c->max_file_size) {
+		if (c->file)
+			fclose(c->file);
+		c->file = NULL;
+		c->file_idx++;
+		capture_open(c);
+	}
+
+	struct __attribute__((packed)) {
+		uint32_t type;
+		uint32_t length;
+		uint32_t interface;
+		uint32_t ts_high;
+		uint32_t ts_low;
+		uint32_t caplen;
+		uint32_t origlen;
+	} epb = {
+		.type = PCAPNG_EPB,
+		.length = sizeof(epb) + caplen + pad + 12 + 4,
+		.interface = 0,
+		.ts_high = slot->ts_us >> 32,
+		.ts_low = slot->ts_us & 0xffffffff,
+		.caplen = caplen,
+		.origlen = CAPTURE_HDR_LEN + slot->length,
+	};
+	struct __attribute__((packed)) {
+		uint16_t code;
+		uint16_t length;
+		uint32_t flags;
+		uint32_t end_of_options;
+		uint32_t length2;
+	} trailer = {
+		.code = PCAPNG_OPT_EPB_FLAGS,
+		.length = 4,
+		.flags = slot->dir == WARPPIPE_CAPTURE_TX ? PCAPNG_EPB_OUTBOUND : PCAPNG_EPB_INBOUND,
+		.end_of_options = 0,
+		.length2 = epb.length,
+	};
+
+	capture_headers(hdr, slot);
+	capture_write(c, &epb, sizeof(epb));
+	capture_write(c, hdr, sizeof(hdr));
+	capture_write(c, slot->data, slot->caplen);
+	capture_write(c, zero, pad);
+	capture_write(c, &trailer, sizeof(trailer));
+	c->file_packets++;
+}
+
+/* write out the packets queued so far, returns how many there were */
+static int capture_drain(struct capture *c)
+{
+	int n = 0;
+
+	for (;;) {
+		struct capture_slot *slot = capture_slot(c, c->tail);
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != c->tail + 1)
+			break;
+		capture_write_packet(c, slot);
+		/* free for the next round */
+		__atomic_store_n(&slot->seq, c->tail + CAPTURE_RING_SLOTS, __ATOMIC_RELEASE);
+		c->tail++;
+		n++;
+	}
+	return n;
+}
+
+static void *capture_writer(void *arg)
+{
+	struct capture *c = arg;
+
+	for (;;) {
+		/* read before draining, so that nothing queued before the stop is left behind */
+		bool stop = __atomic_load_n(&c->stop, __ATOMIC_ACQUIRE);
+
+		if (capture_drain(c))
+			continue;
+		if (stop)
+			break;
+		if (c->file)
+			fflush(c->file);
+		usleep(CAPTURE_WRITER_IDLE_US);
+	}
+
+	if (c->file)
+		fclose(c->file);
+	return NULL;
+}
+
+int warppipe_capture_start(const char *path, uint32_t snaplen, uint64_t max_file_size, unsigned int max_files)
+{
+	struct capture *c;
+	sigset_t all, prev;
+	void *mem;
+	int ret;
+
+	if (__atomic_load_n(&capture_state, __ATOMIC_ACQUIRE)) {
+		syslog(LOG_ERR, "A capture is running already.");
+		return -1;
+	}
+
+	/* head and tail sit on cache lines of their own, calloc does not align them */
+	if (posix_memalign(&mem, 64, sizeof(*c))) {
+		syslog(LOG_ERR, "Failed to allocate the capture.");
+		return -1;
+	}
+	c = memset(mem, 0, sizeof(*c));
+	/* the headers are always kept */
+	c->snaplen = snaplen == 0 ? CAPTURE_HDR_LEN + CLIENT_BUFFER_SIZE :
+		     snaplen < CAPTURE_HDR_LEN ? CAPTURE_HDR_LEN : snaplen;
+	c->keep = c->snaplen - CAPTURE_HDR_LEN;
+	c->stride = (sizeof(struct capture_slot) + c->keep + 63) & ~(size_t)63;
+	c->max_file_size = max_file_size;
+	c->max_files = max_files;
+	c->path = strdup(path);
+	/* slots are a multiple of a cache line apart, start them on one too */
+	if (!posix_memalign(&mem, 64, c->stride * CAPTURE_RING_SLOTS))
+		c->slots = mem;
+	if (!c->path || !c->slots) {
+		syslog(LOG_ERR, "Failed to allocate the capture ring.");
+		goto fail;
+	}
+	for (uint64_t i = 0; i < CAPTURE_RING_SLOTS; i++)
+		capture_slot(c, i)->seq = i;
+
+	if (capture_open(c) == -1)
+		goto fail;
+
+	/* signals are for the threads of the application */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &prev);
+	ret = pthread_create(&c->writer, NULL, capture_writer, c);
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+	if (ret) {
+		syslog(LOG_ERR, "Failed to start the capture writer: %s", strerror(ret));
+		fclose(c->file);
+		goto fail;
+	}
+
+	__atomic_store_n(&capture_dropped, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&capture_state, c, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&warppipe_capture_on, true, __ATOMIC_SEQ_CST);
+	syslog(LOG_NOTICE, "Capturing packets to %s.", path);
+	return 0;
+
+fail:
+	free(c->slots);
+	free(c->path);
+	free(c);
+	return -1;
+}
+
+void warppipe_capture_stop(void)
+{
+	struct capture *c = __atomic_exchange_n(&capture_state, NULL, __ATOMIC_SEQ_CST);
+
+	if (!c)
+		return;
+	__atomic_store_n(&warppipe_capture_on, false, __ATOMIC_SEQ_CST);
+
+	/* a producer that got the capture finishes its packet first */
+	while (__atomic_load_n(&capture_users, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	__atomic_store_n(&c->stop, true, __ATOMIC_RELEASE);
+	pthread_join(c->writer, NULL);
+	syslog(LOG_NOTICE, "Capture stopped, %llu packets dropped.",
+	       (unsigned long long)__atomic_load_n(&capture_dropped, __ATOMIC_RELAXED));
+
+	free(c->slots);
+	free(c->path);
+	free(c);
+}
+
+void warppipe_capture_enable(bool enable)
+{
+	__atomic_store_n(&warppipe_capture_on, enable && __atomic_load_n(&capture_state, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+bool warppipe_capture_enabled(void)
+{
+	return __atomic_load_n(&warppipe_capture_on, __ATOMIC_ACQUIRE);
+}
+
+static void capture_toggle(int signo)
+{
+	warppipe_capture_enable(!warppipe_capture_enabled());
+}
+
+int warppipe_capture_toggle_on_signal(int signo)
+{
+	struct sigaction sa = {
+		.sa_handler = capture_toggle,
+		.sa_flags = SA_RESTART,
+	};
+
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(signo, &sa, NULL) == -1) {
+		syslog(LOG_ERR, "Failed to handle signal %d: %s", signo, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t warppipe_capture_dropped(void)
+{
+	return __atomic_load_n(&capture_dropped, __ATOMIC_RELAXED);
+}
+
+#else
+
+int warppipe_capture_start(const char *path, uint32_t snaplen, uint64_t max_file_size, unsigned int max_files)
+{
+	syslog(LOG_ERR, "Packet capture is not supported on this platform.");
+	return -1;
+}
+
+void warppipe_capture_stop(void)
+{
+}
+
+void warppipe_capture_enable(bool enable)
+{
+}
+
+bool warppipe_capture_enabled(void)
+{
+	return false;
+}
+
+int warppipe_capture_toggle_on_signal(int signo)
+{
+	return -1;
+}
+
+uint64_t warppipe_capture_dropped(void)
+{
+	return 0;
+}
+
+#endif /* WARPPIPE_HAVE_CAPTURE */
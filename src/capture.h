@@ -0,0 +1,75 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WARP_PIPE_CAPTURE_INTERNAL_H
+#define WARP_PIPE_CAPTURE_INTERNAL_H
+
+#include <sys/uio.h>
+
+#include <stdbool.h>
+
+#include <warppipe/capture.h>
+#include <warppipe/client.h>
+
+/* the writer needs a thread and a file system */
+#ifndef __ZEPHYR__
+#define WARPPIPE_HAVE_CAPTURE
+#endif
+
+enum warppipe_capture_dir {
+	WARPPIPE_CAPTURE_RX = 0,
+	WARPPIPE_CAPTURE_TX = 1,
+};
+
+#ifdef WARPPIPE_HAVE_CAPTURE
+
+/* set while a capture is running and enabled */
+extern bool warppipe_capture_on;
+
+/* queue a packet made of iovcnt pieces for the writer, dropped if its ring is full */
+void warppipe_capture_packet(struct warppipe_client *client, enum warppipe_capture_dir dir, const struct iovec *iov, int iovcnt);
+
+/* called with every complete packet sent or received, a single load while nothing is captured */
+static inline void warppipe_capture(struct warppipe_client *client, enum warppipe_capture_dir dir, const void *pkt, int length)
+{
+	if (__atomic_load_n(&warppipe_capture_on, __ATOMIC_RELAXED)) {
+		struct iovec iov = { .iov_base = (void *)pkt, .iov_len = length };
+
+		warppipe_capture_packet(client, dir, &iov, 1);
+	}
+}
+
+/* same for a packet sent from several buffers */
+static inline void warppipe_capture_iov(struct warppipe_client *client, enum warppipe_capture_dir dir, const struct iovec *iov, int iovcnt)
+{
+	if (__atomic_load_n(&warppipe_capture_on, __ATOMIC_RELAXED))
+		warppipe_capture_packet(client, dir, iov, iovcnt);
+}
+
+#else
+
+static inline void warppipe_capture(struct warppipe_client *client, enum warppipe_capture_dir dir, const void *pkt, int length)
+{
+}
+
+static inline void warppipe_capture_iov(struct warppipe_client *client, enum warppipe_capture_dir dir, const struct iovec *iov, int iovcnt)
+{
+}
+
+#endif /* WARPPIPE_HAVE_CAPTURE */
+
+#endif /* WARP_PIPE_CAPTURE_INTERNAL_H */
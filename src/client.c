@@ -16,12 +16,16 @@
  */
 
 #include <sys/socket.h>
+#if defined(__linux__) && !defined(__ZEPHYR__)
+#include <linux/errqueue.h>
+#endif
 
 #include <stdlib.h>
 #include <sys/types.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <warppipe/client.h>
 #include <warppipe/config.h>
@@ -29,74 +33,1150 @@
 #include <warppipe/crc.h>
 #include <warppipe/config.h>
 
-static int get_bar_idx(struct warppipe_client *client, uint64_t addr)
+#include "capture.h"
+#include "client_io.h"
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define CLIENT_HAVE_ZEROCOPY
+#endif
+
+#ifndef __ZEPHYR__
+#define CLIENT_HAVE_SHARED_BARS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef CLIENT_HAVE_SHARED_BARS
+/* recv keeping the file descriptors the peer passed along with the data */
+static ssize_t client_recv_fds(struct warppipe_client *client, void *buf, size_t len, int flags)
 {
-	for (int i = 0; i < 6; i++) {
-		if ((addr & ~(client->bar_size[i] - 1)) == client->bar[i])
-			return i;
+	char control[CMSG_SPACE(sizeof(client->rx_fds))];
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+	n = recvmsg(client->fd, &msg, flags);
+	if (n <= 0)
+		return n;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		for (int i = 0; i < count; i++) {
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (client->rx_nfds < sizeof(client->rx_fds) / sizeof(client->rx_fds[0])) {
+				client->rx_fds[client->rx_nfds++] = fd;
+			} else {
+				syslog(LOG_WARNING, "Too many file descriptors from the peer, dropping one.");
+				close(fd);
+			}
+		}
 	}
-	return -1;
+	if (msg.msg_flags & MSG_CTRUNC)
+		syslog(LOG_WARNING, "File descriptors from the peer were dropped.");
+	return n;
+}
+#endif
+
+static ssize_t client_recv(struct warppipe_client *client, void *buf, size_t len, int flags)
+{
+	if (client->io)
+		return client->io->recv(client->io, buf, len);
+#ifdef CLIENT_HAVE_SHARED_BARS
+	/* the peer may pass the memory of its BARs at any time */
+	if (client->link_caps & WARPPIPE_LINK_CAP_SHARED_BARS)
+		return client_recv_fds(client, buf, len, flags);
+#endif
+	return recv(client->fd, buf, len, flags);
+}
+
+static ssize_t client_send(struct warppipe_client *client, const void *buf, size_t len)
+{
+	if (client->io)
+		return client->io->send(client->io, buf, len);
+	return send(client->fd, buf, len, 0);
+}
+
+/* region map of generation gen */
+static const struct warppipe_region_map *client_region_map(const struct warppipe_client *client, uint32_t gen)
+{
+	return &client->region_maps[gen & 1];
+}
+
+static uint32_t client_region_gen(const struct warppipe_client *client)
+{
+	return __atomic_load_n(&client->region_gen, __ATOMIC_ACQUIRE);
+}
+
+/* span of the region map holding addr, NULL if no region does */
+static const struct warppipe_region_span *client_find_span(struct warppipe_client *client, const struct warppipe_region_map *map, uint64_t addr)
+{
+	uint16_t hint = __atomic_load_n(&client->region_hint, __ATOMIC_RELAXED);
+	const struct warppipe_region_span *span;
+	int lo = 0, hi = map->count;
+
+	/* requests tend to hit the same region in a row, the hint may come from another map */
+	if (hint < map->count) {
+		span = &map->spans[hint];
+		if (addr >= span->start && addr <= span->last)
+			return span;
+	}
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		span = &map->spans[mid];
+		if (addr < span->start) {
+			hi = mid;
+		} else if (addr > span->last) {
+			lo = mid + 1;
+		} else {
+			__atomic_store_n(&client->region_hint, mid, __ATOMIC_RELAXED);
+			return span;
+		}
+	}
+	return NULL;
+}
+
+static inline bool client_crc_trusted(const struct warppipe_client *client)
+{
+	return client->link_caps_agreed & WARPPIPE_LINK_CAP_TRUSTED;
+}
+
+static bool lcrc32_matches(uint32_t crc, const uint8_t *lcrc)
+{
+	return lcrc[0] == (crc & 0xff) && lcrc[1] == ((crc >> 8) & 0xff) &&
+	       lcrc[2] == ((crc >> 16) & 0xff) && lcrc[3] == crc >> 24;
+}
+
+#ifdef CLIENT_HAVE_SHARED_BARS
+static void client_unmap(struct warppipe_bar_mapping *mapping)
+{
+	if (mapping->memory)
+		munmap(mapping->memory, mapping->size);
+	mapping->memory = NULL;
+	mapping->size = 0;
+}
+
+/* pass the memfd of a BAR to the peer, attached to the DLLP announcing it */
+static int client_export_bar(struct warppipe_client *client, int bar_idx)
+{
+	struct warppipe_pcie_transport tport = {
+		.t_proto = PCIE_PROTO_DLLP,
+		.t_dllp = {
+			.dl_vendor = {
+				.dl_vendor_type = PCIE_DLLP_VENDOR,
+				.dl_vendor_id = WARPPIPE_VENDOR_DLLP_BAR_MEMORY,
+				.dl_vendor_data = { bar_idx, client->bar_mapping[bar_idx].flags },
+			},
+		},
+	};
+	int packet_length = 1 + sizeof(tport.t_dllp);
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	struct iovec iov = {
+		.iov_base = &tport,
+		.iov_len = packet_length,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (client_crc_trusted(client))
+		memset(tport.t_dllp.dl_crc16, 0, sizeof(tport.t_dllp.dl_crc16));
+	else
+		pcie_crc16(&tport.t_dllp);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &client->bar_memfd[bar_idx], sizeof(int));
+
+	/* packets queued before go first, the stream stays in order */
+	if (client->tx_len && warppipe_client_flush(client) == -1)
+		return -1;
+	warppipe_capture(client, WARPPIPE_CAPTURE_TX, &tport, packet_length);
+	if (sendmsg(client->fd, &msg, 0) != packet_length) {
+		syslog(LOG_ERR, "Failed to pass the memory of BAR %d to the peer: %s. Disconnecting.", bar_idx, strerror(errno));
+		client->active = false;
+		return -1;
+	}
+	syslog(LOG_DEBUG, "Passed the memory of BAR %d to the peer", bar_idx);
+	return 0;
+}
+
+static void client_export_bars(struct warppipe_client *client)
+{
+	for (int i = 0; i < 6 && client->active; i++)
+		if (client->bar_memfd[i] != -1)
+			client_export_bar(client, i);
+}
+
+/* map a BAR of the peer, its memfd came before the DLLP */
+static void client_import_bar(struct warppipe_client *client, int bar_idx, uint32_t flags)
+{
+	struct warppipe_bar_mapping *peer_bar;
+	struct stat st;
+	void *memory;
+	int fd;
+
+	if (!client->rx_nfds) {
+		syslog(LOG_WARNING, "Got memory DLLP for BAR %d without the memory.", bar_idx);
+		return;
+	}
+	fd = client->rx_fds[0];
+	client->rx_nfds--;
+	memmove(client->rx_fds, client->rx_fds + 1, client->rx_nfds * sizeof(int));
+
+	if (bar_idx > 5 || fstat(fd, &st) == -1 || st.st_size <= 0) {
+		syslog(LOG_WARNING, "Got unusable memory for BAR %d.", bar_idx);
+		close(fd);
+		return;
+	}
+	memory = mmap(NULL, st.st_size, PROT_READ | (flags & WARPPIPE_MEMORY_READONLY ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to map the memory of BAR %d: %s", bar_idx, strerror(errno));
+		return;
+	}
+
+	peer_bar = &client->peer_bars[bar_idx];
+	client_unmap(peer_bar);
+	peer_bar->memory = memory;
+	peer_bar->size = st.st_size;
+	peer_bar->flags = flags;
+	syslog(LOG_NOTICE, "Mapped %llu bytes of BAR %d of the peer.", (unsigned long long)st.st_size, bar_idx);
+}
+
+/* memory of the peer holding addr..addr + length - 1 of a BAR, NULL if the access has to go through TLPs */
+static uint8_t *client_peer_bar(struct warppipe_client *client, int bar_idx, uint64_t addr, int length)
+{
+	const struct warppipe_bar_mapping *peer_bar = &client->peer_bars[bar_idx];
+
+	if (!peer_bar->memory || length < 0 || addr > peer_bar->size || (uint64_t)length > peer_bar->size - addr)
+		return NULL;
+	return peer_bar->memory + addr;
+}
+#endif
+
+static void handle_vendor_dllp(struct warppipe_client *client, const struct pcie_dllp *pkt)
+{
+	switch ((enum warppipe_vendor_dllp)pkt->dl_vendor.dl_vendor_id) {
+	case WARPPIPE_VENDOR_DLLP_LINK_CAPS:
+		client->link_caps_agreed = client->link_caps & pkt->dl_vendor.dl_vendor_data[0];
+		syslog(LOG_DEBUG, "Got link capabilities DLLP: 0x%02x, agreed: 0x%02x",
+		       pkt->dl_vendor.dl_vendor_data[0], client->link_caps_agreed);
+#ifdef CLIENT_HAVE_SHARED_BARS
+		if (client->link_caps_agreed & WARPPIPE_LINK_CAP_SHARED_BARS)
+			client_export_bars(client);
+#endif
+		break;
+	case WARPPIPE_VENDOR_DLLP_BAR_MEMORY:
+#ifdef CLIENT_HAVE_SHARED_BARS
+		client_import_bar(client, pkt->dl_vendor.dl_vendor_data[0], pkt->dl_vendor.dl_vendor_data[1]);
+#endif
+		break;
+	default:
+		syslog(LOG_WARNING, "Unknown vendor-specific DLLP: %d", pkt->dl_vendor.dl_vendor_id);
+		break;
+	}
+}
+
+static void client_next_seqno(struct warppipe_client *client, struct warppipe_pcie_transport *tport)
+{
+	client->seqno++;
+	tport->t_tlp.dl_seqno_hi = client->seqno >> 8;
+	tport->t_tlp.dl_seqno_lo = client->seqno & 0xff;
+}
+
+static int client_packet_length(const struct warppipe_pcie_transport *tport)
+{
+	int packet_length = 1 + sizeof(tport->t_dllp);
+
+	if (tport->t_proto == PCIE_PROTO_TLP)
+		packet_length += tlp_total_length(&tport->t_tlp.dl_tlp);
+	return packet_length;
+}
+
+static uint64_t client_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static inline uint16_t client_outstanding(const struct warppipe_client *client)
+{
+	return (client->seqno - client->acked_seqno) & 0xfff;
+}
+
+/* TLP kept for replay in replay_buf, followed by the bytes stored with it */
+struct client_replay_entry {
+	/* payload of a zero-copy write, kept by the caller until the TLP is acknowledged; NULL if stored too */
+	const void *data;
+	uint32_t data_len;
+	/* bytes stored: the whole packet, or the header and the trailer with data sent after hdr_len of them */
+	uint16_t stored;
+	uint16_t hdr_len;
+};
+
+/* outstanding TLPs are kept below half of the sequence numbers, so are their offsets in replay_index */
+#define CLIENT_REPLAY_INDEX	2048
+
+/* bytes of replay_buf taken by an entry storing stored bytes */
+static inline size_t client_replay_size(size_t stored)
+{
+	return (sizeof(struct client_replay_entry) + stored + 7) & ~(size_t)7;
+}
+
+/* offset in replay_buf for an entry storing length bytes, -1 if it does not fit */
+static long client_replay_offset(const struct warppipe_client *client, size_t length)
+{
+	size_t head = client->replay_head;
+	size_t tail = client->replay_tail;
+
+	length = client_replay_size(length);
+
+	if (tail >= head) {
+		if (tail + length <= client->replay_size)
+			return tail;
+		/* wrap around, the room at the end stays unused */
+		return length < head ? 0 : -1;
+	}
+	return tail + length < head ? (long)tail : -1;
+}
+
+/* Bytes to keep the TLPs the peer has credits for: it returns them no sooner than it acknowledges the TLPs,
+ * so more would never be outstanding. The most for a peer that does not limit every type.
+ */
+static size_t client_replay_buffer_size(const struct warppipe_client *client)
+{
+	size_t size = 0;
+
+	for (int kind = 0; kind <= PCIE_FC_CPL; kind++) {
+		const struct warppipe_fc_tx *tx = &client->fc_tx[kind];
+
+		if (!tx->initialized || !tx->hdr_limited)
+			return CLIENT_REPLAY_BUFFER_SIZE;
+		size += tx->hdr_limit * client_replay_size(CLIENT_MAX_PACKET_HEADER_SIZE);
+		size += tx->data_limited ? tx->data_limit * 16 : tx->hdr_limit * CLIENT_MAX_PACKET_DATA_SIZE;
+	}
+	/* room for the largest TLP and a wrap around */
+	if (size < 2 * client_replay_size(CLIENT_BUFFER_SIZE))
+		size = 2 * client_replay_size(CLIENT_BUFFER_SIZE);
+	return size < CLIENT_REPLAY_BUFFER_SIZE ? size : CLIENT_REPLAY_BUFFER_SIZE;
+}
+
+/* the index and the buffer in one block, allocated with the first TLP sent */
+static int client_replay_alloc(struct warppipe_client *client)
+{
+	size_t size = client_replay_buffer_size(client);
+	uint32_t *index = malloc(CLIENT_REPLAY_INDEX * sizeof(*index) + size);
+
+	if (!index) {
+		syslog(LOG_ERR, "Failed to allocate the replay buffer.");
+		return -1;
+	}
+	client->replay_index = index;
+	client->replay_buf = (uint8_t *)(index + CLIENT_REPLAY_INDEX);
+	client->replay_size = size;
+	client->replay_head = 0;
+	client->replay_tail = 0;
+	return 0;
+}
+
+static void client_replay_free(struct warppipe_client *client)
+{
+	free(client->replay_index);
+	client->replay_index = NULL;
+	client->replay_buf = NULL;
+	client->replay_size = 0;
+}
+
+static bool client_replay_room(struct warppipe_client *client, size_t length)
+{
+	/* half of the sequence numbers at most, the peer tells replays from new TLPs this way */
+	if (client_outstanding(client) >= CLIENT_REPLAY_INDEX)
+		return false;
+	if (!client->replay_buf && client_replay_alloc(client) == -1)
+		return false;
+	return client_replay_offset(client, length) != -1;
+}
+
+/* Entry storing length bytes of the TLP that just got client->seqno, checked with client_replay_room before;
+ * the bytes go right after it. The replay timer starts with the first unacknowledged TLP.
+ */
+static struct client_replay_entry *client_replay_store(struct warppipe_client *client, size_t length)
+{
+	long offset = client_replay_offset(client, length);
+	struct client_replay_entry *entry = (struct client_replay_entry *)(client->replay_buf + offset);
+
+	client->replay_index[client->seqno & (CLIENT_REPLAY_INDEX - 1)] = offset;
+	client->replay_tail = offset + client_replay_size(length);
+	if (client_outstanding(client) == 1)
+		client->replay_deadline_us = client_now_us() + client->replay_timeout_us;
+	entry->data = NULL;
+	entry->data_len = 0;
+	entry->stored = length;
+	entry->hdr_len = length;
+	return entry;
+}
+
+/* queue or send a finished packet */
+static int client_tx(struct warppipe_client *client, const void *pkt, int packet_length)
+{
+	warppipe_capture(client, WARPPIPE_CAPTURE_TX, pkt, packet_length);
+
+	/* built in place by client_tx_alloc, already where it belongs in the queue */
+	if ((const uint8_t *)pkt == client->tx_buf + client->tx_len && !client->io) {
+		client->tx_len += packet_length;
+		if (!client->tx_batch && warppipe_client_flush(client) == -1)
+			return -1;
+	} else if (client->io || (!client->tx_batch && client->tx_len == 0)) {
+		/* the I/O engine queues on its own */
+		int n = client_send(client, pkt, packet_length);
+
+		if (n != packet_length) {
+			syslog(LOG_ERR, "Sending transport packet: %s. Disconnecting.",
+			       n < 0 ? strerror(errno) : "unexpected EOF");
+			client->active = false;
+			return -1;
+		}
+	} else {
+		if (client->tx_len + packet_length > sizeof(client->tx_buf) && warppipe_client_flush(client) == -1)
+			return -1;
+		memcpy(client->tx_buf + client->tx_len, pkt, packet_length);
+		client->tx_len += packet_length;
+		if (!client->tx_batch && warppipe_client_flush(client) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* send a packet right away, TLPs get their sequence number and LCRC here and are kept for replay */
+static int client_send_packet(struct warppipe_client *client, struct warppipe_pcie_transport *tport)
+{
+	int packet_length = client_packet_length(tport);
+
+	if (tport->t_proto == PCIE_PROTO_TLP) {
+		client_next_seqno(client, tport);
+		if (client_crc_trusted(client))
+			memset((uint8_t *)tport + packet_length - 4, 0, 4);
+		else
+			pcie_lcrc32(&tport->t_tlp);
+		memcpy(client_replay_store(client, packet_length) + 1, tport, packet_length);
+	} else if (tport->t_proto == PCIE_PROTO_DLLP) {
+		if (client_crc_trusted(client))
+			memset(tport->t_dllp.dl_crc16, 0, sizeof(tport->t_dllp.dl_crc16));
+		else
+			pcie_crc16(&tport->t_dllp);
+	}
+
+	if (client_tx(client, tport, packet_length) == -1)
+		return -1;
+	syslog(LOG_DEBUG, "Send pcie transport length: %d", packet_length);
+	return packet_length;
+}
+
+/* TLP waiting for flow control credits or replay buffer room */
+struct warppipe_fc_pending {
+	struct warppipe_fc_pending *next;
+	enum pcie_fc_kind kind;
+	uint16_t data;
+	int length;
+	uint8_t pkt[];
+};
+
+static enum pcie_fc_kind client_fc_kind(enum pcie_tlp_type type)
+{
+	switch (type) {
+	case PCIE_TLP_MWR32:
+	case PCIE_TLP_MWR64:
+		return PCIE_FC_P;
+	case PCIE_TLP_CPL:
+	case PCIE_TLP_CPLD:
+		return PCIE_FC_CPL;
+	default:
+		return PCIE_FC_NP;
+	}
+}
+
+static enum pcie_fc_kind client_fc_tlp_kind(const struct pcie_tlp *tlp)
+{
+	return client_fc_kind((enum pcie_tlp_type)(tlp->tlp_fmt << 5 | tlp->tlp_type));
+}
+
+/* data credits (16 bytes each) of a TLP */
+static uint16_t client_fc_tlp_data(const struct pcie_tlp *tlp)
+{
+	return tlp->tlp_fmt & PCIE_TLP_FMT_DATA ? (tlp_data_length(tlp) + 3) / 4 : 0;
+}
+
+/* data credits of a write of length bytes at addr */
+static uint16_t client_fc_write_data(uint64_t addr, int length)
+{
+	int dws = ((addr & 3) + length + 3) / 4;
+
+	return ((dws ? dws : 1) + 3) / 4;
+}
+
+/* the gating function of PCIe spec 2.6.1.2, the counters wrap around */
+static bool client_fc_room(const struct warppipe_client *client, enum pcie_fc_kind kind, uint16_t hdr, uint16_t data)
+{
+	const struct warppipe_fc_tx *tx = &client->fc_tx[kind];
+
+	if (!tx->initialized)
+		return true;
+	if (tx->hdr_limited && ((tx->hdr_limit - tx->hdr_consumed - hdr) & 0xff) > 0x80)
+		return false;
+	if (tx->data_limited && ((tx->data_limit - tx->data_consumed - data) & 0xfff) > 0x800)
+		return false;
+	return true;
+}
+
+static void client_fc_consume(struct warppipe_client *client, enum pcie_fc_kind kind, uint16_t hdr, uint16_t data)
+{
+	struct warppipe_fc_tx *tx = &client->fc_tx[kind];
+
+	tx->hdr_consumed += hdr;
+	tx->data_consumed = (tx->data_consumed + data) & 0xfff;
+}
+
+/* Consume the credits of a TLP about to be sent. Fails if it has to be queued,
+ * for lack of credits or to keep it behind queued TLPs it must not pass.
+ */
+static bool client_fc_take(struct warppipe_client *client, enum pcie_fc_kind kind, uint16_t hdr, uint16_t data)
+{
+	/* Posted Requests may pass the other types, nothing passes them */
+	if (client->fc_queued[PCIE_FC_P] || client->fc_queued[kind] || !client_fc_room(client, kind, hdr, data))
+		return false;
+	client_fc_consume(client, kind, hdr, data);
+	return true;
+}
+
+static int client_fc_queue(struct warppipe_client *client, const struct warppipe_pcie_transport *tport, enum pcie_fc_kind kind, uint16_t data)
+{
+	int length = client_packet_length(tport);
+	struct warppipe_fc_pending *pending = malloc(sizeof(*pending) + length);
+
+	if (!pending) {
+		syslog(LOG_ERR, "Failed to queue a TLP of %d bytes.", length);
+		return -1;
+	}
+	pending->next = NULL;
+	pending->kind = kind;
+	pending->data = data;
+	pending->length = length;
+	memcpy(pending->pkt, tport, length);
+
+	*client->fc_tail = pending;
+	client->fc_tail = &pending->next;
+	client->fc_queued[kind]++;
+	client->fc_queued_bytes += length;
+	syslog(LOG_DEBUG, "Queued TLP waiting for credits, type %d", kind);
+	return length;
+}
+
+/* send the queued TLPs there are credits and replay buffer room for, in order */
+static int client_fc_drain(struct warppipe_client *client)
+{
+	struct warppipe_fc_pending **link = &client->fc_head;
+	struct warppipe_fc_pending *pending;
+	unsigned int blocked = 0;
+
+	while ((pending = *link) && !(blocked & 1 << PCIE_FC_P)) {
+		if ((blocked & 1 << pending->kind) || !client_fc_room(client, pending->kind, 1, pending->data) ||
+		    !client_replay_room(client, pending->length)) {
+			blocked |= 1 << pending->kind;
+			link = &pending->next;
+			continue;
+		}
+
+		client_fc_consume(client, pending->kind, 1, pending->data);
+		*link = pending->next;
+		if (!*link)
+			client->fc_tail = link;
+		client->fc_queued[pending->kind]--;
+		client->fc_queued_bytes -= pending->length;
+
+		int rc = client_send_packet(client, (struct warppipe_pcie_transport *)pending->pkt);
+
+		free(pending);
+		if (rc == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int client_send_fc(struct warppipe_client *client, enum pcie_fc_type type, enum pcie_fc_kind kind, uint8_t hdr, uint16_t data)
+{
+	struct warppipe_pcie_transport tport = {
+		.t_proto = PCIE_PROTO_DLLP,
+		.t_dllp = {
+			.dl_fc = {
+				.fc_type = type,
+				.fc_kind = kind,
+				.fc_hdrfc_hi = hdr >> 2,
+				.fc_hdrfc_lo = hdr & 3,
+				.fc_datafc_hi = data >> 8,
+				.fc_datafc_lo = data & 0xff,
+			},
+		},
+	};
+
+	return client_send_packet(client, &tport) == -1 ? -1 : 0;
+}
+
+/* advertise our receive credits */
+static int client_fc_init(struct warppipe_client *client)
+{
+	client->fc_init_sent = true;
+	for (int kind = PCIE_FC_P; kind <= PCIE_FC_CPL; kind++) {
+		struct warppipe_fc_rx *rx = &client->fc_rx[kind];
+
+		rx->hdr_allocated = client->fc_hdr_credits;
+		rx->data_allocated = client->fc_data_credits;
+		rx->hdr_freed = 0;
+		rx->data_freed = 0;
+		if (client_send_fc(client, PCIE_FC_INIT1, kind, rx->hdr_allocated, rx->data_allocated) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* return the credits freed since the last UpdateFC */
+static int client_send_update_fc(struct warppipe_client *client)
+{
+	client->fc_update_pending = false;
+	for (int kind = PCIE_FC_P; kind <= PCIE_FC_CPL; kind++) {
+		struct warppipe_fc_rx *rx = &client->fc_rx[kind];
+
+		if (!rx->hdr_freed && !rx->data_freed)
+			continue;
+		rx->hdr_freed = 0;
+		rx->data_freed = 0;
+		if (client_send_fc(client, PCIE_FC_UPDATE, kind, rx->hdr_allocated, rx->data_allocated) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static void handle_fc_dllp(struct warppipe_client *client, const struct pcie_dllp *pkt)
+{
+	enum pcie_fc_kind kind = pkt->dl_fc.fc_kind;
+	uint8_t hdr = pkt->dl_fc.fc_hdrfc_hi << 2 | pkt->dl_fc.fc_hdrfc_lo;
+	uint16_t data = pkt->dl_fc.fc_datafc_hi << 8 | pkt->dl_fc.fc_datafc_lo;
+	struct warppipe_fc_tx *tx;
+
+	if (kind > PCIE_FC_CPL || pkt->dl_fc.fc_vcid != 0) {
+		syslog(LOG_WARNING, "Got credit DLLP for unsupported type %d, VC %d", kind, pkt->dl_fc.fc_vcid);
+		return;
+	}
+	tx = &client->fc_tx[kind];
+
+	switch ((enum pcie_fc_type)pkt->dl_fc.fc_type) {
+	case PCIE_FC_INIT1:
+	case PCIE_FC_INIT2:
+		syslog(LOG_DEBUG, "Got InitFC DLLP, type %d: %d header, %d data credits", kind, hdr, data);
+		/* repeated until the peer sees ours, only the first one counts */
+		if (tx->initialized)
+			break;
+		tx->initialized = true;
+		tx->hdr_limited = hdr != 0;
+		tx->data_limited = data != 0;
+		tx->hdr_limit = hdr;
+		tx->hdr_consumed = 0;
+		tx->data_limit = data;
+		tx->data_consumed = 0;
+		/* sized for the credits with the next TLP, unless some are kept already */
+		if (client->replay_buf && !client_outstanding(client))
+			client_replay_free(client);
+		if (client->flow_control && !client->fc_init_sent && client_fc_init(client) == -1)
+			return;
+		break;
+	case PCIE_FC_UPDATE:
+		syslog(LOG_DEBUG, "Got UpdateFC DLLP, type %d: %d header, %d data credits", kind, hdr, data);
+		if (!tx->initialized)
+			break;
+		if (tx->hdr_limited)
+			tx->hdr_limit = hdr;
+		if (tx->data_limited)
+			tx->data_limit = data;
+		break;
+	}
+	client_fc_drain(client);
+}
+
+int client_send_pcie_transport(struct warppipe_client *client, struct warppipe_pcie_transport *tport)
+{
+	if (tport->t_proto == PCIE_PROTO_TLP) {
+		const struct pcie_tlp *tlp = &tport->t_tlp.dl_tlp;
+		enum pcie_fc_kind kind = client_fc_tlp_kind(tlp);
+		uint16_t data = client_fc_tlp_data(tlp);
+
+		if (!client_replay_room(client, client_packet_length(tport)) || !client_fc_take(client, kind, 1, data))
+			return client_fc_queue(client, tport, kind, data);
+	}
+	return client_send_packet(client, tport);
+}
+
+/* Send all of iov, retrying on short writes. Counts the successful calls in *calls if not NULL. */
+static int client_sendmsg(struct warppipe_client *client, struct iovec *iov, int iovcnt, int flags, uint32_t *calls)
+{
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = iovcnt,
+	};
+
+	while (msg.msg_iovlen) {
+		ssize_t n = sendmsg(client->fd, &msg, flags);
+
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Sending transport packet: %s. Disconnecting.",
+			       n < 0 ? strerror(errno) : "unexpected EOF");
+			client->active = false;
+			return -1;
+		}
+		if (calls)
+			(*calls)++;
+
+		while (msg.msg_iovlen && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen) {
+			msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Send a packet made of hdr, data and trailer with a single sendmsg, the queued packets go along in front.
+ * With zc the packet is sent with MSG_ZEROCOPY, so the queue is flushed first, its buffer is reused right away.
+ */
+static int client_send_sg(struct warppipe_client *client, const void *hdr, size_t hdr_len, const void *data, size_t length,
+			  const void *trailer, size_t trailer_len, bool zc)
+{
+	struct iovec iov[4];
+	int iovcnt = 0;
+	int flags = 0;
+	uint32_t *calls = NULL;
+
+	if (client->tx_len && zc && warppipe_client_flush(client) == -1)
+		return -1;
+	if (client->tx_len)
+		iov[iovcnt++] = (struct iovec){ .iov_base = client->tx_buf, .iov_len = client->tx_len };
+	iov[iovcnt++] = (struct iovec){ .iov_base = (void *)hdr, .iov_len = hdr_len };
+	iov[iovcnt++] = (struct iovec){ .iov_base = (void *)data, .iov_len = length };
+	iov[iovcnt++] = (struct iovec){ .iov_base = (void *)trailer, .iov_len = trailer_len };
+	warppipe_capture_iov(client, WARPPIPE_CAPTURE_TX, iov + iovcnt - 3, 3);
+
+#ifdef CLIENT_HAVE_ZEROCOPY
+	if (zc) {
+		flags = MSG_ZEROCOPY;
+		calls = &client->zc_calls;
+	}
+#endif
+	client->tx_len = 0;
+	if (client_sendmsg(client, iov, iovcnt, flags, calls) == -1)
+		return -1;
+
+	syslog(LOG_DEBUG, "Send pcie transport length: %zu", hdr_len + length + trailer_len);
+	return 0;
+}
+
+/* send the unacknowledged TLPs again, as they were */
+static int client_replay(struct warppipe_client *client)
+{
+	uint16_t outstanding = client_outstanding(client);
+	bool tx_batch = client->tx_batch;
+
+	if (!outstanding)
+		return 0;
+	syslog(LOG_DEBUG, "Replaying %d TLPs from seqno = 0x%03x", outstanding, (client->acked_seqno + 1) & 0xfff);
+
+	client->tx_batch = true;
+	for (uint16_t i = 1; i <= outstanding; i++) {
+		uint32_t offset = client->replay_index[(client->acked_seqno + i) & (CLIENT_REPLAY_INDEX - 1)];
+		const struct client_replay_entry *entry = (const struct client_replay_entry *)(client->replay_buf + offset);
+		const uint8_t *pkt = (const uint8_t *)(entry + 1);
+		int rc;
+
+		/* the payload of a zero-copy write is still where the caller put it, the kernel copies it this time */
+		if (entry->data)
+			rc = client_send_sg(client, pkt, entry->hdr_len, entry->data, entry->data_len,
+					    pkt + entry->hdr_len, entry->stored - entry->hdr_len, false);
+		else
+			rc = client_tx(client, pkt, entry->stored);
+		if (rc == -1) {
+			client->tx_batch = tx_batch;
+			return -1;
+		}
+	}
+	client->tx_batch = tx_batch;
+
+	client->replays++;
+	client->replay_deadline_us = client_now_us() + client->replay_timeout_us;
+	if (!tx_batch)
+		return warppipe_client_flush(client);
+	return 0;
+}
+
+/* call release_cb of the zero-copy writes the kernel is done with and the peer acknowledged, in order */
+static void client_zc_release(struct warppipe_client *client)
+{
+	while (client->zc_head != client->zc_done && client->zc_head != client->zc_acked) {
+		struct warppipe_zc_write *zc = &client->zc[client->zc_head % CLIENT_ZEROCOPY_MAX];
+
+		client->zc_head++;
+		if (zc->release_cb)
+			zc->release_cb(zc->data, client->private_data);
+	}
+}
+
+/* the peer got everything up to seqno, credits are not involved so queued TLPs may fit now */
+static void client_replay_purge(struct warppipe_client *client, uint16_t seqno)
+{
+	client->acked_seqno = seqno;
+	/* the writes not acknowledged before were outstanding, so the distance tells which are now */
+	while (client->zc_acked != client->zc_tail &&
+	       ((client->seqno - client->zc[client->zc_acked % CLIENT_ZEROCOPY_MAX].seqno) & 0xfff) >= client_outstanding(client))
+		client->zc_acked++;
+	client_zc_release(client);
+	if (!client_outstanding(client)) {
+		client->replay_head = 0;
+		client->replay_tail = 0;
+		client->replay_deadline_us = 0;
+	} else {
+		client->replay_head = client->replay_index[(seqno + 1) & (CLIENT_REPLAY_INDEX - 1)];
+		client->replay_deadline_us = client_now_us() + client->replay_timeout_us;
+	}
+	if (client->fc_head)
+		client_fc_drain(client);
 }
 
 void handle_dllp(struct warppipe_client *client, const struct pcie_dllp *pkt)
 {
-	if (pkt->dl_type == PCIE_DLLP_ACK || pkt->dl_type == PCIE_DLLP_NAK) {
+	if (pkt->dl_type == PCIE_DLLP_VENDOR) {
+		handle_vendor_dllp(client, pkt);
+	} else if (pkt->dl_type == PCIE_DLLP_ACK) {
+		uint16_t seqno = pkt->dl_acknak.dl_seqno_hi << 8 | pkt->dl_acknak.dl_seqno_lo;
+		/* ACKs are cumulative, one covers every TLP up to seqno */
+		uint16_t acked = (seqno - client->acked_seqno) & 0xfff;
+		uint16_t outstanding = (client->seqno - client->acked_seqno) & 0xfff;
+
+		if (acked > outstanding) {
+			syslog(LOG_WARNING, "Got ACK DLLP for seqno = 0x%03x that was not sent", seqno);
+			return;
+		}
+		syslog(LOG_DEBUG, "Got ACK DLLP for seqno = 0x%03x (%d TLPs)", seqno, acked);
+		if (acked)
+			client_replay_purge(client, seqno);
+	} else if (pkt->dl_type == PCIE_DLLP_NAK) {
+		/* the last good TLP, everything after it has to be sent again */
 		uint16_t seqno = pkt->dl_acknak.dl_seqno_hi << 8 | pkt->dl_acknak.dl_seqno_lo;
+		uint16_t acked = (seqno - client->acked_seqno) & 0xfff;
 
-		syslog(LOG_DEBUG, "Got ACK/NAK DLLP for seqno = 0x%03x", seqno);
+		if (acked > client_outstanding(client)) {
+			syslog(LOG_WARNING, "Got NAK DLLP for seqno = 0x%03x that was not sent", seqno);
+			return;
+		}
+		syslog(LOG_DEBUG, "Got NAK DLLP for seqno = 0x%03x", seqno);
+		if (acked)
+			client_replay_purge(client, seqno);
+		client_replay(client);
 	} else if (pkt->dl_fc.fc_type != 0 && pkt->dl_fc.fc_rsvd1 == 0) {
-		(void)pkt->dl_fc;
-		syslog(LOG_DEBUG, "Got credit DLLP");
+		handle_fc_dllp(client, pkt);
 	} else {
 		syslog(LOG_WARNING, "Unknown DLLP type: %d", pkt->dl_type);
 	}
 }
 
-int client_send_pcie_transport(struct warppipe_client *client, struct warppipe_pcie_transport *tport)
+/* Get room for building a packet of up to size bytes at the end of the transmit queue,
+ * the header is zeroed. Pass it to client_send_pcie_transport, or just drop it.
+ */
+static struct warppipe_pcie_transport *client_tx_alloc(struct warppipe_client *client, size_t size)
 {
-	int packet_length = 1 + sizeof(tport->t_dllp);
+	struct warppipe_pcie_transport *tport;
 
-	if (tport->t_proto == PCIE_PROTO_TLP) {
-		client->seqno++;
-		tport->t_tlp.dl_seqno_hi = client->seqno >> 8;
-		tport->t_tlp.dl_seqno_lo = client->seqno & 0xff;
-		pcie_lcrc32(&tport->t_tlp);
-		packet_length += tlp_total_length(&tport->t_tlp.dl_tlp);
-	} else if (tport->t_proto == PCIE_PROTO_DLLP) {
-		pcie_crc16(&tport->t_dllp);
+	if (size > sizeof(client->tx_buf)) {
+		syslog(LOG_ERR, "Transport packet too long: %zu!", size);
+		return NULL;
 	}
+	if (client->tx_len + size > sizeof(client->tx_buf) && warppipe_client_flush(client) == -1)
+		return NULL;
 
-	int n = send(client->fd, tport, packet_length, 0);
+	tport = (struct warppipe_pcie_transport *)(client->tx_buf + client->tx_len);
+	memset(tport, 0, sizeof(*tport));
+	return tport;
+}
 
-	if (n != packet_length) {
-		syslog(LOG_ERR, "Sending transport packet: %s. Disconnecting.",
-		       n < 0 ? strerror(errno) : "unexpected EOF");
-		client->active = false;
+/* send the pending ACK and the credits to return with it */
+static int client_send_ack(struct warppipe_client *client)
+{
+	if (client->ack_pending) {
+		client->ack_pending = 0;
+		if (warppipe_ack(client, PCIE_DLLP_ACK, client->ack_seqno) == -1)
+			return -1;
+	}
+	if (client->fc_update_pending)
+		return client_send_update_fc(client);
+	return 0;
+}
+
+/* acknowledge a good TLP, the ACK is deferred until enough of them arrive */
+static void client_ack_tlp(struct warppipe_client *client, uint16_t seqno)
+{
+	client->ack_seqno = seqno;
+	if (client->ack_pending++ == 0 && !client->fc_update_pending)
+		client->ack_deadline_us = client_now_us() + client->ack_latency_us;
+	if (client->ack_pending >= client->ack_factor)
+		client_send_ack(client);
+}
+
+/* ask for a replay of everything after the last good TLP, once until it comes */
+static void client_send_nak(struct warppipe_client *client)
+{
+	if (client->nak_sent)
+		return;
+	client->nak_sent = true;
+	/* acknowledge what came before, NAKs are never deferred */
+	if (client->ack_pending)
+		client_send_ack(client);
+	warppipe_ack(client, PCIE_DLLP_NAK, client->ack_seqno);
+}
+
+/* the credits of a handled TLP are free again, they go back to the peer with the next ACK
+ * or right away once half of the advertised ones are used up
+ */
+static void client_fc_release(struct warppipe_client *client, const struct pcie_tlp *tlp)
+{
+	struct warppipe_fc_rx *rx = &client->fc_rx[client_fc_tlp_kind(tlp)];
+	uint16_t data = client_fc_tlp_data(tlp);
+
+	if (!client->fc_init_sent)
+		return;
+	/* infinite credits are never returned */
+	if (client->fc_hdr_credits) {
+		rx->hdr_allocated++;
+		rx->hdr_freed++;
+	}
+	if (client->fc_data_credits && data) {
+		rx->data_allocated = (rx->data_allocated + data) & 0xfff;
+		rx->data_freed += data;
+	}
+	if (!rx->hdr_freed && !rx->data_freed)
+		return;
+
+	if (rx->hdr_freed * 2 >= client->fc_hdr_credits || rx->data_freed * 2 >= client->fc_data_credits) {
+		client_send_update_fc(client);
+	} else if (!client->fc_update_pending) {
+		if (!client->ack_pending)
+			client->ack_deadline_us = client_now_us() + client->ack_latency_us;
+		client->fc_update_pending = true;
+	}
+}
+
+static int client_cpl_timeout(struct warppipe_client *client, uint64_t now);
+
+int warppipe_client_ack_timeout(struct warppipe_client *client)
+{
+	if (!client->ack_pending && !client->fc_update_pending && !client->replay_deadline_us && !client->cpl_deadline_us)
 		return -1;
+
+	uint64_t now = client_now_us();
+	int left = client_cpl_timeout(client, now);
+
+	if (client->ack_pending || client->fc_update_pending) {
+		if (now >= client->ack_deadline_us) {
+			client_send_ack(client);
+		} else {
+			int ack_left = (client->ack_deadline_us - now + 999) / 1000;
+
+			if (left < 0 || ack_left < left)
+				left = ack_left;
+		}
 	}
-	syslog(LOG_DEBUG, "Send pcie transport length: %d", packet_length);
-	return n;
+	if (client->replay_deadline_us && client->active) {
+		if (now >= client->replay_deadline_us) {
+			syslog(LOG_WARNING, "Replay timer expired, %d TLPs not acknowledged", client_outstanding(client));
+			if (client_replay(client) == -1)
+				return -1;
+		}
+
+		int replay_left = (client->replay_deadline_us - now + 999) / 1000;
+
+		if (left < 0 || replay_left < left)
+			left = replay_left;
+	}
+	return left;
+}
+
+int warppipe_client_flush(struct warppipe_client *client)
+{
+	size_t sent = 0;
+
+	/* a pending ACK rides along with the queued packets */
+	if ((client->ack_pending || client->fc_update_pending) && client->tx_len) {
+		bool tx_batch = client->tx_batch;
+
+		client->tx_batch = true;
+		client_send_ack(client);
+		client->tx_batch = tx_batch;
+	}
+
+	while (sent < client->tx_len) {
+		int n = client_send(client, client->tx_buf + sent, client->tx_len - sent);
+
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Sending transport packet: %s. Disconnecting.",
+			       n < 0 ? strerror(errno) : "unexpected EOF");
+			client->active = false;
+			client->tx_len = 0;
+			return -1;
+		}
+		sent += n;
+	}
+	client->tx_len = 0;
+	return 0;
+}
+
+/* a TLP of a full MPS chunk with a 4DW header, sequence number and LCRC has to fit the receive limit */
+_Static_assert(1 + 2 + 16 + CLIENT_MAX_PAYLOAD_SIZE + 4 <= CLIENT_BUFFER_SIZE,
+	       "CLIENT_MAX_PAYLOAD_SIZE does not fit CLIENT_BUFFER_SIZE");
+
+/* bytes from addr up to the next multiple of size (a power of 2), at most length */
+static int client_chunk(uint64_t addr, int length, int size)
+{
+	int n = size - (addr & (size - 1));
+
+	return n < length ? n : length;
+}
+
+/* number of client_chunk pieces of addr..addr + length, at least 1 */
+static int client_chunks(uint64_t addr, int length, int size)
+{
+	int n = ((addr & (size - 1)) + length + size - 1) / size;
+
+	return n ? n : 1;
+}
+
+static bool client_region_range(const struct warppipe_client *client, const struct warppipe_region *region, uint64_t *start, uint64_t *last);
+
+/* smallest region with a read callback around span, it serves reads of a hook that has none */
+static const struct warppipe_region *client_read_parent(const struct warppipe_client *client,
+							const struct warppipe_region_span *span, uint64_t *base)
+{
+	const struct warppipe_region *best = NULL;
+	uint64_t start, last;
+
+	for (int i = 0; i < client->nregions; i++) {
+		const struct warppipe_region *region = &client->regions[i];
+
+		if (!region->read_cb || !client_region_range(client, region, &start, &last) ||
+		    start > span->start || last < span->last)
+			continue;
+		if (!best || region->size <= best->size) {
+			best = region;
+			*base = start;
+		}
+	}
+	return best;
+}
+
+/* Read length bytes at addr into data, each part from the region it falls in:
+ * the hooks of the regions serve their parts, memory-backed ones are copied.
+ */
+static int client_read_regions(struct warppipe_client *client, uint64_t addr, uint8_t *data, int length)
+{
+	while (length > 0) {
+		/* looked up again for each part, a hook may have registered regions */
+		const struct warppipe_region_span *span =
+			client_find_span(client, client_region_map(client, client_region_gen(client)), addr);
+
+		if (!span) {
+			syslog(LOG_ERR, "Read request runs past the end of its region.");
+			return -1;
+		}
+
+		const struct warppipe_region *region = &client->regions[span->region];
+		uint64_t base = span->base;
+		uint64_t offset = addr - span->base;
+		int n = span->last - addr < (uint64_t)length - 1 ? span->last - addr + 1 : length;
+
+		/* a hook without a read callback is read like what it was carved out of */
+		if (!region->read_cb && !region->memory) {
+			const struct warppipe_region *parent = client_read_parent(client, span, &base);
+
+			if (parent)
+				region = parent;
+		}
+
+		if (region->read_cb) {
+			memset(data, 0, n);
+			if (region->read_cb(addr - base, data, n, region->private_data ? region->private_data : client->private_data))
+				return -1;
+		} else if (!span->memory) {
+			syslog(LOG_ERR, "Completer is missing pcie_read callback. Please register pcie_read function.");
+			return -1;
+		} else if (offset + n > span->memory_size) {
+			syslog(LOG_ERR, "Read request runs past the end of the memory-backed BAR.");
+			return -1;
+		} else {
+			/* the payload comes straight from the BAR */
+			memcpy(data, span->memory + offset, n);
+		}
+
+		addr += n;
+		data += n;
+		length -= n;
+	}
+	return 0;
 }
 
 void handle_memory_read_request(struct warppipe_client *client, const struct pcie_tlp *pkt)
 {
 	syslog(LOG_DEBUG, "Got read request TLP");
 	warppipe_read_cb_t read_cb = NULL;
+	/* served by client_read_regions instead of read_cb */
+	bool regions = false;
 
-	int data_len = tlp_data_length(pkt);
 	int data_len_bytes = tlp_data_length_bytes(pkt);
 	uint64_t addr = tlp_req_get_addr(pkt);
-	int bar_idx = -1;
 
 	switch ((enum pcie_tlp_type)(pkt->tlp_fmt << 5 | pkt->tlp_type)) {
 	case PCIE_TLP_IORD:
 	case PCIE_TLP_MRD32:
 	case PCIE_TLP_MRD64:
-		bar_idx = get_bar_idx(client, addr);
-		if (bar_idx != -1) {
-			read_cb = client->bar_read_cb[bar_idx];
-			addr = addr & (client->bar_size[bar_idx] - 1);
-		}
+		regions = client_find_span(client, client_region_map(client, client_region_gen(client)), addr) != NULL;
 		break;
 	case PCIE_TLP_CR0:
 		read_cb = client->cfg0_read_cb;
@@ -105,58 +1185,149 @@ void handle_memory_read_request(struct warppipe_client *client, const struct pci
 		break;
 	}
 
-	if (!read_cb) {
+	/* answered with an Unsupported Request completion, the Requester must not wait for it */
+	bool unsupported = false;
+
+	if (!read_cb && !regions) {
 		syslog(LOG_ERR, "Completer is missing pcie_read callback. Please register pcie_read function.");
-		return;
+		unsupported = true;
 	}
+	if (data_len_bytes < 0) {
+		syslog(LOG_ERR, "Invalid byte enables in read request.");
+		unsupported = true;
+	}
+	if (unsupported)
+		data_len_bytes = 0;
 
-	struct warppipe_pcie_transport *tport = calloc(1, sizeof(struct warppipe_pcie_transport) + data_len * 4);
-	struct pcie_tlp *tlp = &tport->t_tlp.dl_tlp;
-
-	tport->t_proto = PCIE_PROTO_TLP;
-	tlp->tlp_fmt = PCIE_TLP_CPLD >> 5;
-	tlp->tlp_type = PCIE_TLP_CPLD & 0x1F;
-	tlp->tlp_length_hi = pkt->tlp_length_hi;
-	tlp->tlp_length_lo = pkt->tlp_length_lo;
-	tlp->tlp_cpl.c_tag = pkt->tlp_req.r_tag;
-	tlp->tlp_cpl.c_byte_count_hi = data_len_bytes >> 8;
-	tlp->tlp_cpl.c_byte_count_lo = data_len_bytes & 0xFF;
+	int align = 0;
 
 	if ((pkt->tlp_req.r_first_be & 7) == 0)
-		addr += 3;
+		align = 3;
 	else if ((pkt->tlp_req.r_first_be & 3) == 0)
-		addr += 2;
+		align = 2;
 	else if ((pkt->tlp_req.r_first_be & 1) == 0)
-		addr += 1;
+		align = 1;
+	addr += align;
+
+	/* one CplD per Max Payload Size aligned block, the Byte Count tells the Requester how much is left */
+	int offset = 0;
+
+	do {
+		uint64_t cpl_addr = addr + offset;
+		int n = client_chunk(cpl_addr, data_len_bytes - offset, client->mps);
+		int data_len = n ? ((cpl_addr & 3) + n + 3) / 4 : 1;
+		struct warppipe_pcie_transport *tport = client_tx_alloc(client, sizeof(struct warppipe_pcie_transport) + data_len * 4);
+
+		if (!tport)
+			return;
+
+		struct pcie_tlp *tlp = &tport->t_tlp.dl_tlp;
+		int byte_count = data_len_bytes - offset;
+
+		tport->t_proto = PCIE_PROTO_TLP;
+		tlp->tlp_fmt = PCIE_TLP_CPLD >> 5;
+		tlp->tlp_type = PCIE_TLP_CPLD & 0x1F;
+		tlp->tlp_length_hi = (data_len >> 8) & 0x3;
+		tlp->tlp_length_lo = data_len & 0xFF;
+		tlp->tlp_cpl.c_tag = pkt->tlp_req.r_tag;
+		tlp->tlp_t8 = pkt->tlp_t8;
+		tlp->tlp_t9 = pkt->tlp_t9;
+		/* 4096 is encoded as 0 */
+		tlp->tlp_cpl.c_byte_count_hi = (byte_count >> 8) & 0xF;
+		tlp->tlp_cpl.c_byte_count_lo = byte_count & 0xFF;
+		tlp->tlp_cpl.c_lower_address = cpl_addr & 0x7F;
+
+		/* bytes not covered by the byte enables stay zeroed */
+		memset(tlp->tlp_cpl.c_data + n, 0, data_len * 4 - n);
+		int read_error = 0;
+
+		if (unsupported) {
+			read_error = -1;
+		} else if (regions) {
+			read_error = client_read_regions(client, cpl_addr, tlp->tlp_cpl.c_data, n);
+		} else {
+			memset(tlp->tlp_cpl.c_data, 0, n);
+			read_error = read_cb(cpl_addr, tlp->tlp_cpl.c_data, n, client->private_data);
+		}
+
+		if (read_error) {
+			/* send Cpl instead of CplD to indicate failure, it ends the request */
+			tlp->tlp_fmt &= ~PCIE_TLP_FMT_DATA;
+			tlp->tlp_cpl.c_status = PCIE_CPL_STATUS_UR;
+		}
+
+		if (client_send_pcie_transport(client, tport) == -1 || read_error)
+			return;
+		offset += n;
+	} while (offset < data_len_bytes);
+}
 
-	int read_error = read_cb(addr, tlp->tlp_cpl.c_data, data_len_bytes, client->private_data);
+/* Apply a write starting in the memory-backed span found in the map of generation gen,
+ * then pass each part of it to the hooks of the regions it runs into.
+ */
+static void client_write_memory(struct warppipe_client *client, uint32_t gen,
+				const struct warppipe_region_span *span, uint64_t addr, const uint8_t *data, int length)
+{
+	const struct warppipe_region_map *map = client_region_map(client, gen);
+	uint64_t offset = addr - span->base;
 
-	if (read_error)
-		tlp->tlp_fmt &= ~PCIE_TLP_FMT_DATA;  // send Cpl instead of CplD to indicate failure
+	if (length < 0 || offset + length > span->memory_size) {
+		syslog(LOG_ERR, "Write request runs past the end of the memory-backed BAR.");
+		return;
+	}
+	if (!(span->memory_flags & WARPPIPE_MEMORY_READONLY))
+		memcpy(span->memory + offset, data, length);
 
-	// TODO: check status and resend if fail
-	client_send_pcie_transport(client, tport);
+	uint64_t last = addr + length - 1;
+
+	while (length && span && span->start <= last) {
+		const struct warppipe_region *region = &client->regions[span->region];
+		uint64_t start = span->start > addr ? span->start : addr;
+		uint64_t end = span->last < last ? span->last : last;
+
+		if (region->write_cb)
+			region->write_cb(start - span->base, data + (start - addr), end - start + 1,
+					 region->private_data ? region->private_data : client->private_data);
+		if (end == last)
+			break;
 
-	free(tport);
+		/* a hook registered regions, the rest of the write goes by the new map */
+		if (client_region_gen(client) != gen) {
+			gen = client_region_gen(client);
+			map = client_region_map(client, gen);
+			span = client_find_span(client, map, end + 1);
+		} else {
+			span = span + 1 < map->spans + map->count ? span + 1 : NULL;
+		}
+	}
 }
 
 void handle_memory_write_request(struct warppipe_client *client, const struct pcie_tlp *pkt)
 {
 	syslog(LOG_DEBUG, "Got write request TLP");
 	warppipe_write_cb_t write_cb = NULL;
+	void *private_data = client->private_data;
+	const struct warppipe_region_span *span = NULL;
+	uint32_t gen = 0;
 
 	int data_len = tlp_data_length_bytes(pkt);
 	uint64_t addr = tlp_req_get_addr(pkt);
-	int bar_idx = -1;
 
 	switch ((enum pcie_tlp_type)(pkt->tlp_fmt << 5 | pkt->tlp_type)) {
 	case PCIE_TLP_IOWR:
 	case PCIE_TLP_MWR32:
 	case PCIE_TLP_MWR64:
-		bar_idx = get_bar_idx(client, addr);
-		if (bar_idx != -1) {
-			write_cb = client->bar_write_cb[bar_idx];
-			addr = addr & (client->bar_size[bar_idx] - 1);
+		gen = client_region_gen(client);
+		span = client_find_span(client, client_region_map(client, gen), addr);
+		if (span && span->memory)
+			break;
+		if (span) {
+			const struct warppipe_region *region = &client->regions[span->region];
+
+			write_cb = region->write_cb;
+			if (region->private_data)
+				private_data = region->private_data;
+			addr -= span->base;
 		}
 		break;
 	case PCIE_TLP_CW0:
@@ -165,7 +1336,7 @@ void handle_memory_write_request(struct warppipe_client *client, const struct pc
 	default:
 		break;
 	}
-	if (!write_cb) {
+	if (!write_cb && !(span && span->memory)) {
 		syslog(LOG_ERR, "Completer is missing pcie_write callback. Please register pcie_write function.");
 		return;
 	}
@@ -183,26 +1354,202 @@ void handle_memory_write_request(struct warppipe_client *client, const struct pc
 		data += 1;
 	}
 
+	if (span && span->memory)
+		client_write_memory(client, gen, span, addr, data, data_len);
+	else
+		write_cb(addr, data, data_len, private_data);
+}
+
+/* reassembly buffer shared by the tags of a read */
+struct warppipe_read {
+	warppipe_completion_cb_t completion_cb;
+	void *private_data;
+	/* requests not fully completed yet */
+	int pending;
+	int error_code;
+	int length;
+	uint8_t data[];
+};
+
+static struct warppipe_read *client_read_alloc(warppipe_completion_cb_t completion_cb, void *private_data, int length, int pending)
+{
+	struct warppipe_read *read = malloc(sizeof(*read) + length);
+
+	if (!read) {
+		syslog(LOG_ERR, "Failed to allocate a buffer for a read of %d bytes.", length);
+		return NULL;
+	}
+	read->completion_cb = completion_cb;
+	read->private_data = private_data;
+	read->pending = pending;
+	read->error_code = 0;
+	read->length = length;
+	return read;
+}
+
+/* 10-bit tag of a completion, T9 and T8 are zero for 8-bit tags */
+static int client_cpl_tag(const struct pcie_tlp *pkt)
+{
+	return pkt->tlp_t9 << 9 | pkt->tlp_t8 << 8 | pkt->tlp_cpl.c_tag;
+}
+
+static bool client_tag_used(const struct warppipe_client *client, int tag)
+{
+	return client->tag_bitmap[tag / 64] & (1ULL << (tag % 64));
+}
+
+/* lowest free tag, -1 if all max_tags are in use */
+static int client_alloc_tag(struct warppipe_client *client)
+{
+	for (int i = 0; i * 64 < client->max_tags && i < CLIENT_MAX_TAGS / 64; i++) {
+		uint64_t free_bits = ~client->tag_bitmap[i];
+		int tag;
+
+		if (!free_bits)
+			continue;
+		tag = i * 64 + __builtin_ctzll(free_bits);
+		if (tag >= client->max_tags)
+			break;
+		client->tag_bitmap[i] |= 1ULL << (tag % 64);
+		client->tags_used++;
+		return tag;
+	}
+	return -1;
+}
+
+static void client_free_tag(struct warppipe_client *client, int tag)
+{
+	client->tag_bitmap[tag / 64] &= ~(1ULL << (tag % 64));
+	client->tags_used--;
+	client->tags[tag].completion_cb = NULL;
+	client->tags[tag].split = NULL;
+}
 
-	write_cb(addr, data, data_len, client->private_data);
+/* fail the request waiting for tag, its callback runs once the other tags of a split read are done too */
+static void client_fail_tag(struct warppipe_client *client, int tag)
+{
+	struct warppipe_completion_status completion_status = {
+		.error_code = -1,
+	};
+	warppipe_completion_cb_t completion_cb = client->tags[tag].completion_cb;
+	void *private_data = client->tags[tag].private_data;
+	struct warppipe_read *read = client->tags[tag].split;
+
+	client_free_tag(client, tag);
+	if (read) {
+		read->error_code = -1;
+		if (--read->pending)
+			return;
+	}
+	if (completion_cb)
+		completion_cb(completion_status, NULL, 0, private_data);
+	free(read);
+}
+
+/* Fail the reads not completed in time, a Completer may never answer.
+ * returns: ms left until the next one expires, -1 if no read is timed
+ */
+static int client_cpl_timeout(struct warppipe_client *client, uint64_t now)
+{
+	uint64_t next = 0;
+
+	if (!client->cpl_deadline_us)
+		return -1;
+	if (now < client->cpl_deadline_us)
+		return (client->cpl_deadline_us - now + 999) / 1000;
+
+	for (int i = 0; i < CLIENT_MAX_TAGS && client->tags_used; i++) {
+		if (client_tag_used(client, i) && client->tags[i].deadline_us && now >= client->tags[i].deadline_us) {
+			syslog(LOG_WARNING, "Completion timeout for read with tag %d", i);
+			client_fail_tag(client, i);
+		}
+	}
+	/* the callbacks may have sent new reads */
+	for (int i = 0; i < CLIENT_MAX_TAGS && client->tags_used; i++) {
+		if (client_tag_used(client, i) && client->tags[i].deadline_us && (!next || client->tags[i].deadline_us < next))
+			next = client->tags[i].deadline_us;
+	}
+	client->cpl_deadline_us = next;
+	return next ? (int)((next - now + 999) / 1000) : -1;
 }
 
 void handle_completion(struct warppipe_client *client, const struct pcie_tlp *pkt)
 {
 	struct warppipe_completion_status completion_status;
+	int tag_id = client_cpl_tag(pkt);
+	struct warppipe_read_tag *tag = &client->tags[tag_id];
 
 	completion_status.error_code = 0;
 
 	syslog(LOG_DEBUG, "Got completion TLP");
-	if (client->completion_cb[pkt->tlp_cpl.c_tag] == NULL) {
-		syslog(LOG_ERR, "Couldn't find read request for completion with tag: %d", pkt->tlp_req.r_tag);
+	if (!client_tag_used(client, tag_id)) {
+		syslog(LOG_ERR, "Couldn't find read request for completion with tag: %d", tag_id);
 		return;
 	}
 
-	int data_len = pkt->tlp_cpl.c_byte_count_hi << 8 | pkt->tlp_cpl.c_byte_count_lo;
+	/* an unsuccessful completion ends the request, whatever its byte count */
+	if (!(pkt->tlp_fmt & PCIE_TLP_FMT_DATA) || pkt->tlp_cpl.c_status != PCIE_CPL_STATUS_SC) {
+		client_fail_tag(client, tag_id);
+		return;
+	}
+
+	/* bytes left to complete the request including this completion, 0 means 4096 */
+	int byte_count = pkt->tlp_cpl.c_byte_count_hi << 8 | pkt->tlp_cpl.c_byte_count_lo;
+
+	if (byte_count == 0 && tag->length != 0)
+		byte_count = 4096;
+
+	int offset = tag->length - byte_count;
 
-	client->completion_cb[pkt->tlp_cpl.c_tag](completion_status, pkt->tlp_cpl.c_data, data_len, client->private_data);
-	client->completion_cb[pkt->tlp_cpl.c_tag] = NULL;
+	if (offset < 0) {
+		syslog(LOG_ERR, "Completion with tag %d has byte count %d for a read of %u bytes.",
+		       tag_id, byte_count, tag->length);
+		return;
+	}
+
+	/* data starts at c_data[0], the DWs also hold the lower address offset */
+	int avail = tlp_data_length(pkt) * 4 - (pkt->tlp_cpl.c_lower_address & 3);
+	int data_len = byte_count < avail ? byte_count : avail;
+	bool last = byte_count <= avail;
+
+	warppipe_completion_cb_t completion_cb = tag->completion_cb;
+	void *private_data = tag->private_data;
+
+	/* the whole request in a single completion, pass the data on without copying */
+	if (!tag->split && last && offset == 0) {
+		client_free_tag(client, tag_id);
+		if (completion_cb)
+			completion_cb(completion_status, pkt->tlp_cpl.c_data, data_len, private_data);
+		return;
+	}
+
+	if (!tag->split) {
+		tag->split = client_read_alloc(completion_cb, private_data, tag->length, 1);
+		tag->offset = 0;
+		if (!tag->split) {
+			client_free_tag(client, tag_id);
+			completion_status.error_code = -1;
+			if (completion_cb)
+				completion_cb(completion_status, NULL, 0, private_data);
+			return;
+		}
+	}
+
+	struct warppipe_read *read = tag->split;
+
+	memcpy(read->data + tag->offset + offset, pkt->tlp_cpl.c_data, data_len);
+
+	if (!last)
+		return;
+
+	client_free_tag(client, tag_id);
+	if (--read->pending)
+		return;
+
+	completion_status.error_code = read->error_code;
+	if (completion_cb)
+		completion_cb(completion_status, read->data, read->error_code ? 0 : read->length, private_data);
+	free(read);
 }
 
 void handle_tlp(struct warppipe_client *client, const struct pcie_tlp *pkt)
@@ -226,6 +1573,8 @@ void handle_tlp(struct warppipe_client *client, const struct pcie_tlp *pkt)
 		break;
 	case PCIE_TLP_CPL:
 		/* no data, used for IO, configuration write, read completition with error */
+		if (client_tag_used(client, client_cpl_tag(pkt)))
+			handle_completion(client, pkt);
 		break;
 	case PCIE_TLP_CPLD:
 		handle_completion(client, pkt);
@@ -240,86 +1589,184 @@ void handle_tlp(struct warppipe_client *client, const struct pcie_tlp *pkt)
 	}
 }
 
-int warppipe_ack(struct warppipe_client *client, enum pcie_dllp_type type, uint16_t seqno)
+int warppipe_ack(struct warppipe_client *client, enum pcie_dllp_type type, uint16_t seqno)
+{
+	struct warppipe_pcie_transport tport = {
+		.t_proto = PCIE_PROTO_DLLP,
+		.t_dllp = {
+			.dl_acknak = {
+				.dl_nak = type,
+				.dl_seqno_hi = seqno >> 8,
+				.dl_seqno_lo = seqno & 0xff,
+			},
+		},
+	};
+
+	if (client_send_pcie_transport(client, &tport) == -1)
+		return -1;
+
+	return 0;
+}
+
+int warppipe_client_link_up(struct warppipe_client *client)
 {
+	/* file descriptors only go over a socket used directly */
+	if (client->io)
+		client->link_caps &= ~WARPPIPE_LINK_CAP_SHARED_BARS;
+
 	struct warppipe_pcie_transport tport = {
 		.t_proto = PCIE_PROTO_DLLP,
 		.t_dllp = {
-			.dl_acknak = {
-				.dl_nak = type,
-				.dl_seqno_hi = seqno >> 8,
-				.dl_seqno_lo = seqno & 0xff,
+			.dl_vendor = {
+				.dl_vendor_type = PCIE_DLLP_VENDOR,
+				.dl_vendor_id = WARPPIPE_VENDOR_DLLP_LINK_CAPS,
+				.dl_vendor_data = { client->link_caps },
 			},
 		},
 	};
 
 	if (client_send_pcie_transport(client, &tport) == -1)
 		return -1;
+	if (client->flow_control && !client->fc_init_sent)
+		return client_fc_init(client);
 
 	return 0;
 }
 
-void warppipe_client_read(struct warppipe_client *client)
+/* Handle the packet at rx_head if it has been received completely, returns false if more data is needed. */
+static bool client_handle_packet(struct warppipe_client *client)
 {
-	struct warppipe_pcie_transport *tport = (void *)client->buf;
-	int len = 0;
+	uint8_t *pkt = client->rx_buf + client->rx_head;
+	struct warppipe_pcie_transport *tport = (void *)pkt;
+	size_t avail = client->rx_tail - client->rx_head;
+	int total = warppipe_transport_length(pkt, avail);
 
-	len = recv(client->fd, tport, 1 + sizeof(tport->t_dllp), 0);
-	if (len != 1 + sizeof(tport->t_dllp)) {
-		if (len != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
-			syslog(LOG_NOTICE, "Client disconnecting: %s.", len < 0 ? strerror(errno) : "graceful EOF");
-			client->active = false;
+	if (total == 0)
+		return false;
+
+	if (total < 0) {
+		if (tport->t_proto == PCIE_PROTO_TLP)
+			syslog(LOG_ERR, "Unknown TLP format: %d! Disconnecting.", tport->t_tlp.dl_tlp.tlp_fmt);
+		else
+			syslog(LOG_ERR, "Unknown PCIe protocol: %d! Disconnecting.", tport->t_proto);
+		client->active = false;
+		return false;
+	}
+
+	if (total > CLIENT_BUFFER_SIZE) {
+		syslog(LOG_ERR, "Received TLP too long: %d! Disconnecting.", total);
+		client->active = false;
+		return false;
+	}
+
+	bool trusted = client_crc_trusted(client);
+
+	/* LCRC covers everything but the protocol byte and the LCRC itself,
+	 * update it as the data comes in, while it is still in cache
+	 */
+	if (tport->t_proto == PCIE_PROTO_TLP && !trusted) {
+		size_t crc_end = total - 4;
+		size_t upto = avail < crc_end ? avail : crc_end;
+
+		if (client->rx_crc_len == 0) {
+			pcie_lcrc32_init(&client->rx_crc);
+			client->rx_crc_len = 1;
+		}
+		if (upto > client->rx_crc_len) {
+			pcie_lcrc32_update(&client->rx_crc, pkt + client->rx_crc_len, upto - client->rx_crc_len);
+			client->rx_crc_len = upto;
 		}
-		return;
 	}
 
+	if (avail < (size_t)total)
+		return false;
+
+	client->rx_head += total;
+	client->rx_crc_len = 0;
+	warppipe_capture(client, WARPPIPE_CAPTURE_RX, pkt, total);
+
 	switch ((enum pcie_proto)tport->t_proto) {
 	case PCIE_PROTO_DLLP:
-		if (pcie_crc16_valid(&tport->t_dllp))
+		if (trusted || pcie_crc16_valid(&tport->t_dllp))
 			handle_dllp(client, &tport->t_dllp);
 		else
 			syslog(LOG_WARNING, "DLLP corrupted CRC");
 		break;
 	case PCIE_PROTO_TLP:
 		{
-			syslog(LOG_DEBUG, "Got TLP packet");
-			int total = tlp_total_length(&tport->t_tlp.dl_tlp);
-
-			if (total < 0) {  // error
-				syslog(LOG_ERR, "Unknown TLP format: %d! Disconnecting.", tport->t_tlp.dl_tlp.tlp_fmt);
-				client->active = false;
-				return;
-			}
-
-			total += len; // add DLLP length
 			syslog(LOG_DEBUG, "Received TLP packed len: %d", total);
 
-			assert(total <= CLIENT_BUFFER_SIZE);
-			while (len < total) {
-				int n = recv(client->fd, client->buf + len, total - len, 0);
-
-				if (n <= 0) {
-					syslog(LOG_ERR, "Receiving TLP: %s. Disconnecting.",
-					       n < 0 ? strerror(errno) : "unexpected EOF");
-					client->active = false;
-					return;
-				}
-				len += n;
-			}
-			bool crc_ok = pcie_lcrc32_valid(&tport->t_tlp);
+			bool crc_ok = trusted || lcrc32_matches(pcie_lcrc32_final(&client->rx_crc), pkt + total - 4);
+			uint16_t seqno = tport->t_tlp.dl_seqno_hi << 8 | tport->t_tlp.dl_seqno_lo;
 
-			warppipe_ack(client, crc_ok ? PCIE_DLLP_ACK : PCIE_DLLP_NAK, tport->t_tlp.dl_seqno_hi << 8 | tport->t_tlp.dl_seqno_lo);
-			if (crc_ok)
+			/* anything before the expected sequence number is a replay of a TLP handled already */
+			uint16_t expected = (client->ack_seqno + 1) & 0xfff;
+
+			if (crc_ok && seqno == expected) {
+				client->nak_sent = false;
+				client_ack_tlp(client, seqno);
 				handle_tlp(client, &tport->t_tlp.dl_tlp);
-			else
-				syslog(LOG_WARNING, "TLP corrupted CRC");
+				client_fc_release(client, &tport->t_tlp.dl_tlp);
+			} else if (crc_ok && ((seqno - expected) & 0xfff) >= 2048) {
+				syslog(LOG_DEBUG, "Dropping duplicate TLP, seqno = 0x%03x", seqno);
+				/* the peer missed our ACK, send it again */
+				client_ack_tlp(client, client->ack_seqno);
+			} else {
+				if (crc_ok)
+					syslog(LOG_WARNING, "TLP out of sequence, seqno = 0x%03x, expected 0x%03x", seqno, expected);
+				else
+					syslog(LOG_WARNING, "TLP corrupted CRC");
+				client_send_nak(client);
+			}
 			break;
 		}
-	default:
-		syslog(LOG_ERR, "Unknown PCIe protocol: %d! Disconnecting.", tport->t_proto);
-		client->active = false;
+	}
+
+	return true;
+}
+
+static void client_read_once(struct warppipe_client *client)
+{
+	int n, flags = 0;
+
+#ifdef CLIENT_HAVE_ZEROCOPY
+	/* the socket might have been readable only because of zero-copy notifications */
+	if (client->zc_done != client->zc_tail) {
+		warppipe_client_zerocopy_reap(client);
+		flags = MSG_DONTWAIT;
+	}
+#endif
+
+	/* make room at the end, the unparsed remainder is shorter than a packet */
+	if (client->rx_head == client->rx_tail) {
+		client->rx_head = 0;
+		client->rx_tail = 0;
+	} else if (CLIENT_RX_BUFFER_SIZE - client->rx_tail < CLIENT_BUFFER_SIZE) {
+		memmove(client->rx_buf, client->rx_buf + client->rx_head, client->rx_tail - client->rx_head);
+		client->rx_tail -= client->rx_head;
+		client->rx_head = 0;
+	}
+
+	n = client_recv(client, client->rx_buf + client->rx_tail, CLIENT_RX_BUFFER_SIZE - client->rx_tail, flags);
+	if (n <= 0) {
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			syslog(LOG_NOTICE, "Client disconnecting: %s.", n < 0 ? strerror(errno) : "graceful EOF");
+			client->active = false;
+		}
 		return;
 	}
+	client->rx_tail += n;
+
+	/* handle everything that arrived, a partial packet stays for the next call */
+	while (client->active && client_handle_packet(client))
+		;
+}
+
+void warppipe_client_read(struct warppipe_client *client)
+{
+	do {
+		client_read_once(client);
+	} while (client->active && client->io && client->io->pending && client->io->pending(client->io));
 }
 
 void warppipe_client_create(struct warppipe_client *client, int client_fd)
@@ -327,34 +1774,389 @@ void warppipe_client_create(struct warppipe_client *client, int client_fd)
 	client->fd = client_fd;
 	client->seqno = 0;
 	client->active = true;
+	client->link_caps = 0;
+	client->link_caps_agreed = 0;
+	client->io = NULL;
+	client->rx_head = 0;
+	client->rx_tail = 0;
+	client->rx_crc_len = 0;
+	client->tx_batch = false;
+	client->tx_len = 0;
+	client->ack_factor = CLIENT_ACK_FACTOR;
+	client->ack_latency_us = CLIENT_ACK_LATENCY_US;
+	client->ack_pending = 0;
+	client->ack_seqno = 0;
+	client->acked_seqno = 0;
+	client->nak_sent = false;
+	client->replay_index = NULL;
+	client->replay_buf = NULL;
+	client->replay_size = 0;
+	client->replay_head = 0;
+	client->replay_tail = 0;
+	client->replay_timeout_us = CLIENT_REPLAY_TIMEOUT_US;
+	client->replay_deadline_us = 0;
+	client->cpl_timeout_us = CLIENT_COMPLETION_TIMEOUT_US;
+	client->cpl_deadline_us = 0;
+	client->replays = 0;
+	client->write_sg_threshold = CLIENT_WRITE_SG_THRESHOLD;
+	client->zerocopy = false;
+	client->zc_head = 0;
+	client->zc_done = 0;
+	client->zc_acked = 0;
+	client->zc_tail = 0;
+	client->zc_calls = 0;
 	client->cfg0_read_cb = NULL;
 	client->cfg0_write_cb = NULL;
-	client->read_tag = 0;
+	client->max_tags = CLIENT_DEFAULT_TAGS;
+	client->tags_used = 0;
+	memset(client->tag_bitmap, 0, sizeof(client->tag_bitmap));
+	client->mps = CLIENT_MAX_PAYLOAD_SIZE;
+	client->mrrs = CLIENT_MAX_READ_REQUEST_SIZE;
+	client->async = NULL;
+	client->flow_control = false;
+	client->fc_hdr_credits = CLIENT_FC_HDR_CREDITS;
+	client->fc_data_credits = CLIENT_FC_DATA_CREDITS;
+	client->fc_init_sent = false;
+	client->fc_update_pending = false;
+	memset(client->fc_tx, 0, sizeof(client->fc_tx));
+	memset(client->fc_rx, 0, sizeof(client->fc_rx));
+	client->fc_head = NULL;
+	client->fc_tail = &client->fc_head;
+	memset(client->fc_queued, 0, sizeof(client->fc_queued));
+	client->fc_queued_bytes = 0;
+	client->rx_nfds = 0;
+	client->capture_id = 0;
+	client->capture_seq[0] = 0;
+	client->capture_seq[1] = 0;
+	client->bar64 = 0;
+	client->nregions = 0;
+	client->region_maps[0].count = 0;
+	client->region_maps[1].count = 0;
+	client->region_gen = 0;
+	client->region_hint = 0;
 	for (int i = 0; i < 6; i++) {
 		client->bar_read_cb[i] = NULL;
 		client->bar_write_cb[i] = NULL;
 		client->bar[i] = 0;
 		client->bar_size[i] = 0;
+		client->bar_memfd[i] = -1;
+		client->bar_mapping[i].memory = NULL;
+		client->peer_bars[i].memory = NULL;
+	}
+
+}
+
+void warppipe_client_destroy(struct warppipe_client *client)
+{
+	/* reads still waiting for completions fail, once per request */
+	for (int i = 0; i < CLIENT_MAX_TAGS && client->tags_used; i++) {
+		if (client_tag_used(client, i))
+			client_fail_tag(client, i);
+	}
+	client->cpl_deadline_us = 0;
+	free(client->async);
+	client->async = NULL;
+
+	/* nothing is replayed anymore, zero-copy buffers go back to the caller */
+	client->zc_done = client->zc_tail;
+	client->zc_acked = client->zc_tail;
+	client_zc_release(client);
+	client_replay_free(client);
+
+	/* TLPs still waiting for credits are dropped */
+	while (client->fc_head) {
+		struct warppipe_fc_pending *pending = client->fc_head;
+
+		client->fc_head = pending->next;
+		free(pending);
+	}
+	client->fc_tail = &client->fc_head;
+	memset(client->fc_queued, 0, sizeof(client->fc_queued));
+	client->fc_queued_bytes = 0;
+
+#ifdef CLIENT_HAVE_SHARED_BARS
+	for (int i = 0; i < 6; i++) {
+		if (client->bar_memfd[i] != -1)
+			close(client->bar_memfd[i]);
+		client->bar_memfd[i] = -1;
+		client_unmap(&client->bar_mapping[i]);
+		client_unmap(&client->peer_bars[i]);
+	}
+	while (client->rx_nfds)
+		close(client->rx_fds[--client->rx_nfds]);
+#endif
+}
+
+/* absolute first and last address of a region, false if its BAR is not mapped */
+static bool client_region_range(const struct warppipe_client *client, const struct warppipe_region *region, uint64_t *start, uint64_t *last)
+{
+	*start = region->offset;
+	if (region->bar_idx >= 0) {
+		if (client->bar_size[region->bar_idx] == 0)
+			return false;
+		*start += client->bar[region->bar_idx];
+	}
+	*last = *start + region->size - 1;
+	return true;
+}
+
+static int client_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Flatten the regions into the spare map and switch to it with a single store, on the thread
+ * handling the connection: a callback registering regions is in the middle of a request
+ * dispatched with the old map, which stays untouched until the next rebuild.
+ */
+static void client_region_rebuild(struct warppipe_client *client)
+{
+	uint32_t next = client->region_gen + 1;
+	struct warppipe_region_map *map = &client->region_maps[next & 1];
+	uint64_t bounds[2 * CLIENT_MAX_REGIONS];
+	uint64_t starts[CLIENT_MAX_REGIONS], lasts[CLIENT_MAX_REGIONS];
+	bool mapped[CLIENT_MAX_REGIONS];
+	int nbounds = 0;
+
+	for (int i = 0; i < client->nregions; i++) {
+		mapped[i] = client_region_range(client, &client->regions[i], &starts[i], &lasts[i]);
+		if (!mapped[i])
+			continue;
+		bounds[nbounds++] = starts[i];
+		if (lasts[i] != UINT64_MAX)
+			bounds[nbounds++] = lasts[i] + 1;
+	}
+	qsort(bounds, nbounds, sizeof(bounds[0]), client_cmp_u64);
+
+	/* each piece between two bounds goes to the smallest region covering it */
+	map->count = 0;
+	for (int b = 0; b < nbounds; b++) {
+		uint64_t start = bounds[b];
+		int best = -1;
+
+		if (b + 1 < nbounds && bounds[b + 1] == start)
+			continue;
+		for (int i = 0; i < client->nregions; i++) {
+			if (!mapped[i] || start < starts[i] || start > lasts[i])
+				continue;
+			if (best == -1 || client->regions[i].size <= client->regions[best].size)
+				best = i;
+		}
+		if (best == -1)
+			continue;
+
+		uint64_t last = b + 1 < nbounds ? bounds[b + 1] - 1 : UINT64_MAX;
+		struct warppipe_region_span *prev = map->count ? &map->spans[map->count - 1] : NULL;
+
+		if (prev && prev->region == best && prev->last + 1 == start) {
+			prev->last = last;
+			continue;
+		}
+
+		struct warppipe_region_span *span = &map->spans[map->count++];
+
+		*span = (struct warppipe_region_span){
+			.start = start,
+			.last = last,
+			.base = starts[best],
+			.region = best,
+		};
+
+		/* a region in a memory-backed BAR is backed by the same memory */
+		for (int i = 0; i < client->nregions; i++) {
+			if (!mapped[i] || !client->regions[i].memory || starts[best] < starts[i] || lasts[best] > lasts[i])
+				continue;
+			span->memory = (uint8_t *)client->regions[i].memory + (starts[best] - starts[i]);
+			span->memory_size = lasts[i] - starts[best] + 1;
+			span->memory_flags = client->regions[i].memory_flags;
+			break;
+		}
+	}
+
+	__atomic_store_n(&client->region_gen, next, __ATOMIC_RELEASE);
+}
+
+static int client_add_region(struct warppipe_client *client, const struct warppipe_region *region)
+{
+	if (client->nregions == CLIENT_MAX_REGIONS) {
+		syslog(LOG_ERR, "Tried to register more than %d regions!", CLIENT_MAX_REGIONS);
+		return -1;
 	}
+	client->regions[client->nregions++] = *region;
+	client_region_rebuild(client);
+	return 0;
+}
 
+/* BAR bar_idx is registered, or is the upper half of a 64-bit one */
+static bool client_bar_used(const struct warppipe_client *client, int bar_idx)
+{
+	return client->bar_size[bar_idx] != 0 || (bar_idx > 0 && client->bar64 & 1 << (bar_idx - 1));
 }
 
-int warppipe_register_bar(struct warppipe_client *client, uint64_t bar, uint32_t bar_size, int bar_idx, warppipe_read_cb_t read_cb, warppipe_write_cb_t write_cb)
+static int client_register_bar(struct warppipe_client *client, uint64_t bar, uint64_t bar_size, int bar_idx, struct warppipe_region *region)
 {
-	if (client->bar[bar_idx] != 0) {
+	if (bar_idx < 0 || bar_idx > 5) {
+		syslog(LOG_ERR, "Tried to register new BAR on %d idx, but there are only 6 of them!", bar_idx);
+		return -1;
+	}
+	if (client_bar_used(client, bar_idx)) {
 		syslog(LOG_ERR, "Tried to register new BAR on %d idx, but this idx is already in use!", bar_idx);
 		return -1;
 	}
 	if ((bar_size == 0) || (bar_size & (bar_size - 1)) != 0) {
-		syslog(LOG_ERR, "Tried to register new BAR with size: %d, but it isn't power of 2 (spec 6.2.5.1. Address Maps)!", bar_size);
+		syslog(LOG_ERR, "Tried to register new BAR with size: %llu, but it isn't power of 2 (spec 6.2.5.1. Address Maps)!",
+		       (unsigned long long)bar_size);
+		return -1;
+	}
+
+	bool is64 = (bar + bar_size - 1) >> 32;
+
+	if (is64 && (bar_idx == 5 || client_bar_used(client, bar_idx + 1))) {
+		syslog(LOG_ERR, "Tried to register 64-bit BAR on %d idx, but idx %d is not free for its upper half!", bar_idx, bar_idx + 1);
 		return -1;
 	}
-	// TODO: check if bar is 64bit and if so use 2 bar_idx
+
+	region->bar_idx = bar_idx;
+	region->offset = 0;
+	region->size = bar_size;
+
 	client->bar[bar_idx] = bar;
 	client->bar_size[bar_idx] = bar_size;
-	client->bar_read_cb[bar_idx] = read_cb;
-	client->bar_write_cb[bar_idx] = write_cb;
+	client->bar_read_cb[bar_idx] = region->read_cb;
+	client->bar_write_cb[bar_idx] = region->write_cb;
+	if (client_add_region(client, region) == -1) {
+		client->bar[bar_idx] = 0;
+		client->bar_size[bar_idx] = 0;
+		client->bar_read_cb[bar_idx] = NULL;
+		client->bar_write_cb[bar_idx] = NULL;
+		return -1;
+	}
+	if (is64)
+		client->bar64 |= 1 << bar_idx;
+
+	return 0;
+}
+
+int warppipe_register_bar(struct warppipe_client *client, uint64_t bar, uint64_t bar_size, int bar_idx, warppipe_read_cb_t read_cb, warppipe_write_cb_t write_cb)
+{
+	struct warppipe_region region = {
+		.read_cb = read_cb,
+		.write_cb = write_cb,
+	};
+
+	return client_register_bar(client, bar, bar_size, bar_idx, &region);
+}
+
+int warppipe_register_bar_memory(struct warppipe_client *client, uint64_t bar, uint64_t bar_size, int bar_idx, void *base, uint32_t flags)
+{
+	if (!base) {
+		syslog(LOG_ERR, "Tried to register memory-backed BAR on %d idx without memory!", bar_idx);
+		return -1;
+	}
+
+	struct warppipe_region region = {
+		.memory = base,
+		.memory_flags = flags,
+	};
+
+	return client_register_bar(client, bar, bar_size, bar_idx, &region);
+}
+
+int warppipe_register_bar_memfd(struct warppipe_client *client, uint64_t bar, uint64_t bar_size, int bar_idx, int memfd, uint32_t flags)
+{
+#ifdef CLIENT_HAVE_SHARED_BARS
+	struct stat st;
+	void *memory;
+	int fd;
+
+	if (bar_idx < 0 || bar_idx > 5 || client->bar_memfd[bar_idx] != -1) {
+		syslog(LOG_ERR, "Tried to register memory file for BAR %d idx, but it is invalid or has one already!", bar_idx);
+		return -1;
+	}
+	if (fstat(memfd, &st) == -1 || (uint64_t)st.st_size < bar_size) {
+		syslog(LOG_ERR, "Memory file of BAR %d is smaller than the BAR!", bar_idx);
+		return -1;
+	}
+	memory = mmap(NULL, bar_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (memory == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to map the memory of BAR %d: %s", bar_idx, strerror(errno));
+		return -1;
+	}
+	fd = fcntl(memfd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1 || warppipe_register_bar_memory(client, bar, bar_size, bar_idx, memory, flags) == -1) {
+		if (fd != -1)
+			close(fd);
+		munmap(memory, bar_size);
+		return -1;
+	}
+
+	client->bar_memfd[bar_idx] = fd;
+	client->bar_mapping[bar_idx].memory = memory;
+	client->bar_mapping[bar_idx].size = bar_size;
+	client->bar_mapping[bar_idx].flags = flags;
+
+	if (client->link_caps_agreed & WARPPIPE_LINK_CAP_SHARED_BARS)
+		return client_export_bar(client, bar_idx);
+	return 0;
+#else
+	syslog(LOG_ERR, "Sharing BAR memory is not supported on this platform.");
+	return -1;
+#endif
+}
+
+int warppipe_register_region(struct warppipe_client *client, int bar_idx, uint64_t offset, uint64_t size,
+			     warppipe_read_cb_t read_cb, warppipe_write_cb_t write_cb, void *private_data)
+{
+	if (bar_idx < -1 || bar_idx > 5 || size == 0) {
+		syslog(LOG_ERR, "Tried to register region of %llu bytes in BAR %d!", (unsigned long long)size, bar_idx);
+		return -1;
+	}
+	if (bar_idx >= 0 && (offset >= client->bar_size[bar_idx] ||
+			     size > client->bar_size[bar_idx] - offset)) {
+		syslog(LOG_ERR, "Tried to register region 0x%llx..0x%llx outside of BAR %d!",
+		       (unsigned long long)offset, (unsigned long long)(offset + size - 1), bar_idx);
+		return -1;
+	}
+	if (bar_idx >= 0 && client->bar_memfd[bar_idx] != -1) {
+		syslog(LOG_ERR, "Tried to register region in BAR %d, which the peer may access directly!", bar_idx);
+		return -1;
+	}
+	if (bar_idx == -1 && size - 1 > UINT64_MAX - offset) {
+		syslog(LOG_ERR, "Tried to register region past the end of the address space!");
+		return -1;
+	}
+
+	const struct warppipe_region region = {
+		.bar_idx = bar_idx,
+		.offset = offset,
+		.size = size,
+		.read_cb = read_cb,
+		.write_cb = write_cb,
+		.private_data = private_data,
+	};
+
+	return client_add_region(client, &region);
+}
+
+int warppipe_remap_bar(struct warppipe_client *client, int bar_idx, uint64_t bar)
+{
+	if (bar_idx < 0 || bar_idx > 5 || client->bar_size[bar_idx] == 0) {
+		syslog(LOG_ERR, "Tried to remap BAR %d idx, but this idx isn't registered!", bar_idx);
+		return -1;
+	}
+	if (bar & (client->bar_size[bar_idx] - 1)) {
+		syslog(LOG_ERR, "Tried to remap BAR %d to 0x%llx, not aligned to its size!", bar_idx, (unsigned long long)bar);
+		return -1;
+	}
+	if (((bar + client->bar_size[bar_idx] - 1) >> 32) && !(client->bar64 & 1 << bar_idx)) {
+		syslog(LOG_ERR, "Tried to remap 32-bit BAR %d above 4 GiB!", bar_idx);
+		return -1;
+	}
 
+	client->bar[bar_idx] = bar;
+	client_region_rebuild(client);
 	return 0;
 }
 
@@ -368,39 +2170,161 @@ void warppipe_register_config0_write_cb(struct warppipe_client *client, warppipe
 	client->cfg0_write_cb = write_cb;
 }
 
-static int warppipe_read_imp(struct warppipe_client *client, uint64_t addr, int length, warppipe_completion_cb_t completion_cb, enum pcie_tlp_type type)
+static int warppipe_read_imp(struct warppipe_client *client, uint64_t addr, int length, warppipe_completion_cb_t completion_cb, void *private_data, enum pcie_tlp_type type)
 {
-	int tag = client->read_tag++;
-	struct warppipe_pcie_transport tport = {
-		.t_proto = PCIE_PROTO_TLP,
-		.t_tlp = {
-			.dl_tlp = {
-				.tlp_fmt = type >> 5,
-				.tlp_type = type & 0x1F,
-				.tlp_req = {
-					.r_tag = tag,
-				}
-			},
-		},
-	};
+	int requests = client_chunks(addr, length, client->mrrs);
+
+	if (client->fc_queued_bytes >= CLIENT_FC_QUEUE_SIZE) {
+		syslog(LOG_DEBUG, "Too many TLPs waiting for credits.");
+		return -EAGAIN;
+	}
+	if (client->tags_used + requests > client->max_tags) {
+		syslog(LOG_DEBUG, "Not enough free tags for a read of %d bytes.", length);
+		return -EAGAIN;
+	}
 
-	tlp_req_set_addr(&tport.t_tlp.dl_tlp, addr, length);
+	/* requests crossing a Max Read Request Size boundary share one buffer */
+	struct warppipe_read *split = NULL;
 
-	if (client_send_pcie_transport(client, &tport) == -1)
-		return -1;
+	if (requests > 1) {
+		split = client_read_alloc(completion_cb, private_data, length, requests);
+		if (!split)
+			return -1;
+	}
 
-	if (client->completion_cb[tag] != NULL)
-		syslog(LOG_ERR, "Tried to send read request with already used tag!");
+	uint64_t deadline_us = client->cpl_timeout_us ? client_now_us() + client->cpl_timeout_us : 0;
+	int offset = 0;
+
+	if (deadline_us && (!client->cpl_deadline_us || deadline_us < client->cpl_deadline_us))
+		client->cpl_deadline_us = deadline_us;
+
+	do {
+		int n = client_chunk(addr + offset, length - offset, client->mrrs);
+		int tag = client_alloc_tag(client);
+		struct warppipe_pcie_transport tport = {
+			.t_proto = PCIE_PROTO_TLP,
+			.t_tlp = {
+				.dl_tlp = {
+					.tlp_fmt = type >> 5,
+					.tlp_type = type & 0x1F,
+					.tlp_t8 = (tag >> 8) & 1,
+					.tlp_t9 = tag >> 9,
+					.tlp_req = {
+						.r_tag = tag & 0xFF,
+					}
+				},
+			},
+		};
+
+		tlp_req_set_addr(&tport.t_tlp.dl_tlp, addr + offset, n);
 
-	client->completion_cb[tag] = completion_cb;
+		client->tags[tag].completion_cb = completion_cb;
+		client->tags[tag].split = split;
+		client->tags[tag].offset = offset;
+		client->tags[tag].length = n;
+		client->tags[tag].private_data = private_data;
+		client->tags[tag].deadline_us = deadline_us;
+
+		if (client_send_pcie_transport(client, &tport) == -1) {
+			for (int i = 0; i < CLIENT_MAX_TAGS; i++) {
+				if (i == tag || (split && client_tag_used(client, i) && client->tags[i].split == split))
+					client_free_tag(client, i);
+			}
+			free(split);
+			return -1;
+		}
+		offset += n;
+	} while (offset < length);
 
 	return 0;
 }
 
-static int warppipe_write_imp(struct warppipe_client *client, uint64_t addr, const void *data, int length, enum pcie_tlp_type type)
+/* size of the transport packet of a write of length bytes at addr, at most */
+static size_t client_write_packet_length(uint64_t addr, int length)
+{
+	return CLIENT_MAX_PACKET_HEADER_SIZE + (((addr & 3) + length + 3) & ~3);
+}
+
+/* Send a write TLP with the payload taken straight from data, there has to be room for it in the replay buffer.
+ * The queued packets, the header, the payload and the padding with the LCRC go out
+ * as separate iovecs of a single sendmsg. The payload is copied into the replay buffer,
+ * the caller may reuse data once this returns, unless zc is given: then only the header and
+ * the trailer are kept, in zc too as they are sent with MSG_ZEROCOPY along with the payload.
+ */
+static int client_write_sg(struct warppipe_client *client, uint64_t addr, const void *data, int length, enum pcie_tlp_type type, struct warppipe_zc_write *zc)
+{
+	uint8_t hdr_buf[sizeof(struct warppipe_pcie_transport)];
+	uint8_t trailer_buf[8];
+	uint8_t *hdr = zc ? zc->hdr : hdr_buf;
+	uint8_t *trailer = zc ? zc->trailer : trailer_buf;
+	struct warppipe_pcie_transport *tport = (struct warppipe_pcie_transport *)hdr;
+	struct pcie_tlp *tlp = &tport->t_tlp.dl_tlp;
+
+	memset(tport, 0, sizeof(*tport));
+	tport->t_proto = PCIE_PROTO_TLP;
+	tlp->tlp_fmt = type >> 5;
+	tlp->tlp_type = type & 0x1F;
+	tlp_req_set_addr(tlp, addr, length);
+	client_next_seqno(client, tport);
+
+	/* leading padding is the zeroed tail of the header buffer */
+	uint8_t *payload = tlp->tlp_fmt & PCIE_TLP_FMT_4DW ? tlp->tlp_req.r_data64 : tlp->tlp_req.r_data32;
+	size_t hdr_len = payload - hdr + (addr & 3);
+	size_t pad = -(length + (addr & 3)) & 3;
+	uint8_t *lcrc = trailer + pad;
+
+	memset(trailer, 0, pad);
+	if (client_crc_trusted(client)) {
+		memset(lcrc, 0, 4);
+	} else {
+		struct pcie_lcrc32_ctx ctx;
+		uint32_t crc;
+
+		pcie_lcrc32_init(&ctx);
+		pcie_lcrc32_update(&ctx, hdr + 1, hdr_len - 1);
+		pcie_lcrc32_update(&ctx, data, length);
+		pcie_lcrc32_update(&ctx, trailer, pad);
+		crc = pcie_lcrc32_final(&ctx);
+		lcrc[0] = crc & 0xff;
+		lcrc[1] = (crc >> 8) & 0xff;
+		lcrc[2] = (crc >> 16) & 0xff;
+		lcrc[3] = crc >> 24;
+	}
+
+	struct client_replay_entry *entry = client_replay_store(client, hdr_len + (zc ? 0 : length) + pad + 4);
+	uint8_t *replay = (uint8_t *)(entry + 1);
+
+	memcpy(replay, hdr, hdr_len);
+	if (zc) {
+		entry->data = data;
+		entry->data_len = length;
+		entry->hdr_len = hdr_len;
+		memcpy(replay + hdr_len, trailer, pad + 4);
+		zc->seqno = client->seqno;
+	} else {
+		memcpy(replay + hdr_len, data, length);
+		memcpy(replay + hdr_len + length, trailer, pad + 4);
+	}
+
+	return client_send_sg(client, hdr, hdr_len, data, length, trailer, pad + 4, zc);
+}
+
+/* send a write TLP, length must not exceed the Max Payload Size */
+static int client_write_tlp(struct warppipe_client *client, uint64_t addr, const void *data, int length, enum pcie_tlp_type type)
 {
 	int rc = 0;
-	struct warppipe_pcie_transport *tport = malloc(sizeof(struct warppipe_pcie_transport) + ((length + (addr & 3) + 3) & ~3));
+
+	/* large payloads are not worth copying into the queue, unless they have to wait for credits */
+	if (!client->io && client->write_sg_threshold && length >= (int)client->write_sg_threshold &&
+	    client_replay_room(client, client_write_packet_length(addr, length)) &&
+	    client_fc_take(client, client_fc_kind(type), 1, client_fc_write_data(addr, length)))
+		return client_write_sg(client, addr, data, length, type, NULL);
+
+	int padded = (length + (addr & 3) + 3) & ~3;
+	struct warppipe_pcie_transport *tport = client_tx_alloc(client, sizeof(struct warppipe_pcie_transport) + padded);
+
+	if (!tport)
+		return -1;
 
 	struct pcie_tlp *tlp = &tport->t_tlp.dl_tlp;
 
@@ -412,27 +2336,76 @@ static int warppipe_write_imp(struct warppipe_client *client, uint64_t addr, con
 
 	uint8_t *payload = tlp->tlp_fmt & PCIE_TLP_FMT_4DW ? tlp->tlp_req.r_data64 : tlp->tlp_req.r_data32;
 
+	/* zero the bytes the byte enables leave out */
+	if (padded) {
+		memset(payload, 0, 4);
+		memset(payload + padded - 4, 0, 4);
+	}
 	memcpy(payload + (addr & 3), data, length);
 
 	rc = client_send_pcie_transport(client, tport);
 
-	free(tport);
-
 	return rc > 0 ? 0 : rc;
 }
 
-int warppipe_read(struct warppipe_client *client, int bar_idx, uint64_t addr, int length, warppipe_completion_cb_t completion_cb)
+static int warppipe_write_imp(struct warppipe_client *client, uint64_t addr, const void *data, int length, enum pcie_tlp_type type)
+{
+	const uint8_t *p = data;
+
+	if (client->fc_queued_bytes >= CLIENT_FC_QUEUE_SIZE) {
+		syslog(LOG_DEBUG, "Too many TLPs waiting for credits.");
+		return -EAGAIN;
+	}
+
+	/* one TLP per Max Payload Size aligned block */
+	do {
+		int n = client_chunk(addr, length, client->mps);
+
+		if (client_write_tlp(client, addr, p, n, type) == -1)
+			return -1;
+		addr += n;
+		p += n;
+		length -= n;
+	} while (length > 0);
+
+	return 0;
+}
+
+int warppipe_read_ctx(struct warppipe_client *client, int bar_idx, uint64_t addr, int length, warppipe_completion_cb_t completion_cb, void *private_data)
 {
 	if (client->bar[bar_idx] == 0) {
 		syslog(LOG_ERR, "Tried to send MRd to BAR %d idx, but this idx isn't registered!", bar_idx);
 		return -1;
 	}
-	return warppipe_read_imp(client, client->bar[bar_idx] + addr, length, completion_cb, PCIE_TLP_MRD64);
+#ifdef CLIENT_HAVE_SHARED_BARS
+	const uint8_t *memory = client_peer_bar(client, bar_idx, addr, length);
+
+	if (memory) {
+		struct warppipe_completion_status completion_status = {
+			.error_code = 0,
+		};
+
+		if (completion_cb)
+			completion_cb(completion_status, memory, length, private_data);
+		return 0;
+	}
+#endif
+	return warppipe_read_imp(client, client->bar[bar_idx] + addr, length, completion_cb, private_data, PCIE_TLP_MRD64);
+}
+
+int warppipe_read(struct warppipe_client *client, int bar_idx, uint64_t addr, int length, warppipe_completion_cb_t completion_cb)
+{
+	return warppipe_read_ctx(client, bar_idx, addr, length, completion_cb, client->private_data);
+}
+
+int warppipe_config0_read_ctx(struct warppipe_client *client, uint64_t addr, int length, warppipe_completion_cb_t completion_cb, void *private_data)
+{
+	return warppipe_read_imp(client, addr, length, completion_cb, private_data, PCIE_TLP_CR0);
 }
 
 int warppipe_config0_read(struct warppipe_client *client, uint64_t addr, int length, warppipe_completion_cb_t completion_cb)
 {
-	return warppipe_read_imp(client, addr, length, completion_cb, PCIE_TLP_CR0);
+	return warppipe_config0_read_ctx(client, addr, length, completion_cb, client->private_data);
 }
 
 int warppipe_write(struct warppipe_client *client, int bar_idx, uint64_t addr, const void *data, int length)
@@ -441,6 +2414,16 @@ int warppipe_write(struct warppipe_client *client, int bar_idx, uint64_t addr, c
 		syslog(LOG_ERR, "Tried to send MWr to BAR %d idx, but this idx isn't registered!", bar_idx);
 		return -1;
 	}
+#ifdef CLIENT_HAVE_SHARED_BARS
+	uint8_t *memory = client_peer_bar(client, bar_idx, addr, length);
+
+	if (memory) {
+		/* dropped like the Completer would */
+		if (!(client->peer_bars[bar_idx].flags & WARPPIPE_MEMORY_READONLY))
+			memcpy(memory, data, length);
+		return 0;
+	}
+#endif
 	return warppipe_write_imp(client, client->bar[bar_idx] + addr, data, length, PCIE_TLP_MWR64);
 }
 
@@ -448,3 +2431,120 @@ int warppipe_config0_write(struct warppipe_client *client, uint64_t addr, const
 {
 	return warppipe_write_imp(client, addr, data, length, PCIE_TLP_CW0);
 }
+
+int warppipe_client_enable_zerocopy(struct warppipe_client *client)
+{
+#ifdef CLIENT_HAVE_ZEROCOPY
+	int enable = 1;
+
+	if (!client->io && setsockopt(client->fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0) {
+		client->zerocopy = true;
+		return 0;
+	}
+#endif
+	syslog(LOG_WARNING, "Zero-copy writes are not supported on this connection.");
+	return -1;
+}
+
+int warppipe_client_zerocopy_reap(struct warppipe_client *client)
+{
+#ifdef CLIENT_HAVE_ZEROCOPY
+	while (client->zc_done != client->zc_tail) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		struct cmsghdr *cm;
+		struct sock_extended_err *serr;
+
+		if (recvmsg(client->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			break;
+
+		cm = CMSG_FIRSTHDR(&msg);
+		if (!cm)
+			continue;
+		serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+			continue;
+
+		/* calls ee_info..ee_data are done, completions may be merged but never reordered */
+		while (client->zc_done != client->zc_tail &&
+		       (int32_t)(client->zc[client->zc_done % CLIENT_ZEROCOPY_MAX].id - serr->ee_data) <= 0)
+			client->zc_done++;
+	}
+	client_zc_release(client);
+	return client->zc_tail - client->zc_head;
+#else
+	return 0;
+#endif
+}
+
+int warppipe_write_zerocopy(struct warppipe_client *client, int bar_idx, uint64_t addr, const void *data, int length, warppipe_write_release_cb_t release_cb)
+{
+	if (client->bar[bar_idx] == 0) {
+		syslog(LOG_ERR, "Tried to send MWr to BAR %d idx, but this idx isn't registered!", bar_idx);
+		return -1;
+	}
+#ifdef CLIENT_HAVE_SHARED_BARS
+	if (client_peer_bar(client, bar_idx, addr, length)) {
+		int rc = warppipe_write(client, bar_idx, addr, data, length);
+
+		if (release_cb)
+			release_cb(data, client->private_data);
+		return rc;
+	}
+#endif
+	addr += client->bar[bar_idx];
+	if (client->fc_queued_bytes >= CLIENT_FC_QUEUE_SIZE) {
+		syslog(LOG_DEBUG, "Too many TLPs waiting for credits.");
+		return -EAGAIN;
+	}
+
+#ifdef CLIENT_HAVE_ZEROCOPY
+	int chunks = client_chunks(addr, length, client->mps);
+	int data_credits = 0;
+	size_t replay_length = 0;
+
+	for (int offset = 0; offset < length;) {
+		int n = client_chunk(addr + offset, length - offset, client->mps);
+
+		data_credits += client_fc_write_data(addr + offset, n);
+		/* the payload stays in data */
+		replay_length += client_replay_size(sizeof(struct warppipe_pcie_transport) + 8);
+		offset += n;
+	}
+
+	/* a write waiting for credits is copied, all of its TLPs have to go out now */
+	if (client->zerocopy && warppipe_client_zerocopy_reap(client) <= CLIENT_ZEROCOPY_MAX - chunks &&
+	    !client->fc_queued[PCIE_FC_P] && data_credits <= 0x800 && client_fc_room(client, PCIE_FC_P, chunks, data_credits) &&
+	    client_outstanding(client) + chunks < 2048 && client_replay_room(client, replay_length)) {
+		const uint8_t *p = data;
+
+		do {
+			int n = client_chunk(addr, length, client->mps);
+			struct warppipe_zc_write *zc = &client->zc[client->zc_tail % CLIENT_ZEROCOPY_MAX];
+
+			client_fc_consume(client, PCIE_FC_P, 1, client_fc_write_data(addr, n));
+
+			/* notifications come in order, the buffer is released with its last TLP */
+			zc->data = data;
+			zc->release_cb = n == length ? release_cb : NULL;
+			if (client_write_sg(client, addr, p, n, PCIE_TLP_MWR64, zc) == -1)
+				return -1;
+			zc->id = client->zc_calls - 1;
+			client->zc_tail++;
+			addr += n;
+			p += n;
+			length -= n;
+		} while (length > 0);
+		return 0;
+	}
+#endif
+
+	int rc = warppipe_write_imp(client, addr, data, length, PCIE_TLP_MWR64);
+
+	if (rc == 0 && release_cb)
+		release_cb(data, client->private_data);
+	return rc;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WARP_PIPE_CLIENT_IO_H
+#define WARP_PIPE_CLIENT_IO_H
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+
+/* Replaces recv/send on the client socket, with the same return value semantics.
+ * Embedded as the first member of the engine's per-connection state.
+ */
+struct warppipe_client_io {
+	ssize_t (*recv)(struct warppipe_client_io *io, void *buf, size_t len);
+	ssize_t (*send)(struct warppipe_client_io *io, const void *buf, size_t len);
+	/* optional, more to receive that the socket will not signal, warppipe_client_read keeps reading then */
+	bool (*pending)(struct warppipe_client_io *io);
+	/* the socket becomes readable when there is something to receive, so it may be polled directly */
+	bool pollable;
+};
+
+#endif /* WARP_PIPE_CLIENT_IO_H */
@@ -15,15 +15,18 @@
  * limitations under the License.
  */
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include <warppipe/crc.h>
 #include <warppipe/proto.h>
 
-uint32_t crc32p(const void *start, const void *end, uint32_t init, uint32_t poly)
-{
-	uint32_t crc = init;
+#include "crc_tables.h"
 
-	for (const uint8_t *data = start; data != end; data++) {
-		crc = crc ^ *data;
+static uint32_t crc32_bitwise(const uint8_t *data, size_t len, uint32_t crc, uint32_t poly)
+{
+	while (len--) {
+		crc = crc ^ *data++;
 		for (int i = 0; i < 8; i++) {
 			if (crc & 1)
 				crc = (crc >> 1) ^ poly;
@@ -34,6 +37,261 @@ uint32_t crc32p(const void *start, const void *end, uint32_t init, uint32_t poly
 	return crc;
 }
 
+static uint32_t crc32_bytewise(const uint8_t *data, size_t len, uint32_t crc, const uint32_t table[256])
+{
+	while (len--)
+		crc = (crc >> 8) ^ table[(crc ^ *data++) & 0xff];
+	return crc;
+}
+
+/* Slicing-by-8: fold 8 input bytes per iteration using 8 independent table
+ * lookups. Bytes are assembled explicitly, so this is endianness-agnostic
+ * and has no alignment requirements.
+ */
+static uint32_t crc32_slice8(const void *buf, size_t len, uint32_t crc)
+{
+	const uint32_t (*t)[256] = lcrc32_table;
+	const uint8_t *data = buf;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+		      t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		      t[3][data[4]] ^ t[2][data[5]] ^
+		      t[1][data[6]] ^ t[0][data[7]];
+	}
+	return crc32_bytewise(data, len, crc, t[0]);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC_HAVE_X86_CLMUL
+
+#include <immintrin.h>
+
+/* Folding constants for the reflected TLP_LCRC32_POLY, as described in Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * Each pair is (x^(d+32) mod P, x^(d-32) mod P), bit-reflected and shifted left
+ * by one, where d is the distance in bits the data is folded over.
+ */
+#define LCRC32_K_FOLD_2048	0x11542778aULL, 0x1322d1430ULL
+#define LCRC32_K_FOLD_512	0x154442bd4ULL, 0x1c6e41596ULL
+#define LCRC32_K_FOLD_128	0x1751997d0ULL, 0x0ccaa009eULL
+#define LCRC32_K_FOLD_64	0x163cd6124ULL
+/* P(x) and the Barrett constant floor(x^64 / P(x)), both bit-reflected */
+#define LCRC32_P		0x1db710641ULL
+#define LCRC32_MU		0x1f7011641ULL
+
+#define CRC_CLMUL_K(k_lo, k_hi) _mm_set_epi64x(k_hi, k_lo)
+#define CRC_CLMUL_K_(...) CRC_CLMUL_K(__VA_ARGS__)
+
+__attribute__((target("pclmul,sse4.1"), always_inline))
+static inline __m128i crc32_fold128(__m128i x, __m128i k, __m128i data)
+{
+	__m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+	__m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+
+	return _mm_xor_si128(_mm_xor_si128(lo, hi), data);
+}
+
+/* Fold the remaining 16-byte blocks into x, reduce it to 32 bits and finish
+ * the unaligned tail with the table-driven implementation.
+ * Always inlined, so that the AVX-512 kernel does not pay for SSE/AVX
+ * transitions when calling it.
+ */
+__attribute__((target("pclmul,sse4.1"), always_inline))
+static inline uint32_t crc32_clmul_finish(__m128i x, const uint8_t *data, size_t len)
+{
+	const __m128i k128 = CRC_CLMUL_K_(LCRC32_K_FOLD_128);
+	const __m128i k64 = _mm_set_epi64x(0, LCRC32_K_FOLD_64);
+	const __m128i poly = _mm_set_epi64x(LCRC32_MU, LCRC32_P);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i t;
+
+	for (; len >= 16; len -= 16, data += 16)
+		x = crc32_fold128(x, k128, _mm_loadu_si128((const __m128i *)data));
+
+	/* 128 -> 64 bits */
+	t = _mm_clmulepi64_si128(x, k128, 0x10);
+	x = _mm_xor_si128(_mm_srli_si128(x, 8), t);
+	t = _mm_srli_si128(x, 4);
+	x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), k64, 0x00);
+	x = _mm_xor_si128(x, t);
+
+	/* Barrett reduction 64 -> 32 bits */
+	t = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), poly, 0x10);
+	t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+	x = _mm_xor_si128(x, t);
+
+	return crc32_slice8(data, len, _mm_extract_epi32(x, 1));
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(const void *buf, size_t len, uint32_t crc)
+{
+	const __m128i k512 = CRC_CLMUL_K_(LCRC32_K_FOLD_512);
+	const __m128i k128 = CRC_CLMUL_K_(LCRC32_K_FOLD_128);
+	const uint8_t *data = buf;
+	__m128i x0, x1, x2, x3;
+
+	if (len < 64)
+		return crc32_slice8(data, len, crc);
+
+	x0 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+	x1 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+	x2 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+	x3 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+	x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+	data += 64;
+	len -= 64;
+
+	for (; len >= 64; len -= 64, data += 64) {
+		x0 = crc32_fold128(x0, k512, _mm_loadu_si128((const __m128i *)(data + 0x00)));
+		x1 = crc32_fold128(x1, k512, _mm_loadu_si128((const __m128i *)(data + 0x10)));
+		x2 = crc32_fold128(x2, k512, _mm_loadu_si128((const __m128i *)(data + 0x20)));
+		x3 = crc32_fold128(x3, k512, _mm_loadu_si128((const __m128i *)(data + 0x30)));
+	}
+
+	x0 = crc32_fold128(x0, k128, x1);
+	x0 = crc32_fold128(x0, k128, x2);
+	x0 = crc32_fold128(x0, k128, x3);
+
+	return crc32_clmul_finish(x0, data, len);
+}
+
+__attribute__((target("pclmul,sse4.1,avx512f,avx512vl,vpclmulqdq")))
+static inline __m512i crc32_fold512(__m512i x, __m512i k, __m512i data)
+{
+	__m512i lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+	__m512i hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+
+	return _mm512_ternarylogic_epi64(lo, hi, data, 0x96);  /* lo ^ hi ^ data */
+}
+
+__attribute__((target("pclmul,sse4.1,avx512f,avx512vl,vpclmulqdq")))
+static uint32_t crc32_vpclmul(const void *buf, size_t len, uint32_t crc)
+{
+	const __m512i k2048 = _mm512_broadcast_i32x4(CRC_CLMUL_K_(LCRC32_K_FOLD_2048));
+	const __m512i k512 = _mm512_broadcast_i32x4(CRC_CLMUL_K_(LCRC32_K_FOLD_512));
+	const __m128i k128 = CRC_CLMUL_K_(LCRC32_K_FOLD_128);
+	const uint8_t *data = buf;
+	__m512i z0, z1, z2, z3;
+	__m128i x;
+
+	/* below 256 bytes the setup cost is not worth it */
+	if (len < 256)
+		return crc32_pclmul(data, len, crc);
+
+	z0 = _mm512_loadu_si512(data + 0x00);
+	z1 = _mm512_loadu_si512(data + 0x40);
+	z2 = _mm512_loadu_si512(data + 0x80);
+	z3 = _mm512_loadu_si512(data + 0xc0);
+	z0 = _mm512_xor_si512(z0, _mm512_zextsi128_si512(_mm_cvtsi32_si128(crc)));
+	data += 256;
+	len -= 256;
+
+	for (; len >= 256; len -= 256, data += 256) {
+		z0 = crc32_fold512(z0, k2048, _mm512_loadu_si512(data + 0x00));
+		z1 = crc32_fold512(z1, k2048, _mm512_loadu_si512(data + 0x40));
+		z2 = crc32_fold512(z2, k2048, _mm512_loadu_si512(data + 0x80));
+		z3 = crc32_fold512(z3, k2048, _mm512_loadu_si512(data + 0xc0));
+	}
+
+	z0 = crc32_fold512(z0, k512, z1);
+	z0 = crc32_fold512(z0, k512, z2);
+	z0 = crc32_fold512(z0, k512, z3);
+
+	for (; len >= 64; len -= 64, data += 64)
+		z0 = crc32_fold512(z0, k512, _mm512_loadu_si512(data));
+
+	x = _mm512_extracti32x4_epi32(z0, 0);
+	x = crc32_fold128(x, k128, _mm512_extracti32x4_epi32(z0, 1));
+	x = crc32_fold128(x, k128, _mm512_extracti32x4_epi32(z0, 2));
+	x = crc32_fold128(x, k128, _mm512_extracti32x4_epi32(z0, 3));
+
+	return crc32_clmul_finish(x, data, len);
+}
+
+static bool crc32_pclmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+static bool crc32_vpclmul_supported(void)
+{
+	__builtin_cpu_init();
+	return crc32_pclmul_supported() && __builtin_cpu_supports("avx512f") &&
+	       __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("vpclmulqdq");
+}
+#endif /* __x86_64__ && __GNUC__ */
+
+static bool crc32_slice8_supported(void)
+{
+	return true;
+}
+
+static const struct lcrc32_kernel lcrc32_kernels[] = {
+#ifdef CRC_HAVE_X86_CLMUL
+	{ "vpclmulqdq", crc32_vpclmul_supported, crc32_vpclmul },
+	{ "pclmulqdq", crc32_pclmul_supported, crc32_pclmul },
+#endif
+	{ "slice8", crc32_slice8_supported, crc32_slice8 },
+};
+
+const struct lcrc32_kernel *lcrc32_kernel_get(int idx)
+{
+	if (idx < 0 || idx >= sizeof(lcrc32_kernels) / sizeof(lcrc32_kernels[0]))
+		return NULL;
+	return &lcrc32_kernels[idx];
+}
+
+const struct lcrc32_kernel *lcrc32_kernel_selected(void)
+{
+	const struct lcrc32_kernel *kernel = lcrc32_kernels;
+
+	while (!kernel->supported())
+		kernel++;
+	return kernel;
+}
+
+typedef uint32_t (*lcrc32_update_t)(const void *data, size_t len, uint32_t crc);
+
+static uint32_t lcrc32_resolve(const void *data, size_t len, uint32_t crc);
+
+/* Selected on first use, threads racing for it store the same kernel; the tables are constant,
+ * so there is nothing else to publish and relaxed accesses are enough.
+ */
+static lcrc32_update_t lcrc32_kernel = lcrc32_resolve;
+
+static uint32_t lcrc32_resolve(const void *data, size_t len, uint32_t crc)
+{
+	lcrc32_update_t update = lcrc32_kernel_selected()->update;
+
+	__atomic_store_n(&lcrc32_kernel, update, __ATOMIC_RELAXED);
+	return update(data, len, crc);
+}
+
+static inline uint32_t lcrc32_update(const void *data, size_t len, uint32_t crc)
+{
+	return __atomic_load_n(&lcrc32_kernel, __ATOMIC_RELAXED)(data, len, crc);
+}
+
+uint32_t crc32p(const void *start, const void *end, uint32_t init, uint32_t poly)
+{
+	const uint8_t *data = start;
+	size_t len = (const uint8_t *)end - data;
+
+	switch (poly) {
+	case TLP_LCRC32_POLY:
+		return lcrc32_update(data, len, init);
+	case DLLP_CRC16_POLY:
+		return crc32_bytewise(data, len, init, crc16_table);
+	default:
+		return crc32_bitwise(data, len, init, poly);
+	}
+}
+
 void pcie_crc16(struct pcie_dllp *pkt)
 {
 	uint16_t crc = ~crc32p(pkt, pkt->dl_crc16, 0xffff, DLLP_CRC16_POLY);
@@ -56,12 +314,31 @@ bool pcie_crc16_valid(struct pcie_dllp *pkt)
 	return true;
 }
 
+void pcie_lcrc32_init(struct pcie_lcrc32_ctx *ctx)
+{
+	ctx->crc = 0xffffffff;
+}
+
+void pcie_lcrc32_update(struct pcie_lcrc32_ctx *ctx, const void *data, size_t len)
+{
+	ctx->crc = lcrc32_update(data, len, ctx->crc);
+}
+
+uint32_t pcie_lcrc32_final(const struct pcie_lcrc32_ctx *ctx)
+{
+	return ~ctx->crc;
+}
+
 void pcie_lcrc32(struct pcie_dltlp *pkt)
 {
 	int total_length = tlp_total_length(&pkt->dl_tlp);
 	uint8_t *end = (uint8_t *)&pkt->dl_tlp + total_length;
+	struct pcie_lcrc32_ctx ctx;
+
+	pcie_lcrc32_init(&ctx);
+	pcie_lcrc32_update(&ctx, pkt, end - (uint8_t *)pkt);
 
-	uint32_t crc = ~crc32p(pkt, end, 0xffffffff, TLP_LCRC32_POLY);
+	uint32_t crc = pcie_lcrc32_final(&ctx);
 
 	for (int i = 0; i < 4; i++) {
 		end[i] = crc & 0xff;
@@ -73,8 +350,12 @@ bool pcie_lcrc32_valid(struct pcie_dltlp *pkt)
 {
 	int total_length = tlp_total_length(&pkt->dl_tlp);
 	uint8_t *end = (uint8_t *)&pkt->dl_tlp + total_length;
+	struct pcie_lcrc32_ctx ctx;
+
+	pcie_lcrc32_init(&ctx);
+	pcie_lcrc32_update(&ctx, pkt, end - (uint8_t *)pkt);
 
-	uint32_t crc = ~crc32p(pkt, end, 0xffffffff, TLP_LCRC32_POLY);
+	uint32_t crc = pcie_lcrc32_final(&ctx);
 
 	for (int i = 0; i < 4; i++) {
 		if (end[i] != (crc & 0xff))
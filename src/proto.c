@@ -82,6 +82,28 @@ int tlp_total_length(const struct pcie_tlp *pkt)
 	return (hdr_len + data_len) * 4;
 }
 
+int warppipe_transport_length(const void *data, size_t len)
+{
+	const struct warppipe_pcie_transport *tport = data;
+	int total = 1 + sizeof(tport->t_dllp);
+
+	if (len < (size_t)total)
+		return 0;
+
+	switch ((enum pcie_proto)tport->t_proto) {
+	case PCIE_PROTO_DLLP:
+		return total;
+	case PCIE_PROTO_TLP:
+		{
+			int tlp_len = tlp_total_length(&tport->t_tlp.dl_tlp);
+
+			return tlp_len < 0 ? -1 : total + tlp_len;
+		}
+	default:
+		return -1;
+	}
+}
+
 void tlp_req_set_addr(struct pcie_tlp *pkt, uint64_t addr, int length)
 {
 	uint8_t *p;
@@ -15,6 +15,11 @@
  * limitations under the License.
  */
 
+#if defined(__linux__) && !defined(__ZEPHYR__)
+/* CPU affinity of shard threads */
+#define _GNU_SOURCE
+#endif
+
 #include <netinet/in.h>
 #include <netdb.h>
 #include <sys/select.h>
@@ -36,6 +41,23 @@
 #include <warppipe/client.h>
 #include <warppipe/config.h>
 
+#include "shm.h"
+#include "uring.h"
+
+#if defined(__linux__) && !defined(__ZEPHYR__)
+#define SERVER_HAVE_EPOLL
+#include <sys/epoll.h>
+#define SERVER_HAVE_SHARDS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifndef __ZEPHYR__
+#define SERVER_HAVE_UNIX
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
 #ifndef NI_MAXSERV
 #define NI_MAXSERV 32
 #endif
@@ -46,19 +68,22 @@
 typedef void (*sig_t) (int);
 static sig_t sigint_handler;
 static struct warppipe_server *pcie_server;
+static volatile sig_atomic_t sigint_received;
 
+/* Only asks the server to quit: the loop it interrupted finishes its pass and the caller
+ * destroys the server once out of it, nothing else here would be async-signal-safe.
+ */
 static void handle_sigint(int signo)
 {
 	/* if previously we would ignore signal, ignore this one too */
 	if (sigint_handler == SIG_IGN)
 		return;
-	syslog(LOG_NOTICE, "Received SIGINT. " PRJ_NAME_LONG " will shut down.");
-	if (pcie_server) {
-		pcie_server->quit = true;
-
-		/* disconnect every user */
-		warppipe_server_disconnect_clients(pcie_server, NULL);
-		close(pcie_server->fd);
+	if (pcie_server && !sigint_received) {
+		sigint_received = 1;
+		__atomic_store_n(&pcie_server->quit, true, __ATOMIC_RELAXED);
+		/* the default action waits for a second SIGINT, in case the loop is stuck */
+		if (sigint_handler == SIG_DFL)
+			return;
 	}
 
 	/* reset signal handler and raise it again */
@@ -82,23 +107,198 @@ static bool should_disconnect_client(struct warppipe_client *client)
 	return !client->active;
 }
 
+/* whether host is the path of a Unix socket rather than a network address */
+static inline bool server_is_unix(const struct warppipe_server *server)
+{
+#ifdef SERVER_HAVE_UNIX
+	return server->transport == WARPPIPE_TRANSPORT_SHM || server->addr_family == AF_UNIX;
+#else
+	return server->transport == WARPPIPE_TRANSPORT_SHM;
+#endif
+}
+
+static int server_accept(struct warppipe_server *server);
+
+/* read from a client, holding back what the handlers send until the end of the loop iteration */
+static void server_client_read(struct warppipe_client *client)
+{
+	client->tx_batch = true;
+	warppipe_client_read(client);
+}
+
+/* fire the expired ACK latency timers, returns how long the loop may wait for events */
+static int server_timeout_ms(struct warppipe_server *server)
+{
+	struct warppipe_client_node *i;
+	int timeout = 1000;
+
+	TAILQ_FOREACH(i, &server->clients, next) {
+		int left = warppipe_client_ack_timeout(i->client);
+
+		if (left >= 0 && left < timeout)
+			timeout = left;
+	}
+	return timeout;
+}
+
+static void server_flush(struct warppipe_server *server)
+{
+	struct warppipe_client_node *i;
+	bool failed = false;
+
+	TAILQ_FOREACH(i, &server->clients, next) {
+		if (i->client->tx_batch) {
+			i->client->tx_batch = false;
+			warppipe_client_flush(i->client);
+		}
+		/* sending an expired ACK may have failed too */
+		if (!i->client->active)
+			failed = true;
+	}
+
+	if (failed)
+		warppipe_server_disconnect_clients(server, should_disconnect_client);
+}
+static void server_read(struct warppipe_server *server);
+
+static void server_disconnect_node(struct warppipe_server *server, struct warppipe_client_node *node)
+{
+#ifdef WARPPIPE_HAVE_IO_URING
+	if (server->uring)
+		warppipe_uring_remove_client(server->uring, node->client);
+#endif
+#ifdef SERVER_HAVE_EPOLL
+	if (server->epoll_fd != -1)
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, node->client->fd, NULL);
+#endif
+#ifdef WARPPIPE_HAVE_SHM
+	if (server->transport == WARPPIPE_TRANSPORT_SHM)
+		warppipe_shm_detach(node->client);
+#endif
+	close(node->client->fd);
+	warppipe_client_destroy(node->client);
+	free(node->client);
+	TAILQ_REMOVE(&server->clients, node, next);
+	free(node);
+	syslog(LOG_NOTICE, "Client disconnected!");
+	if (!server->listen)
+		server->quit = true;
+}
+
 void warppipe_server_disconnect_clients(struct warppipe_server *server, warppipe_server_disconnect_cond_t condition)
 {
 	struct warppipe_client_node *i, *tmp;
 
 	for (i = TAILQ_FIRST(&server->clients); i != NULL; i = tmp) {
 		tmp = TAILQ_NEXT(i, next);
-		if ((condition == NULL) || condition(i->client)) {
-			close(i->client->fd);
-			free(i->client);
-			TAILQ_REMOVE(&server->clients, i, next);
-			free(i);
-			syslog(LOG_NOTICE, "Client disconnected!");
-			if (!server->listen)
-				server->quit = true;
+		if ((condition == NULL) || condition(i->client))
+			server_disconnect_node(server, i);
+	}
+}
+
+#ifdef SERVER_HAVE_EPOLL
+/* Set up epoll, level-triggered, as a client handles one packet per wakeup.
+ * The listening socket is registered with a NULL pointer, clients with their node.
+ */
+static int server_epoll_init(struct warppipe_server *server)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (server->epoll_fd == -1) {
+		syslog(LOG_WARNING, "epoll_create1: %s, falling back to select.", strerror(errno));
+		return -1;
+	}
+
+	if (server->listen && epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->fd, &ev) == -1) {
+		syslog(LOG_WARNING, "epoll_ctl: %s, falling back to select.", strerror(errno));
+		close(server->epoll_fd);
+		server->epoll_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void server_loop_epoll(struct warppipe_server *server)
+{
+	struct epoll_event events[SERVER_EPOLL_MAX_EVENTS];
+	int n = epoll_wait(server->epoll_fd, events, SERVER_EPOLL_MAX_EVENTS, server_timeout_ms(server));
+
+	for (int i = 0; i < n; i++) {
+		struct warppipe_client_node *node = events[i].data.ptr;
+
+		if (node == NULL) {
+			/* drain the accept queue */
+			while (server_accept(server) == 0)
+				;
+			continue;
 		}
+
+		server_client_read(node->client);
+		if (!node->client->active)
+			server_disconnect_node(server, node);
+		if (server->quit)
+			break;
 	}
 }
+#endif
+
+#ifdef WARPPIPE_HAVE_IO_URING
+static void server_loop_uring(struct warppipe_server *server)
+{
+	struct warppipe_client_node *node;
+
+	warppipe_uring_wait(server->uring, server_timeout_ms(server));
+
+	if (warppipe_uring_listen_ready(server->uring))
+		while (server_accept(server) == 0)
+			;
+
+	while ((node = warppipe_uring_next_ready(server->uring)) != NULL) {
+		warppipe_uring_client_read(node->client);
+		if (!node->client->active)
+			server_disconnect_node(server, node);
+		if (server->quit)
+			break;
+	}
+
+	/* send whatever the handlers produced in one go */
+	warppipe_uring_submit(server->uring);
+}
+#endif
+
+static void server_loop_select(struct warppipe_server *server)
+{
+	struct warppipe_client_node *i;
+
+	/* set up descriptors sets */
+	FD_ZERO(&server->read_fds);
+	FD_SET(server->fd, &server->read_fds);
+	TAILQ_FOREACH(i, &server->clients, next)
+		FD_SET(i->client->fd, &server->read_fds);
+
+	/* at most 1 sec delay for select */
+	int timeout = server_timeout_ms(server);
+	struct timeval tv = {
+		.tv_sec = timeout / 1000,
+		.tv_usec = timeout % 1000 * 1000,
+	};
+	select(server->max_fd + 1, &server->read_fds, NULL, NULL, &tv);
+
+	/* check if there's any incoming connection */
+	if (FD_ISSET(server->fd, &server->read_fds))
+		server_accept(server);
+
+	/* read loop */
+	server_read(server);
+
+	/* remove inactive clients */
+	warppipe_server_disconnect_clients(server, should_disconnect_client);
+}
 
 static void server_read(struct warppipe_server *server)
 {
@@ -106,7 +306,7 @@ static void server_read(struct warppipe_server *server)
 
 	TAILQ_FOREACH(i, &server->clients, next)
 		if (FD_ISSET(i->client->fd, &server->read_fds))
-			warppipe_client_read(i->client);
+			server_client_read(i->client);
 }
 
 static int server_accept(struct warppipe_server *server)
@@ -122,17 +322,23 @@ static int server_accept(struct warppipe_server *server)
 	if (server->listen) {
 		fd = accept(server->fd, (struct sockaddr *)&sock_addr, &sock_addr_len);
 		if (fd == -1) {
-			perror("accept");
+			/* EINVAL: the socket was shut down to stop a shard */
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINVAL)
+				perror("accept");
 			return -1;
 		}
 
-		ret = getnameinfo((struct sockaddr *)&sock_addr, sock_addr_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			fprintf(stderr, "getnameinfo: %s\n", gai_strerror(ret));
-			return -1;
-		}
+		if (server_is_unix(server)) {
+			syslog(LOG_NOTICE, "New client connection on %s", server->host);
+		} else {
+			ret = getnameinfo((struct sockaddr *)&sock_addr, sock_addr_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+			if (ret != 0) {
+				fprintf(stderr, "getnameinfo: %s\n", gai_strerror(ret));
+				return -1;
+			}
 
-		syslog(LOG_NOTICE, "New client connection from %s:%s", host, port);
+			syslog(LOG_NOTICE, "New client connection from %s:%s", host, port);
+		}
 	} else {
 		if (!TAILQ_EMPTY(&server->clients))
 			return -1;
@@ -148,18 +354,62 @@ static int server_accept(struct warppipe_server *server)
 		goto fail_free_client;
 
 	warppipe_client_create(new_client, fd);
+	if (server->trusted_link)
+		new_client->link_caps |= WARPPIPE_LINK_CAP_TRUSTED;
+	if (server->share_bars && server_is_unix(server) && server->transport == WARPPIPE_TRANSPORT_SOCKET)
+		new_client->link_caps |= WARPPIPE_LINK_CAP_SHARED_BARS;
+	new_client->flow_control = server->flow_control;
 	new_client_node->client = new_client;
+
+#ifdef WARPPIPE_HAVE_SHM
+	if (server->transport == WARPPIPE_TRANSPORT_SHM && warppipe_shm_attach(new_client, server->listen) == -1)
+		goto fail_free_node;
+#endif
+
+#ifdef WARPPIPE_HAVE_IO_URING
+	if (server->uring && warppipe_uring_add_client(server->uring, new_client_node) == -1)
+		goto fail_free_node;
+#endif
+#ifdef SERVER_HAVE_EPOLL
+	if (server->epoll_fd != -1) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = new_client_node,
+		};
+
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			syslog(LOG_ERR, "Failed to watch client socket: %s", strerror(errno));
+			goto fail_detach;
+		}
+	}
+#endif
+
 	TAILQ_INSERT_TAIL(&server->clients, new_client_node, next);
 	if (server->accept_cb)
 		server->accept_cb(new_client, server->private_data);
+	if (new_client->link_caps || new_client->flow_control)
+		warppipe_client_link_up(new_client);
 
 	track_max_fd(server, fd);
 
 	return 0;
 
+#ifdef SERVER_HAVE_EPOLL
+fail_detach:
+#ifdef WARPPIPE_HAVE_SHM
+	if (server->transport == WARPPIPE_TRANSPORT_SHM)
+		warppipe_shm_detach(new_client);
+#endif
+#endif
+#if defined(SERVER_HAVE_EPOLL) || defined(WARPPIPE_HAVE_IO_URING) || defined(WARPPIPE_HAVE_SHM)
+fail_free_node:
+	free(new_client_node);
+#endif
 fail_free_client:
 	free(new_client);
 fail:
+	if (server->listen)
+		close(fd);
 	return -1;
 }
 
@@ -168,9 +418,10 @@ void warppipe_server_register_accept_cb(struct warppipe_server *server, warppipe
 	server->accept_cb = accept_cb;
 }
 
-int warppipe_server_create(struct warppipe_server *server)
+/* stream socket to host:port, listening or connected, -1 on error */
+static int server_inet_socket(struct warppipe_server *server)
 {
-	int fd_flags, ret;
+	int ret;
 	char host[NI_MAXHOST];
 	char port[NI_MAXSERV];
 	int sfd = -1;
@@ -179,9 +430,6 @@ int warppipe_server_create(struct warppipe_server *server)
 	struct addrinfo  hints;
 	struct addrinfo  *result, *rp;
 
-	/* save current server for signal handler */
-	pcie_server = server;
-
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = server->addr_family;
 	hints.ai_socktype = SOCK_STREAM;
@@ -255,6 +503,99 @@ int warppipe_server_create(struct warppipe_server *server)
 		       server->listen ? "Failed to bind the socket" : "Failed to connect the socket");
 		return -1;
 	}
+	return sfd;
+}
+
+#ifdef SERVER_HAVE_UNIX
+/* Unix socket at the host path, listening or connected, -1 on error.
+ * A path starting with '@' names a socket in the abstract namespace (Linux only).
+ */
+static int server_unix_socket(struct warppipe_server *server)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	socklen_t addrlen = sizeof(addr);
+	struct stat st;
+	bool abstract;
+	int sfd;
+
+	if (!server->host || !server->host[0] || strlen(server->host) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERR, "Invalid Unix socket path.");
+		return -1;
+	}
+	abstract = server->host[0] == '@';
+#ifndef __linux__
+	if (abstract) {
+		syslog(LOG_ERR, "Abstract Unix sockets are not supported on this platform.");
+		return -1;
+	}
+#endif
+	if (abstract) {
+		/* the name is not NUL-terminated, its length comes from the address length */
+		memcpy(addr.sun_path + 1, server->host + 1, strlen(server->host) - 1);
+		addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(server->host);
+	} else {
+		strcpy(addr.sun_path, server->host);
+	}
+
+	sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sfd == -1) {
+		perror("Failed to create a socket");
+		return -1;
+	}
+
+	if (server->listen) {
+		/* left behind by a previous run */
+		if (!abstract && stat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(addr.sun_path);
+		if (bind(sfd, (struct sockaddr *)&addr, addrlen) == -1) {
+			perror("Failed to bind the socket");
+			close(sfd);
+			return -1;
+		}
+		if (listen(sfd, SERVER_LISTEN_QUEUE_SIZE) == -1) {
+			perror("Failed to listen for connections on the socket!");
+			close(sfd);
+			return -1;
+		}
+	} else if (connect(sfd, (struct sockaddr *)&addr, addrlen) == -1) {
+		perror("Failed to connect the socket");
+		close(sfd);
+		return -1;
+	}
+
+	syslog(LOG_NOTICE, PRJ_NAME_LONG " %s %s.", server->listen ? "listening on" : "connected to", server->host);
+	return sfd;
+}
+#endif
+
+int warppipe_server_create(struct warppipe_server *server)
+{
+	int fd_flags;
+	int sfd;
+
+	/* save current server for signal handler */
+	pcie_server = server;
+	sigint_received = 0;
+
+#ifndef WARPPIPE_HAVE_SHM
+	if (server->transport == WARPPIPE_TRANSPORT_SHM) {
+		syslog(LOG_ERR, "Shared memory transport is not supported on this platform.");
+		return -1;
+	}
+#endif
+#ifdef SERVER_HAVE_UNIX
+	if (server_is_unix(server))
+		sfd = server_unix_socket(server);
+	else
+#endif
+		sfd = server_inet_socket(server);
+	if (sfd == -1)
+		return -1;
+	if (server->share_bars && (!server_is_unix(server) || server->transport != WARPPIPE_TRANSPORT_SOCKET))
+		syslog(LOG_WARNING, "BAR memory can be shared over Unix sockets only, not sharing it.");
+
 	server->max_fd = server->fd = sfd;
 
 	/* set the socket to be non-blocking */
@@ -264,39 +605,217 @@ int warppipe_server_create(struct warppipe_server *server)
 	/* set up client linked list */
 	TAILQ_INIT(&server->clients);
 
+	server->epoll_fd = -1;
+	server->uring = NULL;
+#ifdef WARPPIPE_HAVE_IO_URING
+	if (server->backend == WARPPIPE_SERVER_BACKEND_IO_URING && server->transport == WARPPIPE_TRANSPORT_SHM)
+		syslog(LOG_WARNING, "io_uring does not drive shared memory connections, falling back to epoll.");
+	else if (server->backend == WARPPIPE_SERVER_BACKEND_IO_URING) {
+		server->uring = warppipe_uring_create(server->listen ? sfd : -1);
+		if (!server->uring)
+			syslog(LOG_WARNING, "io_uring is not available, falling back to epoll.");
+	}
+#endif
+#ifdef SERVER_HAVE_EPOLL
+	if (!server->uring && server->backend != WARPPIPE_SERVER_BACKEND_SELECT)
+		server_epoll_init(server);
+#endif
+
 	/* When in client mode, create client node for itself */
-	if (!server->listen)
-		server_accept(server);
+	if (!server->listen && server_accept(server) == -1) {
+		warppipe_server_destroy(server);
+		close(sfd);
+		return -1;
+	}
 
-	sigint_handler = signal(SIGINT, handle_sigint);
+	sig_t prev_handler = signal(SIGINT, handle_sigint);
+
+	/* keep chaining to the handler from before the first server */
+	if (prev_handler != handle_sigint)
+		sigint_handler = prev_handler;
 
 	return 0;
 }
 
+void warppipe_server_destroy(struct warppipe_server *server)
+{
+	/* disconnect every user */
+	warppipe_server_disconnect_clients(server, NULL);
+	if (server->listen)
+		close(server->fd);
+	if (server->listen && server_is_unix(server) && server->host[0] != '@')
+		unlink(server->host);
+	if (server->epoll_fd != -1) {
+		close(server->epoll_fd);
+		server->epoll_fd = -1;
+	}
+#ifdef WARPPIPE_HAVE_IO_URING
+	if (server->uring) {
+		warppipe_uring_destroy(server->uring);
+		server->uring = NULL;
+	}
+#endif
+	if (pcie_server == server)
+		pcie_server = NULL;
+}
+
 void warppipe_server_loop(struct warppipe_server *server)
 {
-	struct warppipe_client_node *i;
+#ifdef WARPPIPE_HAVE_IO_URING
+	if (server->uring)
+		server_loop_uring(server);
+	else
+#endif
+#ifdef SERVER_HAVE_EPOLL
+	if (server->epoll_fd != -1)
+		server_loop_epoll(server);
+	else
+#endif
+		server_loop_select(server);
 
-	/* set up descriptors sets */
-	FD_ZERO(&server->read_fds);
-	FD_SET(server->fd, &server->read_fds);
-	TAILQ_FOREACH(i, &server->clients, next)
-		FD_SET(i->client->fd, &server->read_fds);
+	server_flush(server);
+}
 
-	/* 1 sec delay for select */
-	struct timeval tv = {
-		.tv_sec = 1,
-		.tv_usec = 0,
-	};
-	select(server->max_fd + 1, &server->read_fds, NULL, NULL, &tv);
+#ifdef SERVER_HAVE_SHARDS
+struct warppipe_server_shard {
+	struct warppipe_server server;
+	pthread_t thread;
+	bool stop;
+};
 
-	/* check if there's any incoming connection */
-	if (FD_ISSET(server->fd, &server->read_fds))
-		server_accept(server);
+static void *server_shard_main(void *arg)
+{
+	struct warppipe_server_shard *shard = arg;
 
-	/* read loop */
-	server_read(server);
+	while (!__atomic_load_n(&shard->stop, __ATOMIC_ACQUIRE) && !shard->server.quit)
+		warppipe_server_loop(&shard->server);
 
-	/* remove inactive clients */
-	warppipe_server_disconnect_clients(server, should_disconnect_client);
+	return NULL;
 }
+
+/* the idx-th CPU (modulo their number) the process may run on, -1 if unknown */
+static int server_shard_cpu(int idx)
+{
+	cpu_set_t set;
+	int n;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == -1)
+		return -1;
+	n = CPU_COUNT(&set);
+	if (n == 0)
+		return -1;
+
+	idx %= n;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &set) && idx-- == 0)
+			return cpu;
+	return -1;
+}
+
+static void server_shards_stop(struct warppipe_server_shards *shards, int running)
+{
+	for (int i = 0; i < running; i++) {
+		__atomic_store_n(&shards->shards[i].stop, true, __ATOMIC_RELEASE);
+		/* wake up the event loop waiting for connections */
+		shutdown(shards->shards[i].server.fd, SHUT_RD);
+	}
+	for (int i = 0; i < running; i++)
+		pthread_join(shards->shards[i].thread, NULL);
+}
+
+int warppipe_server_shards_create(struct warppipe_server_shards *shards, const struct warppipe_server *config, int count)
+{
+	int created = 0, running = 0;
+
+	/* shards share a port through SO_REUSEPORT, a Unix socket path can be bound only once */
+	if (!config->listen || count < 1 || server_is_unix(config)) {
+		syslog(LOG_ERR, "Shards need a listening TCP server.");
+		return -1;
+	}
+
+	shards->count = count;
+	shards->shards = calloc(count, sizeof(*shards->shards));
+	if (!shards->shards) {
+		syslog(LOG_ERR, "Failed to allocate %d shards.", count);
+		return -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct warppipe_server *server = &shards->shards[i].server;
+
+		*server = *config;
+		if (i > 0)
+			server->port = shards->port;
+		if (warppipe_server_create(server) == -1)
+			goto fail;
+		created++;
+
+		if (i == 0) {
+			/* the other shards bind the port the first one got */
+			struct sockaddr_storage addr;
+			socklen_t addrlen = sizeof(addr);
+			in_port_t port;
+
+			if (getsockname(server->fd, (struct sockaddr *)&addr, &addrlen) == -1) {
+				perror("getsockname");
+				goto fail;
+			}
+			if (addr.ss_family == AF_INET6)
+				port = ((struct sockaddr_in6 *)&addr)->sin6_port;
+			else
+				port = ((struct sockaddr_in *)&addr)->sin_port;
+			snprintf(shards->port, sizeof(shards->port), "%u", ntohs(port));
+		}
+	}
+
+	/* the SIGINT handler must not destroy a server while its shard is running */
+	pcie_server = NULL;
+
+	for (; running < count; running++) {
+		struct warppipe_server_shard *shard = &shards->shards[running];
+		int ret = pthread_create(&shard->thread, NULL, server_shard_main, shard);
+
+		if (ret) {
+			syslog(LOG_ERR, "Failed to start shard %d: %s", running, strerror(ret));
+			goto fail;
+		}
+
+		int cpu = shards->pin ? server_shard_cpu(running) : -1;
+
+		if (cpu >= 0) {
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			ret = pthread_setaffinity_np(shard->thread, sizeof(set), &set);
+			if (ret)
+				syslog(LOG_WARNING, "Failed to pin shard %d to CPU %d: %s", running, cpu, strerror(ret));
+		}
+	}
+
+	syslog(LOG_NOTICE, "%d shards listening on port %s.", count, shards->port);
+	return 0;
+
+fail:
+	server_shards_stop(shards, running);
+	for (int i = 0; i < created; i++)
+		warppipe_server_destroy(&shards->shards[i].server);
+	free(shards->shards);
+	shards->shards = NULL;
+	return -1;
+}
+
+struct warppipe_server *warppipe_server_shards_get(struct warppipe_server_shards *shards, int idx)
+{
+	return &shards->shards[idx].server;
+}
+
+void warppipe_server_shards_destroy(struct warppipe_server_shards *shards)
+{
+	server_shards_stop(shards, shards->count);
+	for (int i = 0; i < shards->count; i++)
+		warppipe_server_destroy(&shards->shards[i].server);
+	free(shards->shards);
+	shards->shards = NULL;
+}
+#endif
@@ -0,0 +1,424 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Shared memory transport: the byte stream of each direction goes through a single-producer
+ * single-consumer ring in a memfd both peers map, framed exactly like on a socket.
+ * A consumer that runs out of data polls its ring for a while, then asks the producer
+ * for a wakeup: a byte on the Unix socket the memfd was passed over, which the event loops
+ * already watch and which also tells when the peer goes away.
+ */
+
+#if defined(__linux__) && !defined(__ZEPHYR__)
+/* memfd_create */
+#define _GNU_SOURCE
+#endif
+
+#include "shm.h"
+
+#ifdef WARPPIPE_HAVE_SHM
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <warppipe/client.h>
+#include <warppipe/config.h>
+
+#include "client_io.h"
+
+#define SHM_MAGIC		0x57505348 /* "WPSH" */
+#define SHM_CACHELINE		64
+#define SHM_RING_MASK		(CLIENT_SHM_RING_SIZE - 1)
+
+_Static_assert((CLIENT_SHM_RING_SIZE & SHM_RING_MASK) == 0, "CLIENT_SHM_RING_SIZE must be a power of 2");
+
+struct shm_ring {
+	/* free-running byte positions, each written by one side only */
+	uint32_t tail __attribute__((aligned(SHM_CACHELINE)));
+	uint32_t head __attribute__((aligned(SHM_CACHELINE)));
+	/* set by the consumer before it sleeps, cleared by the producer that wakes it up */
+	uint32_t need_wake __attribute__((aligned(SHM_CACHELINE)));
+	uint8_t data[CLIENT_SHM_RING_SIZE] __attribute__((aligned(SHM_CACHELINE)));
+};
+
+struct shm_segment {
+	uint32_t magic;
+	uint32_t ring_size;
+	/* rings[0] carries what the listening side sends */
+	struct shm_ring rings[2];
+};
+
+struct shm_conn {
+	struct warppipe_client_io io;
+	int fd;
+	struct shm_segment *seg;
+	struct shm_ring *rx;
+	struct shm_ring *tx;
+	/* how long to poll the empty rx ring, halved every time it does not pay off */
+	uint64_t spin_us;
+	/* and what it goes back to when it would have */
+	uint64_t spin_max_us;
+	/* when rx->need_wake was last set, 0 while awake */
+	uint64_t slept_us;
+	/* tx->tail at that moment */
+	uint32_t slept_tx;
+	/* the peer closed the socket, reported once the ring is drained */
+	bool hangup;
+};
+
+static uint64_t shm_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static inline uint32_t shm_ring_used(struct shm_ring *ring)
+{
+	return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - ring->head;
+}
+
+static inline void shm_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+/* Called with the rx ring empty: poll it for a while, then ask the peer for a wakeup.
+ * returns 1 if data arrived, 0 once asleep, -1 if the peer is gone
+ */
+static int shm_conn_idle(struct shm_conn *conn)
+{
+	struct shm_ring *ring = conn->rx;
+	uint64_t start = shm_now_us();
+	uint8_t buf[64];
+	int n;
+
+	while (shm_now_us() - start < conn->spin_us) {
+		if (shm_ring_used(ring))
+			return 1;
+		shm_cpu_relax();
+	}
+	conn->spin_us /= 2;
+
+	/* wakeups that came since the last sleep */
+	while ((n = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		;
+	if (n == 0)
+		return -1;
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		syslog(LOG_ERR, "Shared memory wakeup: %s", strerror(errno));
+		return -1;
+	}
+
+	/* a producer that sees need_wake after publishing data sends a wakeup, otherwise the check below sees the data */
+	__atomic_store_n(&ring->need_wake, 1, __ATOMIC_SEQ_CST);
+	conn->slept_us = shm_now_us();
+	conn->slept_tx = conn->tx->tail;
+	return shm_ring_used(ring) ? 1 : 0;
+}
+
+static ssize_t shm_conn_recv(struct warppipe_client_io *io, void *buf, size_t len)
+{
+	struct shm_conn *conn = (struct shm_conn *)io;
+	struct shm_ring *ring = conn->rx;
+	uint32_t used = shm_ring_used(ring);
+
+	if (!used && !conn->hangup) {
+		int rc = shm_conn_idle(conn);
+
+		if (rc == -1)
+			conn->hangup = true;
+		used = shm_ring_used(ring);
+	}
+	if (!used) {
+		if (conn->hangup)
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* woken up soon enough that polling would have caught it, unless it is the answer
+	 * to something sent meanwhile, which could not go out while polling
+	 */
+	if (conn->slept_us && conn->tx->tail == conn->slept_tx && shm_now_us() - conn->slept_us <= conn->spin_max_us)
+		conn->spin_us = conn->spin_max_us;
+	conn->slept_us = 0;
+
+	uint32_t head = ring->head;
+	uint32_t n = used < len ? used : len;
+	uint32_t off = head & SHM_RING_MASK;
+	uint32_t first = CLIENT_SHM_RING_SIZE - off < n ? CLIENT_SHM_RING_SIZE - off : n;
+
+	memcpy(buf, ring->data + off, first);
+	memcpy((uint8_t *)buf + first, ring->data, n - first);
+	__atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/* after the received packets were handled: keep reading if more came meanwhile, poll for more or go to sleep */
+static bool shm_conn_pending(struct warppipe_client_io *io)
+{
+	struct shm_conn *conn = (struct shm_conn *)io;
+
+	if (conn->hangup || shm_ring_used(conn->rx))
+		return true;
+
+	int rc = shm_conn_idle(conn);
+
+	if (rc == -1)
+		conn->hangup = true;
+	return rc != 0;
+}
+
+static void shm_conn_wake(struct shm_conn *conn)
+{
+	struct shm_ring *ring = conn->tx;
+
+	if (!__atomic_load_n(&ring->need_wake, __ATOMIC_SEQ_CST) ||
+	    !__atomic_exchange_n(&ring->need_wake, 0, __ATOMIC_SEQ_CST))
+		return;
+
+	/* a full socket buffer already holds a wakeup, a closed one is noticed on the next receive */
+	send(conn->fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* whether the peer still has the socket open */
+static bool shm_conn_alive(struct shm_conn *conn)
+{
+	uint8_t c;
+	int n = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return n != 0;
+}
+
+static ssize_t shm_conn_send(struct warppipe_client_io *io, const void *buf, size_t len)
+{
+	struct shm_conn *conn = (struct shm_conn *)io;
+	struct shm_ring *ring = conn->tx;
+	uint32_t tail = ring->tail;
+	size_t sent = 0;
+
+	while (sent < len) {
+		uint32_t room = CLIENT_SHM_RING_SIZE - (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+
+		if (room == 0) {
+			/* the peer is behind, like a socket would block */
+			if (!shm_conn_alive(conn)) {
+				errno = EPIPE;
+				return -1;
+			}
+			sched_yield();
+			continue;
+		}
+
+		uint32_t n = len - sent < room ? len - sent : room;
+		uint32_t off = tail & SHM_RING_MASK;
+		uint32_t first = CLIENT_SHM_RING_SIZE - off < n ? CLIENT_SHM_RING_SIZE - off : n;
+
+		memcpy(ring->data + off, (const uint8_t *)buf + sent, first);
+		memcpy(ring->data, (const uint8_t *)buf + sent + first, n - first);
+		tail += n;
+		sent += n;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+		shm_conn_wake(conn);
+	}
+	return len;
+}
+
+/* allocate the segment and pass it to the peer */
+static struct shm_segment *shm_create(int fd)
+{
+	struct shm_segment *seg;
+	int memfd = memfd_create(PRJ_NAME_SHORT, MFD_CLOEXEC);
+
+	if (memfd == -1) {
+		syslog(LOG_ERR, "memfd_create: %s", strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(memfd, sizeof(*seg)) == -1) {
+		syslog(LOG_ERR, "Failed to size the shared memory: %s", strerror(errno));
+		close(memfd);
+		return NULL;
+	}
+	seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (seg == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to map the shared memory: %s", strerror(errno));
+		close(memfd);
+		return NULL;
+	}
+
+	seg->magic = SHM_MAGIC;
+	seg->ring_size = CLIENT_SHM_RING_SIZE;
+	/* both sides start asleep */
+	seg->rings[0].need_wake = 1;
+	seg->rings[1].need_wake = 1;
+
+	char cmsg_buf[CMSG_SPACE(sizeof(int))] = {};
+	struct iovec iov = {
+		.iov_base = "",
+		.iov_len = 1,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg_buf,
+		.msg_controllen = sizeof(cmsg_buf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+	ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+	close(memfd);
+	if (n != 1) {
+		syslog(LOG_ERR, "Failed to pass the shared memory to the peer: %s", n < 0 ? strerror(errno) : "short write");
+		munmap(seg, sizeof(*seg));
+		return NULL;
+	}
+	return seg;
+}
+
+/* wait for the segment of the peer and map it */
+static struct shm_segment *shm_open_peer(int fd)
+{
+	struct timeval tv = {
+		.tv_sec = CLIENT_SHM_SETUP_TIMEOUT_MS / 1000,
+		.tv_usec = CLIENT_SHM_SETUP_TIMEOUT_MS % 1000 * 1000,
+	};
+	char cmsg_buf[CMSG_SPACE(sizeof(int))];
+	char byte;
+	struct iovec iov = {
+		.iov_base = &byte,
+		.iov_len = 1,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg_buf,
+		.msg_controllen = sizeof(cmsg_buf),
+	};
+	struct shm_segment *seg;
+	struct stat st;
+	int memfd;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+	if (n != 1) {
+		syslog(LOG_ERR, "No shared memory from the peer: %s", n < 0 ? strerror(errno) : "connection closed");
+		return NULL;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		syslog(LOG_ERR, "The peer did not pass shared memory.");
+		return NULL;
+	}
+	memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (fstat(memfd, &st) == -1 || st.st_size < (off_t)sizeof(*seg)) {
+		syslog(LOG_ERR, "The shared memory of the peer is too small.");
+		close(memfd);
+		return NULL;
+	}
+	seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	close(memfd);
+	if (seg == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to map the shared memory: %s", strerror(errno));
+		return NULL;
+	}
+	if (seg->magic != SHM_MAGIC || seg->ring_size != CLIENT_SHM_RING_SIZE) {
+		syslog(LOG_ERR, "The shared memory of the peer has another layout (ring size %u, expected %u).",
+		       seg->ring_size, CLIENT_SHM_RING_SIZE);
+		munmap(seg, sizeof(*seg));
+		return NULL;
+	}
+	return seg;
+}
+
+int warppipe_shm_attach(struct warppipe_client *client, bool create)
+{
+	int fd = client->fd;
+	int fd_flags = fcntl(fd, F_GETFL, 0);
+	struct shm_conn *conn = calloc(1, sizeof(*conn));
+
+	if (!conn) {
+		syslog(LOG_ERR, "Failed to allocate a shared memory connection.");
+		return -1;
+	}
+
+	/* the setup blocks, the wakeups must not */
+	fcntl(fd, F_SETFL, fd_flags & ~O_NONBLOCK);
+	conn->seg = create ? shm_create(fd) : shm_open_peer(fd);
+	fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
+	if (!conn->seg) {
+		free(conn);
+		return -1;
+	}
+
+	conn->io.recv = shm_conn_recv;
+	conn->io.send = shm_conn_send;
+	conn->io.pending = shm_conn_pending;
+	conn->io.pollable = true;
+	conn->fd = fd;
+	conn->rx = &conn->seg->rings[create ? 1 : 0];
+	conn->tx = &conn->seg->rings[create ? 0 : 1];
+	/* with a single CPU the peer cannot make progress while we poll */
+	conn->spin_max_us = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CLIENT_SHM_SPIN_US : 0;
+	conn->spin_us = conn->spin_max_us;
+	client->io = &conn->io;
+
+	syslog(LOG_NOTICE, "Connection moved to shared memory.");
+	return 0;
+}
+
+void warppipe_shm_detach(struct warppipe_client *client)
+{
+	struct shm_conn *conn = (struct shm_conn *)client->io;
+
+	if (!conn)
+		return;
+
+	client->io = NULL;
+	munmap(conn->seg, sizeof(*conn->seg));
+	free(conn);
+}
+
+#endif /* WARPPIPE_HAVE_SHM */
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WARP_PIPE_SHM_H
+#define WARP_PIPE_SHM_H
+
+#include <stdbool.h>
+
+#include <warppipe/client.h>
+
+/* The rings live in a memfd handed over the Unix socket of the connection. */
+#if defined(__linux__) && !defined(__ZEPHYR__)
+#define WARPPIPE_HAVE_SHM
+#endif
+
+#ifdef WARPPIPE_HAVE_SHM
+
+/* Move the I/O of a connected Unix socket to shared memory rings. The listening side (create)
+ * allocates them and passes them to the peer, which waits up to CLIENT_SHM_SETUP_TIMEOUT_MS.
+ * The socket stays open for wakeups and to notice the peer going away.
+ * returns: 0 on success, -1 on error
+ */
+int warppipe_shm_attach(struct warppipe_client *client, bool create);
+/* Release the rings, before the socket is closed. */
+void warppipe_shm_detach(struct warppipe_client *client);
+
+#endif /* WARPPIPE_HAVE_SHM */
+
+#endif /* WARP_PIPE_SHM_H */
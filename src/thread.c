@@ -0,0 +1,419 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Threaded mode: requests from any thread reach the I/O thread through a lock-free
+ * multi-producer single-consumer queue (Vyukov's intrusive MPSC queue).
+ * The I/O thread sleeps in poll(2) on the socket and an eventfd producers write to,
+ * only when it announced it is about to sleep.
+ */
+
+#ifdef __ZEPHYR__
+#include <zephyr/posix/sys/eventfd.h>
+#else
+#include <sys/eventfd.h>
+#endif
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <warppipe/client.h>
+#include <warppipe/thread.h>
+
+struct warppipe_thread {
+	struct warppipe_client *client;
+	pthread_t thread;
+	int wake_fd;
+	bool stop;
+	bool running;
+	/* producers between checking running and the end of their push, the exiting I/O thread waits for them */
+	int submitting;
+	/* set while the I/O thread sleeps or is about to, producers then write to wake_fd */
+	bool sleeping;
+	/* producers swap themselves into head, the I/O thread pops from tail */
+	struct warppipe_thread_req *head;
+	struct warppipe_thread_req *tail;
+	struct warppipe_thread_req stub;
+	/* requests waiting for free tags, in order, only touched by the I/O thread */
+	struct warppipe_thread_req *pending;
+	struct warppipe_thread_req **pending_tail;
+};
+
+static void queue_push(struct warppipe_thread *thread, struct warppipe_thread_req *req)
+{
+	struct warppipe_thread_req *prev;
+
+	__atomic_store_n(&req->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&thread->head, req, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, req, __ATOMIC_RELEASE);
+}
+
+/* NULL if empty or if a producer is halfway through queue_push */
+static struct warppipe_thread_req *queue_pop(struct warppipe_thread *thread)
+{
+	struct warppipe_thread_req *tail = thread->tail;
+	struct warppipe_thread_req *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &thread->stub) {
+		if (!next)
+			return NULL;
+		thread->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		thread->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	queue_push(thread, &thread->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		thread->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static bool queue_empty(struct warppipe_thread *thread)
+{
+	return __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE) == thread->tail;
+}
+
+static void thread_done(struct warppipe_thread_req *req, int result)
+{
+	req->result = result;
+	req->done(req);
+}
+
+static void thread_read_done(const struct warppipe_completion_status completion_status, const void *data, int length, void *private_data)
+{
+	struct warppipe_thread_req *req = private_data;
+
+	if (completion_status.error_code) {
+		thread_done(req, completion_status.error_code < 0 ? completion_status.error_code : -1);
+		return;
+	}
+	if (length > req->op.length)
+		length = req->op.length;
+	memcpy(req->op.data, data, length);
+	thread_done(req, length);
+}
+
+/* returns 0 once issued or completed, -EAGAIN if it has to wait for free tags */
+static int thread_issue(struct warppipe_client *client, struct warppipe_thread_req *req)
+{
+	const struct warppipe_op *op = &req->op;
+	int rc;
+
+	switch (op->type) {
+	case WARPPIPE_OP_READ:
+		rc = warppipe_read_ctx(client, op->bar_idx, op->addr, op->length, thread_read_done, req);
+		break;
+	case WARPPIPE_OP_CONFIG0_READ:
+		rc = warppipe_config0_read_ctx(client, op->addr, op->length, thread_read_done, req);
+		break;
+	case WARPPIPE_OP_WRITE:
+		rc = warppipe_write(client, op->bar_idx, op->addr, op->data, op->length);
+		break;
+	case WARPPIPE_OP_CONFIG0_WRITE:
+		rc = warppipe_config0_write(client, op->addr, op->data, op->length);
+		break;
+	/* the region map is only rebuilt on this thread, while no request is dispatched */
+	case WARPPIPE_OP_REGISTER_REGION: {
+		const struct warppipe_region *region = op->data;
+
+		rc = warppipe_register_region(client, region->bar_idx, region->offset, region->size,
+					      region->read_cb, region->write_cb, region->private_data);
+		break;
+	}
+	case WARPPIPE_OP_REMAP_BAR:
+		rc = warppipe_remap_bar(client, op->bar_idx, op->addr);
+		break;
+	default:
+		syslog(LOG_ERR, "Unknown operation type %d.", op->type);
+		rc = -1;
+		break;
+	}
+
+	if (rc == -EAGAIN)
+		return rc;
+	if (rc)
+		thread_done(req, -1);
+	else if (op->type == WARPPIPE_OP_WRITE || op->type == WARPPIPE_OP_CONFIG0_WRITE)
+		thread_done(req, op->length);
+	else if (op->type == WARPPIPE_OP_REGISTER_REGION || op->type == WARPPIPE_OP_REMAP_BAR)
+		thread_done(req, 0);
+	return 0;
+}
+
+/* issue the requests waiting for tags, then the new ones, keeping their order */
+static void thread_issue_all(struct warppipe_thread *thread)
+{
+	struct warppipe_thread_req *req;
+
+	while ((req = thread->pending)) {
+		if (thread_issue(thread->client, req) == -EAGAIN)
+			return;
+		thread->pending = req->next;
+		if (!thread->pending)
+			thread->pending_tail = &thread->pending;
+	}
+
+	while ((req = queue_pop(thread))) {
+		if (thread->pending || thread_issue(thread->client, req) == -EAGAIN) {
+			req->next = NULL;
+			*thread->pending_tail = req;
+			thread->pending_tail = &req->next;
+		}
+	}
+}
+
+static void thread_fail_all(struct warppipe_thread *thread)
+{
+	struct warppipe_thread_req *req;
+
+	while ((req = thread->pending)) {
+		thread->pending = req->next;
+		thread_done(req, -1);
+	}
+	thread->pending_tail = &thread->pending;
+
+	while ((req = queue_pop(thread)))
+		thread_done(req, -1);
+}
+
+static void *thread_main(void *arg)
+{
+	struct warppipe_thread *thread = arg;
+	struct warppipe_client *client = thread->client;
+
+	while (!__atomic_load_n(&thread->stop, __ATOMIC_ACQUIRE) && client->active) {
+		/* everything issued in one pass leaves in a single send */
+		client->tx_batch = true;
+		thread_issue_all(thread);
+		client->tx_batch = false;
+		if (warppipe_client_flush(client) == -1)
+			break;
+
+		__atomic_store_n(&thread->sleeping, true, __ATOMIC_SEQ_CST);
+
+		int wait = queue_empty(thread) ? warppipe_client_ack_timeout(client) : 0;
+		struct pollfd pfds[2] = {
+			{ .fd = client->fd, .events = POLLIN },
+			{ .fd = thread->wake_fd, .events = POLLIN },
+		};
+
+		if (poll(pfds, 2, wait) == -1 && errno != EINTR) {
+			syslog(LOG_ERR, "poll: %s", strerror(errno));
+			break;
+		}
+		__atomic_store_n(&thread->sleeping, false, __ATOMIC_SEQ_CST);
+
+		if (pfds[1].revents) {
+			eventfd_t value;
+
+			eventfd_read(thread->wake_fd, &value);
+		}
+		if (pfds[0].revents) {
+			client->tx_batch = true;
+			warppipe_client_read(client);
+			client->tx_batch = false;
+		}
+	}
+
+	client->tx_batch = false;
+	if (client->active)
+		warppipe_client_flush(client);
+
+	__atomic_store_n(&thread->running, false, __ATOMIC_SEQ_CST);
+	/* producers that saw it running finish their push, the queue holds every request from then on */
+	while (__atomic_load_n(&thread->submitting, __ATOMIC_SEQ_CST))
+		sched_yield();
+	/* reads in flight, then the ones not issued yet */
+	warppipe_client_destroy(client);
+	thread_fail_all(thread);
+
+	return NULL;
+}
+
+struct warppipe_thread *warppipe_thread_create(struct warppipe_client *client)
+{
+	struct warppipe_thread *thread = calloc(1, sizeof(*thread));
+
+	if (!thread) {
+		syslog(LOG_ERR, "Failed to allocate the I/O thread.");
+		return NULL;
+	}
+
+	thread->client = client;
+	thread->head = &thread->stub;
+	thread->tail = &thread->stub;
+	thread->pending_tail = &thread->pending;
+	thread->running = true;
+
+	thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (thread->wake_fd == -1) {
+		syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+		free(thread);
+		return NULL;
+	}
+
+	int rc = pthread_create(&thread->thread, NULL, thread_main, thread);
+
+	if (rc) {
+		syslog(LOG_ERR, "Failed to start the I/O thread: %s", strerror(rc));
+		close(thread->wake_fd);
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+void warppipe_thread_destroy(struct warppipe_thread *thread)
+{
+	__atomic_store_n(&thread->stop, true, __ATOMIC_SEQ_CST);
+	eventfd_write(thread->wake_fd, 1);
+	pthread_join(thread->thread, NULL);
+
+	/* submitted while the I/O thread was exiting */
+	thread_fail_all(thread);
+	close(thread->wake_fd);
+	free(thread);
+}
+
+int warppipe_thread_submit(struct warppipe_thread *thread, struct warppipe_thread_req *req)
+{
+	/* counted before the check, so an exiting I/O thread either turns us away or waits for the push */
+	__atomic_add_fetch(&thread->submitting, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&thread->running, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&thread->submitting, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+
+	queue_push(thread, req);
+	if (__atomic_exchange_n(&thread->sleeping, false, __ATOMIC_SEQ_CST))
+		eventfd_write(thread->wake_fd, 1);
+	__atomic_sub_fetch(&thread->submitting, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/* blocking request, completed on the I/O thread */
+struct thread_waiter {
+	struct warppipe_thread_req req;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+};
+
+static void thread_wake(struct warppipe_thread_req *req)
+{
+	struct thread_waiter *waiter = (struct thread_waiter *)req;
+
+	pthread_mutex_lock(&waiter->lock);
+	waiter->done = true;
+	pthread_cond_signal(&waiter->cond);
+	pthread_mutex_unlock(&waiter->lock);
+}
+
+static int thread_wait(struct warppipe_thread *thread, const struct warppipe_op *op)
+{
+	struct thread_waiter waiter = {
+		.req = {
+			.op = *op,
+			.done = thread_wake,
+		},
+		.done = false,
+	};
+
+	pthread_mutex_init(&waiter.lock, NULL);
+	pthread_cond_init(&waiter.cond, NULL);
+
+	if (warppipe_thread_submit(thread, &waiter.req) == -1) {
+		waiter.req.result = -1;
+	} else {
+		pthread_mutex_lock(&waiter.lock);
+		while (!waiter.done)
+			pthread_cond_wait(&waiter.cond, &waiter.lock);
+		pthread_mutex_unlock(&waiter.lock);
+	}
+
+	pthread_cond_destroy(&waiter.cond);
+	pthread_mutex_destroy(&waiter.lock);
+	return waiter.req.result;
+}
+
+int warppipe_thread_read(struct warppipe_thread *thread, int bar_idx, uint64_t addr, void *data, int length)
+{
+	const struct warppipe_op op = {
+		.type = WARPPIPE_OP_READ,
+		.bar_idx = bar_idx,
+		.addr = addr,
+		.data = data,
+		.length = length,
+	};
+
+	return thread_wait(thread, &op);
+}
+
+int warppipe_thread_write(struct warppipe_thread *thread, int bar_idx, uint64_t addr, const void *data, int length)
+{
+	const struct warppipe_op op = {
+		.type = WARPPIPE_OP_WRITE,
+		.bar_idx = bar_idx,
+		.addr = addr,
+		.data = (void *)data,
+		.length = length,
+	};
+
+	return thread_wait(thread, &op);
+}
+
+int warppipe_thread_register_region(struct warppipe_thread *thread, int bar_idx, uint64_t offset, uint64_t size,
+				    warppipe_read_cb_t read_cb, warppipe_write_cb_t write_cb, void *private_data)
+{
+	struct warppipe_region region = {
+		.bar_idx = bar_idx,
+		.offset = offset,
+		.size = size,
+		.read_cb = read_cb,
+		.write_cb = write_cb,
+		.private_data = private_data,
+	};
+	const struct warppipe_op op = {
+		.type = WARPPIPE_OP_REGISTER_REGION,
+		.data = &region,
+	};
+
+	return thread_wait(thread, &op);
+}
+
+int warppipe_thread_remap_bar(struct warppipe_thread *thread, int bar_idx, uint64_t bar)
+{
+	const struct warppipe_op op = {
+		.type = WARPPIPE_OP_REMAP_BAR,
+		.bar_idx = bar_idx,
+		.addr = bar,
+	};
+
+	return thread_wait(thread, &op);
+}
@@ -0,0 +1,805 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "uring.h"
+
+#ifdef WARPPIPE_HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <warppipe/client.h>
+#include <warppipe/config.h>
+
+#include "client_io.h"
+
+/* operation kept in the low bits of the SQE user_data, the rest is the connection pointer */
+enum uring_op {
+	URING_OP_LISTEN = 0,
+	URING_OP_RECV,
+	URING_OP_SEND,
+	URING_OP_CANCEL,
+};
+
+#define URING_OP_MASK		3ULL
+#define URING_MAX_BGID		65536
+
+struct uring_conn {
+	/* must be first, the client only sees this part */
+	struct warppipe_client_io io;
+	struct warppipe_uring *ring;
+	/* NULL once the connection has been removed, waiting for its requests to finish */
+	struct warppipe_client_node *node;
+	int fd;
+
+	/* provided buffers the multishot receive picks from */
+	uint16_t bgid;
+	uint16_t br_tail;
+	struct io_uring_buf_ring *br;
+	uint8_t *bufs;
+
+	/* received buffers, in order, not yet copied to the client; the first one from stash_off */
+	struct {
+		uint16_t bid;
+		uint16_t len;
+	} stash[CLIENT_URING_BUFS];
+	int stashed;
+	uint16_t stash_off;
+
+	/* packets are gathered in tx[tx_cur] while the other buffer is being sent */
+	uint8_t *tx[2];
+	size_t tx_len[2];
+	size_t tx_cap[2];
+	int tx_cur;
+
+	int inflight;
+	bool recv_armed;
+	bool send_armed;
+	bool hangup;
+	bool on_ready;
+	bool on_tx;
+
+	TAILQ_ENTRY(uring_conn) conns_next;
+	TAILQ_ENTRY(uring_conn) ready_next;
+	TAILQ_ENTRY(uring_conn) tx_next;
+};
+
+struct warppipe_uring {
+	int fd;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int to_submit;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_ptr;
+	size_t ring_size;
+	size_t sqes_size;
+
+	int listen_fd;
+	bool listen_armed;
+	bool listen_ready;
+
+	TAILQ_HEAD(, uring_conn) conns;
+	TAILQ_HEAD(, uring_conn) ready;
+	TAILQ_HEAD(, uring_conn) tx;
+
+	uint8_t bgid_used[URING_MAX_BGID / 8];
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_enter(struct warppipe_uring *ring, unsigned int wait_nr, int timeout_ms)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000L,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = (uint64_t)(uintptr_t)&ts,
+	};
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+	int ret;
+
+	if (!wait_nr && !ring->to_submit)
+		return 0;
+
+	ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr, flags,
+		      wait_nr ? &arg : NULL, sizeof(arg));
+	if (ret >= 0) {
+		ring->to_submit -= ret;
+	} else if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+		syslog(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* There is no SQ polling thread, so the kernel only looks at the queue in io_uring_enter
+ * and the entry may be published before it is filled in.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct warppipe_uring *ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		uring_enter(ring, 0, 0);
+		if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			syslog(LOG_ERR, "io_uring submission queue is full!");
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+
+	return sqe;
+}
+
+static inline uint64_t uring_user_data(struct uring_conn *conn, enum uring_op op)
+{
+	return (uint64_t)(uintptr_t)conn | op;
+}
+
+static void uring_arm_listen(struct warppipe_uring *ring)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ring->listen_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = uring_user_data(NULL, URING_OP_LISTEN);
+	ring->listen_armed = true;
+}
+
+static void uring_arm_recv(struct uring_conn *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->ring);
+
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = conn->bgid;
+	sqe->user_data = uring_user_data(conn, URING_OP_RECV);
+	conn->recv_armed = true;
+	conn->inflight++;
+}
+
+static void uring_arm_send(struct uring_conn *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->ring);
+	int cur = conn->tx_cur;
+
+	if (!sqe)
+		return;
+
+	/* MSG_WAITALL makes the kernel retry short sends, so one completion covers the whole batch */
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->fd;
+	sqe->addr = (uint64_t)(uintptr_t)conn->tx[cur];
+	sqe->len = conn->tx_len[cur];
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe->user_data = uring_user_data(conn, URING_OP_SEND);
+	conn->send_armed = true;
+	conn->inflight++;
+
+	/* gather the next batch in the other buffer */
+	conn->tx_cur ^= 1;
+	conn->tx_len[conn->tx_cur] = 0;
+}
+
+static void uring_buf_recycle(struct uring_conn *conn, uint16_t bid)
+{
+	struct io_uring_buf *buf = &conn->br->bufs[conn->br_tail & (CLIENT_URING_BUFS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(conn->bufs + bid * CLIENT_URING_BUF_SIZE);
+	buf->len = CLIENT_URING_BUF_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&conn->br->tail, ++conn->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_mark_ready(struct uring_conn *conn)
+{
+	if (conn->on_ready || !conn->node)
+		return;
+	TAILQ_INSERT_TAIL(&conn->ring->ready, conn, ready_next);
+	conn->on_ready = true;
+}
+
+/* The multishot receive stops when it runs out of buffers, post it again once some are back. */
+static void uring_conn_rearm(struct uring_conn *conn)
+{
+	if (!conn->recv_armed && !conn->hangup && conn->node && conn->stashed < CLIENT_URING_BUFS)
+		uring_arm_recv(conn);
+}
+
+static void uring_conn_free(struct uring_conn *conn)
+{
+	struct warppipe_uring *ring = conn->ring;
+	struct io_uring_buf_reg reg = {
+		.bgid = conn->bgid,
+	};
+
+	uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(conn->br, CLIENT_URING_BUFS * sizeof(struct io_uring_buf));
+	ring->bgid_used[conn->bgid / 8] &= ~(1 << (conn->bgid % 8));
+
+	TAILQ_REMOVE(&ring->conns, conn, conns_next);
+	free(conn->bufs);
+	free(conn->tx[0]);
+	free(conn->tx[1]);
+	free(conn);
+}
+
+static void uring_handle_recv(struct uring_conn *conn, const struct io_uring_cqe *cqe)
+{
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		conn->recv_armed = false;
+		conn->inflight--;
+	}
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (cqe->res > 0 && conn->node) {
+			conn->stash[conn->stashed].bid = bid;
+			conn->stash[conn->stashed].len = cqe->res;
+			conn->stashed++;
+		} else {
+			uring_buf_recycle(conn, bid);
+		}
+	}
+
+	if (cqe->res == 0) {
+		conn->hangup = true;
+	} else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		syslog(LOG_ERR, "Receiving: %s. Disconnecting.", strerror(-cqe->res));
+		conn->hangup = true;
+	}
+
+	uring_conn_rearm(conn);
+	uring_mark_ready(conn);
+}
+
+static void uring_handle_send(struct uring_conn *conn, const struct io_uring_cqe *cqe)
+{
+	conn->send_armed = false;
+	conn->inflight--;
+
+	if (cqe->res < 0 && cqe->res != -ECANCELED) {
+		syslog(LOG_ERR, "Sending transport packet: %s. Disconnecting.", strerror(-cqe->res));
+		conn->hangup = true;
+		uring_mark_ready(conn);
+		return;
+	}
+
+	if (conn->node && conn->tx_len[conn->tx_cur] && !conn->on_tx) {
+		TAILQ_INSERT_TAIL(&conn->ring->tx, conn, tx_next);
+		conn->on_tx = true;
+	}
+}
+
+static void uring_reap(struct warppipe_uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		struct uring_conn *conn = (void *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+		switch ((enum uring_op)(cqe->user_data & URING_OP_MASK)) {
+		case URING_OP_LISTEN:
+			ring->listen_ready = true;
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				ring->listen_armed = false;
+			break;
+		case URING_OP_RECV:
+			uring_handle_recv(conn, cqe);
+			break;
+		case URING_OP_SEND:
+			uring_handle_send(conn, cqe);
+			break;
+		case URING_OP_CANCEL:
+			/* the cancel of every request on destroy has no connection */
+			if (conn)
+				conn->inflight--;
+			break;
+		}
+
+		if (conn && !conn->node && !conn->inflight)
+			uring_conn_free(conn);
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	if (ring->listen_fd != -1 && !ring->listen_armed)
+		uring_arm_listen(ring);
+}
+
+void warppipe_uring_submit(struct warppipe_uring *ring)
+{
+	struct uring_conn *conn;
+
+	while ((conn = TAILQ_FIRST(&ring->tx)) != NULL) {
+		TAILQ_REMOVE(&ring->tx, conn, tx_next);
+		conn->on_tx = false;
+		if (!conn->send_armed && conn->tx_len[conn->tx_cur])
+			uring_arm_send(conn);
+	}
+
+	uring_enter(ring, 0, 0);
+}
+
+void warppipe_uring_wait(struct warppipe_uring *ring, int timeout_ms)
+{
+	warppipe_uring_submit(ring);
+
+	/* completions left over from the previous call are handled without blocking */
+	if (*ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		uring_enter(ring, 1, timeout_ms);
+
+	uring_reap(ring);
+}
+
+bool warppipe_uring_listen_ready(struct warppipe_uring *ring)
+{
+	bool ready = ring->listen_ready;
+
+	ring->listen_ready = false;
+	return ready;
+}
+
+struct warppipe_client_node *warppipe_uring_next_ready(struct warppipe_uring *ring)
+{
+	struct uring_conn *conn = TAILQ_FIRST(&ring->ready);
+
+	if (!conn)
+		return NULL;
+
+	TAILQ_REMOVE(&ring->ready, conn, ready_next);
+	conn->on_ready = false;
+	return conn->node;
+}
+
+void warppipe_uring_client_read(struct warppipe_client *client)
+{
+	struct uring_conn *conn = (struct uring_conn *)client->io;
+
+	while (client->active && conn->stashed)
+		warppipe_client_read(client);
+
+	if (conn->hangup && client->active) {
+		syslog(LOG_NOTICE, "Client disconnecting: graceful EOF.");
+		client->active = false;
+	}
+}
+
+/* Copy out of the received buffers, handing the consumed ones back to the kernel. */
+static ssize_t uring_conn_recv(struct warppipe_client_io *io, void *buf, size_t len)
+{
+	struct uring_conn *conn = (struct uring_conn *)io;
+	size_t copied = 0;
+
+	while (copied < len && conn->stashed) {
+		size_t n = conn->stash[0].len - conn->stash_off;
+
+		if (n > len - copied)
+			n = len - copied;
+		memcpy((uint8_t *)buf + copied, conn->bufs + conn->stash[0].bid * CLIENT_URING_BUF_SIZE + conn->stash_off, n);
+		copied += n;
+		conn->stash_off += n;
+
+		if (conn->stash_off == conn->stash[0].len) {
+			uring_buf_recycle(conn, conn->stash[0].bid);
+			conn->stashed--;
+			memmove(conn->stash, conn->stash + 1, conn->stashed * sizeof(conn->stash[0]));
+			conn->stash_off = 0;
+		}
+	}
+
+	if (copied) {
+		uring_conn_rearm(conn);
+		return copied;
+	}
+	if (conn->hangup)
+		return 0;
+	errno = EAGAIN;
+	return -1;
+}
+
+/* Wait for the batch being sent and start sending the gathered one, the caller blocks like on a socket. */
+static int uring_conn_flush(struct uring_conn *conn)
+{
+	struct warppipe_uring *ring = conn->ring;
+
+	while (conn->send_armed && !conn->hangup) {
+		if (uring_enter(ring, 1, 1000) == -1)
+			return -1;
+		uring_reap(ring);
+	}
+	if (conn->hangup) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	if (conn->on_tx) {
+		TAILQ_REMOVE(&ring->tx, conn, tx_next);
+		conn->on_tx = false;
+	}
+	uring_arm_send(conn);
+	if (!conn->send_armed) {
+		errno = EBUSY;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t uring_conn_send(struct warppipe_client_io *io, const void *buf, size_t len)
+{
+	struct uring_conn *conn = (struct uring_conn *)io;
+	int cur = conn->tx_cur;
+
+	/* the batch is as big as the socket path's one, push it out instead of growing it */
+	if (conn->tx_len[cur] && conn->tx_len[cur] + len > CLIENT_TX_BUFFER_SIZE) {
+		if (uring_conn_flush(conn) == -1)
+			return -1;
+		cur = conn->tx_cur;
+	}
+	if (len > CLIENT_TX_BUFFER_SIZE - conn->tx_len[cur])
+		len = CLIENT_TX_BUFFER_SIZE - conn->tx_len[cur];
+
+	if (conn->tx_len[cur] + len > conn->tx_cap[cur]) {
+		size_t cap = conn->tx_cap[cur] ? conn->tx_cap[cur] : CLIENT_BUFFER_SIZE;
+		uint8_t *tx;
+
+		while (cap < conn->tx_len[cur] + len)
+			cap *= 2;
+		if (cap > CLIENT_TX_BUFFER_SIZE)
+			cap = CLIENT_TX_BUFFER_SIZE;
+		tx = realloc(conn->tx[cur], cap);
+		if (!tx) {
+			errno = ENOMEM;
+			return -1;
+		}
+		conn->tx[cur] = tx;
+		conn->tx_cap[cur] = cap;
+	}
+
+	memcpy(conn->tx[cur] + conn->tx_len[cur], buf, len);
+	conn->tx_len[cur] += len;
+
+	if (!conn->on_tx && !conn->send_armed) {
+		TAILQ_INSERT_TAIL(&conn->ring->tx, conn, tx_next);
+		conn->on_tx = true;
+	}
+	return len;
+}
+
+static int uring_bgid_alloc(struct warppipe_uring *ring)
+{
+	for (int i = 0; i < URING_MAX_BGID; i++) {
+		if (!(ring->bgid_used[i / 8] & (1 << (i % 8)))) {
+			ring->bgid_used[i / 8] |= 1 << (i % 8);
+			return i;
+		}
+	}
+	return -1;
+}
+
+int warppipe_uring_add_client(struct warppipe_uring *ring, struct warppipe_client_node *node)
+{
+	struct io_uring_buf_reg reg = {
+		.ring_entries = CLIENT_URING_BUFS,
+	};
+	struct uring_conn *conn;
+	int bgid;
+
+	bgid = uring_bgid_alloc(ring);
+	if (bgid == -1) {
+		syslog(LOG_ERR, "Out of io_uring buffer groups!");
+		return -1;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		goto fail_bgid;
+
+	conn->bufs = malloc(CLIENT_URING_BUFS * CLIENT_URING_BUF_SIZE);
+	if (!conn->bufs)
+		goto fail_conn;
+
+	/* the buffer ring has to be page aligned */
+	conn->br = mmap(NULL, CLIENT_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (conn->br == MAP_FAILED)
+		goto fail_bufs;
+
+	reg.ring_addr = (uint64_t)(uintptr_t)conn->br;
+	reg.bgid = bgid;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		syslog(LOG_ERR, "Failed to register io_uring buffer ring: %s", strerror(errno));
+		goto fail_br;
+	}
+
+	conn->io.recv = uring_conn_recv;
+	conn->io.send = uring_conn_send;
+	conn->ring = ring;
+	conn->node = node;
+	conn->fd = node->client->fd;
+	conn->bgid = bgid;
+	for (int i = 0; i < CLIENT_URING_BUFS; i++)
+		uring_buf_recycle(conn, i);
+
+	TAILQ_INSERT_TAIL(&ring->conns, conn, conns_next);
+	node->client->io = &conn->io;
+	uring_arm_recv(conn);
+
+	return 0;
+
+fail_br:
+	munmap(conn->br, CLIENT_URING_BUFS * sizeof(struct io_uring_buf));
+fail_bufs:
+	free(conn->bufs);
+fail_conn:
+	free(conn);
+fail_bgid:
+	ring->bgid_used[bgid / 8] &= ~(1 << (bgid % 8));
+	return -1;
+}
+
+void warppipe_uring_remove_client(struct warppipe_uring *ring, struct warppipe_client *client)
+{
+	struct uring_conn *conn = (struct uring_conn *)client->io;
+	struct io_uring_sqe *sqe;
+
+	if (!conn)
+		return;
+
+	client->io = NULL;
+	conn->node = NULL;
+	if (conn->on_ready)
+		TAILQ_REMOVE(&ring->ready, conn, ready_next);
+	if (conn->on_tx)
+		TAILQ_REMOVE(&ring->tx, conn, tx_next);
+	conn->on_ready = false;
+	conn->on_tx = false;
+
+	if (!conn->inflight) {
+		uring_conn_free(conn);
+		return;
+	}
+
+	/* The requests hold a reference to the socket, cancel them before it is closed.
+	 * The connection is freed once the last of them completes.
+	 */
+	sqe = uring_get_sqe(ring);
+	if (!sqe) {
+		/* completions the kernel could not post keep the queue from draining, handle them and try again;
+		 * the extra reference keeps the connection while its own ones are reaped
+		 */
+		conn->inflight++;
+		uring_reap(ring);
+		if (!--conn->inflight) {
+			uring_conn_free(conn);
+			return;
+		}
+		sqe = uring_get_sqe(ring);
+	}
+	if (!sqe) {
+		/* the requests end with the socket instead and complete on their own */
+		shutdown(conn->fd, SHUT_RDWR);
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = conn->fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = uring_user_data(conn, URING_OP_CANCEL);
+	conn->inflight++;
+	uring_enter(ring, 0, 0);
+}
+
+/* Multishot receives do not have a feature bit, but came in the same release (6.0) as SEND_ZC. */
+static bool uring_supported(int fd)
+{
+	static const uint8_t required_ops[] = {
+		IORING_OP_POLL_ADD,
+		IORING_OP_RECV,
+		IORING_OP_SEND,
+		IORING_OP_ASYNC_CANCEL,
+		IORING_OP_SEND_ZC,
+	};
+	struct io_uring_probe *probe;
+	bool ret = true;
+
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return false;
+
+	if (uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+		ret = false;
+	} else {
+		for (size_t i = 0; i < sizeof(required_ops); i++) {
+			if (required_ops[i] > probe->last_op ||
+			    !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED))
+				ret = false;
+		}
+	}
+
+	free(probe);
+	return ret;
+}
+
+struct warppipe_uring *warppipe_uring_create(int listen_fd)
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = SERVER_URING_ENTRIES * 4,
+	};
+	struct warppipe_uring *ring;
+	size_t sq_size, cq_size;
+	uint8_t *ptr;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->fd = uring_setup(SERVER_URING_ENTRIES, &p);
+	if (ring->fd == -1) {
+		syslog(LOG_WARNING, "io_uring_setup: %s", strerror(errno));
+		goto fail;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		syslog(LOG_WARNING, "io_uring is missing required features: 0x%x", p.features);
+		goto fail_fd;
+	}
+
+	if (!uring_supported(ring->fd)) {
+		syslog(LOG_WARNING, "io_uring does not support multishot receives.");
+		goto fail_fd;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ring_ptr == MAP_FAILED)
+		goto fail_fd;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_ring;
+
+	ptr = ring->ring_ptr;
+	ring->sq_head = (unsigned int *)(ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(ptr + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(ptr + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_array = (unsigned int *)(ptr + p.sq_off.array);
+	ring->cq_head = (unsigned int *)(ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(ptr + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+
+	TAILQ_INIT(&ring->conns);
+	TAILQ_INIT(&ring->ready);
+	TAILQ_INIT(&ring->tx);
+
+	ring->listen_fd = listen_fd;
+	if (listen_fd != -1)
+		uring_arm_listen(ring);
+
+	syslog(LOG_NOTICE, "Using io_uring event loop.");
+	return ring;
+
+fail_ring:
+	munmap(ring->ring_ptr, ring->ring_size);
+fail_fd:
+	close(ring->fd);
+fail:
+	free(ring);
+	return NULL;
+}
+
+void warppipe_uring_destroy(struct warppipe_uring *ring)
+{
+	struct uring_conn *conn, *next;
+	struct io_uring_sqe *sqe;
+	bool cancelled = false;
+
+	ring->listen_fd = -1;
+	for (conn = TAILQ_FIRST(&ring->conns); conn; conn = next) {
+		next = TAILQ_NEXT(conn, conns_next);
+		if (conn->node)
+			conn->node->client->io = NULL;
+		conn->node = NULL;
+		if (!conn->inflight)
+			uring_conn_free(conn);
+	}
+
+	/* The kernel cancels requests asynchronously when the ring is closed and may still use
+	 * their buffers by then, so cancel them here and wait until every connection is idle.
+	 */
+	while (!TAILQ_EMPTY(&ring->conns) || ring->listen_armed) {
+		if (!cancelled) {
+			sqe = uring_get_sqe(ring);
+			if (sqe) {
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+				sqe->user_data = uring_user_data(NULL, URING_OP_CANCEL);
+				cancelled = true;
+			}
+		}
+		if (uring_enter(ring, 1, 1000) == -1)
+			break;
+		uring_reap(ring);
+	}
+
+	/* only left if io_uring_enter failed, the buffer rings are taken back from the kernel at least */
+	while ((conn = TAILQ_FIRST(&ring->conns)) != NULL)
+		uring_conn_free(conn);
+
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring_ptr, ring->ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+#endif /* WARPPIPE_HAVE_IO_URING */
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WARP_PIPE_URING_H
+#define WARP_PIPE_URING_H
+
+#include <stdbool.h>
+
+#include <warppipe/client.h>
+
+/* The engine needs multishot receives and provided buffer rings (Linux 6.0 uAPI),
+ * the running kernel is checked in warppipe_uring_create.
+ */
+#if defined(__linux__) && !defined(__ZEPHYR__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define WARPPIPE_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef WARPPIPE_HAVE_IO_URING
+
+struct warppipe_uring;
+
+/* Returns NULL if io_uring is not usable at runtime. listen_fd is -1 in client mode. */
+struct warppipe_uring *warppipe_uring_create(int listen_fd);
+void warppipe_uring_destroy(struct warppipe_uring *ring);
+
+/* Route the connection I/O through the ring, before anything is sent on it. */
+int warppipe_uring_add_client(struct warppipe_uring *ring, struct warppipe_client_node *node);
+/* Detach the connection, must be called before its socket is closed. */
+void warppipe_uring_remove_client(struct warppipe_uring *ring, struct warppipe_client *client);
+
+/* Submit queued sends, wait up to timeout_ms for completions and process them. */
+void warppipe_uring_wait(struct warppipe_uring *ring, int timeout_ms);
+/* Submit queued sends without waiting. */
+void warppipe_uring_submit(struct warppipe_uring *ring);
+
+/* Check (and clear) whether the listening socket has pending connections. */
+bool warppipe_uring_listen_ready(struct warppipe_uring *ring);
+/* Next connection with received data or a hangup, NULL if there are none left. */
+struct warppipe_client_node *warppipe_uring_next_ready(struct warppipe_uring *ring);
+/* Handle every complete packet received on the connection. */
+void warppipe_uring_client_read(struct warppipe_client *client);
+
+#endif /* WARPPIPE_HAVE_IO_URING */
+
+#endif /* WARP_PIPE_URING_H */
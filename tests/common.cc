@@ -15,8 +15,34 @@
  * limitations under the License.
  */
 
+#include <cstddef>
+
 #include "common.h"
 
 extern "C" {
 DEFINE_FFF_GLOBALS;
+
+unsigned long test_alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	test_alloc_count++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	test_alloc_count++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	test_alloc_count++;
+	return __real_realloc(ptr, size);
+}
 }
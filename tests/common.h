@@ -25,4 +25,7 @@
 
 #include <fff.h>
 
+/* number of malloc/calloc/realloc calls so far, counted by the linker wrappers in common.cc */
+extern "C" unsigned long test_alloc_count;
+
 #endif /* TESTS_COMMON_H */
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <poll.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "common.h"
+
+#include <warppipe/client.h>
+#include <warppipe/config.h>
+
+extern "C" {
+FAKE_VALUE_FUNC(int, poll, struct pollfd *, nfds_t, int);
+DECLARE_FAKE_VALUE_FUNC(int, recv, int, void *, size_t, int);
+DECLARE_FAKE_VALUE_FUNC(int, send, int, void *, size_t, int);
+}
+
+/* the client talks to itself: everything it sends comes back, it completes its own requests */
+class TestAsync : public ::testing::Test {
+public:
+	warppipe_client client = {};
+	std::vector<uint8_t> wire;
+	size_t wire_pos = 0;
+	int poll_timeout = 0;
+
+	virtual void SetUp() override {
+		RESET_FAKE(poll);
+		RESET_FAKE(recv);
+		RESET_FAKE(send);
+		send_fake.custom_fake = [this](int sockfd, void *msg, size_t len, int flags) {
+			wire.insert(wire.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+			return (int)len;
+		};
+		recv_fake.custom_fake = [this](int sockfd, void *msg, size_t len, int flags) {
+			len = std::min(len, wire.size() - wire_pos);
+			memcpy(msg, wire.data() + wire_pos, len);
+			wire_pos += len;
+			return (int)len;
+		};
+		poll_fake.custom_fake = [this](struct pollfd *fds, nfds_t nfds, int timeout) {
+			poll_timeout = timeout;
+			fds[0].revents = wire_pos < wire.size() ? POLLIN : 0;
+			return fds[0].revents ? 1 : 0;
+		};
+
+		warppipe_client_create(&client, 10);
+		warppipe_register_bar(&client, 0x1000, 0x1000, 0,
+			[](uint64_t addr, void *data, int length, void *private_data) {
+				for (int i = 0; i < length; i++)
+					((uint8_t *)data)[i] = addr + i;
+				return 0;
+			},
+			[](uint64_t addr, const void *data, int length, void *private_data) {
+			});
+		client.write_sg_threshold = 0;
+	}
+
+	virtual void TearDown() override {
+		warppipe_client_destroy(&client);
+	}
+
+	/* reap events until count arrived */
+	std::vector<warppipe_event> reap(size_t count)
+	{
+		std::vector<warppipe_event> events;
+		warppipe_event buf[8];
+
+		for (int i = 0; i < 100 && events.size() < count; i++) {
+			int n = warppipe_poll_completions(&client, buf, 8, 0);
+
+			EXPECT_GE(n, 0);
+			events.insert(events.end(), buf, buf + std::max(n, 0));
+		}
+		return events;
+	}
+};
+
+TEST_F(TestAsync, SubmitsInOneSendAndReaps) {
+	uint8_t a[8], b[300], c[4];
+	const uint8_t w[16] = {1, 2, 3};
+	const warppipe_op ops[] = {
+		{ WARPPIPE_OP_READ, 0, 0x10, a, sizeof(a), &a },
+		{ WARPPIPE_OP_WRITE, 0, 0x40, (void *)w, sizeof(w), (void *)&w },
+		{ WARPPIPE_OP_READ, 0, 0x70, b, sizeof(b), &b },
+		{ WARPPIPE_OP_READ, 0, 0x200, c, sizeof(c), &c },
+	};
+
+	client.mrrs = 128;
+	ASSERT_EQ(warppipe_submit(&client, ops, 4), 4);
+	ASSERT_EQ(send_fake.call_count, 1);
+
+	auto events = reap(4);
+
+	ASSERT_EQ(events.size(), 4);
+	/* the write is done once sent */
+	ASSERT_EQ(events[0].user_data, (void *)&w);
+	ASSERT_EQ(events[0].length, sizeof(w));
+
+	for (auto &e : events)
+		ASSERT_EQ(e.error_code, 0);
+	ASSERT_NE(std::find_if(events.begin(), events.end(), [&](auto &e) {
+		return e.user_data == &b && e.length == sizeof(b);
+	}), events.end());
+	ASSERT_EQ(a[7], 0x17);
+	ASSERT_EQ(b[0], 0x70);
+	ASSERT_EQ(b[299], (uint8_t)(0x70 + 299));
+	ASSERT_EQ(c[3], 0x03);
+
+	/* nothing left */
+	ASSERT_EQ(warppipe_poll_completions(&client, events.data(), 1, 0), 0);
+}
+
+TEST_F(TestAsync, SubmitStopsWithoutTags) {
+	uint8_t buf[6][4];
+	warppipe_op ops[6];
+
+	for (int i = 0; i < 6; i++)
+		ops[i] = { WARPPIPE_OP_READ, 0, (uint64_t)i * 4, buf[i], 4, buf[i] };
+
+	client.max_tags = 4;
+	ASSERT_EQ(warppipe_submit(&client, ops, 6), 4);
+	ASSERT_EQ(reap(4).size(), 4);
+	ASSERT_EQ(warppipe_submit(&client, ops + 4, 2), 2);
+	ASSERT_EQ(reap(2).size(), 2);
+	ASSERT_EQ(buf[5][0], 20);
+}
+
+TEST_F(TestAsync, SubmitFails) {
+	const warppipe_op op = { WARPPIPE_OP_READ, 3, 0x0, NULL, 4, NULL };
+
+	/* BAR 3 is not registered */
+	ASSERT_EQ(warppipe_submit(&client, &op, 1), -1);
+	ASSERT_EQ(send_fake.call_count, 0);
+}
+
+TEST_F(TestAsync, PollTimesOut) {
+	uint8_t buf[4];
+	const warppipe_op op = { WARPPIPE_OP_READ, 0, 0x0, buf, 4, NULL };
+	warppipe_event event;
+
+	ASSERT_EQ(warppipe_submit(&client, &op, 1), 1);
+	/* the request is lost */
+	wire.clear();
+
+	ASSERT_EQ(warppipe_poll_completions(&client, &event, 1, 5), 0);
+	ASSERT_GE(poll_fake.call_count, 1);
+	ASSERT_LE(poll_timeout, 5);
+
+	/* the connection goes away, pending reads fail */
+	warppipe_client_destroy(&client);
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "common.h"
+
+#include <warppipe/capture.h>
+#include <warppipe/client.h>
+#include <warppipe/config.h>
+#include <warppipe/proto.h>
+
+extern "C" {
+DECLARE_FAKE_VALUE_FUNC(int, recv, int, void *, size_t, int);
+DECLARE_FAKE_VALUE_FUNC(int, send, int, void *, size_t, int);
+}
+
+/* <sys/socket.h> conflicts with the fakes */
+extern "C" int socketpair(int domain, int type, int protocol, int sv[2]);
+constexpr int TEST_AF_UNIX = 1;
+constexpr int TEST_SOCK_STREAM = 1;
+
+static uint8_t capture_bar[0x100];
+
+struct capture_packet {
+	uint32_t flags;
+	uint32_t origlen;
+	std::vector<uint8_t> data;
+};
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/* parse a pcapng file written by the capture, checking its section and interface blocks */
+static std::vector<capture_packet> read_capture(const std::string &path, uint32_t snaplen)
+{
+	std::ifstream file(path, std::ios::binary);
+	std::vector<uint8_t> buf((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::vector<capture_packet> packets;
+
+	EXPECT_GE(buf.size(), 28u + 20u);
+	if (buf.size() < 48)
+		return packets;
+	EXPECT_EQ(le32(&buf[0]), 0x0a0d0d0au);
+	EXPECT_EQ(le32(&buf[8]), 0x1a2b3c4du);
+	EXPECT_EQ(le32(&buf[28]), 1u);
+	EXPECT_EQ(buf[36], 101);	/* LINKTYPE_RAW */
+	EXPECT_EQ(le32(&buf[40]), snaplen);
+
+	for (size_t off = 48; off + 12 <= buf.size();) {
+		uint32_t length = le32(&buf[off + 4]);
+
+		EXPECT_EQ(le32(&buf[off]), 6u);
+		EXPECT_LE(off + length, buf.size());
+		if (off + length > buf.size())
+			break;
+
+		capture_packet pkt;
+		uint32_t caplen = le32(&buf[off + 20]);
+		const uint8_t *opt = &buf[off + 28 + ((caplen + 3) & ~3u)];
+
+		pkt.origlen = le32(&buf[off + 24]);
+		pkt.data.assign(&buf[off + 28], &buf[off + 28 + caplen]);
+		EXPECT_EQ(opt[0], 2);	/* epb_flags */
+		pkt.flags = le32(opt + 4);
+		EXPECT_EQ(le32(&buf[off + length - 4]), length);
+		packets.push_back(pkt);
+		off += length;
+	}
+	return packets;
+}
+
+/* the client talks to itself over a socketpair */
+class TestCapture : public ::testing::Test {
+public:
+	warppipe_client client = {};
+	int sv[2];
+	std::string path;
+
+	virtual void SetUp() override {
+		ASSERT_EQ(socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, sv), 0);
+
+		RESET_FAKE(recv);
+		RESET_FAKE(send);
+		send_fake.custom_fake = [this](int fd, void *buf, size_t len, int) {
+			return (int)write(sv[1], buf, len);
+		};
+		recv_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+			return (int)read(fd, buf, len);
+		};
+
+		warppipe_client_create(&client, sv[0]);
+		warppipe_register_bar(&client, 0x10000, sizeof(capture_bar), 0,
+			[](uint64_t addr, void *data, int length, void *private_data) {
+				memcpy(data, capture_bar + addr, length);
+				return 0;
+			},
+			[](uint64_t addr, const void *data, int length, void *private_data) {
+				memcpy(capture_bar + addr, data, length);
+			});
+
+		path = "/tmp/warppipe-capture-" + std::to_string(getpid()) + ".pcapng";
+	}
+
+	virtual void TearDown() override {
+		warppipe_capture_stop();
+		warppipe_client_destroy(&client);
+		unlink(path.c_str());
+		for (int i = 0; i < 4; i++)
+			unlink((path + "." + std::to_string(i)).c_str());
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	/* write to the own BAR and handle the request that comes back */
+	void write_and_receive(const void *data, int length) {
+		ASSERT_EQ(warppipe_write(&client, 0, 0, data, length), 0);
+		ASSERT_EQ(warppipe_client_flush(&client), 0);
+		warppipe_client_read(&client);
+	}
+};
+
+TEST_F(TestCapture, WriteAndReceive) {
+	uint8_t data[16];
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 0xa0 + i;
+
+	ASSERT_EQ(warppipe_capture_start(path.c_str(), 0, 0, 0), 0);
+	EXPECT_TRUE(warppipe_capture_enabled());
+	write_and_receive(data, sizeof(data));
+	warppipe_capture_stop();
+	EXPECT_FALSE(warppipe_capture_enabled());
+	EXPECT_EQ(memcmp(capture_bar, data, sizeof(data)), 0);
+
+	auto packets = read_capture(path, 40 + CLIENT_BUFFER_SIZE);
+
+	ASSERT_EQ(packets.size(), 2u);
+	EXPECT_EQ(packets[0].flags, 2u);	/* outbound */
+	EXPECT_EQ(packets[1].flags, 1u);	/* inbound */
+	for (auto &pkt : packets) {
+		ASSERT_GT(pkt.data.size(), 40u);
+		EXPECT_EQ(pkt.origlen, pkt.data.size());
+		EXPECT_EQ(pkt.data[0], 0x45);
+		EXPECT_EQ(be16(&pkt.data[2]), pkt.origlen);
+		EXPECT_EQ(pkt.data[9], 6);
+		EXPECT_EQ(pkt.data[40], PCIE_PROTO_TLP);
+	}
+	/* the same packet, both ways of the same connection */
+	EXPECT_TRUE(std::equal(packets[0].data.begin() + 40, packets[0].data.end(), packets[1].data.begin() + 40));
+	EXPECT_EQ(be16(&packets[0].data[20]), CAPTURE_TCP_PORT);
+	EXPECT_EQ(be16(&packets[1].data[22]), CAPTURE_TCP_PORT);
+	EXPECT_EQ(be16(&packets[0].data[22]), be16(&packets[1].data[20]));
+	/* the payload is at the end of the memory write */
+	EXPECT_NE(std::search(packets[0].data.begin() + 40, packets[0].data.end(), data, data + sizeof(data)),
+		  packets[0].data.end());
+}
+
+TEST_F(TestCapture, Snaplen) {
+	uint8_t data[64] = {};
+
+	ASSERT_EQ(warppipe_capture_start(path.c_str(), 48, 0, 0), 0);
+	write_and_receive(data, sizeof(data));
+	warppipe_capture_stop();
+
+	auto packets = read_capture(path, 48);
+
+	ASSERT_EQ(packets.size(), 2u);
+	for (auto &pkt : packets) {
+		EXPECT_EQ(pkt.data.size(), 48u);
+		EXPECT_GT(pkt.origlen, 40u + sizeof(data));
+		EXPECT_EQ(pkt.data[40], PCIE_PROTO_TLP);
+	}
+}
+
+TEST_F(TestCapture, Disable) {
+	uint8_t data[4] = {};
+
+	ASSERT_EQ(warppipe_capture_start(path.c_str(), 0, 0, 0), 0);
+	warppipe_capture_enable(false);
+	EXPECT_FALSE(warppipe_capture_enabled());
+	write_and_receive(data, sizeof(data));
+	warppipe_capture_enable(true);
+	write_and_receive(data, sizeof(data));
+	warppipe_capture_stop();
+
+	auto packets = read_capture(path, 40 + CLIENT_BUFFER_SIZE);
+	std::vector<capture_packet> tlps;
+
+	/* the second write goes out after the Ack of the first request */
+	std::copy_if(packets.begin(), packets.end(), std::back_inserter(tlps),
+		     [](const capture_packet &pkt) { return pkt.data[40] == PCIE_PROTO_TLP; });
+	ASSERT_EQ(tlps.size(), 2u);
+	EXPECT_EQ(tlps[0].flags, 2u);
+	EXPECT_EQ(tlps[1].flags, 1u);
+	EXPECT_EQ(warppipe_capture_dropped(), 0u);
+
+	/* nothing to enable without a running capture */
+	warppipe_capture_enable(true);
+	EXPECT_FALSE(warppipe_capture_enabled());
+}
+
+TEST_F(TestCapture, Rotation) {
+	uint8_t data[4] = {};
+
+	/* a file per packet, the last one kept */
+	ASSERT_EQ(warppipe_capture_start(path.c_str(), 0, 1, 1), 0);
+	EXPECT_EQ(warppipe_capture_start(path.c_str(), 0, 0, 0), -1);
+	write_and_receive(data, sizeof(data));
+	warppipe_capture_stop();
+
+	EXPECT_NE(access((path + ".0").c_str(), F_OK), 0);
+
+	auto packets = read_capture(path + ".1", 40 + CLIENT_BUFFER_SIZE);
+
+	ASSERT_EQ(packets.size(), 1u);
+	EXPECT_EQ(packets[0].flags, 1u);
+}
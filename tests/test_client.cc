@@ -18,6 +18,7 @@
 #include <array>
 #include <algorithm>
 #include <numeric>
+#include <vector>
 
 #include <gtest/gtest.h>
 #include "common.h"
@@ -49,7 +50,26 @@ public:
 	xport *const tport_request;
 	xport *const tport_request2;
 
-	warppipe_client client;
+	warppipe_client client = {};
+
+	/* bytes returned by recv() through recv_stream() */
+	std::vector<uint8_t> rx_stream;
+	size_t rx_pos = 0;
+
+	void push_rx(const void *data, size_t len)
+	{
+		const uint8_t *p = (const uint8_t *)data;
+
+		rx_stream.insert(rx_stream.end(), p, p + len);
+	}
+
+	int recv_stream(void *msg, size_t len)
+	{
+		len = std::min(len, rx_stream.size() - rx_pos);
+		memcpy(msg, rx_stream.data() + rx_pos, len);
+		rx_pos += len;
+		return len;
+	}
 
 	TestClient()
 	: tport_out((xport *)tport_req_buf), tport_response((xport *)tport_rsp_buf),
@@ -69,6 +89,9 @@ public:
 
 	}
 	virtual void TearDown() override {
+		/* only the tests that created it */
+		if (client.fc_tail)
+			warppipe_client_destroy(&client);
 	}
 };
 
@@ -135,9 +158,62 @@ TEST_F(TestClient, ClientAckFailsErrno) {
 	ASSERT_FALSE(client.active);
 }
 
+TEST_F(TestClient, ClientFlushesBatch) {
+	std::vector<uint8_t> sent;
+
+	RESET_FAKE(send);
+	/* the socket takes at most 5 bytes at a time */
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		len = std::min<size_t>(len, 5);
+		sent.insert(sent.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return len;
+	};
+
+	warppipe_client_create(&client, 10);
+	client.tx_batch = true;
+	warppipe_ack(&client, PCIE_DLLP_ACK, 1);
+	warppipe_ack(&client, PCIE_DLLP_NAK, 2);
+
+	ASSERT_EQ(send_fake.call_count, 0);
+	ASSERT_EQ(client.tx_len, 2 * (1 + sizeof(pcie_dllp)));
+
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(client.tx_len, 0);
+	ASSERT_EQ(sent.size(), 2 * (1 + sizeof(pcie_dllp)));
+	ASSERT_EQ(((xport *)sent.data())->t_dllp.dl_type, PCIE_DLLP_ACK);
+	ASSERT_EQ(((xport *)(sent.data() + 1 + sizeof(pcie_dllp)))->t_dllp.dl_type, PCIE_DLLP_NAK);
+
+	/* nothing left to send */
+	unsigned int calls = send_fake.call_count;
+
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+	ASSERT_EQ(send_fake.call_count, calls);
+}
+
+TEST_F(TestClient, ClientFlushFails) {
+	RESET_FAKE(send);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		errno = EPIPE;
+		return -1;
+	};
+
+	warppipe_client_create(&client, 10);
+	client.tx_batch = true;
+	warppipe_ack(&client, PCIE_DLLP_ACK, 1);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(warppipe_client_flush(&client), -1);
+	ASSERT_FALSE(client.active);
+	ASSERT_EQ(client.tx_len, 0);
+}
+
 TEST_F(TestClient, ClientReadFails) {
 	RESET_FAKE(recv);
-	recv_fake.return_val = sizeof(pcie_dllp) + 100;
+	recv_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		errno = ECONNRESET;
+		return -1;
+	};
 
 	warppipe_client_create(&client, 10);
 	warppipe_client_read(&client);
@@ -145,78 +221,85 @@ TEST_F(TestClient, ClientReadFails) {
 	ASSERT_FALSE(client.active);
 }
 
+TEST_F(TestClient, ClientReadWouldBlock) {
+	RESET_FAKE(recv);
+	recv_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		errno = EAGAIN;
+		return -1;
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+}
+
 TEST_F(TestClient, ClientReadDLLP) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_DLLP;
 	tport_out->t_dllp.dl_type = PCIE_DLLP_ACK;
 	pcie_lcrc32(&tport_out->t_tlp);
 
 	RESET_FAKE(recv);
 	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
-		memcpy(msg, tport_out, len);
-		total_sent += len;
-		return len;
+		return recv_stream(msg, len);
 	};
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
 	warppipe_client_read(&client);
 
 	ASSERT_TRUE(client.active);
+	ASSERT_EQ(rx_pos, 1 + sizeof(pcie_dllp));
 }
 
 TEST_F(TestClient, ClientReadTLPEmpty) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_TLP;
 	pcie_lcrc32(&tport_out->t_tlp);
 
 	RESET_FAKE(recv);
 	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
-		memcpy(msg, tport_out, len);
-		total_sent += len;
-		return len;
+		return recv_stream(msg, len);
 	};
 
+	/* only the header arrives before the peer hangs up */
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
 	warppipe_client_read(&client);
+	ASSERT_TRUE(client.active);
 
+	warppipe_client_read(&client);
 	ASSERT_FALSE(client.active);
 }
 
 TEST_F(TestClient, ClientReadTLPTotalLengthNegative) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_TLP;
 	tport_out->t_tlp.dl_tlp.tlp_fmt = 4; // undefined format
 	pcie_lcrc32(&tport_out->t_tlp);
 
 	RESET_FAKE(recv);
 	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
-		memcpy(msg, tport_out, len);
-		total_sent += len;
-		return len;
+		return recv_stream(msg, len);
 	};
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
 	warppipe_client_read(&client);
 
 	ASSERT_FALSE(client.active);
 }
 
 TEST_F(TestClient, ClientReadTLPTotalRecvFail) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_TLP;
 	tport_out->t_tlp.dl_tlp.tlp_fmt = 0;
 	pcie_lcrc32(&tport_out->t_tlp);
 
 	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes [2] = {
 		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_out, len);
-			total_sent += len;
-			return len;
+			return recv_stream(msg, 1 + sizeof(pcie_dllp));
 		},
 		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_out + total_sent, len);
-			total_sent += len;
-			return len;
+			errno = ECONNRESET;
+			return -1;
 		}
 	};
 
@@ -224,159 +307,109 @@ TEST_F(TestClient, ClientReadTLPTotalRecvFail) {
 	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes, 2);
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
 	warppipe_client_read(&client);
+	ASSERT_TRUE(client.active);
 
+	warppipe_client_read(&client);
 	ASSERT_FALSE(client.active);
 }
 
 TEST_F(TestClient, ClientReadTLPIOWR) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_TLP;
 	tport_out->t_tlp.dl_tlp.tlp_fmt = 1;
 	tport_out->t_tlp.dl_tlp.tlp_type = 2;
 	pcie_lcrc32(&tport_out->t_tlp);
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes [2] = {
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_out, len);
-			total_sent += len;
-			return len;
-		},
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_out + total_sent, len);
-			total_sent += len;
-			return len;
-		}
-	};
-
 	RESET_FAKE(recv);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 	RESET_FAKE(send);
 	send_fake.return_val = sizeof(pcie_dllp) + 1;
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes, 2);
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
 	warppipe_client_read(&client);
 
 	ASSERT_TRUE(client.active);
+	ASSERT_EQ(recv_fake.call_count, 1);
 }
 
 TEST_F(TestClient, ClientReadTLPCPL) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_TLP;
 	tport_out->t_tlp.dl_tlp.tlp_fmt = 0;
 	tport_out->t_tlp.dl_tlp.tlp_type = 10;
 	pcie_lcrc32(&tport_out->t_tlp);
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes [2] = {
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_out, len);
-			total_sent += len;
-			return len;
-		},
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_out + total_sent, len);
-			total_sent += len;
-			return len;
-		}
-	};
-
 	RESET_FAKE(recv);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 	RESET_FAKE(send);
 	send_fake.return_val = sizeof(pcie_dllp) + 1;
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes, 2);
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
 	warppipe_client_read(&client);
 
 	ASSERT_TRUE(client.active);
+	ASSERT_EQ(recv_fake.call_count, 1);
 }
 
 TEST_F(TestClient, ClientReadTLPMRDLK32) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_TLP;
 	tport_out->t_tlp.dl_tlp.tlp_fmt = 0;
 	tport_out->t_tlp.dl_tlp.tlp_type = 1;
 	pcie_lcrc32(&tport_out->t_tlp);
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes [2] = {
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_out, len);
-			total_sent += len;
-			return len;
-		},
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_out + total_sent, len);
-			total_sent += len;
-			return len;
-		}
-	};
-
 	RESET_FAKE(recv);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 	RESET_FAKE(send);
 	send_fake.return_val = sizeof(pcie_dllp) + 1;
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes, 2);
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
 	warppipe_client_read(&client);
 
 	ASSERT_TRUE(client.active);
+	ASSERT_EQ(recv_fake.call_count, 1);
 }
 
 TEST_F(TestClient, ClientReadTLPCPLFail) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_TLP;
 	tport_out->t_tlp.dl_tlp.tlp_fmt = 0;
 	tport_out->t_tlp.dl_tlp.tlp_type = 2;
+	tport_out->t_tlp.dl_seqno_lo = 1;
 	pcie_lcrc32(&tport_out->t_tlp);
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes [2] = {
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_out, len);
-			total_sent += len;
-			return len;
-		},
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_out + total_sent, len);
-			total_sent += len;
-			return len;
-		}
-	};
-
 	int custom_send_fake_return_vals[3] = {sizeof(pcie_dllp) + 1, 15, -1};
 
 	RESET_FAKE(recv);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 	RESET_FAKE(send);
 	SET_RETURN_SEQ(send, custom_send_fake_return_vals, 3);
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes, 2);
 
 	warppipe_client_create(&client, 10);
 	int rc = warppipe_register_bar(&client, 0x0, 1024, 0, [](uint64_t addr, void *data, int length, void *private_data) { return 0; }, NULL);
 	ASSERT_EQ(rc, 0);
+	push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
 	warppipe_client_read(&client);
 
-	EXPECT_EQ(total_sent, 19);
+	EXPECT_EQ(rx_pos, 19);
 
 	ASSERT_FALSE(client.active);
 }
 
 TEST_F(TestClient, ClientReadTLPCPLCRCFail) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_TLP;
 	tport_out->t_tlp.dl_tlp.tlp_fmt = 0;
 	tport_out->t_tlp.dl_tlp.tlp_type = 2;
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes_recv [2] = {
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_out, len);
-			total_sent += len;
-			return len;
-		},
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)&tport_out + total_sent, len);
-			total_sent += len;
-			return len;
-		}
-	};
 	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes_send [1] = {
 		[&](int sockfd, void *msg, size_t len, int flags) -> int {
 			memcpy(tport_response, msg, len);
@@ -385,11 +418,14 @@ TEST_F(TestClient, ClientReadTLPCPLCRCFail) {
 	};
 
 	RESET_FAKE(recv);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 	RESET_FAKE(send);
 	SET_CUSTOM_FAKE_SEQ(send, custom_fakes_send, 1);
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes_recv, 2);
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
 	warppipe_client_read(&client);
 
 	EXPECT_EQ(tport_response->t_proto, PCIE_PROTO_DLLP);
@@ -398,83 +434,59 @@ TEST_F(TestClient, ClientReadTLPCPLCRCFail) {
 }
 
 TEST_F(TestClient, ClientReadCreditDLL) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_DLLP;
 	tport_out->t_dllp.dl_fc.fc_type = 1;
 	tport_out->t_dllp.dl_fc.fc_rsvd1 = 0;
 	pcie_crc16(&tport_out->t_dllp);
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes [2] = {
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_out, len);
-			total_sent += len;
-			return len;
-		},
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_out + total_sent, len);
-			total_sent += len;
-			return len;
-		}
-	};
-
 	int custom_send_fake_return_vals[3] = {sizeof(pcie_dllp) + 1, 15, 1};
 
 	RESET_FAKE(recv);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 	RESET_FAKE(send);
 	SET_RETURN_SEQ(send, custom_send_fake_return_vals, 3);
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes, 2);
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
 	warppipe_client_read(&client);
 
 	ASSERT_TRUE(client.active);
 }
 
 TEST_F(TestClient, ClientReadUnknownDLL) {
-	int total_sent = 0;
 	tport_out->t_proto = PCIE_PROTO_DLLP;
 	tport_out->t_dllp.dl_fc.fc_type = 0;
 	tport_out->t_dllp.dl_fc.fc_rsvd1 = 0;
 	pcie_crc16(&tport_out->t_dllp);
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes [2] = {
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_out, len);
-			total_sent += len;
-			return len;
-		},
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_out + total_sent, len);
-			total_sent += len;
-			return len;
-		}
-	};
-
 	int custom_send_fake_return_vals[3] = {sizeof(pcie_dllp) + 1, 15, 1};
 
 	RESET_FAKE(recv);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 	RESET_FAKE(send);
 	SET_RETURN_SEQ(send, custom_send_fake_return_vals, 3);
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes, 2);
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
 	warppipe_client_read(&client);
 
 	ASSERT_TRUE(client.active);
 }
 
 TEST_F(TestClient, ClientReadUnknown) {
-	int total_sent = 0;
 	tport_out->t_proto = 111;
 
 	RESET_FAKE(recv);
 	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
-		memcpy(msg, tport_out, len);
-		total_sent += len;
-		return len;
+		return recv_stream(msg, len);
 	};
 
 	warppipe_client_create(&client, 10);
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
 	warppipe_client_read(&client);
 
 	ASSERT_FALSE(client.active);
@@ -482,8 +494,6 @@ TEST_F(TestClient, ClientReadUnknown) {
 
 TEST_F(TestClient, ClientPcieRead) {
 	int tport_request_recv = 0;
-	int tport_response_send = 0;
-	int total_sent2 = 0;
 	int total_sent_rec = 0;
 
 	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes_send [4] = {
@@ -509,39 +519,17 @@ TEST_F(TestClient, ClientPcieRead) {
 		},
 	};
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes_recv [4] = {
-		// request
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_request, len);
-			tport_response_send += len;
-			return len;
-		},
-		// request part 2
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_request + tport_response_send, len);
-			tport_response_send += len;
-			return len;
-		},
-		// completion
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_request2, len);
-			total_sent2 += len;
-			return len;
-		},
-		// completion part 2
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_request2 + total_sent2, len);
-			total_sent2 += len;
-			return len;
-		}
-	};
 
 	RESET_FAKE(recv);
 	RESET_FAKE(send);
 	SET_CUSTOM_FAKE_SEQ(send, custom_fakes_send, 4);
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes_recv, 4);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 
 	warppipe_client_create(&client, 10);
+	/* acknowledge every TLP */
+	client.ack_factor = 1;
 	int rc = warppipe_register_bar(&client, 0x1000, 1024, 0, [](uint64_t addr, void *data, int length, void *private_data)
 	{
 		uint8_t *result = (uint8_t*)data;
@@ -576,10 +564,11 @@ TEST_F(TestClient, ClientPcieRead) {
 	ASSERT_EQ(send_fake.call_count, 1);
 	ASSERT_EQ(recv_fake.call_count, 0);
 
+	push_rx(tport_request, tport_request_recv);
 	warppipe_client_read(&client); //request
 
 	ASSERT_EQ(send_fake.call_count, 3);
-	ASSERT_EQ(recv_fake.call_count, 2);
+	ASSERT_EQ(recv_fake.call_count, 1);
 	ASSERT_EQ(tport_request2->t_proto, PCIE_PROTO_TLP);
 	ASSERT_EQ(tport_request2->t_tlp.dl_tlp.tlp_fmt, PCIE_TLP_CPLD >> 5);
 	ASSERT_EQ(tport_request2->t_tlp.dl_tlp.tlp_type, PCIE_TLP_CPLD & 0x1F);
@@ -589,19 +578,18 @@ TEST_F(TestClient, ClientPcieRead) {
 
 	ASSERT_TRUE(pcie_lcrc32_valid(&tport_request2->t_tlp));
 
+	push_rx(tport_request2, total_sent_rec);
 	warppipe_client_read(&client); //response
 
 	ASSERT_TRUE(client.active);
 
 	ASSERT_EQ(send_fake.call_count, 4);
-	ASSERT_EQ(recv_fake.call_count, 4);
+	ASSERT_EQ(recv_fake.call_count, 2);
 }
 
 TEST_F(TestClient, ClientPcieSmallRead) {
 	int tport_request_recv = 0;
 	int read_size = 1;
-	int tport_response_send = 0;
-	int total_sent2 = 0;
 	int total_sent_rec = 0;
 
 	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes_send [4] = {
@@ -627,39 +615,16 @@ TEST_F(TestClient, ClientPcieSmallRead) {
 		},
 	};
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes_recv [4] = {
-		// request
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_request, len);
-			tport_response_send += len;
-			return len;
-		},
-		// request part 2
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_request + tport_response_send, len);
-			tport_response_send += len;
-			return len;
-		},
-		// completion
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_request2, len);
-			total_sent2 += len;
-			return len;
-		},
-		// completion part 2
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_request2 + total_sent2, len);
-			total_sent2 += len;
-			return len;
-		}
-	};
 
 	RESET_FAKE(recv);
 	RESET_FAKE(send);
 	SET_CUSTOM_FAKE_SEQ(send, custom_fakes_send, 4);
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes_recv, 4);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 
 	warppipe_client_create(&client, 10);
+	client.ack_factor = 1;
 	int rc_bar = warppipe_register_bar(&client, 0x1000, 1024, 0, [](uint64_t addr, void *data, int length, void *private_data)
 	{
 		uint8_t *result = (uint8_t*)data;
@@ -693,10 +658,11 @@ TEST_F(TestClient, ClientPcieSmallRead) {
 	ASSERT_EQ(send_fake.call_count, 1);
 	ASSERT_EQ(recv_fake.call_count, 0);
 
+	push_rx(tport_request, tport_request_recv);
 	warppipe_client_read(&client); //request
 
 	ASSERT_EQ(send_fake.call_count, 3);
-	ASSERT_EQ(recv_fake.call_count, 2);
+	ASSERT_EQ(recv_fake.call_count, 1);
 	ASSERT_EQ(tport_request2->t_proto, PCIE_PROTO_TLP);
 	ASSERT_EQ(tport_request2->t_tlp.dl_tlp.tlp_fmt, PCIE_TLP_CPLD >> 5);
 	ASSERT_EQ(tport_request2->t_tlp.dl_tlp.tlp_type, PCIE_TLP_CPLD & 0x1F);
@@ -706,21 +672,23 @@ TEST_F(TestClient, ClientPcieSmallRead) {
 
 	ASSERT_TRUE(pcie_lcrc32_valid(&tport_request2->t_tlp));
 
+	push_rx(tport_request2, total_sent_rec);
 	warppipe_client_read(&client); //response
 
 	ASSERT_TRUE(client.active);
 
 	ASSERT_EQ(send_fake.call_count, 4);
-	ASSERT_EQ(recv_fake.call_count, 4);
+	ASSERT_EQ(recv_fake.call_count, 2);
 }
 
 TEST_F(TestClient, ClientPcieWrite) {
-	int tport_response_send = 0;
+	int tport_request_recv = 0;
 
 	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes_send [2] = {
 		// request
 		[&](int sockfd, void *msg, size_t len, int flags) -> int {
 			memcpy(tport_request, msg, len);
+			tport_request_recv += len;
 			return len;
 		},
 		// ACK/NACK
@@ -729,27 +697,16 @@ TEST_F(TestClient, ClientPcieWrite) {
 		},
 	};
 
-	std::function<int(int sockfd, void *msg, size_t len, int flags)> custom_fakes_recv [2] = {
-		// request
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, tport_request, len);
-			tport_response_send += len;
-			return len;
-		},
-		// request part 2
-		[&](int sockfd, void *msg, size_t len, int flags) -> int {
-			memcpy(msg, (uint8_t*)tport_request + tport_response_send, len);
-			tport_response_send += len;
-			return len;
-		},
-	};
 
 	RESET_FAKE(recv);
 	RESET_FAKE(send);
 	SET_CUSTOM_FAKE_SEQ(send, custom_fakes_send, 2);
-	SET_CUSTOM_FAKE_SEQ(recv, custom_fakes_recv, 2);
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
 
 	warppipe_client_create(&client, 10);
+	client.ack_factor = 1;
 	int rc_bar = warppipe_register_bar(&client, 0x1000, 1024, 0, NULL, [](uint64_t addr, const void *data, int length, void *private_data)
 	{
 		ASSERT_EQ(length, WD_SIZE);
@@ -774,12 +731,13 @@ TEST_F(TestClient, ClientPcieWrite) {
 	ASSERT_EQ(send_fake.call_count, 1);
 	ASSERT_EQ(recv_fake.call_count, 0);
 
+	push_rx(tport_request, tport_request_recv);
 	warppipe_client_read(&client); //request
 
 	ASSERT_TRUE(client.active);
 
 	ASSERT_EQ(send_fake.call_count, 2);
-	ASSERT_EQ(recv_fake.call_count, 2);
+	ASSERT_EQ(recv_fake.call_count, 1);
 }
 
 
@@ -952,3 +910,1603 @@ TEST_F(TestClient, ClientTlpReqSetAddr) {
 	ASSERT_EQ(tport.t_tlp.dl_tlp.tlp_req.r_last_be, 0xF);
 	ASSERT_EQ(tlp_data_length_bytes(tlp), 1028);
 }
+
+TEST_F(TestClient, ClientTrustedLinkSkipsCrc) {
+	std::vector<std::vector<uint8_t>> sent;
+	bool written = false;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	client.ack_factor = 1;
+	client.private_data = &written;
+	client.link_caps = WARPPIPE_LINK_CAP_TRUSTED;
+	ASSERT_EQ(warppipe_client_link_up(&client), 0);
+
+	/* our advertisement goes out with a valid CRC */
+	ASSERT_EQ(sent.size(), 1);
+	xport *caps = (xport *)sent[0].data();
+	ASSERT_EQ(caps->t_proto, PCIE_PROTO_DLLP);
+	ASSERT_EQ(caps->t_dllp.dl_type, PCIE_DLLP_VENDOR);
+	ASSERT_EQ(caps->t_dllp.dl_vendor.dl_vendor_id, WARPPIPE_VENDOR_DLLP_LINK_CAPS);
+	ASSERT_EQ(caps->t_dllp.dl_vendor.dl_vendor_data[0], WARPPIPE_LINK_CAP_TRUSTED);
+	ASSERT_TRUE(pcie_crc16_valid(&caps->t_dllp));
+
+	/* the peer advertises the same */
+	push_rx(caps, 1 + sizeof(pcie_dllp));
+	warppipe_client_read(&client);
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(client.link_caps_agreed, WARPPIPE_LINK_CAP_TRUSTED);
+
+	/* TLPs with bogus LCRC are accepted and ACKed */
+	int rc = warppipe_register_bar(&client, 0x1000, 1024, 0, NULL,
+		[](uint64_t addr, const void *data, int length, void *private_data) {
+			*(bool *)private_data = true;
+		});
+	ASSERT_EQ(rc, 0);
+
+	ASSERT_EQ(warppipe_write(&client, 0, 0x0, write_data, WD_SIZE), 0);
+	ASSERT_EQ(sent.size(), 2);
+	xport *wr = (xport *)sent[1].data();
+	uint8_t *lcrc = sent[1].data() + sent[1].size() - 4;
+	ASSERT_EQ(lcrc[0] | lcrc[1] | lcrc[2] | lcrc[3], 0);
+
+	lcrc[0] ^= 0xff;
+	push_rx(wr, sent[1].size());
+	warppipe_client_read(&client);
+	ASSERT_TRUE(client.active);
+	ASSERT_TRUE(written);
+	ASSERT_EQ(sent.size(), 3);
+	ASSERT_EQ(((xport *)sent[2].data())->t_dllp.dl_type, PCIE_DLLP_ACK);
+}
+
+TEST_F(TestClient, ClientTrustedLinkRequiresBothEnds) {
+	std::vector<std::vector<uint8_t>> sent;
+	xport caps = {
+		.t_proto = PCIE_PROTO_DLLP,
+	};
+
+	caps.t_dllp.dl_vendor.dl_vendor_type = PCIE_DLLP_VENDOR;
+	caps.t_dllp.dl_vendor.dl_vendor_id = WARPPIPE_VENDOR_DLLP_LINK_CAPS;
+	caps.t_dllp.dl_vendor.dl_vendor_data[0] = WARPPIPE_LINK_CAP_TRUSTED;
+	pcie_crc16(&caps.t_dllp);
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	/* the peer asks for a trusted link, but we force full CRC */
+	warppipe_client_create(&client, 10);
+	push_rx(&caps, 1 + sizeof(pcie_dllp));
+	warppipe_client_read(&client);
+	ASSERT_EQ(client.link_caps_agreed, 0);
+
+	/* corrupted TLP gets NAKed */
+	tport_out->t_proto = PCIE_PROTO_TLP;
+	tport_out->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport_out->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport_out->t_tlp.dl_tlp, 0x1000, 4);
+	pcie_lcrc32(&tport_out->t_tlp);
+	tport_out->t_tlp.dl_tlp.tlp_req.r_data32[0] ^= 1;
+	push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(sent.size(), 1);
+	ASSERT_TRUE(pcie_lcrc32_valid(&tport_out->t_tlp) == false);
+	ASSERT_EQ(((xport *)sent[0].data())->t_dllp.dl_type, PCIE_DLLP_NAK);
+	ASSERT_TRUE(pcie_crc16_valid(&((xport *)sent[0].data())->t_dllp));
+}
+
+TEST_F(TestClient, ClientReadTLPChunked) {
+	std::vector<std::vector<uint8_t>> sent;
+	int written = 0;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return len;
+	};
+	/* the packets trickle in a few bytes at a time */
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, std::min<size_t>(len, 1 + rx_pos % 5));
+	};
+
+	tport_out->t_proto = PCIE_PROTO_TLP;
+	tport_out->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport_out->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport_out->t_tlp.dl_tlp, 0x1000, WD_SIZE);
+	memcpy(tport_out->t_tlp.dl_tlp.tlp_req.r_data32, write_data, WD_SIZE);
+	tport_out->t_tlp.dl_seqno_lo = 1;
+	pcie_lcrc32(&tport_out->t_tlp);
+
+	size_t tlp_len = 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4;
+
+	push_rx(tport_out, tlp_len);
+	tport_out->t_tlp.dl_seqno_lo = 2;
+	tport_out->t_tlp.dl_tlp.tlp_req.r_data32[WD_SIZE - 1] ^= 1;
+	push_rx(tport_out, tlp_len);
+
+	warppipe_client_create(&client, 10);
+	client.private_data = &written;
+	int rc = warppipe_register_bar(&client, 0x1000, 1024, 0, NULL,
+		[](uint64_t addr, const void *data, int length, void *private_data) {
+			(*(int *)private_data)++;
+		});
+	ASSERT_EQ(rc, 0);
+
+	while (rx_pos < rx_stream.size() && client.active)
+		warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(written, 1);
+	ASSERT_EQ(sent.size(), 2);
+	ASSERT_EQ(((xport *)sent[0].data())->t_dllp.dl_type, PCIE_DLLP_ACK);
+	ASSERT_EQ(((xport *)sent[1].data())->t_dllp.dl_type, PCIE_DLLP_NAK);
+}
+
+TEST_F(TestClient, ClientReadManyPacketsPerRecv) {
+	int written = 0;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	tport_out->t_proto = PCIE_PROTO_DLLP;
+	tport_out->t_dllp.dl_type = PCIE_DLLP_ACK;
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
+
+	tport_out->t_proto = PCIE_PROTO_TLP;
+	tport_out->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport_out->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport_out->t_tlp.dl_tlp, 0x1000, WD_SIZE);
+	memcpy(tport_out->t_tlp.dl_tlp.tlp_req.r_data32, write_data, WD_SIZE);
+
+	size_t tlp_len = 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4;
+
+	/* the tail of the last packet arrives with the next wakeup */
+	for (int i = 1; i <= 4; i++) {
+		tport_out->t_tlp.dl_seqno_lo = i;
+		pcie_lcrc32(&tport_out->t_tlp);
+		push_rx(tport_out, tlp_len);
+	}
+	size_t split = rx_stream.size() - tlp_len / 2;
+
+	warppipe_client_create(&client, 10);
+	client.ack_factor = 1;
+	client.private_data = &written;
+	int rc = warppipe_register_bar(&client, 0x1000, 1024, 0, NULL,
+		[](uint64_t addr, const void *data, int length, void *private_data) {
+			(*(int *)private_data)++;
+		});
+	ASSERT_EQ(rc, 0);
+
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, std::min(len, split - rx_pos));
+	};
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(recv_fake.call_count, 1);
+	ASSERT_EQ(written, 3);
+	ASSERT_EQ(send_fake.call_count, 3);
+
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(recv_fake.call_count, 2);
+	ASSERT_EQ(written, 4);
+	ASSERT_EQ(send_fake.call_count, 4);
+	ASSERT_EQ(client.rx_head, client.rx_tail);
+}
+
+TEST_F(TestClient, ClientAckCoalescing) {
+	std::vector<std::vector<uint8_t>> sent;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	tport_out->t_proto = PCIE_PROTO_TLP;
+	tport_out->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport_out->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport_out->t_tlp.dl_tlp, 0x1000, WD_SIZE);
+
+	size_t tlp_len = 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4;
+
+	for (int i = 1; i <= 6; i++) {
+		tport_out->t_tlp.dl_seqno_lo = i;
+		pcie_lcrc32(&tport_out->t_tlp);
+		push_rx(tport_out, tlp_len);
+	}
+
+	warppipe_client_create(&client, 10);
+	client.ack_factor = 4;
+	client.ack_latency_us = 1000000;
+	warppipe_register_bar(&client, 0x1000, 1024, 0, NULL, NULL);
+	warppipe_client_read(&client);
+
+	/* one ACK covers the first four TLPs */
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(sent.size(), 1);
+	ASSERT_EQ(((xport *)sent[0].data())->t_dllp.dl_type, PCIE_DLLP_ACK);
+	ASSERT_EQ(((xport *)sent[0].data())->t_dllp.dl_acknak.dl_seqno_lo, 4);
+	ASSERT_EQ(client.ack_pending, 2);
+
+	/* the rest is acknowledged once the latency timer expires */
+	int left = warppipe_client_ack_timeout(&client);
+
+	ASSERT_GT(left, 0);
+	ASSERT_LE(left, 1000);
+	ASSERT_EQ(sent.size(), 1);
+
+	client.ack_deadline_us = 0;
+	ASSERT_EQ(warppipe_client_ack_timeout(&client), -1);
+	ASSERT_EQ(sent.size(), 2);
+	ASSERT_EQ(((xport *)sent[1].data())->t_dllp.dl_acknak.dl_seqno_lo, 6);
+	ASSERT_EQ(client.ack_pending, 0);
+	ASSERT_EQ(warppipe_client_ack_timeout(&client), -1);
+}
+
+TEST_F(TestClient, ClientAckPiggybacksOnFlush) {
+	std::vector<std::vector<uint8_t>> sent;
+
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return len;
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 1024, 0, NULL, NULL);
+	client.ack_pending = 1;
+	client.ack_seqno = 7;
+	client.tx_batch = true;
+	warppipe_write(&client, 0, 0x0, write_data, WD_SIZE);
+
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+	ASSERT_EQ(client.ack_pending, 0);
+	ASSERT_EQ(sent.size(), 1);
+
+	const xport *ack = (const xport *)(sent[0].data() + sent[0].size() - 1 - sizeof(pcie_dllp));
+
+	ASSERT_EQ(ack->t_proto, PCIE_PROTO_DLLP);
+	ASSERT_EQ(ack->t_dllp.dl_type, PCIE_DLLP_ACK);
+	ASSERT_EQ(ack->t_dllp.dl_acknak.dl_seqno_lo, 7);
+}
+
+TEST_F(TestClient, ClientCumulativeAck) {
+	RESET_FAKE(send);
+	RESET_FAKE(recv);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 1024, 0, NULL, NULL);
+	for (int i = 0; i < 3; i++)
+		warppipe_write(&client, 0, 0x0, write_data, WD_SIZE);
+
+	tport_out->t_proto = PCIE_PROTO_DLLP;
+	tport_out->t_dllp.dl_acknak.dl_nak = PCIE_DLLP_ACK;
+	tport_out->t_dllp.dl_acknak.dl_seqno_lo = 3;
+	pcie_crc16(&tport_out->t_dllp);
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(client.acked_seqno, 3);
+
+	/* sequence number never sent */
+	tport_out->t_dllp.dl_acknak.dl_seqno_lo = 5;
+	pcie_crc16(&tport_out->t_dllp);
+	push_rx(tport_out, 1 + sizeof(pcie_dllp));
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(client.acked_seqno, 3);
+}
+
+TEST_F(TestClient, ClientHotPathDoesNotAllocate) {
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	tport_out->t_proto = PCIE_PROTO_TLP;
+	tport_out->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MRD32 >> 5;
+	tport_out->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MRD32 & 0x1f;
+	tlp_req_set_addr(&tport_out->t_tlp.dl_tlp, 0x1000, WD_SIZE);
+	for (int i = 1; i <= 4; i++) {
+		tport_out->t_tlp.dl_seqno_lo = i;
+		pcie_lcrc32(&tport_out->t_tlp);
+		push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
+	}
+
+	tport_out->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport_out->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport_out->t_tlp.dl_tlp, 0x1000, WD_SIZE);
+	memcpy(tport_out->t_tlp.dl_tlp.tlp_req.r_data32, write_data, WD_SIZE);
+	for (int i = 5; i <= 8; i++) {
+		tport_out->t_tlp.dl_seqno_lo = i;
+		pcie_lcrc32(&tport_out->t_tlp);
+		push_rx(tport_out, 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4);
+	}
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 1024, 0,
+		[](uint64_t addr, void *data, int length, void *private_data) {
+			memset(data, 0xaa, length);
+			return 0;
+		},
+		[](uint64_t addr, const void *data, int length, void *private_data) {
+		});
+
+	unsigned long allocs = test_alloc_count;
+
+	/* completer side: completions and ACKs */
+	client.tx_batch = true;
+	warppipe_client_read(&client);
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+	client.tx_batch = false;
+
+	/* requester side: posted writes and read requests */
+	warppipe_write(&client, 0, 0x3, write_data, WD_SIZE);
+	warppipe_read(&client, 0, 0x0, WD_SIZE, NULL);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(send_fake.call_count, 3);
+	/* the replay buffer, once per connection */
+	ASSERT_EQ(test_alloc_count, allocs + 1);
+	ASSERT_NE(client.replay_buf, nullptr);
+
+	warppipe_write(&client, 0, 0x3, write_data, WD_SIZE);
+	ASSERT_EQ(test_alloc_count, allocs + 1);
+
+	/* make sure the hook is alive */
+	void *volatile p = malloc(1);
+
+	free(p);
+	ASSERT_EQ(test_alloc_count, allocs + 2);
+}
+
+/* split a byte stream into transport packets, ACKs left out */
+static std::vector<std::vector<uint8_t>> split_tlps(const std::vector<uint8_t> &bytes)
+{
+	std::vector<std::vector<uint8_t>> packets;
+
+	for (size_t pos = 0; pos < bytes.size();) {
+		int len = warppipe_transport_length(bytes.data() + pos, bytes.size() - pos);
+
+		EXPECT_GT(len, 0);
+		if (len <= 0)
+			break;
+		if (bytes[pos] == PCIE_PROTO_TLP)
+			packets.emplace_back(bytes.begin() + pos, bytes.begin() + pos + len);
+		pos += len;
+	}
+	return packets;
+}
+
+/* give a captured TLP another sequence number, as if the peer sent it */
+static std::vector<uint8_t> with_seqno(std::vector<uint8_t> pkt, uint16_t seqno)
+{
+	xport *tport = (xport *)pkt.data();
+
+	tport->t_tlp.dl_seqno_hi = seqno >> 8;
+	tport->t_tlp.dl_seqno_lo = seqno & 0xff;
+	pcie_lcrc32(&tport->t_tlp);
+	return pkt;
+}
+
+static int pattern_read(uint64_t addr, void *data, int length, void *private_data)
+{
+	for (int i = 0; i < length; i++)
+		((uint8_t *)data)[i] = addr + i;
+	return 0;
+}
+
+TEST_F(TestClient, ClientWriteSplitsAtMps) {
+	std::vector<uint8_t> tx;
+	uint8_t data[300];
+
+	std::iota(&data[0], &data[sizeof(data)], 0);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, NULL, NULL);
+	client.mps = 128;
+	ASSERT_EQ(warppipe_write(&client, 0, 0x70, data, sizeof(data)), 0);
+
+	/* TLPs end on 128-byte boundaries */
+	const std::array<std::pair<uint64_t, int>, 4> expected = {{
+		{0x1070, 16}, {0x1080, 128}, {0x1100, 128}, {0x1180, 28},
+	}};
+	auto packets = split_tlps(tx);
+	int offset = 0;
+
+	ASSERT_EQ(packets.size(), expected.size());
+	for (size_t i = 0; i < packets.size(); i++) {
+		const pcie_tlp *tlp = &((const xport *)packets[i].data())->t_tlp.dl_tlp;
+
+		EXPECT_EQ(tlp_req_get_addr(tlp), expected[i].first);
+		EXPECT_EQ(tlp_data_length_bytes(tlp), expected[i].second);
+		EXPECT_EQ(memcmp(tlp->tlp_req.r_data32, data + offset, expected[i].second), 0);
+		offset += expected[i].second;
+	}
+}
+
+static std::vector<uint8_t> split_read_data;
+static int split_read_calls;
+static int split_read_error;
+
+static void split_read_done(const warppipe_completion_status status, const void *data, int length, void *private_data)
+{
+	split_read_calls++;
+	split_read_error = status.error_code;
+	split_read_data.assign((const uint8_t *)data, (const uint8_t *)data + length);
+}
+
+TEST_F(TestClient, ClientSplitReadRoundTrip) {
+	std::vector<uint8_t> tx;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	/* the client completes its own requests */
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, pattern_read, NULL);
+	client.mrrs = 256;
+	client.mps = 64;
+
+	split_read_calls = 0;
+	ASSERT_EQ(warppipe_read(&client, 0, 0xf0, 300, split_read_done), 0);
+
+	auto requests = split_tlps(tx);
+
+	ASSERT_EQ(requests.size(), 3);
+	EXPECT_EQ(tlp_data_length_bytes(&((const xport *)requests[1].data())->t_tlp.dl_tlp), 256);
+
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	/* 16 + 4 * 64 + 28 bytes */
+	auto completions = split_tlps(tx);
+	const std::array<int, 6> byte_counts = {16, 256, 192, 128, 64, 28};
+
+	ASSERT_EQ(completions.size(), byte_counts.size());
+	for (size_t i = 0; i < completions.size(); i++) {
+		const pcie_tlp *tlp = &((const xport *)completions[i].data())->t_tlp.dl_tlp;
+
+		EXPECT_EQ(tlp->tlp_cpl.c_byte_count_hi << 8 | tlp->tlp_cpl.c_byte_count_lo, byte_counts[i]);
+	}
+	EXPECT_EQ(((const xport *)completions[2].data())->t_tlp.dl_tlp.tlp_cpl.c_lower_address, 0x40);
+	ASSERT_EQ(split_read_calls, 0);
+
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_EQ(split_read_error, 0);
+	ASSERT_EQ(split_read_data.size(), 300);
+	for (int i = 0; i < 300; i++)
+		ASSERT_EQ(split_read_data[i], (uint8_t)(0xf0 + i));
+}
+
+TEST_F(TestClient, ClientSplitReadFails) {
+	std::vector<uint8_t> tx;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0,
+		[](uint64_t addr, void *data, int length, void *private_data) {
+			return addr >= 0x200 ? -1 : pattern_read(addr, data, length, private_data);
+		}, NULL);
+	client.mrrs = 128;
+	client.max_tags = 32;
+
+	/* 32 tags, 128 bytes each */
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 33 * 128, split_read_done), -EAGAIN);
+	ASSERT_TRUE(tx.empty());
+
+	split_read_calls = 0;
+	ASSERT_EQ(warppipe_read(&client, 0, 0x100, 0x200, split_read_done), 0);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_NE(split_read_error, 0);
+	ASSERT_EQ(split_read_data.size(), 0);
+
+	/* all tags are free again */
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 32 * 128, split_read_done), 0);
+
+	/* the connection goes away before the completions arrive */
+	split_read_calls = 0;
+	warppipe_client_destroy(&client);
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_NE(split_read_error, 0);
+}
+
+TEST_F(TestClient, ClientTagBackpressure) {
+	std::vector<uint8_t> tx;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, pattern_read, NULL);
+	ASSERT_EQ(client.max_tags, CLIENT_DEFAULT_TAGS);
+	client.max_tags = 32;
+
+	for (int i = 0; i < 32; i++)
+		ASSERT_EQ(warppipe_read(&client, 0, i * 4, 4, split_read_done), 0);
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 4, split_read_done), -EAGAIN);
+
+	/* complete the request with tag 5 only, its tag is handed out next */
+	auto requests = split_tlps(tx);
+
+	ASSERT_EQ(requests.size(), 32);
+	ASSERT_EQ(((const xport *)requests[5].data())->t_tlp.dl_tlp.tlp_req.r_tag, 5);
+	auto request = with_seqno(requests[5], 1);
+
+	push_rx(request.data(), request.size());
+	tx.clear();
+	warppipe_client_read(&client);
+	auto completion = with_seqno(split_tlps(tx)[0], 2);
+
+	push_rx(completion.data(), completion.size());
+	tx.clear();
+	split_read_calls = 0;
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_EQ(split_read_data, std::vector<uint8_t>({20, 21, 22, 23}));
+	ASSERT_EQ(client.tags_used, 31);
+
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 4, split_read_done), 0);
+	ASSERT_EQ(((const xport *)split_tlps(tx)[0].data())->t_tlp.dl_tlp.tlp_req.r_tag, 5);
+
+	warppipe_client_destroy(&client);
+	ASSERT_EQ(client.tags_used, 0);
+}
+
+TEST_F(TestClient, ClientTenBitTags) {
+	std::vector<uint8_t> tx;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, pattern_read, NULL);
+	client.max_tags = 1024;
+
+	for (int i = 0; i < 1024; i++)
+		ASSERT_EQ(warppipe_read(&client, 0, i, 1, split_read_done), 0);
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 1, split_read_done), -EAGAIN);
+
+	auto requests = split_tlps(tx);
+	const pcie_tlp *tlp = &((const xport *)requests[0x2a5].data())->t_tlp.dl_tlp;
+
+	ASSERT_EQ(tlp->tlp_req.r_tag, 0xa5);
+	ASSERT_EQ(tlp->tlp_t8, 0);
+	ASSERT_EQ(tlp->tlp_t9, 1);
+
+	/* the Completer echoes T9/T8, so the completion finds its request */
+	auto request = with_seqno(requests[0x2a5], 1);
+
+	push_rx(request.data(), request.size());
+	tx.clear();
+	warppipe_client_read(&client);
+	auto completion = with_seqno(split_tlps(tx)[0], 2);
+
+	push_rx(completion.data(), completion.size());
+	tx.clear();
+	split_read_calls = 0;
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_EQ(split_read_data, std::vector<uint8_t>({0xa5}));
+	ASSERT_EQ(client.tags_used, 1023);
+
+	split_read_calls = 0;
+	warppipe_client_destroy(&client);
+	ASSERT_EQ(split_read_calls, 1023);
+}
+
+TEST_F(TestClient, ClientReadContext) {
+	std::vector<uint8_t> tx;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, pattern_read, NULL);
+	client.mrrs = 128;
+
+	auto done = [](const warppipe_completion_status status, const void *data, int length, void *private_data) {
+		auto *buf = (std::vector<uint8_t> *)private_data;
+
+		buf->assign((const uint8_t *)data, (const uint8_t *)data + length);
+	};
+	std::vector<uint8_t> a, b, c;
+
+	/* three reads in flight, one split in two requests, each completing into its own buffer */
+	client.private_data = &c;
+	ASSERT_EQ(warppipe_read_ctx(&client, 0, 0x10, 4, done, &a), 0);
+	ASSERT_EQ(warppipe_read_ctx(&client, 0, 0x70, 32, done, &b), 0);
+	ASSERT_EQ(warppipe_read(&client, 0, 0x20, 2, done), 0);
+	client.private_data = NULL;
+
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(a, std::vector<uint8_t>({0x10, 0x11, 0x12, 0x13}));
+	ASSERT_EQ(b.size(), 32);
+	ASSERT_EQ(b[31], 0x8f);
+	ASSERT_EQ(c, std::vector<uint8_t>({0x20, 0x21}));
+}
+
+static void push_fc(TestClient *t, int type, int kind, int hdr, int data)
+{
+	uint8_t buf[16] = {};
+	xport *fc = (xport *)buf;
+
+	fc->t_proto = PCIE_PROTO_DLLP;
+	fc->t_dllp.dl_fc.fc_type = type;
+	fc->t_dllp.dl_fc.fc_kind = kind;
+	fc->t_dllp.dl_fc.fc_hdrfc_hi = hdr >> 2;
+	fc->t_dllp.dl_fc.fc_hdrfc_lo = hdr & 3;
+	fc->t_dllp.dl_fc.fc_datafc_hi = data >> 8;
+	fc->t_dllp.dl_fc.fc_datafc_lo = data & 0xff;
+	pcie_crc16(&fc->t_dllp);
+	t->push_rx(fc, 1 + sizeof(pcie_dllp));
+}
+
+static int fc_hdr(const std::vector<uint8_t> &pkt)
+{
+	const pcie_dllp *dllp = &((const xport *)pkt.data())->t_dllp;
+
+	return dllp->dl_fc.fc_hdrfc_hi << 2 | dllp->dl_fc.fc_hdrfc_lo;
+}
+
+static int fc_data(const std::vector<uint8_t> &pkt)
+{
+	const pcie_dllp *dllp = &((const xport *)pkt.data())->t_dllp;
+
+	return dllp->dl_fc.fc_datafc_hi << 8 | dllp->dl_fc.fc_datafc_lo;
+}
+
+TEST_F(TestClient, ClientFlowControlInit) {
+	std::vector<std::vector<uint8_t>> sent;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	client.flow_control = true;
+	client.fc_hdr_credits = 16;
+	client.fc_data_credits = 300;
+
+	/* InitFC of the peer comes first, ours goes out in reply, once */
+	push_fc(this, PCIE_FC_INIT1, PCIE_FC_P, 2, 0);
+	push_fc(this, PCIE_FC_INIT1, PCIE_FC_NP, 0, 0);
+	push_fc(this, PCIE_FC_INIT2, PCIE_FC_P, 5, 5);
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(sent.size(), 3);
+	for (int kind = PCIE_FC_P; kind <= PCIE_FC_CPL; kind++) {
+		const pcie_dllp *dllp = &((const xport *)sent[kind].data())->t_dllp;
+
+		ASSERT_EQ(dllp->dl_fc.fc_type, PCIE_FC_INIT1);
+		ASSERT_EQ(dllp->dl_fc.fc_kind, kind);
+		ASSERT_EQ(fc_hdr(sent[kind]), 16);
+		ASSERT_EQ(fc_data(sent[kind]), 300);
+	}
+	ASSERT_TRUE(client.fc_tx[PCIE_FC_P].initialized);
+	ASSERT_TRUE(client.fc_tx[PCIE_FC_P].hdr_limited);
+	ASSERT_FALSE(client.fc_tx[PCIE_FC_P].data_limited);
+	ASSERT_EQ(client.fc_tx[PCIE_FC_P].hdr_limit, 2);
+	ASSERT_FALSE(client.fc_tx[PCIE_FC_NP].hdr_limited);
+	ASSERT_FALSE(client.fc_tx[PCIE_FC_CPL].initialized);
+
+	/* link-up does not advertise again */
+	ASSERT_EQ(warppipe_client_link_up(&client), 0);
+	ASSERT_EQ(sent.size(), 4);
+}
+
+TEST_F(TestClient, ClientFlowControlQueues) {
+	std::vector<uint8_t> tx;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, pattern_read, NULL);
+	push_fc(this, PCIE_FC_INIT1, PCIE_FC_P, 2, 8);
+	warppipe_client_read(&client);
+
+	/* 40 bytes take 3 data credits, the second write runs out of them */
+	ASSERT_EQ(warppipe_write(&client, 0, 0x0, write_data, WD_SIZE), 0);
+	ASSERT_EQ(warppipe_write(&client, 0, 0x40, write_data, WD_SIZE), 0);
+	ASSERT_EQ(warppipe_write(&client, 0, 0x80, write_data, WD_SIZE), 0);
+	/* Non-Posted Requests must not pass the queued write */
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 4, NULL), 0);
+
+	auto packets = split_tlps(tx);
+
+	ASSERT_EQ(packets.size(), 2);
+	ASSERT_EQ(client.fc_queued[PCIE_FC_P], 1);
+	ASSERT_EQ(client.fc_queued[PCIE_FC_NP], 1);
+	ASSERT_EQ(client.fc_tx[PCIE_FC_P].data_consumed, 6);
+
+	tx.clear();
+	/* a header credit alone is not enough */
+	push_fc(this, PCIE_FC_UPDATE, PCIE_FC_P, 3, 8);
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(tx.empty());
+	ASSERT_EQ(client.fc_queued[PCIE_FC_P], 1);
+
+	tx.clear();
+	push_fc(this, PCIE_FC_UPDATE, PCIE_FC_P, 3, 12);
+	warppipe_client_read(&client);
+
+	/* the write goes out first, sequence numbers follow the order on the wire */
+	packets = split_tlps(tx);
+	ASSERT_EQ(packets.size(), 2);
+	ASSERT_TRUE(((const xport *)packets[0].data())->t_tlp.dl_tlp.tlp_fmt & PCIE_TLP_FMT_DATA);
+	ASSERT_EQ(((const xport *)packets[0].data())->t_tlp.dl_seqno_lo, 3);
+	ASSERT_FALSE(((const xport *)packets[1].data())->t_tlp.dl_tlp.tlp_fmt & PCIE_TLP_FMT_DATA);
+	ASSERT_EQ(((const xport *)packets[1].data())->t_tlp.dl_seqno_lo, 4);
+	ASSERT_EQ(client.fc_queued_bytes, 0);
+
+	/* requests are refused once too much waits for credits */
+	int n = 0;
+
+	while (warppipe_write(&client, 0, 0x0, write_data, WD_SIZE) == 0)
+		n++;
+	ASSERT_EQ(warppipe_write(&client, 0, 0x0, write_data, WD_SIZE), -EAGAIN);
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 4, NULL), -EAGAIN);
+	ASSERT_GT(n, 0);
+	ASSERT_GE(client.fc_queued_bytes, CLIENT_FC_QUEUE_SIZE);
+
+	warppipe_client_destroy(&client);
+	ASSERT_EQ(client.fc_queued_bytes, 0);
+}
+
+TEST_F(TestClient, ClientFlowControlReturnsCredits) {
+	std::vector<std::vector<uint8_t>> sent;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 1024, 0, NULL, NULL);
+	client.flow_control = true;
+	client.fc_hdr_credits = 8;
+	client.fc_data_credits = 64;
+	client.ack_factor = 100;
+	client.ack_latency_us = 1000000;
+	ASSERT_EQ(warppipe_client_link_up(&client), 0);
+	ASSERT_EQ(sent.size(), 4);
+	sent.clear();
+
+	tport_out->t_proto = PCIE_PROTO_TLP;
+	tport_out->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport_out->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport_out->t_tlp.dl_tlp, 0x1000, WD_SIZE);
+
+	size_t tlp_len = 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4;
+
+	for (int i = 1; i <= 5; i++) {
+		tport_out->t_tlp.dl_seqno_lo = i;
+		pcie_lcrc32(&tport_out->t_tlp);
+		push_rx(tport_out, tlp_len);
+	}
+	warppipe_client_read(&client);
+
+	/* half of the header credits are used up after four writes */
+	ASSERT_EQ(sent.size(), 1);
+	ASSERT_EQ(((const xport *)sent[0].data())->t_dllp.dl_fc.fc_type, PCIE_FC_UPDATE);
+	ASSERT_EQ(((const xport *)sent[0].data())->t_dllp.dl_fc.fc_kind, PCIE_FC_P);
+	ASSERT_EQ(fc_hdr(sent[0]), 12);
+	ASSERT_EQ(fc_data(sent[0]), 64 + 4 * 3);
+
+	/* the fifth one is returned with the ACK */
+	ASSERT_TRUE(client.fc_update_pending);
+	client.ack_deadline_us = 0;
+	ASSERT_EQ(warppipe_client_ack_timeout(&client), -1);
+	ASSERT_EQ(sent.size(), 3);
+	ASSERT_EQ(((const xport *)sent[1].data())->t_dllp.dl_type, PCIE_DLLP_ACK);
+	ASSERT_EQ(fc_hdr(sent[2]), 13);
+	ASSERT_EQ(fc_data(sent[2]), 64 + 5 * 3);
+	ASSERT_FALSE(client.fc_update_pending);
+}
+
+static void push_acknak(TestClient *t, int type, uint16_t seqno)
+{
+	uint8_t buf[16] = {};
+	xport *ack = (xport *)buf;
+
+	ack->t_proto = PCIE_PROTO_DLLP;
+	ack->t_dllp.dl_acknak.dl_nak = type;
+	ack->t_dllp.dl_acknak.dl_seqno_hi = seqno >> 8;
+	ack->t_dllp.dl_acknak.dl_seqno_lo = seqno & 0xff;
+	pcie_crc16(&ack->t_dllp);
+	t->push_rx(ack, 1 + sizeof(pcie_dllp));
+}
+
+TEST_F(TestClient, ClientReplaysOnNak) {
+	std::vector<std::vector<uint8_t>> sent;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, NULL, NULL);
+	for (int i = 0; i < 3; i++)
+		ASSERT_EQ(warppipe_write(&client, 0, i * 0x40, write_data, WD_SIZE), 0);
+	ASSERT_EQ(sent.size(), 3);
+
+	/* the first one arrived, the rest goes out again as it was */
+	push_acknak(this, PCIE_DLLP_NAK, 1);
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(client.acked_seqno, 1);
+	ASSERT_EQ(client.replays, 1);
+	ASSERT_EQ(sent.size(), 4);
+	std::vector<uint8_t> replayed(sent[1]);
+
+	replayed.insert(replayed.end(), sent[2].begin(), sent[2].end());
+	ASSERT_EQ(sent[3], replayed);
+
+	/* a cumulative ACK empties the replay buffer and stops the timer */
+	push_acknak(this, PCIE_DLLP_ACK, 3);
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(client.replay_deadline_us, 0);
+	ASSERT_EQ(client.replay_head, client.replay_tail);
+	ASSERT_EQ(warppipe_client_ack_timeout(&client), -1);
+}
+
+TEST_F(TestClient, ClientReplayTimer) {
+	std::vector<std::vector<uint8_t>> sent;
+
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, NULL, NULL);
+	ASSERT_EQ(warppipe_write(&client, 0, 0x0, write_data, WD_SIZE), 0);
+	ASSERT_EQ(warppipe_write(&client, 0, 0x40, write_data, WD_SIZE), 0);
+
+	int left = warppipe_client_ack_timeout(&client);
+
+	ASSERT_GT(left, 0);
+	ASSERT_LE(left, CLIENT_REPLAY_TIMEOUT_US / 1000);
+	ASSERT_EQ(sent.size(), 2);
+
+	/* no ACK in time, both are replayed and the timer starts over */
+	client.replay_deadline_us = 1;
+	ASSERT_GT(warppipe_client_ack_timeout(&client), 0);
+	ASSERT_EQ(client.replays, 1);
+	ASSERT_EQ(sent.size(), 3);
+	ASSERT_EQ(sent[2].size(), sent[0].size() + sent[1].size());
+}
+
+TEST_F(TestClient, ClientDropsDuplicateTLP) {
+	std::vector<std::vector<uint8_t>> sent;
+	int written = 0;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		sent.emplace_back((uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	tport_out->t_proto = PCIE_PROTO_TLP;
+	tport_out->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport_out->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport_out->t_tlp.dl_tlp, 0x1000, WD_SIZE);
+
+	size_t tlp_len = 1 + 2 + tlp_total_length(&tport_out->t_tlp.dl_tlp) + 4;
+
+	/* a replay of 1, then 3 with 2 lost, then the replay of 2 and 3 */
+	for (int seqno : {1, 1, 3, 2, 3}) {
+		tport_out->t_tlp.dl_seqno_lo = seqno;
+		pcie_lcrc32(&tport_out->t_tlp);
+		push_rx(tport_out, tlp_len);
+	}
+
+	warppipe_client_create(&client, 10);
+	client.ack_factor = 1;
+	client.private_data = &written;
+	warppipe_register_bar(&client, 0x1000, 1024, 0, NULL,
+		[](uint64_t addr, const void *data, int length, void *private_data) {
+			(*(int *)private_data)++;
+		});
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(written, 3);
+	ASSERT_EQ(sent.size(), 5);
+
+	const int types[] = { PCIE_DLLP_ACK, PCIE_DLLP_ACK, PCIE_DLLP_NAK, PCIE_DLLP_ACK, PCIE_DLLP_ACK };
+	const int seqnos[] = { 1, 1, 1, 2, 3 };
+
+	for (int i = 0; i < 5; i++) {
+		ASSERT_EQ(((xport *)sent[i].data())->t_dllp.dl_type, types[i]);
+		ASSERT_EQ(((xport *)sent[i].data())->t_dllp.dl_acknak.dl_seqno_lo, seqnos[i]);
+	}
+}
+
+TEST_F(TestClient, ClientReplayBufferFull) {
+	static uint8_t big[4096];
+	int n = 0;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, NULL, NULL);
+	client.write_sg_threshold = 0;
+
+	/* unacknowledged TLPs wait once the replay buffer is full */
+	while (client.fc_queued[PCIE_FC_P] == 0) {
+		ASSERT_EQ(warppipe_write(&client, 0, 0x0, big, sizeof(big)), 0);
+		n++;
+	}
+	ASSERT_EQ(client.seqno, n - 1);
+	ASSERT_GE(n * sizeof(big), CLIENT_REPLAY_BUFFER_SIZE - CLIENT_BUFFER_SIZE);
+
+	push_acknak(this, PCIE_DLLP_ACK, n - 1);
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(client.fc_queued[PCIE_FC_P], 0);
+	ASSERT_EQ(client.seqno, n);
+}
+
+TEST_F(TestClient, ClientReplayBufferSizedFromCredits) {
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	/* nothing kept in the client itself */
+	ASSERT_LT(sizeof(client), (size_t)CLIENT_REPLAY_BUFFER_SIZE);
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, NULL, NULL);
+	ASSERT_EQ(client.replay_buf, nullptr);
+
+	push_fc(this, PCIE_FC_INIT1, PCIE_FC_P, 4, 64);
+	push_fc(this, PCIE_FC_INIT1, PCIE_FC_NP, 4, 64);
+	push_fc(this, PCIE_FC_INIT1, PCIE_FC_CPL, 4, 64);
+	warppipe_client_read(&client);
+	ASSERT_EQ(client.replay_buf, nullptr);
+
+	/* the first TLP allocates it, with room for the largest one */
+	ASSERT_EQ(warppipe_write(&client, 0, 0x0, write_data, WD_SIZE), 0);
+	ASSERT_NE(client.replay_buf, nullptr);
+	EXPECT_LT(client.replay_size, (size_t)CLIENT_REPLAY_BUFFER_SIZE);
+	EXPECT_GE(client.replay_size, (size_t)CLIENT_BUFFER_SIZE);
+
+	warppipe_client_destroy(&client);
+	EXPECT_EQ(client.replay_buf, nullptr);
+}
+
+TEST_F(TestClient, ClientUnhandledReadGetsUr) {
+	std::vector<uint8_t> tx;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	/* nothing serves reads of the BAR */
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, NULL, NULL);
+
+	split_read_calls = 0;
+	ASSERT_EQ(warppipe_read(&client, 0, 0x10, 16, split_read_done), 0);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	auto completions = split_tlps(tx);
+
+	ASSERT_EQ(completions.size(), 1);
+	const pcie_tlp *tlp = &((const xport *)completions[0].data())->t_tlp.dl_tlp;
+
+	EXPECT_EQ(tlp->tlp_fmt << 5 | tlp->tlp_type, PCIE_TLP_CPL);
+	EXPECT_EQ(tlp->tlp_cpl.c_status, PCIE_CPL_STATUS_UR);
+
+	push_rx(tx.data(), tx.size());
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_EQ(split_read_error, -1);
+	ASSERT_EQ(client.tags_used, 0);
+}
+
+TEST_F(TestClient, ClientCompletionTimeout) {
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		return (int)len;
+	};
+
+	warppipe_client_create(&client, 10);
+	warppipe_register_bar(&client, 0x1000, 0x1000, 0, NULL, NULL);
+	client.max_tags = 32;
+	client.mrrs = 256;
+	client.cpl_timeout_us = 1000;
+
+	/* the peer never answers, a split read takes three tags */
+	split_read_calls = 0;
+	ASSERT_EQ(warppipe_read(&client, 0, 0xf0, 300, split_read_done), 0);
+	for (int i = 3; i < 32; i++)
+		ASSERT_EQ(warppipe_read(&client, 0, 0x0, 4, split_read_done), 0);
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 4, split_read_done), -EAGAIN);
+	ASSERT_GE(warppipe_client_ack_timeout(&client), 0);
+	ASSERT_EQ(split_read_calls, 0);
+
+	usleep(2000);
+	warppipe_client_ack_timeout(&client);
+	/* once per request */
+	ASSERT_EQ(split_read_calls, 30);
+	ASSERT_EQ(split_read_error, -1);
+	ASSERT_EQ(client.tags_used, 0);
+	ASSERT_EQ(warppipe_read(&client, 0, 0x0, 4, split_read_done), 0);
+}
+
+/* (private_data, offset) of every write callback call */
+static std::vector<std::pair<void *, uint64_t>> region_writes;
+
+static void region_write(uint64_t addr, const void *data, int length, void *private_data)
+{
+	region_writes.emplace_back(private_data, addr);
+}
+
+/* queue a 4-byte write TLP to addr, numbered like the rest of the stream */
+static void push_region_write(TestClient *t, uint64_t addr, uint16_t seqno)
+{
+	uint8_t buf[64] = {};
+	xport *tport = (xport *)buf;
+
+	tport->t_proto = PCIE_PROTO_TLP;
+	tport->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport->t_tlp.dl_tlp, addr, 4);
+	tport->t_tlp.dl_seqno_lo = seqno;
+	pcie_lcrc32(&tport->t_tlp);
+	t->push_rx(tport, 1 + 2 + tlp_total_length(&tport->t_tlp.dl_tlp) + 4);
+}
+
+TEST_F(TestClient, ClientRegionDispatch) {
+	int bar_tag, a_tag, b_tag, abs_tag;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	client.private_data = &bar_tag;
+	ASSERT_EQ(warppipe_register_bar(&client, 0x10000, 0x1000, 0, NULL, region_write), 0);
+	/* a register block in the BAR with a single register of its own inside */
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0x100, 0x10, NULL, region_write, &a_tag), 0);
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0x104, 0x4, NULL, region_write, &b_tag), 0);
+	ASSERT_EQ(warppipe_register_region(&client, -1, 0x20000000, 0x100, NULL, region_write, &abs_tag), 0);
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0xff0, 0x20, NULL, region_write, NULL), -1);
+	ASSERT_EQ(warppipe_register_region(&client, 1, 0x0, 0x10, NULL, region_write, NULL), -1);
+
+	const warppipe_region_map *map = &client.region_maps[client.region_gen & 1];
+
+	ASSERT_EQ(map->count, 6);
+	for (int i = 1; i < map->count; i++)
+		ASSERT_GT(map->spans[i].start, map->spans[i - 1].last);
+
+	region_writes.clear();
+	push_region_write(this, 0x10000, 1);
+	push_region_write(this, 0x10100, 2);
+	push_region_write(this, 0x10104, 3);
+	push_region_write(this, 0x1010c, 4);
+	push_region_write(this, 0x10200, 5);
+	push_region_write(this, 0x20000010, 6);
+	push_region_write(this, 0x30000000, 7);
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(region_writes, (std::vector<std::pair<void *, uint64_t>>{
+		{ &bar_tag, 0x0 }, { &a_tag, 0x0 }, { &b_tag, 0x0 }, { &a_tag, 0xc }, { &bar_tag, 0x200 }, { &abs_tag, 0x10 },
+	}));
+}
+
+TEST_F(TestClient, ClientBar64) {
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	ASSERT_EQ(warppipe_register_bar(&client, 0x100000000ULL, 0x1000, 5, NULL, region_write), -1);
+	ASSERT_EQ(warppipe_register_bar(&client, 0x100000000ULL, 0x1000, 2, NULL, region_write), 0);
+	ASSERT_EQ(client.bar64, 1 << 2);
+	/* the upper half takes the next BAR */
+	ASSERT_EQ(warppipe_register_bar(&client, 0x20000, 0x1000, 3, NULL, region_write), -1);
+	ASSERT_EQ(warppipe_register_bar(&client, 0x20000, 0x1000, 4, NULL, region_write), 0);
+
+	region_writes.clear();
+	push_region_write(this, 0x100000010ULL, 1);
+	push_region_write(this, 0x20020, 2);
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(region_writes, (std::vector<std::pair<void *, uint64_t>>{ { NULL, 0x10 }, { NULL, 0x20 } }));
+}
+
+static uint8_t bar64_memory[0x2000];
+
+TEST_F(TestClient, ClientBar64FullPayload) {
+	std::vector<uint8_t> tx;
+	std::vector<uint8_t> data(CLIENT_MAX_PAYLOAD_SIZE);
+
+	std::iota(data.begin(), data.end(), 7);
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	/* the client completes its own requests, a maximum-size MWr has a 4DW header above 4 GiB */
+	warppipe_client_create(&client, 10);
+	client.write_sg_threshold = 0;
+	ASSERT_EQ(warppipe_register_bar(&client, 0x100000000ULL, sizeof(bar64_memory), 2,
+		[](uint64_t addr, void *data, int length, void *private_data) {
+			memcpy(data, bar64_memory + addr, length);
+			return 0;
+		},
+		[](uint64_t addr, const void *data, int length, void *private_data) {
+			memcpy(bar64_memory + addr, data, length);
+		}), 0);
+	memset(bar64_memory, 0, sizeof(bar64_memory));
+
+	ASSERT_EQ(warppipe_write(&client, 2, 0x1000, data.data(), data.size()), 0);
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+	ASSERT_EQ(split_tlps(tx).size(), 1);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(memcmp(bar64_memory + 0x1000, data.data(), data.size()), 0);
+
+	split_read_calls = 0;
+	ASSERT_EQ(warppipe_read(&client, 2, 0x1000, data.size(), split_read_done), 0);
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_EQ(split_read_error, 0);
+	ASSERT_EQ(split_read_data, data);
+}
+
+TEST_F(TestClient, ClientSplitAtMpsBar64) {
+	std::vector<uint8_t> tx;
+	std::vector<uint8_t> data(sizeof(bar64_memory));
+
+	std::iota(data.begin(), data.end(), 3);
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	client.write_sg_threshold = 0;
+	ASSERT_EQ(warppipe_register_bar(&client, 0x100000000ULL, sizeof(bar64_memory), 2,
+		[](uint64_t addr, void *data, int length, void *private_data) {
+			memcpy(data, bar64_memory + addr, length);
+			return 0;
+		},
+		[](uint64_t addr, const void *data, int length, void *private_data) {
+			memcpy(bar64_memory + addr, data, length);
+		}), 0);
+	memset(bar64_memory, 0, sizeof(bar64_memory));
+	client.mps = 4096;
+	client.mrrs = 4096;
+
+	/* two MWr64 of exactly mps bytes */
+	ASSERT_EQ(warppipe_write(&client, 2, 0, data.data(), data.size()), 0);
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+
+	auto writes = split_tlps(tx);
+
+	ASSERT_EQ(writes.size(), 2);
+	for (auto &pkt : writes)
+		EXPECT_EQ(tlp_data_length_bytes(&((const xport *)pkt.data())->t_tlp.dl_tlp), client.mps);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(memcmp(bar64_memory, data.data(), data.size()), 0);
+
+	/* two MRd64 of mrrs bytes, each completed by a CplD of exactly mps bytes */
+	split_read_calls = 0;
+	ASSERT_EQ(warppipe_read(&client, 2, 0, data.size(), split_read_done), 0);
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+	ASSERT_EQ(split_tlps(tx).size(), 2);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+	ASSERT_EQ(warppipe_client_flush(&client), 0);
+
+	auto completions = split_tlps(tx);
+
+	ASSERT_EQ(completions.size(), 2);
+	for (auto &pkt : completions)
+		EXPECT_EQ(pkt.size(), 1 + 2 + 12 + client.mps + 4);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_EQ(split_read_error, 0);
+	ASSERT_EQ(split_read_data, data);
+}
+
+TEST_F(TestClient, ClientRemapBar) {
+	int tag;
+
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [](int sockfd, void *msg, size_t len, int flags) {
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	ASSERT_EQ(warppipe_register_bar(&client, 0x10000, 0x1000, 0, NULL, region_write), 0);
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0x100, 0x10, NULL, region_write, &tag), 0);
+	ASSERT_EQ(warppipe_remap_bar(&client, 0, 0x40800), -1);
+	ASSERT_EQ(warppipe_remap_bar(&client, 0, 0x100000000ULL), -1);
+	ASSERT_EQ(warppipe_remap_bar(&client, 0, 0x40000), 0);
+
+	/* the region moves along with its BAR */
+	region_writes.clear();
+	push_region_write(this, 0x10100, 1);
+	push_region_write(this, 0x40104, 2);
+	push_region_write(this, 0x40008, 3);
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(region_writes, (std::vector<std::pair<void *, uint64_t>>{ { &tag, 0x4 }, { NULL, 0x8 } }));
+}
+
+TEST_F(TestClient, ClientMemoryBar) {
+	std::vector<uint8_t> tx;
+	uint8_t memory[0x100], rom[0x100];
+	uint8_t data[0x20];
+	int tag;
+
+	std::iota(&memory[0], &memory[sizeof(memory)], 0);
+	std::iota(&rom[0], &rom[sizeof(rom)], 0x80);
+	std::iota(&data[0], &data[sizeof(data)], 0xa0);
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	/* the client completes its own requests */
+	warppipe_client_create(&client, 10);
+	ASSERT_EQ(warppipe_register_bar_memory(&client, 0x1000, sizeof(memory), 0, NULL, 0), -1);
+	ASSERT_EQ(warppipe_register_bar_memory(&client, 0x1000, sizeof(memory), 0, memory, 0), 0);
+	ASSERT_EQ(warppipe_register_bar_memory(&client, 0x2000, sizeof(rom), 1, rom, WARPPIPE_MEMORY_READONLY), 0);
+	/* a doorbell in the middle of the BAR */
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0x10, 0x4, NULL, region_write, &tag), 0);
+
+	region_writes.clear();
+	ASSERT_EQ(warppipe_write(&client, 0, 0x8, data, sizeof(data)), 0);
+	ASSERT_EQ(warppipe_write(&client, 1, 0x0, data, sizeof(data)), 0);
+	ASSERT_EQ(warppipe_write(&client, 0, 0xf0, data, sizeof(data)), 0);
+	split_read_calls = 0;
+	ASSERT_EQ(warppipe_read(&client, 1, 0x40, 0x10, split_read_done), 0);
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	/* the write lands in memory, the doorbell gets the part of it that hit it */
+	ASSERT_EQ(memcmp(memory + 0x8, data, sizeof(data)), 0);
+	ASSERT_EQ(memory[0x7], 0x7);
+	ASSERT_EQ(memory[0x28], 0x28);
+	ASSERT_EQ(region_writes, (std::vector<std::pair<void *, uint64_t>>{ { &tag, 0x0 } }));
+	/* read-only, and the last write ran past the end of the BAR */
+	ASSERT_EQ(rom[0], 0x80);
+	ASSERT_EQ(memory[0xf0], 0xf0);
+
+	push_rx(tx.data(), tx.size());
+	tx.clear();
+	warppipe_client_read(&client);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_EQ(split_read_calls, 1);
+	ASSERT_EQ(split_read_error, 0);
+	ASSERT_EQ(split_read_data, std::vector<uint8_t>(rom + 0x40, rom + 0x50));
+}
+
+static std::vector<std::pair<uint64_t, int>> hook_reads;
+
+static int hook_read(uint64_t addr, void *data, int length, void *private_data)
+{
+	hook_reads.emplace_back(addr, length);
+	memset(data, 0xee, length);
+	return 0;
+}
+
+TEST_F(TestClient, ClientReadSplitAtRegions) {
+	std::vector<uint8_t> tx;
+	uint8_t memory[0x100];
+
+	std::iota(&memory[0], &memory[sizeof(memory)], 0);
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	/* the client completes its own requests */
+	warppipe_client_create(&client, 10);
+	ASSERT_EQ(warppipe_register_bar_memory(&client, 0x1000, sizeof(memory), 0, memory, 0), 0);
+	/* a clear-on-read status register and a doorbell without a read callback in the memory */
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0x10, 0x4, hook_read, NULL, NULL), 0);
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0x40, 0x8, hook_read, NULL, NULL), 0);
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0x80, 0x4, NULL, region_write, NULL), 0);
+	/* and a write-only register in a BAR served by callbacks */
+	ASSERT_EQ(warppipe_register_bar(&client, 0x2000, 0x100, 1, pattern_read, NULL), 0);
+	ASSERT_EQ(warppipe_register_region(&client, 1, 0x10, 0x4, NULL, region_write, NULL), 0);
+
+	auto read = [&](int bar_idx, uint64_t addr, int length) {
+		split_read_calls = 0;
+		split_read_data.clear();
+		ASSERT_EQ(warppipe_read(&client, bar_idx, addr, length, split_read_done), 0);
+		for (int i = 0; i < 2; i++) {
+			push_rx(tx.data(), tx.size());
+			tx.clear();
+			warppipe_client_read(&client);
+		}
+		ASSERT_TRUE(client.active);
+		ASSERT_EQ(split_read_calls, 1);
+		ASSERT_EQ(split_read_error, 0);
+	};
+	std::vector<uint8_t> expected(memory + 0x8, memory + 0x88);
+
+	/* the hook serves its part of a read running across it, the memory the rest */
+	hook_reads.clear();
+	read(0, 0x8, 0x80);
+	std::fill(&expected[0x8], &expected[0xc], 0xee);
+	std::fill(&expected[0x38], &expected[0x40], 0xee);
+	EXPECT_EQ(split_read_data, expected);
+	EXPECT_EQ(hook_reads, (std::vector<std::pair<uint64_t, int>>{ { 0x0, 0x4 }, { 0x0, 0x8 } }));
+
+	/* starting in a hook, it only gets as much as it covers */
+	hook_reads.clear();
+	read(0, 0x44, 0x8);
+	EXPECT_EQ(split_read_data, (std::vector<uint8_t>{ 0xee, 0xee, 0xee, 0xee, 0x48, 0x49, 0x4a, 0x4b }));
+	EXPECT_EQ(hook_reads, (std::vector<std::pair<uint64_t, int>>{ { 0x4, 0x4 } }));
+
+	/* the BAR callback reads the register carved out of it */
+	read(1, 0x8, 0x10);
+	expected.resize(0x10);
+	std::iota(expected.begin(), expected.end(), 0x8);
+	EXPECT_EQ(split_read_data, expected);
+}
+
+TEST_F(TestClient, ClientRegionHookRegistersRegions) {
+	static int a_tag, b_tag;
+	std::vector<uint8_t> tx;
+	uint8_t memory[0x100] = {};
+	uint8_t data[0x20];
+
+	std::iota(&data[0], &data[sizeof(data)], 0xa0);
+	RESET_FAKE(recv);
+	RESET_FAKE(send);
+	send_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		tx.insert(tx.end(), (uint8_t *)msg, (uint8_t *)msg + len);
+		return (int)len;
+	};
+	recv_fake.custom_fake = [&](int sockfd, void *msg, size_t len, int flags) {
+		return recv_stream(msg, len);
+	};
+
+	warppipe_client_create(&client, 10);
+	ASSERT_EQ(warppipe_register_bar_memory(&client, 0x1000, sizeof(memory), 0, memory, 0), 0);
+	/* the doorbell sets up two more regions, one before it: the map changes twice in the middle of the write */
+	ASSERT_EQ(warppipe_register_region(&client, 0, 0x10, 0x4, NULL,
+		[](uint64_t addr, const void *data, int length, void *private_data) {
+			warppipe_client *client = (warppipe_client *)private_data;
+
+			region_write(addr, data, length, private_data);
+			warppipe_register_region(client, 0, 0x0, 0x4, NULL, region_write, &a_tag);
+			warppipe_register_region(client, 0, 0x20, 0x4, NULL, region_write, &b_tag);
+		}, &client), 0);
+
+	region_writes.clear();
+	ASSERT_EQ(warppipe_write(&client, 0, 0x8, data, sizeof(data)), 0);
+	push_rx(tx.data(), tx.size());
+	warppipe_client_read(&client);
+
+	ASSERT_EQ(memcmp(memory + 0x8, data, sizeof(data)), 0);
+	ASSERT_EQ(region_writes, (std::vector<std::pair<void *, uint64_t>>{ { &client, 0x0 }, { &b_tag, 0x0 } }));
+}
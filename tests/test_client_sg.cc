@@ -0,0 +1,285 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Scatter-gather writes, in a file of their own as they need the real <sys/socket.h>. */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "common.h"
+
+#include <warppipe/client.h>
+#include <warppipe/crc.h>
+#include <warppipe/proto.h>
+
+extern "C" {
+FAKE_VALUE_FUNC(ssize_t, sendmsg, int, const struct msghdr *, int);
+FAKE_VALUE_FUNC(ssize_t, recvmsg, int, struct msghdr *, int);
+}
+
+using xport = warppipe_pcie_transport;
+
+class TestClientSg : public ::testing::Test {
+public:
+	warppipe_client client = {};
+	uint8_t data[1000];
+	/* bytes passed to sendmsg, one vector per call */
+	std::vector<std::vector<uint8_t>> sent;
+	std::vector<int> sent_flags;
+	size_t max_send = SIZE_MAX;
+
+	virtual void SetUp() override {
+		std::iota(&data[0], &data[sizeof(data)], 0);
+
+		RESET_FAKE(sendmsg);
+		RESET_FAKE(recvmsg);
+		/* empty error queue */
+		recvmsg_fake.custom_fake = [](int fd, struct msghdr *msg, int flags) -> ssize_t {
+			errno = EAGAIN;
+			return -1;
+		};
+		sendmsg_fake.custom_fake = [this](int fd, const struct msghdr *msg, int flags) {
+			std::vector<uint8_t> bytes;
+
+			for (size_t i = 0; i < msg->msg_iovlen && bytes.size() < max_send; i++) {
+				const uint8_t *base = (const uint8_t *)msg->msg_iov[i].iov_base;
+				size_t len = std::min(msg->msg_iov[i].iov_len, max_send - bytes.size());
+
+				bytes.insert(bytes.end(), base, base + len);
+			}
+			sent.push_back(bytes);
+			sent_flags.push_back(flags);
+			return (ssize_t)bytes.size();
+		};
+
+		warppipe_client_create(&client, 10);
+		warppipe_register_bar(&client, 0x1000, 0x1000, 0, NULL, NULL);
+		client.write_sg_threshold = 64;
+	}
+
+	virtual void TearDown() override {
+		warppipe_client_destroy(&client);
+	}
+
+	std::vector<uint8_t> all_sent()
+	{
+		std::vector<uint8_t> bytes;
+
+		for (auto &s : sent)
+			bytes.insert(bytes.end(), s.begin(), s.end());
+		return bytes;
+	}
+
+	void check_write(const uint8_t *pkt, uint64_t addr, int length)
+	{
+		xport *tport = (xport *)pkt;
+		const pcie_tlp *tlp = &tport->t_tlp.dl_tlp;
+		const uint8_t *payload = tlp->tlp_fmt & PCIE_TLP_FMT_4DW ? tlp->tlp_req.r_data64 : tlp->tlp_req.r_data32;
+
+		ASSERT_EQ(tport->t_proto, PCIE_PROTO_TLP);
+		ASSERT_EQ(tlp_req_get_addr(tlp), 0x1000 + (addr & ~3ULL));
+		ASSERT_EQ(tlp_data_length(tlp), (length + (addr & 3) + 3) / 4);
+		ASSERT_TRUE(pcie_lcrc32_valid(&tport->t_tlp));
+		ASSERT_EQ(memcmp(payload + (addr & 3), data, length), 0);
+	}
+};
+
+TEST_F(TestClientSg, SendsPayloadFromCallerBuffer) {
+	ASSERT_EQ(warppipe_write(&client, 0, 0x3, data, 101), 0);
+
+	ASSERT_EQ(sendmsg_fake.call_count, 1);
+	ASSERT_EQ(sent_flags[0], 0);
+	/* 3DW header, the address fits in 32 bits */
+	ASSERT_EQ(sent[0].size(), 1 + 2 + 12 + 104 + 4);
+	check_write(sent[0].data(), 0x3, 101);
+}
+
+TEST_F(TestClientSg, SmallWritesAreCopied) {
+	client.tx_batch = true;
+	ASSERT_EQ(warppipe_write(&client, 0, 0x0, data, 63), 0);
+
+	ASSERT_EQ(sendmsg_fake.call_count, 0);
+	ASSERT_GT(client.tx_len, 63);
+
+	/* disabled */
+	client.write_sg_threshold = 0;
+	ASSERT_EQ(warppipe_write(&client, 0, 0x0, data, 500), 0);
+	ASSERT_EQ(sendmsg_fake.call_count, 0);
+}
+
+TEST_F(TestClientSg, TakesQueuedPacketsAlong) {
+	client.tx_batch = true;
+	ASSERT_EQ(warppipe_ack(&client, PCIE_DLLP_ACK, 1), 0);
+	ASSERT_EQ(warppipe_write(&client, 0, 0x10, data, 64), 0);
+
+	ASSERT_EQ(sendmsg_fake.call_count, 1);
+	ASSERT_EQ(client.tx_len, 0);
+	ASSERT_EQ(((const xport *)sent[0].data())->t_dllp.dl_type, PCIE_DLLP_ACK);
+	check_write(sent[0].data() + 1 + sizeof(pcie_dllp), 0x10, 64);
+}
+
+TEST_F(TestClientSg, RetriesShortWrites) {
+	max_send = 7;
+	ASSERT_EQ(warppipe_write(&client, 0, 0x1, data, 200), 0);
+
+	ASSERT_TRUE(client.active);
+	ASSERT_GT(sendmsg_fake.call_count, 1);
+	check_write(all_sent().data(), 0x1, 200);
+}
+
+TEST_F(TestClientSg, SendFails) {
+	sendmsg_fake.custom_fake = [](int fd, const struct msghdr *msg, int flags) {
+		errno = EPIPE;
+		return (ssize_t)-1;
+	};
+
+	ASSERT_EQ(warppipe_write(&client, 0, 0x0, data, 200), -1);
+	ASSERT_FALSE(client.active);
+}
+
+static std::vector<const void *> released;
+
+static void release(const void *data, void *private_data)
+{
+	released.push_back(data);
+}
+
+TEST_F(TestClientSg, ZerocopyFallsBackToCopy) {
+	released.clear();
+	ASSERT_EQ(warppipe_write_zerocopy(&client, 0, 0x0, data, 200, release), 0);
+
+	/* sent right away, buffer released before returning */
+	ASSERT_EQ(sendmsg_fake.call_count, 1);
+	ASSERT_EQ(sent_flags[0], 0);
+	ASSERT_EQ(released.size(), 1);
+}
+
+/* queue a notification for MSG_ZEROCOPY calls lo..hi, read with recvmsg(MSG_ERRQUEUE) */
+static void notify(uint32_t lo, uint32_t hi)
+{
+	static struct sock_extended_err serr;
+
+	serr = {};
+	serr.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr.ee_info = lo;
+	serr.ee_data = hi;
+
+	RESET_FAKE(recvmsg);
+	recvmsg_fake.custom_fake = [](int fd, struct msghdr *msg, int flags) -> ssize_t {
+		EXPECT_TRUE(flags & MSG_ERRQUEUE);
+		if (recvmsg_fake.call_count > 1) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+
+		cm->cmsg_level = SOL_IP;
+		cm->cmsg_type = IP_RECVERR;
+		cm->cmsg_len = CMSG_LEN(sizeof(serr));
+		memcpy(CMSG_DATA(cm), &serr, sizeof(serr));
+		return 0;
+	};
+}
+
+/* handles DLLPs from the peer, the socket calls of this file are not faked */
+extern "C" void handle_dllp(struct warppipe_client *client, const struct pcie_dllp *pkt);
+
+static void ack(warppipe_client *client, enum pcie_dllp_type type, uint16_t seqno)
+{
+	pcie_dllp dllp = {};
+
+	dllp.dl_type = type;
+	dllp.dl_acknak.dl_seqno_hi = seqno >> 8;
+	dllp.dl_acknak.dl_seqno_lo = seqno & 0xff;
+	handle_dllp(client, &dllp);
+}
+
+TEST_F(TestClientSg, ZerocopyReleasesOnNotificationAndAck) {
+	released.clear();
+	client.zerocopy = true;
+
+	ASSERT_EQ(warppipe_write_zerocopy(&client, 0, 0x0, data, 200, release), 0);
+	uint16_t first = client.seqno;
+	ASSERT_EQ(warppipe_write_zerocopy(&client, 0, 0x100, data + 100, 300, release), 0);
+	uint16_t second = client.seqno;
+
+	ASSERT_EQ(sendmsg_fake.call_count, 2);
+	ASSERT_EQ(sent_flags[0], MSG_ZEROCOPY);
+	check_write(sent[0].data(), 0x0, 200);
+	ASSERT_TRUE(released.empty());
+
+	/* the kernel reports the first call done, the peer has not acknowledged it yet */
+	notify(0, 0);
+	ASSERT_EQ(warppipe_client_zerocopy_reap(&client), 2);
+	ASSERT_TRUE(released.empty());
+
+	ack(&client, PCIE_DLLP_ACK, first);
+	ASSERT_EQ(released.size(), 1);
+	ASSERT_EQ(released[0], data);
+
+	/* nothing new */
+	ASSERT_EQ(warppipe_client_zerocopy_reap(&client), 1);
+	ASSERT_EQ(released.size(), 1);
+
+	/* acknowledged before the kernel is done */
+	ack(&client, PCIE_DLLP_ACK, second);
+	ASSERT_EQ(released.size(), 1);
+	notify(1, 1);
+	ASSERT_EQ(warppipe_client_zerocopy_reap(&client), 0);
+	ASSERT_EQ(released.size(), 2);
+	ASSERT_EQ(released[1], data + 100);
+}
+
+TEST_F(TestClientSg, ZerocopyReplaysFromCallerBuffer) {
+	released.clear();
+	client.zerocopy = true;
+
+	ASSERT_EQ(warppipe_write_zerocopy(&client, 0, 0x2, data, 300, release), 0);
+	uint16_t seqno = client.seqno;
+
+	notify(0, 0);
+	ASSERT_EQ(warppipe_client_zerocopy_reap(&client), 1);
+
+	/* the TLP got lost, it is sent again from data, with the kernel copying it */
+	ack(&client, PCIE_DLLP_NAK, seqno - 1);
+	ASSERT_EQ(sendmsg_fake.call_count, 2);
+	ASSERT_EQ(sent_flags[1], 0);
+	ASSERT_EQ(sent[1], sent[0]);
+	check_write(sent[1].data(), 0x2, 300);
+	ASSERT_TRUE(released.empty());
+
+	ack(&client, PCIE_DLLP_ACK, seqno);
+	ASSERT_EQ(released.size(), 1);
+	ASSERT_EQ(warppipe_client_zerocopy_reap(&client), 0);
+}
+
+TEST_F(TestClientSg, ZerocopyReleasedOnDestroy) {
+	released.clear();
+	client.zerocopy = true;
+
+	ASSERT_EQ(warppipe_write_zerocopy(&client, 0, 0x0, data, 200, release), 0);
+	ASSERT_TRUE(released.empty());
+	warppipe_client_destroy(&client);
+	ASSERT_EQ(released.size(), 1);
+}
@@ -15,11 +15,15 @@
  * limitations under the License.
  */
 
+#include <random>
+#include <vector>
+
 #include <gtest/gtest.h>
 #include "common.h"
 
 #include <warppipe/proto.h>
 #include <warppipe/crc.h>
+#include <warppipe/config.h>
 
 TEST(TestCrc, Crc32Correct) {
 	warppipe_pcie_transport tport = {
@@ -63,3 +67,107 @@ TEST(TestCrc, Crc16Correct) {
 	uint16_t actual_crc = tport.t_dllp.dl_crc16[0] | tport.t_dllp.dl_crc16[1] << 8;
 	ASSERT_EQ(actual_crc, 0x62b3);
 }
+
+static uint32_t crc32_reference(const uint8_t *data, size_t len, uint32_t crc, uint32_t poly)
+{
+	for (size_t n = 0; n < len; n++) {
+		crc ^= data[n];
+		for (int i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+	}
+	return crc;
+}
+
+TEST(TestCrc, Crc32pMatchesReference) {
+	std::vector<uint8_t> buf(CLIENT_BUFFER_SIZE + 16);
+	std::mt19937 rng(2115);
+
+	for (auto &b : buf)
+		b = rng();
+
+	/* cover every alignment and all tail lengths of the sliced loop */
+	for (size_t offset = 0; offset < 8; offset++) {
+		for (size_t len = 0; len < 64; len++) {
+			const uint8_t *p = buf.data() + offset;
+
+			ASSERT_EQ(crc32p(p, p + len, 0xffffffff, TLP_LCRC32_POLY),
+				  crc32_reference(p, len, 0xffffffff, TLP_LCRC32_POLY));
+			ASSERT_EQ(crc32p(p, p + len, 0xffff, DLLP_CRC16_POLY),
+				  crc32_reference(p, len, 0xffff, DLLP_CRC16_POLY));
+		}
+	}
+
+	/* 4 KiB completion payload */
+	const uint8_t *p = buf.data() + 3;
+	ASSERT_EQ(crc32p(p, p + CLIENT_MAX_PACKET_DATA_SIZE, 0xffffffff, TLP_LCRC32_POLY),
+		  crc32_reference(p, CLIENT_MAX_PACKET_DATA_SIZE, 0xffffffff, TLP_LCRC32_POLY));
+}
+
+TEST(TestCrc, Crc32pOtherPoly) {
+	const uint8_t data[] = "123456789";
+
+	/* CRC-32C check value */
+	ASSERT_EQ(~crc32p(data, data + 9, 0xffffffff, 0x82f63b78), 0xe3069283);
+}
+
+TEST(TestCrc, Lcrc32KernelsMatchReference) {
+	std::vector<uint8_t> buf(2 * CLIENT_BUFFER_SIZE);
+	std::mt19937 rng(2115);
+
+	for (auto &b : buf)
+		b = rng();
+
+	ASSERT_NE(lcrc32_kernel_selected(), nullptr);
+	ASSERT_TRUE(lcrc32_kernel_selected()->supported());
+
+	for (int idx = 0; lcrc32_kernel_get(idx) != NULL; idx++) {
+		const lcrc32_kernel *kernel = lcrc32_kernel_get(idx);
+
+		if (!kernel->supported())
+			continue;
+
+		/* short, fold-by-4, fold-by-16 and the tails of each */
+		for (size_t len = 0; len < 1100; len += (len < 300 ? 1 : 13)) {
+			for (size_t offset = 0; offset < 4; offset++) {
+				const uint8_t *p = buf.data() + offset;
+				uint32_t init = rng();
+
+				ASSERT_EQ(kernel->update(p, len, init),
+					  crc32_reference(p, len, init, TLP_LCRC32_POLY))
+					<< kernel->name << " len " << len << " offset " << offset;
+			}
+		}
+
+		ASSERT_EQ(kernel->update(buf.data() + 1, CLIENT_BUFFER_SIZE, 0xffffffff),
+			  crc32_reference(buf.data() + 1, CLIENT_BUFFER_SIZE, 0xffffffff, TLP_LCRC32_POLY))
+			<< kernel->name;
+	}
+}
+
+TEST(TestCrc, Lcrc32Streaming) {
+	uint8_t buf[sizeof(warppipe_pcie_transport) + 64] = {};
+	warppipe_pcie_transport *tport = (warppipe_pcie_transport *)buf;
+
+	tport->t_proto = PCIE_PROTO_TLP;
+	tport->t_tlp.dl_seqno_lo = 0x42;
+	tport->t_tlp.dl_tlp.tlp_fmt = PCIE_TLP_MWR32 >> 5;
+	tport->t_tlp.dl_tlp.tlp_type = PCIE_TLP_MWR32 & 0x1f;
+	tlp_req_set_addr(&tport->t_tlp.dl_tlp, 0x1000, 64);
+	for (int i = 0; i < 64; i++)
+		tport->t_tlp.dl_tlp.tlp_req.r_data32[i] = i;
+	pcie_lcrc32(&tport->t_tlp);
+
+	const uint8_t *start = (const uint8_t *)&tport->t_tlp;
+	size_t len = 2 + tlp_total_length(&tport->t_tlp.dl_tlp);
+	const uint8_t *lcrc = start + len;
+	uint32_t expected = lcrc[0] | lcrc[1] << 8 | lcrc[2] << 16 | (uint32_t)lcrc[3] << 24;
+
+	for (size_t split = 0; split <= len; split++) {
+		pcie_lcrc32_ctx ctx;
+
+		pcie_lcrc32_init(&ctx);
+		pcie_lcrc32_update(&ctx, start, split);
+		pcie_lcrc32_update(&ctx, start + split, len - split);
+		ASSERT_EQ(pcie_lcrc32_final(&ctx), expected) << "split " << split;
+	}
+}
@@ -15,21 +15,36 @@
  * limitations under the License.
  */
 
+#include <vector>
+
 #include <gtest/gtest.h>
 #include "common.h"
 
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
 #include <warppipe/server.h>
+#include <warppipe/client.h>
 #include <warppipe/config.h>
 
 extern "C" {
 FAKE_VALUE_FUNC(int, bind, int, void *, int);
 FAKE_VALUE_FUNC(int, socket, int, int, int);
 FAKE_VALUE_FUNC(int, listen, int, int);
+FAKE_VALUE_FUNC(int, connect, int, void *, int);
 FAKE_VALUE_FUNC(int, accept, int, void *, size_t *);
 FAKE_VALUE_FUNC(int, getsockname, int, void *, size_t *);
 FAKE_VALUE_FUNC(int, getpeername, int, void *, size_t *);
 FAKE_VALUE_FUNC(int, getnameinfo, void *, size_t *, char *, size_t, char *, size_t, int);
 FAKE_VALUE_FUNC(int, setsockopt, int, int, int,const void *, size_t);
+DECLARE_FAKE_VALUE_FUNC(int, recv, int, void *, size_t, int);
+DECLARE_FAKE_VALUE_FUNC(int, send, int, void *, size_t, int);
+DECLARE_FAKE_VALUE_FUNC(ssize_t, sendmsg, int, const struct msghdr *, int);
+DECLARE_FAKE_VALUE_FUNC(ssize_t, recvmsg, int, struct msghdr *, int);
 }
 
 TEST(TestServer, CreatesServer) {
@@ -92,3 +107,699 @@ TEST(TestServer, ServerLoopEmpty) {
 	warppipe_server_loop(&server);
 	warppipe_server_disconnect_clients(&server, NULL);
 }
+
+TEST(TestServer, ServerSelectBackend) {
+	warppipe_server server = {};
+	server.listen = true;
+	server.port = "0";
+	server.backend = WARPPIPE_SERVER_BACKEND_SELECT;
+
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+
+	bind_fake.return_val = 0;
+	socket_fake.return_val = 10;
+
+	warppipe_server_create(&server);
+
+	EXPECT_EQ(server.epoll_fd, -1);
+}
+
+/* the handler leaves the server alone, the loop ends and the caller destroys it */
+TEST(TestServer, SigintOnlyRequestsQuit) {
+	warppipe_server server = {};
+	server.listen = true;
+	server.port = "0";
+
+	int sv[2];
+
+	ASSERT_EQ(pipe(sv), 0);
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+	RESET_FAKE(listen);
+	RESET_FAKE(setsockopt);
+
+	socket_fake.return_val = sv[0];
+
+	ASSERT_EQ(warppipe_server_create(&server), 0);
+	int epoll_fd = server.epoll_fd;
+
+	raise(SIGINT);
+	EXPECT_TRUE(server.quit);
+	EXPECT_EQ(server.epoll_fd, epoll_fd);
+
+	warppipe_server_destroy(&server);
+	EXPECT_EQ(server.epoll_fd, -1);
+	close(sv[1]);
+}
+
+#ifdef __linux__
+TEST(TestServer, ServerEpollAcceptsAndDropsClients) {
+	warppipe_server server = {};
+	server.listen = true;
+	server.port = "0";
+	server.backend = WARPPIPE_SERVER_BACKEND_EPOLL;
+
+	/* pipes stand in for the listening and the accepted sockets */
+	int listen_sv[2], client_sv[2];
+
+	ASSERT_EQ(pipe(listen_sv), 0);
+	ASSERT_EQ(pipe(client_sv), 0);
+
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+	RESET_FAKE(listen);
+	RESET_FAKE(accept);
+	RESET_FAKE(getnameinfo);
+	RESET_FAKE(recv);
+
+	socket_fake.return_val = listen_sv[0];
+	accept_fake.custom_fake = [&](int, void *, size_t *) {
+		if (accept_fake.call_count == 1)
+			return client_sv[0];
+		errno = EAGAIN;
+		return -1;
+	};
+
+	ASSERT_EQ(warppipe_server_create(&server), 0);
+	ASSERT_NE(server.epoll_fd, -1);
+
+	/* make the listening socket readable, the accept queue is drained in one pass */
+	ASSERT_EQ(write(listen_sv[1], "x", 1), 1);
+	warppipe_server_loop(&server);
+
+	EXPECT_EQ(accept_fake.call_count, 2);
+	ASSERT_FALSE(TAILQ_EMPTY(&server.clients));
+	EXPECT_EQ(TAILQ_FIRST(&server.clients)->client->fd, client_sv[0]);
+
+	/* peer hangs up, client is removed on the next wakeup */
+	char c;
+
+	ASSERT_EQ(read(listen_sv[0], &c, 1), 1);
+	close(client_sv[1]);
+	recv_fake.return_val = 0;
+	warppipe_server_loop(&server);
+
+	EXPECT_EQ(recv_fake.call_count, 1);
+	EXPECT_TRUE(TAILQ_EMPTY(&server.clients));
+
+	warppipe_server_destroy(&server);
+	close(listen_sv[1]);
+}
+
+/* <sys/socket.h> conflicts with the fakes above */
+extern "C" int socketpair(int domain, int type, int protocol, int sv[2]);
+constexpr int TEST_AF_UNIX = 1;
+constexpr int TEST_SOCK_STREAM = 1;
+constexpr int TEST_MSG_DONTWAIT = 0x40;
+
+static uint8_t uring_bar[64];
+
+static int uring_bar_read(uint64_t addr, void *data, int length, void *private_data)
+{
+	memcpy(data, uring_bar + addr, length);
+	return 0;
+}
+
+static void uring_accept(warppipe_client *client, void *private_data)
+{
+	warppipe_register_bar(client, 0x1000, sizeof(uring_bar), 0, uring_bar_read, NULL);
+}
+
+/* serve one read request from a requester on the other end of a socketpair */
+static void server_read_request(enum warppipe_server_backend backend, unsigned int server_sends)
+{
+	warppipe_server server = {};
+	server.listen = true;
+	server.port = "0";
+	server.backend = backend;
+
+	int listen_sv[2], conn_sv[2];
+
+	ASSERT_EQ(socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, listen_sv), 0);
+	ASSERT_EQ(socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, conn_sv), 0);
+
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+	RESET_FAKE(listen);
+	RESET_FAKE(accept);
+	RESET_FAKE(getnameinfo);
+	RESET_FAKE(send);
+	RESET_FAKE(recv);
+
+	socket_fake.return_val = listen_sv[0];
+	accept_fake.custom_fake = [&](int, void *, size_t *) {
+		if (accept_fake.call_count == 1)
+			return conn_sv[0];
+		errno = EAGAIN;
+		return -1;
+	};
+
+	ASSERT_EQ(warppipe_server_create(&server), 0);
+	if (backend == WARPPIPE_SERVER_BACKEND_IO_URING && !server.uring) {
+		warppipe_server_destroy(&server);
+		close(listen_sv[1]);
+		close(conn_sv[0]);
+		close(conn_sv[1]);
+		GTEST_SKIP() << "io_uring is not available";
+	}
+	warppipe_server_register_accept_cb(&server, uring_accept);
+
+	ASSERT_EQ(write(listen_sv[1], "x", 1), 1);
+	warppipe_server_loop(&server);
+	ASSERT_FALSE(TAILQ_EMPTY(&server.clients));
+
+	/* the requester uses plain socket calls, routed through the fakes */
+	warppipe_client peer;
+
+	warppipe_client_create(&peer, conn_sv[1]);
+	warppipe_register_bar(&peer, 0x1000, sizeof(uring_bar), 0, NULL, NULL);
+	send_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)write(fd, buf, len);
+	};
+	recv_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)read(fd, buf, len);
+	};
+
+	for (size_t i = 0; i < sizeof(uring_bar); i++)
+		uring_bar[i] = i;
+
+	static uint8_t completion[4];
+	static int completion_len;
+
+	completion_len = 0;
+	ASSERT_EQ(warppipe_read(&peer, 0, 8, sizeof(completion),
+		  [](const warppipe_completion_status, const void *data, int length, void *) {
+			  memcpy(completion, data, length);
+			  completion_len = length;
+		  }), 0);
+
+	/* the ACK and the completion leave in a single batch */
+	warppipe_server_loop(&server);
+	EXPECT_EQ(send_fake.call_count, 1 + server_sends);
+
+	while (completion_len == 0 && peer.active)
+		warppipe_client_read(&peer);
+	ASSERT_EQ(completion_len, 4);
+	EXPECT_EQ(completion[0], 8);
+	EXPECT_EQ(completion[3], 11);
+
+	/* peer hangs up, its ACK for the completion may still be queued ahead of the EOF */
+	close(conn_sv[1]);
+	for (int i = 0; i < 2 && !TAILQ_EMPTY(&server.clients); i++)
+		warppipe_server_loop(&server);
+	EXPECT_TRUE(TAILQ_EMPTY(&server.clients));
+
+	warppipe_client_destroy(&peer);
+	warppipe_server_destroy(&server);
+	close(listen_sv[1]);
+}
+
+TEST(TestServer, ServerEpollBatchesReplies) {
+	server_read_request(WARPPIPE_SERVER_BACKEND_EPOLL, 1);
+}
+
+TEST(TestServer, ServerSelectBatchesReplies) {
+	server_read_request(WARPPIPE_SERVER_BACKEND_SELECT, 1);
+}
+
+/* the io_uring backend sends without send() */
+TEST(TestServer, ServerIoUringReadRequest) {
+	server_read_request(WARPPIPE_SERVER_BACKEND_IO_URING, 0);
+}
+
+/* replies that do not fit one batch go out in several instead of growing it */
+TEST(TestServer, ServerIoUringSendsLargeBatchesInParts) {
+	constexpr int READS = 200;
+	warppipe_server server = {};
+	server.listen = true;
+	server.port = "0";
+	server.backend = WARPPIPE_SERVER_BACKEND_IO_URING;
+
+	static int listen_sv[2], conn_sv[2];
+
+	ASSERT_EQ(socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, listen_sv), 0);
+	ASSERT_EQ(socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, conn_sv), 0);
+
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+	RESET_FAKE(listen);
+	RESET_FAKE(accept);
+	RESET_FAKE(getnameinfo);
+	RESET_FAKE(send);
+	RESET_FAKE(recv);
+
+	socket_fake.return_val = listen_sv[0];
+	accept_fake.custom_fake = [](int, void *, size_t *) {
+		if (accept_fake.call_count == 1)
+			return conn_sv[0];
+		errno = EAGAIN;
+		return -1;
+	};
+
+	ASSERT_EQ(warppipe_server_create(&server), 0);
+	if (!server.uring) {
+		warppipe_server_destroy(&server);
+		close(listen_sv[1]);
+		close(conn_sv[0]);
+		close(conn_sv[1]);
+		GTEST_SKIP() << "io_uring is not available";
+	}
+	warppipe_server_register_accept_cb(&server, uring_accept);
+
+	ASSERT_EQ(write(listen_sv[1], "x", 1), 1);
+	warppipe_server_loop(&server);
+	ASSERT_FALSE(TAILQ_EMPTY(&server.clients));
+
+	warppipe_client peer;
+
+	warppipe_client_create(&peer, conn_sv[1]);
+	warppipe_register_bar(&peer, 0x1000, sizeof(uring_bar), 0, NULL, NULL);
+	send_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)write(fd, buf, len);
+	};
+	/* the requester must not block while the server is still sending */
+	recv_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)syscall(SYS_recvfrom, fd, buf, len, TEST_MSG_DONTWAIT, NULL, NULL);
+	};
+
+	for (size_t i = 0; i < sizeof(uring_bar); i++)
+		uring_bar[i] = i;
+
+	static int completions, bad;
+
+	completions = 0;
+	bad = 0;
+	for (int i = 0; i < READS; i++) {
+		ASSERT_EQ(warppipe_read(&peer, 0, 0, sizeof(uring_bar),
+			  [](const warppipe_completion_status status, const void *data, int length, void *) {
+				  if (status.error_code || length != sizeof(uring_bar) || memcmp(data, uring_bar, length))
+					  bad++;
+				  completions++;
+			  }), 0);
+	}
+
+	/* the replies to all of them are far more than CLIENT_TX_BUFFER_SIZE */
+	for (int i = 0; i < 100 && completions < READS && peer.active; i++) {
+		warppipe_server_loop(&server);
+		warppipe_client_read(&peer);
+	}
+	EXPECT_EQ(completions, READS);
+	EXPECT_EQ(bad, 0);
+
+	close(conn_sv[1]);
+	for (int i = 0; i < 2 && !TAILQ_EMPTY(&server.clients); i++)
+		warppipe_server_loop(&server);
+	EXPECT_TRUE(TAILQ_EMPTY(&server.clients));
+
+	warppipe_client_destroy(&peer);
+	warppipe_server_destroy(&server);
+	close(listen_sv[1]);
+}
+
+/* every shard binds the port the first one got */
+TEST(TestServer, ShardsShareThePort) {
+	warppipe_server config = {};
+	config.listen = true;
+	config.host = "127.0.0.1";
+	config.port = "0";
+
+	static std::vector<int> peers;
+	static std::vector<int> bound_ports;
+
+	peers.clear();
+	bound_ports.clear();
+
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+	RESET_FAKE(listen);
+	RESET_FAKE(accept);
+	RESET_FAKE(getsockname);
+	RESET_FAKE(getnameinfo);
+
+	/* socketpairs stand in for the listening sockets, so they can be shut down */
+	socket_fake.custom_fake = [](int, int, int) {
+		int sv[2];
+
+		if (socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, sv) == -1)
+			return -1;
+		peers.push_back(sv[1]);
+		return sv[0];
+	};
+	/* struct sockaddr_in: the port follows the address family */
+	bind_fake.custom_fake = [](int, void *addr, int) {
+		bound_ports.push_back(((uint8_t *)addr)[2] << 8 | ((uint8_t *)addr)[3]);
+		return 0;
+	};
+	getsockname_fake.custom_fake = [](int, void *addr, size_t *) {
+		memset(addr, 0, 16);
+		((uint8_t *)addr)[0] = 2;
+		((uint8_t *)addr)[2] = 4242 >> 8;
+		((uint8_t *)addr)[3] = 4242 & 0xff;
+		return 0;
+	};
+	getnameinfo_fake.custom_fake = [](void *, size_t *, char *host, size_t, char *serv, size_t, int) {
+		strcpy(host, "127.0.0.1");
+		strcpy(serv, "4242");
+		return 0;
+	};
+	accept_fake.custom_fake = [](int, void *, size_t *) {
+		errno = EAGAIN;
+		return -1;
+	};
+
+	warppipe_server_shards shards = {};
+
+	shards.pin = true;
+	ASSERT_EQ(warppipe_server_shards_create(&shards, &config, 4), 0);
+	EXPECT_STREQ(shards.port, "4242");
+	ASSERT_EQ(bound_ports.size(), 4);
+	EXPECT_EQ(bound_ports[0], 0);
+	for (int i = 1; i < 4; i++)
+		EXPECT_EQ(bound_ports[i], 4242);
+	EXPECT_NE(warppipe_server_shards_get(&shards, 0)->fd, warppipe_server_shards_get(&shards, 3)->fd);
+
+	/* returns once every event loop noticed */
+	warppipe_server_shards_destroy(&shards);
+	EXPECT_EQ(shards.shards, nullptr);
+
+	for (int fd : peers)
+		close(fd);
+}
+#endif
+
+#ifdef __linux__
+/* a requester connected over shared memory, the Unix sockets are socketpairs */
+TEST(TestServer, SharedMemoryReadRequest) {
+	warppipe_server server = {};
+	server.listen = true;
+	server.host = "/tmp/warppipe-test-shm.sock";
+	server.transport = WARPPIPE_TRANSPORT_SHM;
+
+	static int listen_sv[2], conn_sv[2];
+
+	ASSERT_EQ(socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, listen_sv), 0);
+	ASSERT_EQ(socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, conn_sv), 0);
+
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+	RESET_FAKE(listen);
+	RESET_FAKE(connect);
+	RESET_FAKE(accept);
+	RESET_FAKE(send);
+	RESET_FAKE(recv);
+	RESET_FAKE(sendmsg);
+	RESET_FAKE(recvmsg);
+
+	socket_fake.custom_fake = [](int, int, int) {
+		return socket_fake.call_count == 1 ? listen_sv[0] : conn_sv[1];
+	};
+	/* the file descriptor of the rings goes over the real socket */
+	sendmsg_fake.custom_fake = [](int fd, const struct msghdr *msg, int flags) {
+		return (ssize_t)syscall(SYS_sendmsg, fd, msg, flags);
+	};
+	recvmsg_fake.custom_fake = [](int fd, struct msghdr *msg, int flags) {
+		return (ssize_t)syscall(SYS_recvmsg, fd, msg, flags);
+	};
+	accept_fake.custom_fake = [](int, void *, size_t *) {
+		if (accept_fake.call_count == 1)
+			return conn_sv[0];
+		errno = EAGAIN;
+		return -1;
+	};
+	send_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)write(fd, buf, len);
+	};
+	recv_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)read(fd, buf, len);
+	};
+
+	ASSERT_EQ(warppipe_server_create(&server), 0);
+	warppipe_server_register_accept_cb(&server, uring_accept);
+
+	/* the listening side hands the rings over as it accepts */
+	ASSERT_EQ(write(listen_sv[1], "x", 1), 1);
+	warppipe_server_loop(&server);
+	ASSERT_FALSE(TAILQ_EMPTY(&server.clients));
+	ASSERT_NE(TAILQ_FIRST(&server.clients)->client->io, nullptr);
+
+	warppipe_server requester = {};
+	requester.listen = false;
+	requester.host = server.host;
+	requester.transport = WARPPIPE_TRANSPORT_SHM;
+	ASSERT_EQ(warppipe_server_create(&requester), 0);
+	ASSERT_FALSE(TAILQ_EMPTY(&requester.clients));
+
+	warppipe_client *peer = TAILQ_FIRST(&requester.clients)->client;
+
+	ASSERT_NE(peer->io, nullptr);
+	warppipe_register_bar(peer, 0x1000, sizeof(uring_bar), 0, NULL, NULL);
+
+	for (size_t i = 0; i < sizeof(uring_bar); i++)
+		uring_bar[i] = i;
+
+	static uint8_t completion[4];
+	static int completion_len;
+
+	completion_len = 0;
+	ASSERT_EQ(warppipe_read(peer, 0, 8, sizeof(completion),
+		  [](const warppipe_completion_status, const void *data, int length, void *) {
+			  memcpy(completion, data, length);
+			  completion_len = length;
+		  }), 0);
+
+	/* the request is in shared memory, the socket only carries the wakeup */
+	warppipe_server_loop(&server);
+	for (int i = 0; i < 100 && completion_len == 0 && peer->active; i++)
+		warppipe_server_loop(&requester);
+	ASSERT_EQ(completion_len, 4);
+	EXPECT_EQ(completion[0], 8);
+	EXPECT_EQ(completion[3], 11);
+
+	/* the requester goes away, the server notices on the socket */
+	warppipe_server_destroy(&requester);
+	for (int i = 0; i < 2 && !TAILQ_EMPTY(&server.clients); i++)
+		warppipe_server_loop(&server);
+	EXPECT_TRUE(TAILQ_EMPTY(&server.clients));
+
+	warppipe_server_destroy(&server);
+	close(listen_sv[1]);
+}
+#endif
+
+#ifdef __linux__
+/* offsetof(struct sockaddr_un, sun_path), sys/un.h would clash with the fakes */
+constexpr int TEST_SUN_PATH_OFFSET = 2;
+
+TEST(TestServer, UnixSocketReadRequest) {
+	static char path[64];
+	static int bind_addrlen;
+	warppipe_server server = {};
+
+	snprintf(path, sizeof(path), "@warppipe-test-%d", getpid());
+	server.listen = true;
+	server.addr_family = TEST_AF_UNIX;
+	server.host = path;
+
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+	RESET_FAKE(listen);
+	RESET_FAKE(connect);
+	RESET_FAKE(accept);
+	RESET_FAKE(send);
+	RESET_FAKE(recv);
+
+	/* real sockets, so that the kernel checks the abstract address */
+	socket_fake.custom_fake = [](int domain, int type, int protocol) {
+		return (int)syscall(SYS_socket, domain, type, protocol);
+	};
+	bind_fake.custom_fake = [](int fd, void *addr, int addrlen) {
+		bind_addrlen = addrlen;
+		return (int)syscall(SYS_bind, fd, addr, addrlen);
+	};
+	listen_fake.custom_fake = [](int fd, int backlog) {
+		return (int)syscall(SYS_listen, fd, backlog);
+	};
+	connect_fake.custom_fake = [](int fd, void *addr, int addrlen) {
+		return (int)syscall(SYS_connect, fd, addr, addrlen);
+	};
+	accept_fake.custom_fake = [](int fd, void *addr, size_t *addrlen) {
+		return (int)syscall(SYS_accept4, fd, addr, addrlen, 0);
+	};
+	send_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)write(fd, buf, len);
+	};
+	recv_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)read(fd, buf, len);
+	};
+
+	ASSERT_EQ(warppipe_server_create(&server), 0);
+	warppipe_server_register_accept_cb(&server, uring_accept);
+	/* the name is not NUL-terminated, the address ends right after it */
+	EXPECT_EQ(bind_addrlen, (int)(TEST_SUN_PATH_OFFSET + strlen(path)));
+
+	warppipe_server requester = {};
+	requester.listen = false;
+	requester.addr_family = TEST_AF_UNIX;
+	requester.host = path;
+	ASSERT_EQ(warppipe_server_create(&requester), 0);
+
+	warppipe_client *peer = TAILQ_FIRST(&requester.clients)->client;
+
+	warppipe_register_bar(peer, 0x1000, sizeof(uring_bar), 0, NULL, NULL);
+	for (size_t i = 0; i < sizeof(uring_bar); i++)
+		uring_bar[i] = i;
+
+	static uint8_t completion[4];
+	static int completion_len;
+
+	completion_len = 0;
+	ASSERT_EQ(warppipe_read(peer, 0, 16, sizeof(completion),
+		  [](const warppipe_completion_status, const void *data, int length, void *) {
+			  memcpy(completion, data, length);
+			  completion_len = length;
+		  }), 0);
+
+	/* accept, then answer the request */
+	for (int i = 0; i < 2; i++)
+		warppipe_server_loop(&server);
+	ASSERT_FALSE(TAILQ_EMPTY(&server.clients));
+	for (int i = 0; i < 100 && completion_len == 0 && peer->active; i++)
+		warppipe_server_loop(&requester);
+	ASSERT_EQ(completion_len, 4);
+	EXPECT_EQ(completion[0], 16);
+	EXPECT_EQ(completion[3], 19);
+
+	warppipe_server_destroy(&requester);
+	for (int i = 0; i < 2 && !TAILQ_EMPTY(&server.clients); i++)
+		warppipe_server_loop(&server);
+	EXPECT_TRUE(TAILQ_EMPTY(&server.clients));
+
+	warppipe_server_destroy(&server);
+}
+#endif
+
+#ifdef __linux__
+static int shared_bar_fd;
+
+static void shared_bar_accept(warppipe_client *client, void *private_data)
+{
+	warppipe_register_bar_memfd(client, 0x1000, 4096, 0, shared_bar_fd, 0);
+}
+
+TEST(TestServer, SharedBarMemory) {
+	static char path[64];
+	warppipe_server server = {};
+
+	snprintf(path, sizeof(path), "@warppipe-test-bar-%d", getpid());
+	server.listen = true;
+	server.addr_family = TEST_AF_UNIX;
+	server.host = path;
+	server.share_bars = true;
+
+	shared_bar_fd = memfd_create("warppipe-test", MFD_CLOEXEC);
+	ASSERT_NE(shared_bar_fd, -1);
+	ASSERT_EQ(ftruncate(shared_bar_fd, 4096), 0);
+
+	uint8_t *device = (uint8_t *)mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, shared_bar_fd, 0);
+
+	ASSERT_NE(device, MAP_FAILED);
+
+	RESET_FAKE(bind);
+	RESET_FAKE(socket);
+	RESET_FAKE(listen);
+	RESET_FAKE(connect);
+	RESET_FAKE(accept);
+	RESET_FAKE(send);
+	RESET_FAKE(recv);
+	RESET_FAKE(sendmsg);
+	RESET_FAKE(recvmsg);
+
+	socket_fake.custom_fake = [](int domain, int type, int protocol) {
+		return (int)syscall(SYS_socket, domain, type, protocol);
+	};
+	bind_fake.custom_fake = [](int fd, void *addr, int addrlen) {
+		return (int)syscall(SYS_bind, fd, addr, addrlen);
+	};
+	listen_fake.custom_fake = [](int fd, int backlog) {
+		return (int)syscall(SYS_listen, fd, backlog);
+	};
+	connect_fake.custom_fake = [](int fd, void *addr, int addrlen) {
+		return (int)syscall(SYS_connect, fd, addr, addrlen);
+	};
+	accept_fake.custom_fake = [](int fd, void *addr, size_t *addrlen) {
+		return (int)syscall(SYS_accept4, fd, addr, addrlen, 0);
+	};
+	send_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+		return (int)write(fd, buf, len);
+	};
+	/* the memory goes along with the DLLP announcing it */
+	sendmsg_fake.custom_fake = [](int fd, const struct msghdr *msg, int flags) {
+		return (ssize_t)syscall(SYS_sendmsg, fd, msg, flags);
+	};
+	recvmsg_fake.custom_fake = [](int fd, struct msghdr *msg, int flags) {
+		return (ssize_t)syscall(SYS_recvmsg, fd, msg, flags);
+	};
+
+	ASSERT_EQ(warppipe_server_create(&server), 0);
+	warppipe_server_register_accept_cb(&server, shared_bar_accept);
+
+	warppipe_server requester = {};
+	requester.listen = false;
+	requester.addr_family = TEST_AF_UNIX;
+	requester.host = path;
+	requester.share_bars = true;
+	ASSERT_EQ(warppipe_server_create(&requester), 0);
+
+	warppipe_client *peer = TAILQ_FIRST(&requester.clients)->client;
+
+	warppipe_register_bar(peer, 0x1000, 4096, 0, NULL, NULL);
+
+	/* capabilities go both ways, then the completer passes its BAR */
+	for (int i = 0; i < 10 && !peer->peer_bars[0].memory; i++) {
+		warppipe_server_loop(&server);
+		warppipe_server_loop(&requester);
+	}
+	ASSERT_NE(peer->peer_bars[0].memory, nullptr);
+	EXPECT_EQ(peer->peer_bars[0].size, 4096u);
+
+	warppipe_client *completer = TAILQ_FIRST(&server.clients)->client;
+
+	/* the BAR has no side effects, nothing to hook */
+	EXPECT_EQ(warppipe_register_region(completer, 0, 0, 16, NULL, NULL, NULL), -1);
+
+	/* both directions are plain memory accesses, completed right away */
+	static uint8_t completion[4];
+	static int completion_len;
+	const uint8_t data[4] = { 0xde, 0xad, 0xbe, 0xef };
+
+	int seqno = peer->seqno;
+
+	memcpy(device + 8, data, sizeof(data));
+	completion_len = 0;
+	ASSERT_EQ(warppipe_read(peer, 0, 8, sizeof(completion),
+		  [](const warppipe_completion_status, const void *data, int length, void *) {
+			  memcpy(completion, data, length);
+			  completion_len = length;
+		  }), 0);
+	ASSERT_EQ(completion_len, 4);
+	EXPECT_EQ(memcmp(completion, data, sizeof(data)), 0);
+
+	ASSERT_EQ(warppipe_write(peer, 0, 100, data, sizeof(data)), 0);
+	EXPECT_EQ(memcmp(device + 100, data, sizeof(data)), 0);
+	/* and so are accesses through the completer's own mapping */
+	EXPECT_EQ(memcmp(completer->bar_mapping[0].memory + 100, data, sizeof(data)), 0);
+	EXPECT_EQ(peer->seqno, seqno);
+
+	/* past the end of the memory, TLPs are sent */
+	EXPECT_EQ(warppipe_write(peer, 0, 4095, data, sizeof(data)), 0);
+	EXPECT_GT(peer->seqno, seqno);
+
+	warppipe_server_destroy(&requester);
+	for (int i = 0; i < 2 && !TAILQ_EMPTY(&server.clients); i++)
+		warppipe_server_loop(&server);
+	warppipe_server_destroy(&server);
+	munmap(device, 4096);
+	close(shared_bar_fd);
+}
+#endif
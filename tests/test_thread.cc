@@ -0,0 +1,224 @@
+/*
+ * Copyright 2023 Antmicro <www.antmicro.com>
+ * Copyright 2023 Meta
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "common.h"
+
+#include <warppipe/client.h>
+#include <warppipe/thread.h>
+
+extern "C" {
+DECLARE_FAKE_VALUE_FUNC(int, poll, struct pollfd *, nfds_t, int);
+DECLARE_FAKE_VALUE_FUNC(int, recv, int, void *, size_t, int);
+DECLARE_FAKE_VALUE_FUNC(int, send, int, void *, size_t, int);
+}
+
+/* <sys/socket.h> conflicts with the fakes */
+extern "C" int socketpair(int domain, int type, int protocol, int sv[2]);
+constexpr int TEST_AF_UNIX = 1;
+constexpr int TEST_SOCK_STREAM = 1;
+
+static uint8_t thread_bar[0x1000];
+
+/* the client talks to itself over a socketpair, the I/O thread completes its own requests */
+class TestThread : public ::testing::Test {
+public:
+	warppipe_client client = {};
+	int sv[2];
+
+	virtual void SetUp() override {
+		ASSERT_EQ(socketpair(TEST_AF_UNIX, TEST_SOCK_STREAM, 0, sv), 0);
+
+		RESET_FAKE(poll);
+		RESET_FAKE(recv);
+		RESET_FAKE(send);
+		poll_fake.custom_fake = [](struct pollfd *fds, nfds_t nfds, int timeout) {
+			struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+
+			return ppoll(fds, nfds, timeout < 0 ? NULL : &ts, NULL);
+		};
+		send_fake.custom_fake = [this](int fd, void *buf, size_t len, int) {
+			return (int)write(sv[1], buf, len);
+		};
+		recv_fake.custom_fake = [](int fd, void *buf, size_t len, int) {
+			return (int)read(fd, buf, len);
+		};
+
+		for (size_t i = 0; i < sizeof(thread_bar); i++)
+			thread_bar[i] = i;
+
+		warppipe_client_create(&client, sv[0]);
+		warppipe_register_bar(&client, 0x10000, sizeof(thread_bar), 0,
+			[](uint64_t addr, void *data, int length, void *private_data) {
+				memcpy(data, thread_bar + addr, length);
+				return 0;
+			},
+			[](uint64_t addr, const void *data, int length, void *private_data) {
+				memcpy(thread_bar + addr, data, length);
+			});
+		client.write_sg_threshold = 0;
+	}
+
+	virtual void TearDown() override {
+		close(sv[0]);
+		if (sv[1] != -1)
+			close(sv[1]);
+	}
+};
+
+TEST_F(TestThread, ConcurrentRequests) {
+	constexpr int workers = 8;
+	constexpr int iterations = 50;
+	std::atomic<int> failures(0);
+	warppipe_thread *thread = warppipe_thread_create(&client);
+
+	ASSERT_NE(thread, nullptr);
+
+	std::vector<std::thread> threads;
+
+	for (int w = 0; w < workers; w++) {
+		threads.emplace_back([&, w]() {
+			/* every worker owns a 256-byte slice of the BAR */
+			uint64_t base = w * 0x100;
+			uint8_t buf[0x100];
+
+			for (int k = 0; k < iterations; k++) {
+				for (int j = 0; j < 0x100; j++)
+					buf[j] = w + k + j;
+				if (warppipe_thread_write(thread, 0, base, buf, sizeof(buf)) != sizeof(buf))
+					failures++;
+				memset(buf, 0, sizeof(buf));
+				if (warppipe_thread_read(thread, 0, base, buf, sizeof(buf)) != sizeof(buf))
+					failures++;
+				for (int j = 0; j < 0x100; j++)
+					if (buf[j] != (uint8_t)(w + k + j))
+						failures++;
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+
+	ASSERT_EQ(failures, 0);
+	/* every read got its completion */
+	ASSERT_EQ(client.tags_used, 0);
+
+	warppipe_thread_destroy(thread);
+}
+
+TEST_F(TestThread, SubmitCallsDone) {
+	static std::atomic<int> done;
+	uint8_t buf[16];
+	warppipe_thread_req req = {};
+	warppipe_thread *thread = warppipe_thread_create(&client);
+
+	ASSERT_NE(thread, nullptr);
+
+	done = 0;
+	req.op = { WARPPIPE_OP_READ, 0, 0x20, buf, sizeof(buf), NULL };
+	req.done = [](warppipe_thread_req *req) {
+		done = req->result;
+	};
+	ASSERT_EQ(warppipe_thread_submit(thread, &req), 0);
+
+	for (int i = 0; i < 1000 && !done; i++)
+		usleep(1000);
+	ASSERT_EQ(done, sizeof(buf));
+	ASSERT_EQ(buf[0], 0x20);
+	ASSERT_EQ(buf[15], 0x2f);
+
+	warppipe_thread_destroy(thread);
+}
+
+TEST_F(TestThread, FailsAfterDisconnect) {
+	uint8_t buf[4];
+	warppipe_thread *thread = warppipe_thread_create(&client);
+
+	ASSERT_NE(thread, nullptr);
+
+	/* the peer goes away, the I/O thread stops and requests fail */
+	close(sv[1]);
+	sv[1] = -1;
+	ASSERT_LT(warppipe_thread_read(thread, 0, 0, buf, sizeof(buf)), 0);
+
+	warppipe_thread_destroy(thread);
+}
+
+TEST_F(TestThread, RegistersRegionsOnThread) {
+	uint8_t buf[4];
+	warppipe_thread *thread = warppipe_thread_create(&client);
+
+	ASSERT_NE(thread, nullptr);
+
+	ASSERT_EQ(warppipe_thread_register_region(thread, 0, 0x100, 0x10,
+		[](uint64_t addr, void *data, int length, void *private_data) {
+			memset(data, 0x5a, length);
+			return 0;
+		}, NULL, NULL), 0);
+	ASSERT_EQ(warppipe_thread_read(thread, 0, 0x100, buf, sizeof(buf)), sizeof(buf));
+	ASSERT_EQ(buf[0], 0x5a);
+	ASSERT_EQ(warppipe_thread_read(thread, 0, 0x120, buf, sizeof(buf)), sizeof(buf));
+	ASSERT_EQ(buf[0], 0x20);
+
+	/* the region moves along with the BAR */
+	ASSERT_EQ(warppipe_thread_remap_bar(thread, 0, 0x20000), 0);
+	ASSERT_EQ(client.bar[0], 0x20000u);
+	ASSERT_EQ(warppipe_thread_read(thread, 0, 0x100, buf, sizeof(buf)), sizeof(buf));
+	ASSERT_EQ(buf[0], 0x5a);
+	ASSERT_EQ(warppipe_thread_remap_bar(thread, 0, 0x20010), -1);
+
+	warppipe_thread_destroy(thread);
+}
+
+TEST_F(TestThread, DisconnectWhileSubmitting) {
+	constexpr int workers = 8;
+	std::atomic<int> failed(0);
+	warppipe_thread *thread = warppipe_thread_create(&client);
+
+	ASSERT_NE(thread, nullptr);
+
+	/* every blocking request returns, whether it got in before the I/O thread stopped or not */
+	std::vector<std::thread> threads;
+
+	for (int w = 0; w < workers; w++) {
+		threads.emplace_back([&]() {
+			uint8_t buf[16];
+
+			while (warppipe_thread_read(thread, 0, 0, buf, sizeof(buf)) >= 0)
+				;
+			for (int i = 0; i < 100; i++)
+				if (warppipe_thread_write(thread, 0, 0, buf, sizeof(buf)) >= 0)
+					return;
+			failed++;
+		});
+	}
+	usleep(10000);
+	close(sv[1]);
+	sv[1] = -1;
+	for (auto &t : threads)
+		t.join();
+
+	ASSERT_EQ(failed, workers);
+	warppipe_thread_destroy(thread);
+}
@@ -28,8 +28,7 @@ int read_config_header_field(struct warppipe_server *server, struct warppipe_cli
 		.ret = 0,
 	};
 
-	client->private_data = (void *)&read_data;
-	ret = warppipe_config0_read(client, aligned_addr, 4, &read_compl);
+	ret = warppipe_config0_read_ctx(client, aligned_addr, 4, &read_compl, &read_data);
 	if (ret < 0) {
 		LOG_ERR("Failed to read config space at addr %lx-%lx", addr, addr + length);
 		return ret;
@@ -53,8 +52,7 @@ int read_data(struct warppipe_server *server, struct warppipe_client *client, in
 		.ret = 0,
 	};
 
-	client->private_data = (void *)&read_data;
-	ret = warppipe_read(client, bar, addr, length, &read_compl);
+	ret = warppipe_read_ctx(client, bar, addr, length, &read_compl, &read_data);
 	if (ret < 0) {
 		LOG_ERR("Failed to read bar %d at addr %lx-%lx", bar, addr, addr + length);
 		return ret;
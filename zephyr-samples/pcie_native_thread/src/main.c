@@ -26,6 +26,7 @@
 #include <warppipe/client.h>
 #include <warppipe/server.h>
 #include <warppipe/config.h>
+#include <warppipe/thread.h>
 
 #include "../../common/common.h"
 
@@ -49,9 +50,6 @@ static struct k_thread threads[NUM_THREADS];
 
 static K_THREAD_STACK_ARRAY_DEFINE(stacks, NUM_THREADS, STACK_SIZE);
 
-// Use for access to pcie_server, client.
-pthread_rwlock_t rwlock;
-
 static struct warppipe_server pcie_server = {
 	.listen = false,
 	.addr_family = AF_UNSPEC,
@@ -62,6 +60,9 @@ static struct warppipe_server pcie_server = {
 
 static struct warppipe_client *client;
 
+/* owns client once the device is enumerated */
+static struct warppipe_thread *io_thread;
+
 #ifdef DEBUG
 static void print_read_data(uint8_t *buffer, int length)
 {
@@ -78,10 +79,7 @@ void thread_task(int i)
 	int ret;
 
 	for (int k = 0; k < ITERATIONS; k++) {
-		pthread_rwlock_rdlock(&rwlock);
-			ret = read_data(&pcie_server, client, 1, 0, TRANSACTION_LENGTH, buf);
-		pthread_rwlock_unlock(&rwlock);
-
+		ret = warppipe_thread_read(io_thread, 1, 0, buf, TRANSACTION_LENGTH);
 		assert(ret == TRANSACTION_LENGTH);
 #ifdef DEBUG
 		print_read_data(buf, ret);
@@ -91,14 +89,10 @@ void thread_task(int i)
 		for (int j = 0; j < TRANSACTION_LENGTH; j++)
 			buf[j] = j+i;
 
-		pthread_rwlock_wrlock(&rwlock);
-			ret = warppipe_write(client, 1, 0, buf, TRANSACTION_LENGTH);
-		pthread_rwlock_unlock(&rwlock);
-		assert(ret == 0);
+		ret = warppipe_thread_write(io_thread, 1, 0, buf, TRANSACTION_LENGTH);
+		assert(ret == TRANSACTION_LENGTH);
 
-		pthread_rwlock_rdlock(&rwlock);
-			ret = read_data(&pcie_server, client, 1, 0, TRANSACTION_LENGTH, buf);
-		pthread_rwlock_unlock(&rwlock);
+		ret = warppipe_thread_read(io_thread, 1, 0, buf, TRANSACTION_LENGTH);
 		assert(ret == TRANSACTION_LENGTH);
 #ifdef DEBUG
 		print_read_data(buf, ret);
@@ -110,8 +104,6 @@ void thread_task(int i)
 
 static void init_threads(void)
 {
-	pthread_rwlock_init(&rwlock, NULL);
-
 	for (int i = 0 ; i < NUM_THREADS; i++) {
 		k_thread_create(&threads[i], (k_thread_stack_t *)&stacks[i], STACK_SIZE,
 			(k_thread_entry_t)thread_task, (void *)i, NULL, NULL,
@@ -152,10 +144,18 @@ int main(void)
 		return -1;
 	}
 
+	io_thread = warppipe_thread_create(client);
+	if (!io_thread) {
+		LOG_ERR("Failed to start the I/O thread!");
+		return -1;
+	}
+
 	init_threads();
 	start_threads();
 	wait_for_threads_done();
 
+	warppipe_thread_destroy(io_thread);
+
 	LOG_INF("Done!");
 	return 0;
 }
@@ -74,8 +74,7 @@ static int read_config_header_field(warppipe_server *server, warppipe_client *cl
 		.finished = false,
 	};
 
-	client->private_data = (void *)&read_data;
-	zassert_equal(warppipe_config0_read(client, aligned_addr, 4, &read_compl), 0, "Unexpected config data read");
+	zassert_equal(warppipe_config0_read_ctx(client, aligned_addr, 4, &read_compl, &read_data), 0, "Unexpected config data read");
 
 	zassert_equal(wait_for_completion(server, &read_data), 0, "Failed to wait for response");
 	zassert_equal(read_data.ret, 4, "Invalid read length");
@@ -167,8 +166,7 @@ static int read_data(warppipe_server *pcie_server, warppipe_client *client, int
 {
 	int ret;
 
-	client->private_data = (void *)read_data;
-	ret = warppipe_read(client, bar, addr, length, &read_compl);
+	ret = warppipe_read_ctx(client, bar, addr, length, &read_compl, read_data);
 	if (ret < 0) {
 		return ret;
 	}